@@ -0,0 +1,87 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * fastdiv.h - Division by an invariant integer
+ *
+ * Copyright (c) 2025 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  A 64-bit divide costs tens of cycles; when many numbers are
+ *    divided by the same 'd', a multiply and two shifts do the
+ *    same [1]. The result is exact for every 64-bit dividend.
+ *
+ * o  Only worth it when the divisor is reused: fastdiv_init() does
+ *    one 128-bit division.
+ *
+ * [1] Granlund & Montgomery, Division by Invariant Integers using
+ *     Multiplication. PLDI 1994.
+ */
+
+#ifndef ___FAST_FASTDIV_H__8QYmB1cEonV4Lz2k___
+#define ___FAST_FASTDIV_H__8QYmB1cEonV4Lz2k___ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <assert.h>
+
+struct fastdiv
+{
+    uint64_t m;
+    uint64_t d;
+    uint32_t sh;
+};
+typedef struct fastdiv fastdiv;
+
+
+// Setup to divide by 'd'; 'd' must be at least 2.
+static inline void
+fastdiv_init(fastdiv *v, uint64_t d)
+{
+    assert(d > 1);
+
+    uint32_t l = 64 - __builtin_clzll(d - 1);   // ceil(log2(d))
+    uint64_t r = (uint64_t)(((__uint128_t)1 << l) - d);
+
+    v->m  = (uint64_t)(((__uint128_t)r << 64) / d) + 1;
+    v->d  = d;
+    v->sh = l - 1;
+}
+
+
+// Return n / d
+static inline uint64_t
+fastdiv_div(const fastdiv *v, uint64_t n)
+{
+    uint64_t t = (uint64_t)(((__uint128_t)v->m * n) >> 64);
+
+    return (t + ((n - t) >> 1)) >> v->sh;
+}
+
+
+// Return n % d
+static inline uint64_t
+fastdiv_mod(const fastdiv *v, uint64_t n)
+{
+    return n - (fastdiv_div(v, n) * v->d);
+}
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___FAST_FASTDIV_H__8QYmB1cEonV4Lz2k___ */
+
+/* EOF */
@@ -12,6 +12,23 @@
  * This software does not come with any express or implied
  * warranty; it is provided "as is". No claim  is made to its
  * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o SIMD_xxx are the 128-bit (SSE2/NEON) primitives; they are
+ *   always available on amd64 and arm64.
+ *
+ * o SIMD256_xxx and SIMD512_xxx are the 256-bit (AVX2) and 512-bit
+ *   (AVX-512BW) primitives. On amd64 they can only be used in
+ *   functions marked SIMD_TARGET_AVX2 or SIMD_TARGET_AVX512 and
+ *   only after simd_isa() says the CPU has them. On arm64 they are
+ *   emulated with 2 and 4 NEON registers and are always available.
+ *
+ * o simd_matchNN() return a bitmask of the NN bytes at 'p' that are
+ *   equal to a given byte - using the widest vectors the CPU
+ *   supports. The per-ISA versions (simd128_matchNN(),
+ *   simd256_matchNN(), simd512_match64()) are exported for
+ *   benchmarks and tests.
  */
 
 #ifndef ___FAST_SIMD_H__geTEq1VjplXcRszm___
@@ -22,6 +39,14 @@
 extern "C" {
 #endif /* __cplusplus */
 
+#include <stdint.h>
+
+/* Return values of simd_isa() */
+#define SIMD_ISA_NONE       0
+#define SIMD_ISA_128        1   /* SSE2 or NEON */
+#define SIMD_ISA_256        2   /* AVX2 */
+#define SIMD_ISA_512        3   /* AVX-512BW */
+
 
 #if defined(__x86_64__) || defined(_M_X64) || defined(__amd64__)
 #include <immintrin.h>
@@ -34,10 +59,49 @@ typedef __m128i simd_vec128_t;
 
 /* Broadcast byte to all 16 positions */
 #define SIMD_SET1_EPI8(byte)         _mm_set1_epi8((byte))
+#define SIMD_LOADU_128(p)            _mm_loadu_si128((const __m128i *)(p))
 #define SIMD_CMPEQ_EPI8(a, b)        _mm_cmpeq_epi8((a), (b))
 #define SIMD_MOVEMASK_EPI8(v)        _mm_movemask_epi8((v))
 #define SIMD_PREFETCH_T0(addr)       _mm_prefetch((addr), _MM_HINT_T0)
 
+typedef __m256i simd_vec256_t;
+typedef __m512i simd_vec512_t;
+
+/* Compile a function for AVX2 or AVX-512BW regardless of -march */
+#define SIMD_TARGET_AVX2            __attribute__((target("avx2")))
+#define SIMD_TARGET_AVX512          __attribute__((target("avx512f,avx512bw")))
+
+#define SIMD256_LOADU(p)            _mm256_loadu_si256((const __m256i *)(p))
+#define SIMD256_SET1_EPI8(b)        _mm256_set1_epi8((b))
+#define SIMD256_CMPEQ_EPI8(a, b)    _mm256_cmpeq_epi8((a), (b))
+#define SIMD256_MOVEMASK_EPI8(v)    ((uint32_t)_mm256_movemask_epi8((v)))
+
+#define SIMD512_LOADU(p)            _mm512_loadu_si512((const void *)(p))
+#define SIMD512_SET1_EPI8(b)        _mm512_set1_epi8((b))
+#define SIMD512_CMPEQ_EPI8(a, b)    _mm512_movm_epi8(_mm512_cmpeq_epi8_mask((a), (b)))
+#define SIMD512_MOVEMASK_EPI8(v)    ((uint64_t)_mm512_movepi8_mask((v)))
+
+/* AVX-512 compares straight into a mask; prefer this to CMPEQ + MOVEMASK */
+#define SIMD512_CMPEQ_MASK(a, b)    ((uint64_t)_mm512_cmpeq_epi8_mask((a), (b)))
+
+/*
+ * cpuid based ISA detection; this also checks for OS support. The
+ * answer is cached: simd_match32() and friends ask on every call.
+ * Racing threads store the same value.
+ */
+static inline int simd_isa(void) {
+    static int isa;
+    int v = __atomic_load_n(&isa, __ATOMIC_RELAXED);
+
+    if (__builtin_expect(v == SIMD_ISA_NONE, 0)) {
+        if (__builtin_cpu_supports("avx512bw"))  v = SIMD_ISA_512;
+        else if (__builtin_cpu_supports("avx2")) v = SIMD_ISA_256;
+        else                                     v = SIMD_ISA_128;
+        __atomic_store_n(&isa, v, __ATOMIC_RELAXED);
+    }
+    return v;
+}
+
 #elif defined(__aarch64__) || defined(_M_ARM64)
 #include <arm_neon.h>
 
@@ -46,6 +110,7 @@ typedef uint8x16_t simd_vec128_t;
 /* Load two 64-bit values into 128-bit vector */
 #define SIMD_SET_EPI64X(hi, lo)     __arm64_simd_set_epi64(hi,lo)
 #define SIMD_SET1_EPI8(b)           vdupq_n_u8(b)
+#define SIMD_LOADU_128(p)           vld1q_u8((const uint8_t *)(p))
 #define SIMD_CMPEQ_EPI8(a, b)       vceqq_u8(a, b)
 #define SIMD_MOVEMASK_EPI8(v)     __arm64_simd_movemask_epi8(v)
 #define SIMD_PREFETCH_T0(addr)       __builtin_prefetch((addr), 0, 3)
@@ -60,16 +125,104 @@ static inline int __arm64_simd_movemask_epi8(simd_vec128_t v) {
     /* Shift each byte's MSB to bit position 0 */
     uint8x16_t mask = vshrq_n_u8(v, 7);
 
-    /* Pack into 16-bit value using pairwise operations */
-    static const uint8_t shifts[16] = {
-        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+    /* Shift lane i left by (i % 8); each half then sums to a byte */
+    static const int8_t shifts[16] = {
+        0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7
     };
-    uint8x16_t shift_vec = vld1q_u8(shifts);
-    uint8x16_t masked = vandq_u8(mask, vdupq_n_u8(1));
-    uint8x16_t shifted = vshlq_u8(masked, vreinterpretq_s8_u8(shift_vec));
+    uint8x16_t shifted = vshlq_u8(mask, vld1q_s8(shifts));
+
+    return vaddv_u8(vget_low_u8(shifted)) | (vaddv_u8(vget_high_u8(shifted)) << 8);
+}
+
+
+/*
+ * arm64 has no vectors wider than 128 bits: a 256-bit (512-bit)
+ * vector is a pair (quad) of NEON registers.
+ */
+typedef uint8x16x2_t simd_vec256_t;
+typedef uint8x16x4_t simd_vec512_t;
+
+#define SIMD_TARGET_AVX2
+#define SIMD_TARGET_AVX512
+
+#define SIMD256_LOADU(p)            __arm64_simd256_loadu(p)
+#define SIMD256_SET1_EPI8(b)        __arm64_simd256_set1(b)
+#define SIMD256_CMPEQ_EPI8(a, b)    __arm64_simd256_cmpeq(a, b)
+#define SIMD256_MOVEMASK_EPI8(v)    __arm64_simd256_movemask_epi8(v)
+
+#define SIMD512_LOADU(p)            __arm64_simd512_loadu(p)
+#define SIMD512_SET1_EPI8(b)        __arm64_simd512_set1(b)
+#define SIMD512_CMPEQ_EPI8(a, b)    __arm64_simd512_cmpeq(a, b)
+#define SIMD512_MOVEMASK_EPI8(v)    __arm64_simd512_movemask_epi8(v)
+#define SIMD512_CMPEQ_MASK(a, b)    SIMD512_MOVEMASK_EPI8(SIMD512_CMPEQ_EPI8(a, b))
+
+static inline int simd_isa(void) {
+    return SIMD_ISA_128;
+}
+
+static inline simd_vec256_t __arm64_simd256_loadu(const void *p) {
+    const uint8_t *s = (const uint8_t *)p;
+    simd_vec256_t v = {{ vld1q_u8(s), vld1q_u8(s + 16) }};
+    return v;
+}
+
+static inline simd_vec256_t __arm64_simd256_set1(uint8_t b) {
+    simd_vec256_t v = {{ vdupq_n_u8(b), vdupq_n_u8(b) }};
+    return v;
+}
+
+static inline simd_vec256_t __arm64_simd256_cmpeq(simd_vec256_t a, simd_vec256_t b) {
+    simd_vec256_t v = {{ vceqq_u8(a.val[0], b.val[0]), vceqq_u8(a.val[1], b.val[1]) }};
+    return v;
+}
+
+static inline simd_vec512_t __arm64_simd512_loadu(const void *p) {
+    const uint8_t *s = (const uint8_t *)p;
+    simd_vec512_t v = {{ vld1q_u8(s), vld1q_u8(s + 16), vld1q_u8(s + 32), vld1q_u8(s + 48) }};
+    return v;
+}
+
+static inline simd_vec512_t __arm64_simd512_set1(uint8_t b) {
+    uint8x16_t x = vdupq_n_u8(b);
+    simd_vec512_t v = {{ x, x, x, x }};
+    return v;
+}
+
+static inline simd_vec512_t __arm64_simd512_cmpeq(simd_vec512_t a, simd_vec512_t b) {
+    simd_vec512_t v = {{ vceqq_u8(a.val[0], b.val[0]), vceqq_u8(a.val[1], b.val[1]),
+                         vceqq_u8(a.val[2], b.val[2]), vceqq_u8(a.val[3], b.val[3]) }};
+    return v;
+}
+
+/*
+ * Replace each byte by its bit weight (1, 2, .. 128 repeating) if
+ * its MSB is set and 0 otherwise. Pairwise adds of such vectors
+ * then assemble the movemask a byte at a time - 3 adds for 32
+ * lanes instead of a horizontal sum per 8 lanes.
+ */
+static inline uint8x16_t __arm64_simd_msb_bits(uint8x16_t v) {
+    static const uint8_t w[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+    };
+    uint8x16_t m = vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(v), 7));
+    return vandq_u8(m, vld1q_u8(w));
+}
+
+static inline uint32_t __arm64_simd256_movemask_epi8(simd_vec256_t v) {
+    uint8x16_t x = vpaddq_u8(__arm64_simd_msb_bits(v.val[0]), __arm64_simd_msb_bits(v.val[1]));
 
-    /* Sum all bytes to get final mask */
-    return vaddvq_u8(shifted);
+    x = vpaddq_u8(x, x);
+    x = vpaddq_u8(x, x);
+    return vgetq_lane_u32(vreinterpretq_u32_u8(x), 0);
+}
+
+static inline uint64_t __arm64_simd512_movemask_epi8(simd_vec512_t v) {
+    uint8x16_t x = vpaddq_u8(__arm64_simd_msb_bits(v.val[0]), __arm64_simd_msb_bits(v.val[1]));
+    uint8x16_t y = vpaddq_u8(__arm64_simd_msb_bits(v.val[2]), __arm64_simd_msb_bits(v.val[3]));
+
+    x = vpaddq_u8(x, y);
+    x = vpaddq_u8(x, x);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(x), 0);
 }
 
 
@@ -78,6 +231,96 @@ static inline int __arm64_simd_movemask_epi8(simd_vec128_t v) {
 #endif /* Architecture selection */
 
 
+/*
+ * Byte match scans: return the bitmask of the bytes at 'p' that are
+ * equal to 'b'; bit i corresponds to p[i].
+ */
+#ifdef __NO_SIMD__
+
+static inline int simd_isa(void) {
+    return SIMD_ISA_NONE;
+}
+
+static inline uint64_t __simd_match_n(const void *p, uint8_t b, int n) {
+    const uint8_t *s = (const uint8_t *)p;
+    uint64_t m = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (s[i] == b) m |= ((uint64_t)1) << i;
+    }
+    return m;
+}
+
+static inline uint32_t simd_match32(const void *p, uint8_t b) {
+    return (uint32_t)__simd_match_n(p, b, 32);
+}
+
+static inline uint64_t simd_match64(const void *p, uint8_t b) {
+    return __simd_match_n(p, b, 64);
+}
+
+#else
+
+static inline uint32_t simd128_match32(const void *p, uint8_t b) {
+    const uint8_t *s = (const uint8_t *)p;
+    simd_vec128_t v = SIMD_SET1_EPI8(b);
+    uint32_t lo = SIMD_MOVEMASK_EPI8(SIMD_CMPEQ_EPI8(SIMD_LOADU_128(s), v));
+    uint32_t hi = SIMD_MOVEMASK_EPI8(SIMD_CMPEQ_EPI8(SIMD_LOADU_128(s + 16), v));
+
+    return lo | (hi << 16);
+}
+
+static inline uint64_t simd128_match64(const void *p, uint8_t b) {
+    const uint8_t *s = (const uint8_t *)p;
+
+    return simd128_match32(s, b) | ((uint64_t)simd128_match32(s + 32, b) << 32);
+}
+
+static inline SIMD_TARGET_AVX2 uint32_t simd256_match32(const void *p, uint8_t b) {
+    return SIMD256_MOVEMASK_EPI8(SIMD256_CMPEQ_EPI8(SIMD256_LOADU(p), SIMD256_SET1_EPI8(b)));
+}
+
+static inline SIMD_TARGET_AVX2 uint64_t simd256_match64(const void *p, uint8_t b) {
+    const uint8_t *s = (const uint8_t *)p;
+    simd_vec256_t v = SIMD256_SET1_EPI8(b);
+    uint64_t lo = SIMD256_MOVEMASK_EPI8(SIMD256_CMPEQ_EPI8(SIMD256_LOADU(s), v));
+    uint64_t hi = SIMD256_MOVEMASK_EPI8(SIMD256_CMPEQ_EPI8(SIMD256_LOADU(s + 32), v));
+
+    return lo | (hi << 32);
+}
+
+static inline SIMD_TARGET_AVX512 uint64_t simd512_match64(const void *p, uint8_t b) {
+    return SIMD512_CMPEQ_MASK(SIMD512_LOADU(p), SIMD512_SET1_EPI8(b));
+}
+
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+
+/* The paired NEON versions need fewer movemask steps */
+#define simd_match32(p, b)  simd256_match32(p, b)
+#define simd_match64(p, b)  simd512_match64(p, b)
+
+#else
+
+static inline uint32_t simd_match32(const void *p, uint8_t b) {
+    if (simd_isa() >= SIMD_ISA_256) return simd256_match32(p, b);
+    return simd128_match32(p, b);
+}
+
+static inline uint64_t simd_match64(const void *p, uint8_t b) {
+    switch (simd_isa()) {
+    case SIMD_ISA_512: return simd512_match64(p, b);
+    case SIMD_ISA_256: return simd256_match64(p, b);
+    default:           return simd128_match64(p, b);
+    }
+}
+
+#endif /* __aarch64__ */
+
+#endif /* __NO_SIMD__ */
+
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
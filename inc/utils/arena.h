@@ -25,6 +25,14 @@
  * scope can all be deleted in one shot.
  *
  * It relies internally on malloc() and free() for its operations.
+ *
+ * Allocations bump a pointer in the current chunk; a new chunk is
+ * only needed when it is full. Chunks grow geometrically. A
+ * checkpoint (arena_mark()) lets a caller throw away everything
+ * allocated since (arena_rewind()); arena_reset() throws away
+ * everything. Both keep the chunks for reuse - thus an arena
+ * reused across requests stops calling malloc() once it has grown
+ * to the size of the largest request.
  */
 
 #ifndef		__ARENA_H__
@@ -41,6 +49,16 @@ extern "C" {
 typedef struct arena * arena_t ;
 
 
+/* A checkpoint in an arena; see arena_mark() */
+struct arena_checkpoint
+{
+    void          *node;
+    void          *next;
+    unsigned char *free;
+};
+typedef struct arena_checkpoint arena_mark_t;
+
+
 /* Create a new arena and return it as an output parameter 'ret_ptr'
  *
  * Returns:
@@ -50,6 +68,18 @@ typedef struct arena * arena_t ;
 extern int arena_new(arena_t* ret_ptr, size_t alloc_chunk_size);
 
 
+/* Create a new arena like arena_new() whose chunks are allocated
+ * from the memory manager `mm' (eg. memmgr_init_mmap() for huge
+ * pages); NULL means malloc().
+ *
+ * Returns:
+ *   On Success: 0
+ *   On failure: -EINVAL or -ENOMEM
+ */
+extern int arena_new_memmgr(arena_t* ret_ptr, size_t alloc_chunk_size,
+                            const memmgr* mm);
+
+
 /* Allocate `n' bytes of storage from arena `a'.
  * Returns:
  *   On success: pointer to suitably aligned block of memory
@@ -59,6 +89,30 @@ extern int arena_new(arena_t* ret_ptr, size_t alloc_chunk_size);
 extern void * arena_alloc(arena_t a, size_t n);
 
 
+/* Allocate `n' bytes of storage aligned to `align' bytes from arena
+ * `a'. `align' must be a power of 2.
+ * Returns:
+ *   On success: pointer to block of memory atleast `n' bytes big.
+ *   On failure: NULL
+ */
+extern void * arena_alloc_aligned(arena_t a, size_t n, size_t align);
+
+
+/* Record the current position of arena `a' in `m'. */
+extern void arena_mark(arena_t a, arena_mark_t *m);
+
+
+/* Free every allocation made in arena `a' after the checkpoint `m'
+ * was taken. Checkpoints taken after `m' are no longer valid. The
+ * chunks are kept for subsequent allocations. */
+extern void arena_rewind(arena_t a, const arena_mark_t *m);
+
+
+/* Free every allocation made in arena `a'; keep the chunks for
+ * subsequent allocations. */
+extern void arena_reset(arena_t a);
+
+
 /* Delete the entire arena `a' -- thus deallocating all individual
  * requests (via arena_alloc()) in one shot! */
 extern void arena_delete(arena_t a);
@@ -86,6 +86,10 @@
  *
  *   o The math above is from [2].
  *
+ *   o The blocked filter [5] sets all 'k' bits of an element in one
+ *     64-byte block picked by the hash. It trades some space for
+ *     one cache miss per lookup.
+ *
  *   o The library provides facilities to safely marshal and
  *     unmarshall the bloom filter to a file. The marshalled data
  *     uses strong checksums (SHA256) on the filter bits as well as
@@ -103,6 +107,9 @@
  *
  * [4] Approximate caches for packet classification
  *     http://www.ieee-infocom.org/2004/Papers/45_3.PDF
+ *
+ * [5] Cache-, Hash- and Space-Efficient Bloom Filters
+ *     Putze, Sanders & Singler
  */
 
 #ifndef ___UTILS_BLOOM_H_3279193_1446926677__
@@ -121,6 +128,32 @@ extern "C" {
  */
 #define BLOOM_BITMAP_MMAP   (1 << 0)
 
+/*
+ * Unmarshal: with BLOOM_BITMAP_MMAP, verify each block of the file
+ * when a lookup first touches it - instead of verifying the entire
+ * file before returning.
+ */
+#define BLOOM_VERIFY_LAZY   (1 << 1)
+
+/*
+ * Marshal: use a fast, non-cryptographic checksum (xxhash64).
+ * Only use this for trusted, local files.
+ */
+#define BLOOM_CKSUM_FAST    (1 << 2)
+
+/*
+ * Marshal: write the old (version 0) format with one checksum over
+ * the entire file.
+ */
+#define BLOOM_MARSHAL_VER0  (1 << 3)
+
+/*
+ * Counting filter: use 4-bit counters instead of 8-bit ones. The
+ * filter is half the size; a counter that goes past 15 keeps the
+ * rest of its count in a (small) side table.
+ */
+#define BLOOM_COUNTER4      (1 << 4)
+
 
 /*
  * Interface for bloom filter. This contains pointers to actual
@@ -158,6 +191,13 @@ typedef struct Bloom Bloom;
 extern Bloom* Counting_bloom_new(uint64_t n, double e);
 
 
+/**
+ * Create a new COUNTING bloom filter like Counting_bloom_new();
+ * 'flags' is 0 or BLOOM_COUNTER4.
+ */
+extern Bloom* Counting_bloom_new_flags(uint64_t n, double e, uint32_t flags);
+
+
 /**
  * Create and initialize a new bloom filter to hold 'n' elements
  * with 50% fill rate satisfying a false positive error rate of
@@ -169,6 +209,16 @@ extern Bloom* Counting_bloom_new(uint64_t n, double e);
 extern Bloom* Standard_bloom_new(uint64_t n, double e, int scalable);
 
 
+/**
+ * Create and initialize a new BLOCKED bloom filter to hold 'n'
+ * elements satisfying a false positive error rate of 'e'. All the
+ * bits of an element are in one 64-byte block (cache line); so a
+ * lookup costs one cache miss. It uses more memory than a standard
+ * filter for the same 'e'.
+ */
+extern Bloom* Blocked_bloom_new(uint64_t n, double e);
+
+
 /**
  * Initialize a new COUNTING bloom filter to hold 'n' elements
  * with 50% fill rate satisfying a false positive error rate of
@@ -178,6 +228,13 @@ extern Bloom* Standard_bloom_new(uint64_t n, double e, int scalable);
 extern Bloom* Counting_bloom_init(Bloom*, uint64_t n, double e);
 
 
+/**
+ * Initialize a new COUNTING bloom filter like Counting_bloom_init();
+ * 'flags' is 0 or BLOOM_COUNTER4.
+ */
+extern Bloom* Counting_bloom_init_flags(Bloom*, uint64_t n, double e, uint32_t flags);
+
+
 /**
  * Initialize a new bloom filter to hold 'n' elements
  * with 50% fill rate satisfying a false positive error rate of
@@ -189,6 +246,63 @@ extern Bloom* Counting_bloom_init(Bloom*, uint64_t n, double e);
  */
 extern Bloom* Standard_bloom_init(Bloom*, uint64_t n, double e, int scalable);
 
+
+/**
+ * Initialize a new BLOCKED bloom filter to hold 'n' elements
+ * satisfying a false positive error rate of 'e'. The caller is
+ * expected to provide the storage for the filter instance.
+ */
+extern Bloom* Blocked_bloom_init(Bloom*, uint64_t n, double e);
+
+
+/**
+ * Create and initialize a new CUCKOO filter to hold 'n' elements
+ * with a false positive rate of at most 'e'. Like the counting
+ * filter, elements can be removed - but it uses far less memory.
+ * Unlike the bloom filters, it can fill up: once full, Bloom_probe()
+ * drops the element. Use Cuckoo_bloom_insert() to know when that
+ * happens.
+ *
+ * The fingerprints are at most 16 bits; so 'e' can't be below
+ * 8/65536 (about 1.2e-4). A smaller 'e' returns NULL.
+ */
+extern Bloom* Cuckoo_bloom_new(uint64_t n, double e);
+
+
+/**
+ * Initialize a new CUCKOO filter to hold 'n' elements with a false
+ * positive rate of at most 'e'; see Cuckoo_bloom_new() for the
+ * smallest 'e'. The caller is expected to provide the storage for
+ * the filter instance.
+ */
+extern Bloom* Cuckoo_bloom_init(Bloom*, uint64_t n, double e);
+
+
+/**
+ * Add 'v' to the cuckoo filter 'b'.
+ *
+ * Returns 0 on success, -ENOSPC if the filter is full and
+ * -ENOTSUP if 'b' isn't a cuckoo filter.
+ */
+extern int Cuckoo_bloom_insert(Bloom *b, uint64_t v);
+
+/**
+ * Create a new, empty filter just like 'b' - same type, size and
+ * hash salt - so that the two can be merged with Bloom_union() or
+ * Bloom_intersect(). Scalable filters can't be cloned.
+ *
+ * Returns 0 on failure.
+ */
+extern Bloom* Bloom_new_like(Bloom *b);
+
+
+/**
+ * Initialize 'nb' as a new, empty filter just like 'b'. The caller
+ * is expected to provide the storage for the filter instance.
+ */
+extern Bloom* Bloom_init_like(Bloom *nb, Bloom *b);
+
+
 /**
  * Delete a bloom filter 'b' and free all storage associated with
  * it.
@@ -202,6 +316,25 @@ extern void Bloom_delete(Bloom *b);
 extern void Bloom_fini(Bloom *b);
 
 
+/**
+ * Switch a standard (non-scalable) or blocked filter into
+ * concurrent mode (on = 1) or back (on = 0).
+ *
+ * In concurrent mode many threads can call Bloom_probe() and
+ * Bloom_find() on the filter at the same time: the bits are set
+ * with atomic word sized fetch-or and each thread counts its
+ * elements separately. Lookups use plain loads; a lookup that
+ * races with an add of the same element may not see it.
+ *
+ * Mode changes are not thread safe; they must happen before the
+ * threads start and after they've all finished.
+ *
+ * Return 0 on success, -ENOTSUP for other filter types and -ENOMEM
+ * if the counters can't be allocated.
+ */
+extern int Bloom_concurrent(Bloom *b, int on);
+
+
 /*
  * Next set of functions are generic and operate on any type of the
  * filter.
@@ -233,6 +366,18 @@ Bloom_find(Bloom *b, uint64_t v)
 }
 
 
+/**
+ * Look up the 'n' elements in 'v' and set bit 'i' of the bitmap
+ * 'res' if v[i] _maybe_ in the filter. 'res' must have room for
+ * (n + 63) / 64 words. The memory accesses of many elements are
+ * overlapped; so this is much faster than calling Bloom_find() for
+ * each element of a large batch.
+ *
+ * Return the number of elements that may be in the filter.
+ */
+extern size_t Bloom_find_batch(Bloom *b, const uint64_t *v, size_t n, uint64_t *res);
+
+
 /**
  * Remove an element from the filter.
  * Only applicable to counting bloom filters. No-op for the
@@ -275,6 +420,24 @@ Bloom_desc(Bloom *b, char *buf, size_t sz)
  */
 extern int Bloom_eq(Bloom *a, Bloom *b);
 
+/**
+ * Add all the elements of filter 'src' to 'dst' (dst |= src).
+ * Bloom_intersect() keeps just the elements that might be in
+ * both (dst &= src); its element count is an estimate.
+ *
+ * The filters must be standard (non-scalable) or blocked filters
+ * of the same type, size and salt (see Bloom_new_like()). Bitmaps
+ * larger than a few MB are split across 'nthreads' threads; use 0
+ * or 1 to do it all in the calling thread.
+ *
+ * Return 0 on success, -ENOTSUP for other filter types, -EINVAL
+ * for incompatible filters, -EROFS if 'dst' is mmap'd and -EBUSY
+ * if either filter is in concurrent mode.
+ */
+extern int Bloom_union(Bloom *dst, Bloom *src, int nthreads);
+extern int Bloom_intersect(Bloom *dst, Bloom *src, int nthreads);
+
+
 /*
  * Marshal/Unmarshall interface
  */
@@ -296,11 +459,27 @@ extern int Bloom_eq(Bloom *a, Bloom *b);
 extern int Bloom_marshal(Bloom* b, const char *fname);
 
 
+/**
+ * Marshal a bloom-filter into 'fname' - with 'flags' being a
+ * combination of BLOOM_CKSUM_FAST and BLOOM_MARSHAL_VER0.
+ * Bloom_marshal() is the same as calling this with zero flags.
+ *
+ * Return: 0 on success; -errno on failure
+ */
+extern int Bloom_marshal_flags(Bloom* b, const char *fname, uint32_t flags);
+
+
 /**
  * Unmarshall a bloom-filter from 'fname' into bloom filter
  * 'b'. Flags is a bitmap:
  *   o  BLOOM_BITMAP_MMAP:  don't allocate memory for the bitmap,
  *      instead mmap the file contents.
+ *   o  BLOOM_VERIFY_LAZY:  with BLOOM_BITMAP_MMAP, verify the
+ *      checksum of each block of the file on first use.
+ *
+ *  Files in the current format are verified in parallel on all
+ *  CPUs; files in the old (version 0) format are verified
+ *  sequentially.
  *
  *  Return:
  *   o 0 on success
@@ -311,6 +490,21 @@ extern int Bloom_marshal(Bloom* b, const char *fname);
  */
 extern int Bloom_unmarshal(Bloom **p_ret,   const char* fname, uint32_t flags);
 
+
+/**
+ * Verify the blocks of a filter unmarshaled with BLOOM_VERIFY_LAZY
+ * that no lookup has touched yet; use up to 'nthreads' threads (0
+ * for all CPUs).
+ *
+ * Lookups report the elements in a damaged block as "maybe
+ * present"; thus a damaged lazily verified filter has more false
+ * positives but no false negatives.
+ *
+ * Return 0 if all the blocks are good (or the filter wasn't
+ * unmarshaled lazily), -EILSEQ otherwise.
+ */
+extern int Bloom_verify(Bloom *b, int nthreads);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
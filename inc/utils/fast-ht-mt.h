@@ -0,0 +1,124 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * utils/fast-ht-mt.h - Concurrent, read-mostly variant of fast-ht
+ *
+ * Copyright (c) 2015 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o This is a thread-safe version of the hash table in
+ *   utils/fast-ht.h; keys and values have the same semantics: the
+ *   key is an already hashed, NON-ZERO uint64_t and the value is an
+ *   opaque "void *".
+ *
+ * o Lookups (cht_find) never take a lock: each bucket is protected
+ *   by a sequence lock and readers simply retry if a writer changed
+ *   the bucket underneath them.
+ *
+ * o Writers (cht_probe, cht_replace, cht_remove) serialize on one
+ *   of a fixed number of striped locks.
+ *
+ * o A resize copies the table while readers continue to use the
+ *   old one; the old table is freed only after all readers that
+ *   could've seen it are done (epoch based deferred reclamation).
+ *   Writers wait for the duration of the copy.
+ */
+
+#ifndef ___UTILS_FAST_HT_MT_H__Qm7Xc2RkWz0aLbVe___
+#define ___UTILS_FAST_HT_MT_H__Qm7Xc2RkWz0aLbVe___ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+
+// Forward Decl: Opaque struct for callers
+struct cht;
+typedef struct cht cht;
+
+
+/*
+ * Snapshot of the table statistics.
+ */
+struct cht_stats
+{
+    uint64_t n;         // number of buckets
+    uint64_t nodes;     // number of nodes in the hash table
+    uint64_t fill;      // number of buckets occupied
+    uint32_t maxfill;   // max load factor % before splitting
+    uint32_t splits;    // number of times the table is doubled
+};
+typedef struct cht_stats cht_stats;
+
+
+/*
+ * Create and initialize a concurrent hash table and return it.
+ * 'size' is a size hint for initial number of buckets. The table
+ * will grow dynamically if the fill percent is larger than
+ * 'maxfill'.
+ */
+cht* cht_new(uint32_t size, uint32_t maxfill);
+
+
+/*
+ * Delete and free memory associated with the hash table. The
+ * caller must ensure that no other thread is using it.
+ */
+void cht_del(cht*);
+
+
+/*
+ * Add a new entry to the hash-table only if it doesn't already
+ * exist.
+ *
+ * Return ptr to existing "val" if it exists, 0 if newly inserted.
+ */
+void* cht_probe(cht*, uint64_t hv, void *val);
+
+
+/*
+ * Replace an existing entry with a new "val".
+ * Return true if replaced, false if 'hv' is not in the hash table.
+ */
+int cht_replace(cht*, uint64_t hv, void *val);
+
+
+/*
+ * Find the hash value 'hv' and return the corresponding value in
+ * 'p_ret'. This never blocks.
+ * Return true on success, false if not found.
+ */
+int cht_find(cht*, uint64_t hv, void** p_ret);
+
+
+/*
+ * Remove the hash value 'hv' from the table.
+ * Return true on success, false if not found.
+ */
+int cht_remove(cht*, uint64_t hv, void** p_ret);
+
+
+/*
+ * Fill 's' with a snapshot of the table statistics.
+ */
+void cht_stat(cht*, cht_stats *s);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___UTILS_FAST_HT_MT_H__Qm7Xc2RkWz0aLbVe___ */
+
+/* EOF */
@@ -20,6 +20,19 @@
  * o This key (hashed) is always assumed to be NON-ZERO.
  * o Value is an opaque "void *"; this library does not manage the
  *   memory or the lifetime of this void ptr.
+ * o By default, the table doubles in one shot when the fill
+ *   exceeds 'maxfill'. With FASTHT_INCREMENTAL, the old and new
+ *   bucket arrays coexist and every subsequent probe/find/remove
+ *   migrates about FASTHT_MIGRATE nodes; this bounds the worst case
+ *   latency of an insert regardless of the size of the table.
+ * o With FASTHT_FLAT, the table uses a different engine: a flat
+ *   power-of-two array of slots with one control byte per slot
+ *   (Swiss-table layout). The control bytes are probed 16 at a time
+ *   (FASTHT_GROUP) with SIMD; collisions are resolved by linear
+ *   probing and deletes shift the rest of the cluster back - so
+ *   there are no tombstones. The API is identical; 'n' and 'fill'
+ *   are in slots instead of buckets. FASTHT_INCREMENTAL is ignored
+ *   and the max fill is capped at FASTHT_FLAT_MAXFILL.
  */
 
 #ifndef ___UTILS_HT_H_668986_1448848235__
@@ -31,6 +44,7 @@ extern "C" {
 #endif /* __cplusplus */
 
 #include <stdint.h>
+#include <stddef.h>
 #include "fast/list.h"
 
 /*
@@ -73,6 +87,27 @@ extern "C" {
 #define FASTHT_BAGSZ        7
 #define FILLPCT            85
 
+// Number of nodes (and at most old buckets) migrated per operation
+// in incremental mode
+#define FASTHT_MIGRATE      4
+
+// Number of keys in flight in ht_find_batch() and ht_probe_batch()
+#define FASTHT_BATCH_WINDOW 16
+
+// Flags for ht_init_flags() and ht_new_flags()
+#define FASTHT_INCREMENTAL  (1 << 0)
+#define FASTHT_FLAT         (1 << 1)
+
+// Flags for ht_unmarshal()
+#define FASTHT_MMAP         (1 << 8)
+#define FASTHT_NOVERIFY     (1 << 9)
+
+// Number of control bytes probed at a time by the flat engine
+#define FASTHT_GROUP        16
+
+// Linear probing degrades quickly beyond this fill %
+#define FASTHT_FLAT_MAXFILL 90
+
 
 /*
  * Hash Bucket: holds keys and values as separate arrays.
@@ -104,6 +139,17 @@ struct hb
 typedef struct hb hb;
 
 
+/*
+ * Slot of the flat engine; the key and value share a cache line.
+ */
+struct ht_slot
+{
+    uint64_t  hk;
+    void*     hv;
+};
+typedef struct ht_slot ht_slot;
+
+
 /*
  * Hash table.
  */
@@ -119,7 +165,29 @@ struct ht
     uint32_t splits;    // number of times HT is doubled
     uint32_t bagmax;    // max number of bags in a bucket
     uint32_t maxn;      // max number of items in a bucket
-    uint32_t pad0;      // alignment
+    uint32_t flags;     // FASTHT_xxx flags
+    uint32_t minfill;   // load factor % below which the table is halved
+    uint32_t shrinks;   // number of times HT is halved
+    uint64_t minn;      // never shrink below this many buckets
+
+    // Incremental resize state; 'ob' is non-null only while a
+    // migration is in progress.
+    hb      *ob;        // old array of buckets
+    uint64_t on;        // number of old buckets
+    uint64_t osalt;     // random seed of the old buckets
+    uint64_t omig;      // next old bucket to be migrated
+
+    // Flat engine state (FASTHT_FLAT): slot 'i' is free if bit 7
+    // of ctrl[i] is set; else ctrl[i] holds 7 bits of the hash.
+    // The first FASTHT_GROUP control bytes are mirrored at the end
+    // so that a group can be loaded at any slot. 'maxn' is the
+    // longest probe distance.
+    uint8_t *ctrl;      // n + FASTHT_GROUP control bytes
+    ht_slot *slot;      // n slots
+
+    // file image backing 'ctrl' and 'slot' (FASTHT_MMAP)
+    void    *map;
+    uint64_t mapsz;
 };
 typedef struct ht ht;
 
@@ -148,6 +216,20 @@ void ht_fini(ht*);
 ht* ht_new(uint32_t size, uint32_t maxfill);
 
 
+/*
+ * Initialize a hash table with additional FASTHT_xxx flags. See
+ * ht_init() for the other args.
+ */
+ht* ht_init_flags(ht*, uint32_t size, uint32_t maxfill, uint32_t flags);
+
+
+/*
+ * Create and initialize a hash table with additional FASTHT_xxx
+ * flags. See ht_new() for the other args.
+ */
+ht* ht_new_flags(uint32_t size, uint32_t maxfill, uint32_t flags);
+
+
 /*
  * Delete and free memory associated with the hash table.
  */
@@ -187,6 +269,135 @@ int ht_remove(ht*, uint64_t hv, void** p_ret);
 
 
 
+/*
+ * Find 'n' hash values in 'keys'. For each key, 'found[i]' is set to
+ * true if it exists and 'vals[i]' holds the corresponding value (0
+ * otherwise). The lookups are pipelined with prefetches so that the
+ * cache misses of several keys overlap.
+ *
+ * Return the number of keys found.
+ */
+size_t ht_find_batch(ht*, const uint64_t *keys, size_t n, void **vals, uint8_t *found);
+
+
+/*
+ * Batched version of ht_probe(): add the 'n' hash values in 'keys'
+ * with the corresponding values in 'vals' if they don't already
+ * exist. If 'keys[i]' already exists, 'found[i]' is set to true and
+ * 'vals[i]' is overwritten with the existing value; otherwise
+ * 'found[i]' is false.
+ *
+ * Return the number of keys newly inserted.
+ */
+size_t ht_probe_batch(ht*, const uint64_t *keys, size_t n, void **vals, uint8_t *found);
+
+
+/*
+ * Halve the table whenever its fill percent drops below 'minfill';
+ * the table never shrinks below its initial size. 0 (the default)
+ * disables shrinking. 'minfill' is capped at a quarter of
+ * 'maxfill' if it is too close to it.
+ */
+void ht_set_minfill(ht*, uint32_t minfill);
+
+
+/*
+ * Coalesce sparse bags in every bucket into as few bags as
+ * possible, free the rest and recompute the 'bagmax' and 'maxn'
+ * stats. A pending incremental resize is completed first.
+ *
+ * Return the number of bags freed.
+ */
+uint64_t ht_compact(ht*);
+
+
+/*
+ * Iterator over all the entries in the table. The iterator walks
+ * the bucket array in order and the bags in each bucket.
+ *
+ * The table must not be modified while it is being iterated
+ * (ht_find() included in incremental mode) - except via
+ * ht_iter_remove(). Use ht_compact() after the walk to reclaim the
+ * bags emptied by ht_iter_remove(). The flat engine walks the slot
+ * array instead; it has nothing to reclaim.
+ */
+struct ht_iter
+{
+    ht      *h;
+    hb      *b;     // current bucket
+    hb      *e;     // end of the current bucket array
+    bag     *g;     // current bag
+    int      slot;  // next slot to look at in 'g'
+    int      old;   // set while walking the old buckets
+
+    // last entry returned by ht_iter_next()
+    hb      *lb;
+    bag     *lg;
+    int      ls;
+
+    // flat engine: next slot, end of the walk and 1 + the slot of
+    // the last entry returned (0 if none)
+    uint64_t pos;
+    uint64_t end;
+    uint64_t last;
+};
+typedef struct ht_iter ht_iter;
+
+
+/*
+ * Initialize an iterator for table 'h'.
+ */
+void ht_iter_init(ht_iter *, ht *h);
+
+
+/*
+ * Return the next entry in 'p_key' and 'p_val' (either may be
+ * null). Return true if there is an entry, false at the end.
+ */
+int ht_iter_next(ht_iter *, uint64_t *p_key, void **p_val);
+
+
+/*
+ * Remove the entry last returned by ht_iter_next().
+ * Return true on success, false if there is no such entry.
+ */
+int ht_iter_remove(ht_iter *);
+
+
+/*
+ * Marshal the table into 'fname'. The file is a pointer free image
+ * of a flat (FASTHT_FLAT) table - keys and values are stored as
+ * 64-bit little endian words; thus the values must be meaningful
+ * across processes (e.g., indices or file offsets rather than
+ * pointers). A table using the bag engine is rehashed into a flat
+ * image. The whole image is checksummed with SHA256.
+ *
+ * Return: 0 on success; -errno on failure.
+ */
+int ht_marshal(ht*, const char *fname);
+
+
+/*
+ * Unmarshal a table from 'fname' into 'h'; the result is always a
+ * flat table. Flags is a bitmap:
+ *   o FASTHT_MMAP: don't copy the control bytes and slots; use a
+ *     private, copy-on-write mapping of the file instead. The
+ *     table is usable right away and pages are faulted in as keys
+ *     are looked up. Modifications are never written to the file.
+ *     Not supported on big-endian hosts.
+ *   o FASTHT_NOVERIFY: skip the SHA256 check of the image (which
+ *     touches every page); only the header is sanity checked.
+ *
+ * Return:
+ *   o 0 on success
+ *   o -EILSEQ: the checksum failed or the header is garbage
+ *   o -EINVAL: the file is too small for the table it describes
+ *   o -EOPNOTSUPP: FASTHT_MMAP on a big-endian host
+ *   o -errno:  for open() and mmap() related failures
+ */
+int ht_unmarshal(ht *h, const char *fname, uint32_t flags);
+
+
 /*
  * Dump the hash table via caller provided output function.
  * The 'start' string is printed at the beginning of the dump.
@@ -0,0 +1,85 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * fusefilter.h - Binary Fuse Filters
+ *
+ * An independent implementation of:
+ *  "Binary Fuse Filters: Fast and Smaller Than Xor Filters"
+ *  https://arxiv.org/abs/2201.01174
+ *
+ * Copyright (c) 2025 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  Same interface and false positive rate as Xorfilter (see
+ *    xorfilter.h) in ~1.13 instead of 1.23 fingerprints per
+ *    element; the three fingerprints of a key are close together.
+ *    So it's smaller, faster to build and faster to query.
+ *
+ * o  Duplicate keys are allowed (and only counted once).
+ */
+
+#ifndef ___FUSEFILTER_H__Yv0b5Q6kP2xJmW3n___
+#define ___FUSEFILTER_H__Yv0b5Q6kP2xJmW3n___ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+// Forward Decl: Opaque struct for callers
+struct Fusefilter;
+typedef struct Fusefilter Fusefilter;
+
+/*
+ * Create and return a new 8-bit Fusefilter using 'n' keys in 'elem'.
+ */
+extern Fusefilter* Fusefilter_new8(uint64_t *elem, size_t n);
+
+/*
+ * Create and return a new 16-bit Fusefilter using 'n' keys in 'elem'.
+ */
+extern Fusefilter* Fusefilter_new16(uint64_t *elem, size_t n);
+
+/* Delete and free memory associated with Fusefilter */
+extern void Fusefilter_delete(Fusefilter *);
+
+/*
+ * Return true if the Fusefilter contains element 'x' and false
+ * otherwise.
+ */
+extern int Fusefilter_contains(Fusefilter *, uint64_t x);
+
+/* Return number of bits per element in this Fusefilter */
+extern double Fusefilter_bpe(Fusefilter *);
+
+/*
+ * Marshal a Fusefilter to a file 'fname'
+ */
+extern int Fusefilter_marshal(Fusefilter *, const char *fname);
+
+
+#define FUSEFILTER_MMAP   (1 << 0)
+
+/*
+ * Unmarshal a Fusefilter from the given file. If FUSEFILTER_MMAP is
+ * set in 'flags', the actual filter data is mmap'd directly from
+ * the file (instead of malloc()'ing the memory).
+ */
+extern int Fusefilter_unmarshal(Fusefilter **p_x, const char *fname, uint32_t flags);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___FUSEFILTER_H__Yv0b5Q6kP2xJmW3n___ */
+
+/* EOF */
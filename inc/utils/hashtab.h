@@ -46,6 +46,20 @@ typedef int hash_cmp_f(const void* lhs, const void* rhs);
 typedef uint32_t hash_func_f(const void*);
 
 
+/*
+ * Optional key accessor: return a pointer to the bytes of the key
+ * of an element and set '*len' to its length.
+ *
+ * Two keys must be equal (as per the comparison function) if and
+ * only if their key bytes are identical.
+ */
+typedef const void* hash_key_f(const void* elem, size_t* len);
+
+
+/* Largest key length that can be stored inline in a hash node */
+#define HASH_TABLE_KEYMAX       128
+
+
 /*
  * Policy/Traits for an instance of the hash table.
  * These traits describe the allocation, de-allocation, hash
@@ -85,6 +99,33 @@ struct hash_table_policy
 
     /* Locking semantics. */
     lockmgr  lock;
+
+    /*
+     * Node pool (optional): if non-zero and 'lock' is set, nodes
+     * come from a thread caching pool (mempool_mt) - inserts and
+     * deletes then don't serialize on a pool lock. Each such table
+     * uses up a pthread key (PTHREAD_KEYS_MAX in all) and a
+     * magazine in every thread that touches it. By default nodes
+     * come from a per-table mempool under a lock.
+     */
+    int thread_cache;
+
+
+    /*
+     * Inline keys (optional): if 'key' is non-null and 'keymax'
+     * is non-zero, keys upto 'keymax' bytes (at most
+     * HASH_TABLE_KEYMAX) are copied into the hash node next to
+     * the hash value. Lookups compare such keys directly without
+     * calling 'cmp' or touching the element; 'cmp' is only
+     * called when both keys are longer than 'keymax'.
+     *
+     * This trades a bigger node (by 'keymax' bytes) and a call to
+     * 'key' per lookup for the calls to 'cmp'; it is not faster
+     * by itself (see t_hashbench) and pays only when 'cmp' is
+     * expensive.
+     */
+    hash_key_f* key;
+    size_t keymax;
 };
 typedef struct hash_table_policy hash_table_policy;
 
@@ -23,7 +23,14 @@ extern "C" {
 #endif /* __cplusplus */
 
 
-/* Virtual lock structure */
+/*
+ * Virtual lock structure.
+ *
+ * 'lock' and 'unlock' are exclusive (writer) operations. The
+ * optional 'rdlock' and 'rdunlock' are shared (reader) operations;
+ * a locker that doesn't provide them degrades to the exclusive
+ * ones.
+ */
 struct lockmgr
 {
     void (*create)(struct lockmgr*);
@@ -31,6 +38,9 @@ struct lockmgr
     void (*unlock)(void *);
     void (*dtor)(void*);
 
+    void (*rdlock)(void *);
+    void (*rdunlock)(void *);
+
     void * opaq;
 };
 typedef struct lockmgr lockmgr;
@@ -44,6 +54,8 @@ typedef struct lockmgr lockmgr;
                                 (m)->lock = 0; \
                                 (m)->unlock = 0; \
                                 (m)->dtor = 0; \
+                                (m)->rdlock = 0; \
+                                (m)->rdunlock = 0; \
                             } \
                         } while (0)
 
@@ -63,12 +75,34 @@ typedef struct lockmgr lockmgr;
 
 
 
+/* obtain a shared lock */
+#define lockmgr_rdlock(m)   do { \
+                                if ( (m)->rdlock ) \
+                                    (*(m)->rdlock)((m)->opaq); \
+                                else if ( (m)->lock ) \
+                                    (*(m)->lock)((m)->opaq); \
+                            } while (0)
+
+
+
+/* release a shared lock */
+#define lockmgr_rdunlock(m) do { \
+                                if ( (m)->rdunlock ) \
+                                    (*(m)->rdunlock)((m)->opaq); \
+                                else if ( (m)->unlock ) \
+                                    (*(m)->unlock)((m)->opaq); \
+                            } while (0)
+
+
+
 /* Delete a lock */
 #define lockmgr_delete(m)   do { \
                                     if ((m)->dtor) (*(m)->dtor)((m)->opaq); \
                                     (m)->lock   = 0; \
                                     (m)->unlock = 0; \
                                     (m)->dtor   = 0; \
+                                    (m)->rdlock   = 0; \
+                                    (m)->rdunlock = 0; \
                             } while (0)
 
 
@@ -77,12 +111,23 @@ typedef struct lockmgr lockmgr;
 #define lockmgr_new_empty(l)    do { \
                                    (l)->lock   = 0; \
                                    (l)->unlock = 0; \
+                                   (l)->rdlock   = 0; \
+                                   (l)->rdunlock = 0; \
                                 } while (0)
 
 
 
-/* Various lockers available to be cloned. */
+/*
+ * Various lockers available to be cloned:
+ *
+ *  - Mutex_locker:  exclusive mutex; shared ops are exclusive too
+ *  - Rwlock_locker: reader/writer lock (pthread_rwlock)
+ *  - Spin_locker:   reader/writer spin lock; for short critical
+ *                   sections that are never held across a sleep
+ */
 extern const lockmgr Mutex_locker;
+extern const lockmgr Rwlock_locker;
+extern const lockmgr Spin_locker;
 extern const lockmgr Null_locker;
 
 
@@ -23,6 +23,25 @@
  *   2) Call the macros memmgr_alloc() and memmgr_free() to call
  *      the desired alloc/free functions.
  *
+ * Page allocators (POSIX only):
+ *   memmgr_init_mmap() and memmgr_init_numa() make memory managers
+ *   that map every allocation directly from the OS - optionally on
+ *   huge pages and/or on a given NUMA node. Each allocation is at
+ *   least a page; they are meant for large, long lived memory (the
+ *   chunks of a mempool or an arena, bucket arrays). To use them
+ *   for small objects, put a mempool or an arena in front:
+ *
+ *      memmgr  pg, mm;
+ *      arena_t a;
+ *
+ *      memmgr_init_mmap(&pg, MEMMGR_HUGEPAGE);
+ *      arena_new_memmgr(&a, 0, &pg);
+ *      arena_memmgr(&mm, a);   // eg. for hash_table_policy.mem
+ *
+ *   Each mapping also holds a MEMMGR_OVERHEAD byte header; size a
+ *   request to a multiple of the huge page size less this overhead
+ *   (eg. with mempool_chunk_size()) - else it spills into one more
+ *   huge page.
  */
 
 #ifndef __MEMMGR_H__
@@ -51,6 +70,47 @@ extern memmgr * memmgr_init_default(memmgr *);
 extern memmgr * memmgr_init_xmalloc(memmgr *);
 
 
+/*
+ * Flags for the page allocators.
+ *
+ * MEMMGR_HUGEPAGE: Allocations of a huge page or larger are put on
+ *      huge pages: MAP_HUGETLB if the system has huge pages
+ *      reserved, else transparent huge pages via madvise(). After
+ *      MAP_HUGETLB fails, the next few allocations go straight to
+ *      transparent huge pages before it is tried again. Smaller
+ *      allocations use normal pages.
+ *
+ * MEMMGR_NUMA_STRICT: Fail the allocation if the memory can't come
+ *      from the requested node; the default is to prefer the node
+ *      and fall back to other nodes.
+ */
+#define MEMMGR_HUGEPAGE         (1 << 0)
+#define MEMMGR_NUMA_STRICT      (1 << 1)
+
+/* Bytes the page allocators add to every allocation */
+#define MEMMGR_OVERHEAD         64
+
+/* Node argument for memmgr_init_numa(): the node of the CPU the
+ * allocating thread runs on. */
+#define MEMMGR_NUMA_LOCAL       (-1)
+
+
+/* Make a memory manager that mmap's each allocation. Memory is zero
+ * filled. */
+extern memmgr * memmgr_init_mmap(memmgr *, unsigned int flags);
+
+/* Make a memory manager like memmgr_init_mmap() that binds the
+ * memory to NUMA node 'node'. On systems with a single node (or
+ * without NUMA support) this is the same as memmgr_init_mmap(). */
+extern memmgr * memmgr_init_numa(memmgr *, int node, unsigned int flags);
+
+/* Return the number of NUMA nodes; 1 if the system isn't NUMA. */
+extern int memmgr_numa_nodes(void);
+
+/* Return the huge page size used by MEMMGR_HUGEPAGE. */
+extern size_t memmgr_hugepage_size(void);
+
+
 #define memmgr_alloc(m,s)   (*(m)->alloc)((m)->context, s)
 #define memmgr_free(m,p)    (*(m)->free)((m)->context, p)
 
@@ -0,0 +1,187 @@
+/* vim: ts=4:sw=4:expandtab:tw=72:
+ *
+ * mempool-mt.h - Thread caching front-end for mempool.
+ *
+ * Copyright (c) 2005 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o A mempool_mt is a fixed size allocator that is safe to use
+ *   from many threads without a caller-side lock.
+ *
+ * o Each thread has a "magazine" of free blocks; alloc and free
+ *   only touch the calling thread's magazine. A magazine that is
+ *   empty is refilled with a batch of blocks; a magazine that is
+ *   full gives a batch of blocks back.
+ *
+ * o A block can be freed by any thread. Batches that are given
+ *   back are pushed on a lock-free list; thus, free never takes a
+ *   lock. A refill takes the central lock; it first reuses the
+ *   batches that were given back and only then allocates from the
+ *   underlying mempool.
+ *
+ * o When a thread exits, the blocks in its magazine go back to the
+ *   central pool.
+ *
+ * o A bounded pool (non-zero 'maxblks') can return NULL even though
+ *   other threads have free blocks in their magazines.
+ */
+
+#ifndef __UTILS_MEMPOOL_MT_H_1718043322__
+#define __UTILS_MEMPOOL_MT_H_1718043322__ 1
+
+#include "utils/mempool.h"
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+// Opaque struct for callers
+struct mempool_mt;
+typedef struct mempool_mt mempool_mt;
+
+
+/*
+ * Default number of blocks in a thread's magazine. Blocks move
+ * between a magazine and the central pool in batches of half this
+ * many.
+ */
+#define MEMPOOL_MT_MAGSIZE      64
+
+
+/** Create a new thread caching allocator of 'blksize' blocks.
+ *
+ *  @param p_st     The new allocator is returned here.
+ *  @param traits   Allocator for the underlying mempool; NULL for
+ *                  malloc()/free().
+ *  @param blksize  Size of each fixed sized block.
+ *  @param maxblks  If non-zero, clamps the allocator to this many
+ *                  blocks.
+ *  @param min_alloc_units Allocation granularity of the underlying
+ *                  mempool (see mempool_new()).
+ *  @param magsize  Number of blocks in a thread's magazine; if
+ *                  zero, use MEMPOOL_MT_MAGSIZE.
+ *
+ *  @return  0      on success
+ *  @return -EINVAL if 'p_st' is NULL or 'traits' is invalid
+ *  @return -ENOMEM if there is no more memory
+ */
+int mempool_mt_new(mempool_mt** p_st, const memmgr* traits,
+                   unsigned int blksize, unsigned int maxblks,
+                   unsigned int min_alloc_units, unsigned int magsize);
+
+
+/** Delete the allocator and all its memory. The caller must ensure
+ *  that no other thread is using it.
+ */
+void mempool_mt_delete(mempool_mt*);
+
+
+/** Allocate one block.
+ *
+ *  @return pointer to the block; NULL if there is no memory or if
+ *          the allocator is clamped.
+ */
+void * mempool_mt_alloc(mempool_mt*);
+
+
+/** Return a block allocated by mempool_mt_alloc() - from any
+ *  thread.
+ */
+void mempool_mt_free(mempool_mt*, void * ptr);
+
+
+/** Return the blocks in the calling thread's magazine to the
+ *  central pool.
+ */
+void mempool_mt_flush(mempool_mt*);
+
+
+/** Return the batches given back by the threads to the central
+ *  pool and release its free chunks - except 'keep' of them (see
+ *  mempool_trim()). The blocks cached in the threads' magazines
+ *  are not touched.
+ *
+ *  @return Number of bytes released
+ */
+uint64_t mempool_mt_trim(mempool_mt*, unsigned int keep);
+
+
+/** Return the block size used by this allocator.  */
+unsigned int mempool_mt_block_size(mempool_mt*);
+
+
+#ifdef __cplusplus
+} /* end of "C" linkage */
+
+
+namespace putils {
+
+// MempoolMT is a Mempool that can be shared by many threads.
+template <typename T> class MempoolMT
+{
+public:
+    MempoolMT(int max = 0, int minunits=0, const memmgr* tr=0, int magsize=0)
+    {
+        int e = mempool_mt_new(&m_pool, tr, sizeof(T), max, minunits, magsize);
+        if (e < 0) throw std::bad_alloc();
+    }
+
+    virtual ~MempoolMT()
+    {
+        mempool_mt_delete(m_pool);
+    }
+
+    MempoolMT(const MempoolMT&) = delete;
+    MempoolMT(MempoolMT&&) = delete;
+
+    MempoolMT& operator=(const MempoolMT&) = delete;
+    MempoolMT& operator=(MempoolMT&&) = delete;
+
+    // Allocate one fixed size block and construct using the right args
+    template <class... Args> T* Alloc(Args&&... a)
+    {
+        void *r = mempool_mt_alloc(m_pool);
+        if (!r) throw std::bad_alloc();
+
+        return new(r) T(std::forward<Args>(a)...);
+    }
+
+    // Deallocate a fixed size block
+    void Free(T * ptr)
+    {
+        // Call explicitly
+        ptr->~T();
+        mempool_mt_free(m_pool, ptr);
+    }
+
+    // Return the calling thread's cached blocks to the pool
+    void Flush() { mempool_mt_flush(m_pool); }
+
+    // Release free memory of the pool; keep 'keep' free chunks.
+    uint64_t Trim(unsigned int keep=0) { return mempool_mt_trim(m_pool, keep); }
+
+    // Return the actual block size used by this allocator.
+    unsigned int Blocksize() { return mempool_mt_block_size(m_pool); }
+
+private:
+    mempool_mt *m_pool;
+};
+
+} /* namespace putils */
+
+#endif /* __cplusplus */
+
+#endif /* ! __UTILS_MEMPOOL_MT_H_1718043322__ */
+
+/* EOF */
@@ -39,6 +39,10 @@
  *   It takes care of the tedium of bookeeping associated with
  *   successive allocation, free etc.
  *
+ *   The memory of chunks whose blocks are all free can be given
+ *   back (mempool_trim(), mempool_set_trim()). To make that
+ *   likely, blocks are allocated from the fullest chunks first.
+ *
  * Multi-threaded Issues
  * =====================
  * This allocator is fully-reentrant. i.e., it does NOT maintain any
@@ -79,16 +83,43 @@
 extern "C" {
 #endif /* __cplusplus */
 
-struct mru_node;
+struct memchunk;
+
+DL_HEAD_TYPEDEF(memchunk_head, memchunk);
+
+/*
+ * Chunks with free blocks are kept in this many lists by the
+ * fraction of their blocks that are free.
+ */
+#define MEMPOOL_NCLASS      8
 
-DL_HEAD_TYPEDEF(mru_head_type, mru_node);
 /*
  * mempool state;
  */
 struct mempool
 {
-    /* Head of MRU block list */
-    struct mru_head_type  mru_head;
+    /* Chunks with free blocks by class; the fullest are in class 0 */
+    struct memchunk_head part[MEMPOOL_NCLASS];
+
+    /* Chunks that are completely free */
+    struct memchunk_head empty;
+
+    /* Chunk we are allocating from */
+    struct memchunk *cur;
+
+    /* Chunk of the last free; the next one likely is the same */
+    struct memchunk *last;
+
+    /* All the chunks sorted by address; and the inline storage for
+     * the first one */
+    struct memchunk **chunkv;
+    struct memchunk  *chunk0;
+    uint32_t nchunks;
+    uint32_t capchunks;
+
+    /* Number of empty chunks; and the most we keep */
+    uint32_t nempty;
+    uint32_t hiwat;
 
     /* size of each block in this pool */
     uint64_t block_size;
@@ -99,9 +130,6 @@ struct mempool
     /* minimum number of units to allocate at a time */
     uint64_t min_units;
 
-    /* list of OS allocated chunks */
-    struct memchunk  *chunks;
-
     /* OS Traits */
     struct memmgr traits;
 };
@@ -237,6 +265,17 @@ void mempool_free(struct mempool* a, void * ptr);
 unsigned int mempool_block_size(struct mempool* a);
 
 
+/** Return the number of bytes a mempool of 'block_size' blocks asks
+ *  its memory manager for each chunk. The arguments are those given
+ *  to mempool_new(); as there, a non-zero 'max' is the number of
+ *  blocks in a chunk and 'min_alloc_units' is used only when 'max'
+ *  is zero. A memory manager can use this to tell chunk requests
+ *  from the others.
+ */
+uint64_t mempool_chunk_size(unsigned int block_size, unsigned int max,
+                            unsigned int min_alloc_units);
+
+
 /** Return the number of fixed sized blocks available in the allocator.
  *
  * @note This function is useful for those situations where the
@@ -250,6 +289,29 @@ unsigned int mempool_block_size(struct mempool* a);
 unsigned int mempool_total_blocks(struct mempool* a);
 
 
+/** Release the completely free chunks of the allocator - except
+ *  'keep' of them - to the underlying allocator. The chunk of a
+ *  mempool made from a fixed size zone is never released; instead
+ *  its pages are returned to the OS with madvise(2).
+ *
+ * @param a     Handle to the allocator
+ * @param keep  Number of free chunks to keep
+ *
+ * @return Number of bytes released
+ */
+uint64_t mempool_trim(struct mempool* a, unsigned int keep);
+
+
+/** Set the high-water mark of free chunks: when a free leaves more
+ *  than 'hiwat' completely free chunks, a chunk is released to the
+ *  underlying allocator. MEMPOOL_NO_TRIM (the default) keeps every
+ *  chunk until mempool_trim() is called.
+ */
+void mempool_set_trim(struct mempool* a, unsigned int hiwat);
+
+#define MEMPOOL_NO_TRIM     (~0U)
+
+
 /** Turn the mempool into a memgr interface.
  *  Basically, given a lower level of allocator, stack the mempool
  *  interface on top of it.
@@ -266,6 +328,7 @@ struct memmgr* mempool_make_memmgr(struct memmgr* out, struct mempool* a);
 
 
 #include <new>
+#include <utility>
 
 namespace putils {
 
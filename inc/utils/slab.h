@@ -0,0 +1,123 @@
+/* vim: ts=4:sw=4:expandtab:tw=72:
+ *
+ * slab.h - General purpose size-class allocator built on mempool.
+ *
+ * Copyright (c) 2005 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o A slab allocator serves requests of any size. Requests upto
+ *   SLAB_MAX_SIZE bytes are rounded up to one of SLAB_NCLASS size
+ *   classes; each class is a mempool. Larger requests go to the
+ *   system allocator.
+ *
+ * o The size classes are 16 bytes apart upto 128 bytes and then
+ *   four per power of 2; thus the most a request is rounded up by
+ *   is 25%.
+ *
+ * o The size classes get their memory from the OS in
+ *   SLAB_REGION_SIZE aligned regions with a small header at the
+ *   start. Thus, slab_free() and slab_size() find the size class
+ *   of a pointer in O(1) by masking its low bits (and a lookup in
+ *   a small table of the regions).
+ *
+ * o Like a mempool, a slab allocator is NOT thread safe.
+ */
+
+#ifndef __UTILS_SLAB_H_1718910442__
+#define __UTILS_SLAB_H_1718910442__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+#include "utils/memmgr.h"
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+// Opaque struct for callers
+struct slab;
+typedef struct slab slab;
+
+
+/* Requests larger than this are not served from a size class */
+#define SLAB_MAX_SIZE       (16 * 1024)
+
+/* Number of size classes */
+#define SLAB_NCLASS         36
+
+/* Size and alignment of each region of memory */
+#define SLAB_REGION_SIZE    (128 * 1024)
+
+
+/** Create a new slab allocator.
+ *
+ *  @return  0      on success
+ *  @return -EINVAL if 'p_s' is NULL
+ *  @return -ENOMEM if there is no more memory
+ */
+int slab_new(slab** p_s);
+
+
+/** Delete the slab allocator and all the memory allocated from it. */
+void slab_delete(slab*);
+
+
+/** Allocate 'n' bytes.
+ *
+ *  @return pointer to memory aligned to 8 bytes (the alignment of a
+ *          mempool block); NULL if there is no more memory. Types
+ *          that need more (eg. long double or SSE vectors) must
+ *          come from malloc(). Requests larger than SLAB_MAX_SIZE
+ *          keep malloc()'s alignment.
+ */
+void * slab_alloc(slab*, size_t n);
+
+
+/** Free 'ptr' allocated by slab_alloc() or slab_realloc(). 'ptr'
+ *  may be NULL.
+ */
+void slab_free(slab*, void * ptr);
+
+
+/** Resize 'ptr' to 'n' bytes. If the size class doesn't change,
+ *  'ptr' is returned as is.
+ *
+ *  @return pointer to the resized memory; NULL if there is no more
+ *          memory ('ptr' is untouched).
+ */
+void * slab_realloc(slab*, void * ptr, size_t n);
+
+
+/** Return the usable size of 'ptr' (at least what was asked for). */
+size_t slab_size(slab*, void * ptr);
+
+
+/** Release the empty chunks of every size class to the system.
+ *
+ *  @return Number of bytes released
+ */
+uint64_t slab_trim(slab*);
+
+
+/* Make a memory manager out of the slab allocator `s' into `m'. */
+#define slab_memmgr(m,s)    memmgr_init(m, (Alloc_f *)slab_alloc, (Free_f *)slab_free, s)
+
+
+#ifdef __cplusplus
+} /* end of "C" linkage */
+#endif /* __cplusplus */
+
+#endif /* ! __UTILS_SLAB_H_1718910442__ */
+
+/* EOF */
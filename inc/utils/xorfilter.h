@@ -41,6 +41,17 @@ extern Xorfilter* Xorfilter_new8(uint64_t *elem, size_t n);
  */
 extern Xorfilter* Xorfilter_new16(uint64_t *elem, size_t n);
 
+/*
+ * Create and return a new 8-bit or 16-bit Xorfilter using 'n' keys
+ * in 'elem' with 'nthreads' threads (all CPUs if 'nthreads' is
+ * zero). The updates to the construction state are partitioned for
+ * locality; so this is faster than Xorfilter_new8() for large 'n'
+ * even with one thread. The filter is the same as the one made by
+ * Xorfilter_new8() and Xorfilter_new16().
+ */
+extern Xorfilter* Xorfilter_new8_mt(uint64_t *elem, size_t n, int nthreads);
+extern Xorfilter* Xorfilter_new16_mt(uint64_t *elem, size_t n, int nthreads);
+
 /* Delete and free memory associated with Xorfilter */
 extern void Xorfilter_delete(Xorfilter *);
 
@@ -50,6 +61,20 @@ extern void Xorfilter_delete(Xorfilter *);
  */
 extern int Xorfilter_contains(Xorfilter *, uint64_t x);
 
+/*
+ * Look up the 'n' keys in 'keys' and set bit 'i' of the bitmap
+ * 'res' if keys[i] is in the filter. 'res' must have room for
+ * (n + 63) / 64 words. For a filter larger than the cache, the
+ * lookups of many keys are overlapped (and vectorized with AVX2). A
+ * filter that fits in cache has no misses to overlap; it is probed
+ * a key at a time and only saves the divisions of
+ * Xorfilter_contains(). The gain is modest either way (1.1x - 1.3x
+ * in t_xorfilter).
+ *
+ * Return the number of keys in the filter.
+ */
+extern size_t Xorfilter_contains_batch(Xorfilter *, const uint64_t *keys, size_t n, uint64_t *res);
+
 /* Return number of bits per element in this XOrfilter */
 extern double Xorfilter_bpe(Xorfilter *);
 
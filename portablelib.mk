@@ -41,6 +41,8 @@ all_posix_objs = daemon.o
 
 #all_posix_objs += resolve.o
 all_posix_objs += c_resolve.o work.o job.o
+all_posix_objs += cdb_read.o cdb_write.o
+all_posix_objs += memmgr-mmap.o slab.o
 
 posix_vpath    += $(PORTABLE)/src/posix
 posix_incdirs  +=
@@ -94,11 +96,13 @@ hashfunc_objs = cityhash.o fasthash.o fnvhash.o \
 			romu-rand.o xoroshiro.o xorshift.o \
 			siphash24.o xxhash.o yorrike.o \
 
-hashtab_objs = bloom.o bloom_marshal.o \
-			fast-ht.o hashtab.o hashtab_iter.o \
-			xorfilter.o xorfilter_marshal.o \
+hashtab_objs = bloom.o bloom_marshal.o bloom_merge.o cuckoo.o \
+			fast-ht.o fast-ht-flat.o fast-ht-marshal.o fast-ht-mt.o \
+			hashtab.o hashtab_iter.o \
+			xorfilter.o xorfilter_marshal.o xorfilter_mt.o \
+			fusefilter.o fusefilter_marshal.o \
 
-baseobjs = mempool.o dirname.o fts.o splitargs.o \
+baseobjs = mempool.o mempool-mt.o dirname.o fts.o splitargs.o \
 			escape.o unescape.o mmap.o sysexception.o syserror.o \
 			getopt_long.o error.o str2hex.o \
 			b64_encode.o b64_decode.o humanize.o strtosize.o \
@@ -25,17 +25,39 @@
  *  e.g., symbol-table management: Symbol-tables of a particular
  *  scope can all be deleted in one shot.
  *
- *  It relies internally on malloc() and free() for its operations.
+ *  It relies internally on malloc() and free() for its operations -
+ *  or on the memory manager given to arena_new_memmgr().
+ *
+ *  o  The first chunk of the list is the current chunk. An
+ *     allocation bumps its free pointer; only when it is full is
+ *     a chunk pushed to the head of the list. Thus, allocation is
+ *     O(1) and the space left in older chunks is never looked at.
+ *
+ *  o  Each new chunk is twice the size of the previous one (upto
+ *     MAX_CHUNK_SIZE); a request larger than that gets a chunk of
+ *     its own. Such a chunk is linked behind the current chunk -
+ *     which stays current - and doesn't grow the chunk size.
+ *
+ *  o  A checkpoint is the current chunk, the chunk behind it and
+ *     its free pointer. Rewinding pops the chunks allocated after
+ *     the checkpoint - including the oversized ones linked behind
+ *     the current chunk - and restores the free pointer. The
+ *     popped chunks go to a list of spares; a new chunk is taken
+ *     from there before calling malloc(). arena_reset() rewinds to
+ *     an empty arena.
  *
  */
 
 #include <errno.h>
 #include <stdlib.h>
+#include <assert.h>
 #include "utils/arena.h"
 #include "utils/utils.h"
 #include "fast/list.h"
 
 #define DEFAULT_CHUNK_SIZE  (128 * 1024)
+#define MAX_CHUNK_SIZE      (64 * 1024 * 1024)
+#define CHUNK_SLACK         256
 
 #if 0
 #define DIAG(a) printf a
@@ -63,8 +85,17 @@ typedef struct arena_node arena_node;
 
 struct arena
 {
+    /* chunks in use; the first one is the current chunk */
     SL_HEAD(node_head, arena_node) head;
+
+    /* chunks released by arena_rewind() and arena_reset() */
+    SL_HEAD(spare_head, arena_node) spare;
+
+    /* size of the next chunk from malloc() */
     uint64_t chunk_size;
+
+    /* allocator for the chunks */
+    memmgr mem;
 };
 typedef struct arena arena;
 
@@ -87,11 +118,19 @@ union align
 
 int
 arena_new(arena_t* p_arena, size_t chunk_size)
+{
+    return arena_new_memmgr(p_arena, chunk_size, 0);
+}
+
+
+int
+arena_new_memmgr(arena_t* p_arena, size_t chunk_size, const memmgr* mm)
 {
     int retval = -ENOMEM;
     arena * a;
 
     if (!p_arena) return -EINVAL;
+    if (mm && !memmgr_valid_p(mm)) return -EINVAL;
 
     if (chunk_size <= 0)
         chunk_size = DEFAULT_CHUNK_SIZE;
@@ -100,7 +139,10 @@ arena_new(arena_t* p_arena, size_t chunk_size)
     if (a) {
         retval = 0;
         SL_INIT(&a->head);
-        a->chunk_size = chunk_size;
+        SL_INIT(&a->spare);
+        if (mm) a->mem = *mm;
+        else    malloc_memmgr(&a->mem);
+        a->chunk_size = _ALIGN_UP(chunk_size, SYS_ALIGNMENT);
     }
 
     *p_arena = a;
@@ -108,11 +150,67 @@ arena_new(arena_t* p_arena, size_t chunk_size)
 }
 
 
-/* compute available bytes in a node */
-static inline uint64_t
-__avail(arena_node* n)
+/* Carve 'nbytes' aligned to 'align' from the chunk 'n' */
+static inline void *
+__carve(arena_node* n, size_t nbytes, size_t align)
 {
-    return n->end - n->free;
+    unsigned char *mem = _ALIGN_UP(n->free, align);
+
+    if (mem > n->end || nbytes > _U64(n->end - mem)) return 0;
+
+    n->free = mem + nbytes;
+    return mem;
+}
+
+
+/*
+ * Make a new chunk that can hold 'nbytes' aligned to 'align' and
+ * allocate from it. An oversized chunk goes behind the current
+ * chunk; any other becomes the current chunk.
+ */
+static void *
+__newchunk(arena* a, size_t nbytes, size_t align)
+{
+    uint64_t need  = _U64(nbytes) + align;
+    uint64_t chunk = a->chunk_size;
+    arena_node *n, *cur, *prev = 0;
+    int big;
+
+    // Leave room for the chunk header and the allocator's own
+    // header: the allocation is then at most chunk_size bytes and
+    // doesn't spill into another (huge) page.
+    if (chunk > 2 * CHUNK_SLACK) chunk -= CHUNK_SLACK;
+    big = need > chunk;
+
+    /* the spares are few: at most one per doubling */
+    SL_FOREACH(n, &a->spare, link) {
+        if (n->total >= need) break;
+        prev = n;
+    }
+
+    if (n) {
+        if (prev) SL_NEXT(prev, link) = SL_NEXT(n, link);
+        else      SL_REMOVE_HEAD(&a->spare, link);
+    } else {
+        if (big) chunk = _ALIGN_UP(need, SYS_ALIGNMENT);
+
+        DIAG(("arena=%p; new chunk=%llu:\n", a, chunk));
+        n = (arena_node *) memmgr_alloc(&a->mem, sizeof(arena_node) + chunk);
+        if (!n) return 0;
+
+        n->total = chunk;
+        if (!big && a->chunk_size < MAX_CHUNK_SIZE) a->chunk_size *= 2;
+    }
+
+    n->free = _ALIGN_UP(pUCHAR(n) + sizeof *n, SYS_ALIGNMENT);
+    n->end  = pUCHAR(n) + sizeof *n + n->total;
+
+    if (big && (cur = SL_FIRST(&a->head)))
+        SL_INSERT_AFTER(&a->head, cur, n, link);
+    else
+        SL_INSERT_HEAD(&a->head, n, link);
+
+    return __carve(n, nbytes, align);
 }
 
 
@@ -120,63 +218,91 @@ __avail(arena_node* n)
  * Allocate memory from an arena
  */
 void *
-arena_alloc(arena_t a, size_t nbytes)
+arena_alloc_aligned(arena_t a, size_t nbytes, size_t align)
 {
     arena_node* n;
-    size_t chunk;
-    void * mem = 0;
+    void * mem;
 
     if (!a) return 0;
 
-    /* Account for system alignment */
-    nbytes = _ALIGN_UP(nbytes, SYS_ALIGNMENT);
+    assert(_IS_POW2(align));
 
-    /*
-     * find an arena with the best size.
-     */
-    DIAG(("arena=%p; alloc-req=%d:\n", p, nbytes));
-    SL_FOREACH(n, &a->head, link) {
-        if (__avail(n) >= nbytes)
-            goto _found;
-    }
+    n = SL_FIRST(&a->head);
+    if (likely(n && (mem = __carve(n, nbytes, align)))) return mem;
 
-    /* allocate a new node; but, try to allocate a few more bytes
-     * to satisfy atleast few more such allocations.  */
-    chunk = nbytes < a->chunk_size ? a->chunk_size : nbytes * 16;
-    n     = (arena_node *) malloc(sizeof(arena_node) + chunk);
-    if (!n) goto _end;
+    return __newchunk(a, nbytes, align);
+}
 
-    n->total = chunk;
-    n->free  = pUCHAR(n) + sizeof *n;
-    n->end   = n->free + chunk;
-    
-    SL_INSERT_HEAD(&a->head, n, link);
 
-_found:
+void *
+arena_alloc(arena_t a, size_t nbytes)
+{
+    return arena_alloc_aligned(a, nbytes, SYS_ALIGNMENT);
+}
 
-    mem     = _ALIGN_UP(n->free, SYS_ALIGNMENT);
-    n->free = pUCHAR(mem) + nbytes;
 
-_end:
-    return mem;
+void
+arena_mark(arena_t a, arena_mark_t* m)
+{
+    arena_node* n = SL_FIRST(&a->head);
+
+    m->node = n;
+    m->next = n ? SL_NEXT(n, link) : 0;
+    m->free = n ? n->free : 0;
 }
 
 
+void
+arena_rewind(arena_t a, const arena_mark_t* m)
+{
+    arena_node* n;
+
+    while ((n = SL_FIRST(&a->head)) && n != m->node) {
+        SL_REMOVE_HEAD(&a->head, link);
+        SL_INSERT_HEAD(&a->spare, n, link);
+    }
+
+    assert(n == m->node);
+    if (n) {
+        arena_node* x;
+
+        // the oversized chunks linked behind it since
+        while ((x = SL_NEXT(n, link)) != m->next) {
+            SL_NEXT(n, link) = SL_NEXT(x, link);
+            SL_INSERT_HEAD(&a->spare, x, link);
+        }
+        n->free = m->free;
+    }
+}
 
 
-/* Delete all pools of memory associated with arena `a' */
 void
-arena_delete(arena_t a)
+arena_reset(arena_t a)
 {
-    arena_node* n;
+    arena_mark_t m = { 0, 0, 0 };
 
-    n = SL_FIRST(&a->head);
+    arena_rewind(a, &m);
+}
+
+
+static void
+__delete_list(arena* a, arena_node* n)
+{
     while (n) {
         arena_node* next = SL_NEXT(n, link);
 
-        DEL(n);
+        memmgr_free(&a->mem, n);
         n = next;
     }
+}
+
+
+/* Delete all pools of memory associated with arena `a' */
+void
+arena_delete(arena_t a)
+{
+    __delete_list(a, SL_FIRST(&a->head));
+    __delete_list(a, SL_FIRST(&a->spare));
     DEL(a);
 }
 
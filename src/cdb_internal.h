@@ -0,0 +1,69 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * cdb_internal.h - Internal definitions shared by the CDB reader
+ *                  and writer
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ */
+
+#ifndef ___CDB_INTERNAL_H_6015372_1470077389__
+#define ___CDB_INTERNAL_H_6015372_1470077389__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Number of top level tables
+#define CDB_NTAB        256
+
+// Size of the index of top level tables at the start of the file
+#define CDB_HDRSIZE     (CDB_NTAB * 8)
+
+// Size of the record header: key length, value length
+#define CDB_RECHDR      8
+
+/*
+ * A cdb64 file starts with an 8 byte magic and 8 reserved bytes;
+ * the index of the top level tables that follows has a 64 bit
+ * offset and number of slots per table. A slot is a 64 bit hash
+ * and a 64 bit record offset.
+ */
+#define CDB64_MAGIC     "CDB64\0\0\0"
+#define CDB64_HDRSIZE   (16 + (CDB_NTAB * 16))
+
+extern uint64_t fasthash64(const void*, size_t, uint64_t);
+
+// The hash of a cdb64 key
+static inline uint64_t
+cdb_hash64(const void* k, size_t klen)
+{
+    return fasthash64(k, klen, 0x2de9ce7b97d9569f);
+}
+
+static inline uint32_t
+cdb_hash(const void* k, size_t klen)
+{
+    uint64_t h = cdb_hash64(k, klen);
+    return (uint32_t)(h - (h >> 32));
+}
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___CDB_INTERNAL_H_6015372_1470077389__ */
+
+/* EOF */
@@ -18,6 +18,16 @@
  * o  This uses a memory map'd interface for READONLY access to the
  *    database.
  * o  All read offsets are checked for sanity.
+ * o  Files are written by cdb_write.c (see cdb_writer.h).
+ * o  A cdb64 (see cdb_internal.h) is recognized by its magic. It
+ *    has the same two levels as a CDB: a lookup reads one entry of
+ *    the index and then probes one table - with 64 bit offsets
+ *    and a 64 bit hash in each slot.
+ * o  Lookups are random: the mapping is marked MADV_RANDOM. Every
+ *    lookup touches the index and a table; these are contiguous
+ *    (the tables follow the records) and are asked to be paged in
+ *    ahead of time and to be backed by huge pages where the kernel
+ *    and the filesystem can.
  */
 #include <unistd.h>
 #include <fcntl.h>
@@ -32,9 +42,12 @@
 #include <sys/stat.h>
 
 #include "cdb_reader.h"
+#include "cdb_internal.h"
 
 #define _u32(x)     ((uint32_t)(x))
+#define _u64(x)     ((uint64_t)(x))
 #define pU32(x)     ((uint32_t*)(x))
+#define pU64(x)     ((uint64_t*)(x))
 
 #ifdef __little_endian
 
@@ -42,6 +55,11 @@
         assert(off < (d)->size); \
         (*pU32((d)->mmap+off));  \
         })
+
+#define __read64(d, off) ({ \
+        assert(off < (d)->size); \
+        (*pU64((d)->mmap+off));  \
+        })
 #else
 
 static inline uint32_t
@@ -52,20 +70,112 @@ dec_LE_u32(const uint8_t * p) {
            | (_u32(p[3]) << 24);
 }
 
+static inline uint64_t
+dec_LE_u64(const uint8_t * p) {
+    return dec_LE_u32(p) | (_u64(dec_LE_u32(p+4)) << 32);
+}
+
 #define __read32(d, off) ({ \
         assert(off < (d)->size); \
         dec_LE_u32((d)->mmap+off);     \
         })
 
+#define __read64(d, off) ({ \
+        assert(off < (d)->size); \
+        dec_LE_u64((d)->mmap+off);     \
+        })
+
 #endif /* __little_endian */
 
-extern uint64_t fasthash64(const void*, size_t, uint64_t);
 
-static inline uint32_t
-cdb_hash(const void* k, size_t klen)
+// Return true if the table at 'off' with 'len' slots of 'slotsz'
+// bytes is within the file.
+static inline int
+tabok(CDB* db, uint64_t off, uint64_t len, uint64_t slotsz)
+{
+    if (len == 0) return 1;
+    return off <= db->size && len <= ((db->size - off) / slotsz);
+}
+
+
+// Setup the index of a CDB; return the offset of the first table
+static int
+index32(CDB* db, uint64_t* p_tab)
+{
+    uint64_t tab = db->size;
+    int i;
+
+#ifdef __little_endian
+    db->index = (idx *)db->mmap;
+#else
+    uint8_t * p = db->mmap;
+    for (i = 0; i < 256; i++) {
+        idx *ii = &db->index[i];
+        ii->off = dec_LE_u32(p); p += 4;
+        ii->len = dec_LE_u32(p); p += 4;
+    }
+#endif /* __little_endian */
+
+    for (i = 0; i < 256; i++) {
+        idx *ii = &db->index[i];
+
+        if (!tabok(db, ii->off, ii->len, 8)) return -EINVAL;
+        if (ii->len > 0 && ii->off < tab) tab = ii->off;
+    }
+
+    *p_tab = tab;
+    return 0;
+}
+
+
+// Setup the index of a cdb64; return the offset of the first table
+static int
+index64(CDB* db, uint64_t* p_tab)
+{
+    uint64_t tab = db->size;
+    int i;
+
+    db->is64 = 1;
+
+#ifdef __little_endian
+    db->index64 = (idx64 *)(db->mmap + 16);
+#else
+    uint8_t * p = db->mmap + 16;
+    for (i = 0; i < 256; i++) {
+        idx64 *ii = &db->index64[i];
+        ii->off = dec_LE_u64(p); p += 8;
+        ii->len = dec_LE_u64(p); p += 8;
+    }
+#endif /* __little_endian */
+
+    for (i = 0; i < 256; i++) {
+        idx64 *ii = &db->index64[i];
+
+        if (!tabok(db, ii->off, ii->len, 16)) return -EINVAL;
+        if (ii->len > 0 && ii->off < tab) tab = ii->off;
+    }
+
+    *p_tab = tab;
+    return 0;
+}
+
+
+// Hints for the mapping of 'db' whose tables start at 'tab'
+static void
+advise(CDB* db, uint64_t tab)
 {
-    uint64_t h = fasthash64(k, klen, 0x2de9ce7b97d9569f);
-    return (uint32_t)(h - (h >> 32));
+    uint64_t pg  = sysconf(_SC_PAGESIZE);
+    uint64_t off = tab & ~(pg - 1);
+    uint64_t hdr = db->is64 ? CDB64_HDRSIZE : CDB_HDRSIZE;
+
+    madvise(db->mmap, db->size, MADV_RANDOM);
+
+    // Only the index is read on every lookup; the tables at the end
+    // can be as large as the records - fault them in as needed.
+    madvise(db->mmap, (hdr + pg - 1) & ~(pg - 1), MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+    if (off < db->size) madvise(db->mmap + off, db->size - off, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
 }
 
 
@@ -81,7 +191,7 @@ cdb_read_init(CDB* db, const char* filename)
     struct stat st;
 
     if (fstat(fd, &st) < 0) { r = -errno;  goto fail; }
-    if (st.st_size < 2048)  { r = -EINVAL; goto fail; }
+    if (st.st_size < CDB_HDRSIZE) { r = -EINVAL; goto fail; }
 
     void* ptr = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
     if (ptr == MAP_FAILED)  { r = -errno;  goto fail; }
@@ -92,6 +202,9 @@ cdb_read_init(CDB* db, const char* filename)
      * First 256 * 8 bytes are the index.
      * Each entry is: offset, length pair (4 bytes each)
      *
+     * A cdb64 has a 16 byte header before its index; and each
+     * entry is a pair of 8 byte numbers.
+     *
      * The entries are in little-endian format.
      */
 
@@ -100,18 +213,20 @@ cdb_read_init(CDB* db, const char* filename)
     db->mmap  = (uint8_t*)ptr;
     db->size  = st.st_size;
 
-#ifdef __little_endian
-    db->index = (idx *)ptr;
-#else
-    int i;
-    uint8_t * p = db->mmap;
-    for (i = 0; i < 256; i++) {
-        idx *ii = &db->index[i];
-        ii->off = dec_LE_u32(p); p += 4;
-        ii->len = dec_LE_u32(p); p += 4;
+    uint64_t tab;
+
+    if (st.st_size >= CDB64_HDRSIZE && 0 == memcmp(ptr, CDB64_MAGIC, 8)) {
+        r = index64(db, &tab);
+    } else {
+        r = index32(db, &tab);
+    }
+
+    if (r < 0) {
+        munmap(ptr, st.st_size);
+        goto fail;
     }
-#endif /* __little_endian */
 
+    advise(db, tab);
     return 0;
 
 fail:
@@ -120,6 +235,64 @@ fail:
 }
 
 
+// Release the mapping and the fd of 'db'
+void
+cdb_close(CDB* db)
+{
+    munmap(db->mmap, db->size);
+    close(db->fd);
+    memset(db, 0, sizeof *db);
+}
+
+
+// Return true if the record at 'off' has the key 'key'; set the
+// value and its length if so.
+static inline int
+match(CDB* db, uint64_t off, const void* key, size_t klen, void** p_ret, ssize_t* p_vlen)
+{
+    uint32_t dklen = __read32(db, off);
+    uint32_t dvlen = __read32(db, off+4);
+
+    // Sanity check
+    assert((off+8+dklen+dvlen) <= db->size);
+
+    // key + value is at off+8
+    if (dklen != klen || 0 != memcmp(key, db->mmap+off+8, klen)) return 0;
+
+    // Value is at off+8+dklen
+    *p_ret  = db->mmap + off + 8 + dklen;
+    *p_vlen = dvlen;
+    return 1;
+}
+
+
+static ssize_t
+cdb64_find(CDB* db, void** p_ret, const void* key, size_t klen)
+{
+    uint64_t h = cdb_hash64(key, klen);
+    idx64 *ii  = &db->index64[h & 0xff];
+    ssize_t vlen;
+
+    if (ii->len == 0) { return -ENOENT; }
+
+    uint64_t start = (h >> 8) % ii->len;
+    uint64_t slot  = start;
+
+    do {
+        uint64_t slotoff  = ii->off + (16 * slot);
+        uint64_t slothash = __read64(db, slotoff);
+        uint64_t off      = __read64(db, slotoff+8);
+
+        // An empty slot has a zero record offset
+        if (off == 0) break;
+
+        if (slothash == h && match(db, off, key, klen, p_ret, &vlen)) return vlen;
+
+        if (++slot == ii->len) slot = 0;
+    } while (slot != start);
+
+    return -ENOENT;
+}
 
 
 /**
@@ -133,8 +306,11 @@ fail:
 ssize_t
 cdb_find(CDB* db, void** p_ret, const void* key, size_t klen)
 {
+    if (db->is64) return cdb64_find(db, p_ret, key, klen);
+
     uint32_t h = cdb_hash(key, klen);
     idx *ii    = &db->index[h & 0xff];
+    ssize_t vlen;
 
     if (ii->len == 0) { return -ENOENT; }
 
@@ -146,25 +322,14 @@ cdb_find(CDB* db, void** p_ret, const void* key, size_t klen)
         uint32_t slothash = __read32(db, slotoff);
         uint32_t off      = __read32(db, slotoff+4);
 
-        if (slothash == 0) break;
-
-        // Now, check to see if the key matches
-        if (slothash == h) {
-            uint32_t dklen = __read32(db, off);
-            uint32_t dvlen = __read32(db, off+4);
-
-            if (dklen != klen) return -ENOENT;
-
-            // Sanity check
-            assert((off+8+dklen+dvlen) <= db->size);
-        
-            // key + value is at off+8
-            if (0 != memcmp(key, db->mmap+off+8, klen)) return -ENOENT;
+        // An empty slot has a zero record offset; a record can't
+        // be at offset 0 (the index is there) - but its hash can
+        // be 0.
+        if (off == 0) break;
 
-            // Value is at off+8+dklen
-            *p_ret = db->mmap + off + 8 + dklen;
-            return dvlen;
-        }
+        // Now, check to see if the key matches; a different key
+        // with the same hash continues the probe.
+        if (slothash == h && match(db, off, key, klen, p_ret, &vlen)) return vlen;
 
         slot = (slot + 1) % ii->len;
     } while (slot != start);
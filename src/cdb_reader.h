@@ -24,6 +24,7 @@ extern "C" {
 
 #include <stdint.h>
 #include <inttypes.h>
+#include <sys/types.h>
 
 #ifndef __BYTE_ORDER__
 #error "Don't know the byte order!"
@@ -46,6 +47,17 @@ struct idx {
 typedef struct idx idx;
 
 
+/*
+ * The first level directory index of a cdb64 (a DB larger than
+ * 4GB).
+ */
+struct idx64 {
+    uint64_t off;
+    uint64_t len;
+};
+typedef struct idx64 idx64;
+
+
 /*
  * Abstrction of a DJB CDB/
  *
@@ -58,18 +70,22 @@ struct CDB {
 
 #ifdef __little_endian
     idx     *index;   // we just point to the structure
+    idx64   *index64;
 #else
     idx     index[256];
+    idx64   index64[256];
 #endif /* LITTLE_ENDIAN */
 
     int      fd;
+    int      is64;    // set if this is a cdb64
 };
 typedef struct CDB CDB;
 
 
 
 /*
- * Initialize the 'db' for read operations from file 'fname'
+ * Initialize the 'db' for read operations from file 'fname'; it can
+ * be a CDB or a cdb64.
  * Return:
  *  0      on success
  *  -errno on failre.
@@ -78,6 +94,12 @@ extern int cdb_read_init(CDB* db, const char* fname);
 
 
 
+/*
+ * Unmap the DB and close its fd.
+ */
+extern void cdb_close(CDB* db);
+
+
 /**
  * Find key 'key' in the DB. If found, set 'p_ret' to the
  * corresponding value.
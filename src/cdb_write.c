@@ -0,0 +1,667 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * cdb_write.c - CDB Writer Interface
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  The file is DJB's CDB format (see cdb_read.c) with cdb_hash()
+ *    instead of DJB's hash:
+ *     - 256 (offset, nslots) pairs of the top level tables
+ *     - records: key length, value length, key, value
+ *     - the top level tables; table 'i' has the records whose
+ *       hash has 'i' in its low byte. A table has two slots
+ *       (hash, record offset) per record; a record starts at slot
+ *       (hash >> 8) % nslots and is in the first free slot at or
+ *       after it. An empty slot has a zero offset.
+ *    All integers are 32 bit Little Endian; thus a DB is at most
+ *    4GB.
+ *
+ * o  The records are written as they are added; only the (hash,
+ *    offset) of each record is kept in memory - partitioned by its
+ *    table. The 256 tables are independent of each other: they
+ *    are built in parallel by 'nthreads' workers, each owning a
+ *    contiguous run of tables (with about the same number of
+ *    slots). Each table is built in memory and written with one
+ *    pwrite(2).
+ *
+ * o  cdb_build() also serializes the records in parallel: each
+ *    worker hashes a slice of the records and counts them per
+ *    table; the counts give each worker the file offset of its
+ *    records and where its slots go in the partitioned slot array.
+ *    The records are then written via a large buffer per worker.
+ *
+ * o  Slots of a table are in the order the records were added;
+ *    thus of several records with the same key, cdb_find() returns
+ *    the one added first.
+ *
+ * o  The DB is written to a temporary file and renamed when it is
+ *    complete.
+ *
+ * o  With CDB_64BIT, the DB is a cdb64 (see cdb_internal.h): the
+ *    records are the same; the index and the slots have 64 bit
+ *    offsets and the slots have the 64 bit hash of the key.
+ *    In memory, the slots are always 64 bits wide; they are encoded
+ *    in the format of the DB when their table is written.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "fast/vect.h"
+#include "fast/encdec.h"
+#include "fast/fastdiv.h"
+#include "posix/job.h"
+#include "cdb_writer.h"
+#include "cdb_internal.h"
+
+
+// Size of the write buffer (of a writer or a bulk worker)
+#define CDB_BUFSZ       (4 * 1024 * 1024)
+
+// Offsets of a CDB are 32 bits
+#define CDB_MAXSIZE     _U64(UINT32_MAX)
+
+
+struct cdb_slot {
+    uint64_t hash;
+    uint64_t off;
+};
+typedef struct cdb_slot cdb_slot;
+
+VECT_TYPEDEF(cdb_slotv, cdb_slot);
+
+
+// A top level table: its records and where it goes in the file
+struct table {
+    cdb_slot *s;
+    uint64_t  n;
+    uint64_t  off;
+};
+typedef struct table table;
+
+
+struct worker {
+    int      err;
+
+    // records [lo, hi) of a bulk build: 'size' bytes at 'off'
+    size_t   lo, hi;
+    uint64_t size;
+    uint64_t off;
+
+    // records of the slice per table; and then the index of the
+    // slice's next slot in each table.
+    uint64_t cnt[CDB_NTAB];
+
+    // tables [tlo, thi)
+    uint32_t tlo, thi;
+};
+typedef struct worker worker;
+
+
+// The tables being built
+struct tabset {
+    int    fd;
+    int    is64;
+    table  t[CDB_NTAB];
+};
+typedef struct tabset tabset;
+
+
+// State of a bulk build
+struct bulk {
+    int            fd;
+    int            is64;
+    const cdb_rec *r;
+    uint64_t      *hash;
+    cdb_slot      *slot;
+};
+typedef struct bulk bulk;
+
+
+// Write all of 'buf' at offset 'off'
+static int
+wrall(int fd, const uint8_t *buf, size_t n, uint64_t off)
+{
+    while (n > 0) {
+        ssize_t m = pwrite(fd, buf, n, off);
+
+        if (m < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+
+        buf += m;
+        off += m;
+        n   -= m;
+    }
+    return 0;
+}
+
+
+/*
+ * Append 'n' bytes of 'p' to the buffer 'b' of CDB_BUFSZ bytes; it
+ * has '*bl' bytes that end at file offset '*off'. A full buffer is
+ * written out.
+ */
+static int
+bufwrite(int fd, uint8_t *b, size_t *bl, uint64_t *off, const void *p, size_t n)
+{
+    const uint8_t *s = p;
+    int r;
+
+    while (n > 0) {
+        size_t m = CDB_BUFSZ - *bl;
+
+        if (m == 0) {
+            if ((r = wrall(fd, b, *bl, *off - *bl)) < 0) return r;
+
+            *bl = 0;
+            m   = CDB_BUFSZ;
+        }
+        if (m > n) m = n;
+
+        memcpy(b + *bl, s, m);
+        *bl  += m;
+        *off += m;
+        s    += m;
+        n    -= m;
+    }
+    return 0;
+}
+
+
+// Run 'fn' over the 'nthreads' workers in 'w'
+static int
+run(int nthreads, jobfunc_t fn, void *ctx, worker *w)
+{
+    int v, r;
+
+    if (nthreads == 1) {
+        fn(ctx, &w[0], 0);
+    } else {
+        job_manager jm;
+
+        if ((r = job_manager_init(&jm, nthreads, fn, ctx)) < 0) return r;
+
+        for (v = 0; v < nthreads; v++) job_manager_submit_job(&jm, &w[v]);
+
+        job_manager_wait(&jm);
+        job_manager_destroy(&jm);
+    }
+
+    for (v = 0; v < nthreads; v++) {
+        if (w[v].err < 0) return w[v].err;
+    }
+    return 0;
+}
+
+
+// Hash of a key in a CDB or a cdb64
+static inline uint64_t
+hashkey(const void *k, size_t klen, int is64)
+{
+    return is64 ? cdb_hash64(k, klen) : cdb_hash(k, klen);
+}
+
+
+// Place the 'n' slots of 's' in the table 'tab' of 'len' slots
+static void
+mktable(cdb_slot *tab, uint64_t len, const cdb_slot *s, uint64_t n)
+{
+    fastdiv  d;
+    uint64_t i;
+
+    fastdiv_init(&d, len);
+    memset(tab, 0, len * sizeof tab[0]);
+    for (i = 0; i < n; i++) {
+        uint64_t j = fastdiv_mod(&d, s[i].hash >> 8);
+
+        while (tab[j].off != 0) {
+            if (++j == len) j = 0;
+        }
+        tab[j] = s[i];
+    }
+}
+
+
+// Encode the 'len' slots of 'tab' in place; return the size of the
+// encoded table. A CDB slot is half the size of the one in memory;
+// thus slot 'i' is always read before it is overwritten.
+static size_t
+enctable(cdb_slot *tab, uint64_t len, int is64)
+{
+    uint8_t *p = (uint8_t *)tab;
+    uint64_t i;
+
+    for (i = 0; i < len; i++) {
+        cdb_slot t = tab[i];
+
+        if (is64) {
+            p = enc_LE_u64(p, t.hash);
+            p = enc_LE_u64(p, t.off);
+        } else {
+            p = enc_LE_u32(p, t.hash);
+            p = enc_LE_u32(p, t.off);
+        }
+    }
+    return p - (uint8_t *)tab;
+}
+
+
+// Build and write the tables of worker 'job'
+static int
+tab_worker(void *ctx, void *job, int thr)
+{
+    tabset   *ts  = ctx;
+    worker   *w   = job;
+    cdb_slot *tab = 0;
+    uint64_t  cap = 0;
+    uint32_t  i;
+
+    (void)thr;
+    for (i = w->tlo; i < w->thi; i++) {
+        table   *t   = &ts->t[i];
+        uint64_t len = 2 * t->n;
+
+        if (len == 0) continue;
+        if (len > cap) {
+            DEL(tab);
+            cap = len;
+            tab = NEWA(cdb_slot, cap);
+            if (!tab) {
+                w->err = -ENOMEM;
+                break;
+            }
+        }
+
+        mktable(tab, len, t->s, t->n);
+
+        size_t sz = enctable(tab, len, ts->is64);
+        if ((w->err = wrall(ts->fd, (uint8_t *)tab, sz, t->off)) < 0) break;
+    }
+
+    DEL(tab);
+    return w->err;
+}
+
+
+/*
+ * Lay out the tables in 'ts' after the records that end at 'end';
+ * build them with 'nthreads' workers and write the index.
+ */
+static int
+mktables(tabset *ts, uint64_t end, int nthreads)
+{
+    uint8_t  hdr[CDB64_HDRSIZE],
+            *p   = hdr;
+    uint64_t off = end,
+             tot = 0,
+             acc = 0,
+             ssz = ts->is64 ? 16 : 8;
+    uint32_t i   = 0;
+    int      v, r;
+
+    if (ts->is64) {
+        memset(p, 0, 16);
+        memcpy(p, CDB64_MAGIC, 8);
+        p += 16;
+    }
+
+    for (i = 0; i < CDB_NTAB; i++) {
+        table *t = &ts->t[i];
+
+        t->off = off;
+        off   += 2 * ssz * t->n;
+        tot   += t->n;
+
+        if (ts->is64) {
+            p = enc_LE_u64(p, t->off);
+            p = enc_LE_u64(p, 2 * t->n);
+        } else {
+            p = enc_LE_u32(p, t->off);
+            p = enc_LE_u32(p, 2 * t->n);
+        }
+    }
+    if (!ts->is64 && off > CDB_MAXSIZE) return -EFBIG;
+
+    // Split the tables into contiguous runs of about the same
+    // number of slots.
+    worker *w = NEWZA(worker, nthreads);
+    if (!w) return -ENOMEM;
+
+    for (i = 0, v = 0; v < nthreads; v++) {
+        uint64_t want = (tot * (v+1)) / nthreads;
+
+        w[v].tlo = i;
+        while (i < CDB_NTAB && (acc < want || v == (nthreads-1))) acc += ts->t[i++].n;
+        w[v].thi = i;
+    }
+
+    r = run(nthreads, tab_worker, ts, w);
+    DEL(w);
+
+    if (r < 0) return r;
+
+    return wrall(ts->fd, hdr, p - hdr, 0);
+}
+
+
+// Create the temporary file for the template 'tmp'. mkostemp(3)
+// makes it 0600 and rename(2) keeps that; so give it the mode
+// open(2) would give a new DB.
+static int
+mktmp(char *tmp)
+{
+    mode_t um = umask(0);
+    int    fd;
+
+    umask(um);
+    if ((fd = mkostemp(tmp, 0)) < 0) return -errno;
+
+    if (fchmod(fd, 0666 & ~um) < 0) {
+        int r = -errno;
+
+        close(fd);
+        unlink(tmp);
+        return r;
+    }
+    return fd;
+}
+
+
+// Make the temporary file 'tmp' the DB 'fname' if 'r' is zero;
+// else, remove it.
+static int
+commit(int fd, const char *tmp, const char *fname, int r)
+{
+    if (r == 0 && fsync(fd) < 0) r = -errno;
+
+    close(fd);
+    if (r == 0 && rename(tmp, fname) < 0) r = -errno;
+    if (r < 0) unlink(tmp);
+    return r;
+}
+
+
+static int
+nthr(int nthreads)
+{
+    return nthreads > 0 ? nthreads : sys_cpu_getavail();
+}
+
+
+int
+cdb_writer_init(cdb_writer* w, const char* fname, int nthreads, uint32_t flags)
+{
+    int i;
+
+    memset(w, 0, sizeof *w);
+    if (snprintf(w->tmp, sizeof w->tmp, "%s.tmp.XXXXXX", fname) >= (int)sizeof w->tmp) {
+        return -ENAMETOOLONG;
+    }
+
+    snprintf(w->fname, sizeof w->fname, "%s", fname);
+    w->fd = mktmp(w->tmp);
+    if (w->fd < 0) return w->fd;
+
+    w->nthreads = nthr(nthreads);
+    w->is64     = !!(flags & CDB_64BIT);
+    w->off      = w->is64 ? CDB64_HDRSIZE : CDB_HDRSIZE;
+    w->buf      = NEWA(uint8_t, CDB_BUFSZ);
+    w->tab      = NEWZA(cdb_slotv, CDB_NTAB);
+    if (!w->buf || !w->tab) {
+        commit(w->fd, w->tmp, w->fname, -ENOMEM);
+        DEL(w->buf);
+        DEL(w->tab);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < CDB_NTAB; i++) VECT_INIT(&w->tab[i], 0);
+    return 0;
+}
+
+
+int
+cdb_writer_add(cdb_writer* w, const void* key, size_t klen, const void* val, size_t vlen)
+{
+    uint8_t  hdr[CDB_RECHDR];
+    uint64_t sz = CDB_RECHDR + _U64(klen) + _U64(vlen);
+    int      r;
+
+    if (klen > UINT32_MAX || vlen > UINT32_MAX)     return -EFBIG;
+    if (!w->is64 && (w->off + sz) > CDB_MAXSIZE)    return -EFBIG;
+
+    uint64_t h = hashkey(key, klen, w->is64);
+    cdb_slot s = {
+        .hash = h,
+        .off  = w->off,
+    };
+
+    enc_LE_u32(hdr,   klen);
+    enc_LE_u32(hdr+4, vlen);
+
+    if ((r = bufwrite(w->fd, w->buf, &w->buflen, &w->off, hdr, sizeof hdr)) < 0) return r;
+    if ((r = bufwrite(w->fd, w->buf, &w->buflen, &w->off, key, klen)) < 0)       return r;
+    if ((r = bufwrite(w->fd, w->buf, &w->buflen, &w->off, val, vlen)) < 0)       return r;
+
+    VECT_PUSH_BACK(&w->tab[h & 0xff], s);
+    return 0;
+}
+
+
+static void
+writer_fini(cdb_writer *w)
+{
+    int i;
+
+    for (i = 0; i < CDB_NTAB; i++) VECT_FINI(&w->tab[i]);
+
+    DEL(w->tab);
+    DEL(w->buf);
+    w->fd = -1;
+}
+
+
+int
+cdb_writer_finish(cdb_writer* w)
+{
+    int r = wrall(w->fd, w->buf, w->buflen, w->off - w->buflen);
+
+    if (r == 0) {
+        tabset ts;
+        int i;
+
+        ts.fd   = w->fd;
+        ts.is64 = w->is64;
+        for (i = 0; i < CDB_NTAB; i++) {
+            ts.t[i].s = w->tab[i].arr;
+            ts.t[i].n = VECT_LEN(&w->tab[i]);
+        }
+
+        r = mktables(&ts, w->off, w->nthreads);
+    }
+
+    r = commit(w->fd, w->tmp, w->fname, r);
+    writer_fini(w);
+    return r;
+}
+
+
+void
+cdb_writer_abort(cdb_writer* w)
+{
+    commit(w->fd, w->tmp, w->fname, -ECANCELED);
+    writer_fini(w);
+}
+
+
+// Hash the records of worker 'job' and count them per table
+static int
+hash_worker(void *ctx, void *job, int thr)
+{
+    bulk   *b = ctx;
+    worker *w = job;
+    size_t  i;
+
+    (void)thr;
+    for (i = w->lo; i < w->hi; i++) {
+        const cdb_rec *r = &b->r[i];
+        uint64_t h = hashkey(r->key, r->klen, b->is64);
+
+        b->hash[i] = h;
+        w->cnt[h & 0xff]++;
+        w->size += CDB_RECHDR + _U64(r->klen) + _U64(r->vlen);
+    }
+    return 0;
+}
+
+
+// Write the records of worker 'job' and put their slots in the
+// partitioned slot array.
+static int
+rec_worker(void *ctx, void *job, int thr)
+{
+    bulk     *b   = ctx;
+    worker   *w   = job;
+    uint8_t  *buf = NEWA(uint8_t, CDB_BUFSZ);
+    size_t    bl  = 0,
+              i;
+    uint64_t  off = w->off;
+
+    (void)thr;
+    if (!buf) return w->err = -ENOMEM;
+
+    for (i = w->lo; i < w->hi; i++) {
+        const cdb_rec *r = &b->r[i];
+        uint64_t h = b->hash[i];
+        cdb_slot s = {
+            .hash = h,
+            .off  = off,
+        };
+        uint8_t  hdr[CDB_RECHDR];
+
+        b->slot[w->cnt[h & 0xff]++] = s;
+
+        enc_LE_u32(hdr,   r->klen);
+        enc_LE_u32(hdr+4, r->vlen);
+        if ((w->err = bufwrite(b->fd, buf, &bl, &off, hdr, sizeof hdr)) < 0)  goto done;
+        if ((w->err = bufwrite(b->fd, buf, &bl, &off, r->key, r->klen)) < 0) goto done;
+        if ((w->err = bufwrite(b->fd, buf, &bl, &off, r->val, r->vlen)) < 0) goto done;
+    }
+
+    w->err = wrall(b->fd, buf, bl, off - bl);
+
+done:
+    DEL(buf);
+    return w->err;
+}
+
+
+int
+cdb_build(const char* fname, const cdb_rec* r, size_t n, int nthreads, uint32_t flags)
+{
+    char     tmp[PATH_MAX];
+    tabset   ts;
+    bulk     b;
+    uint64_t off,
+             pos = 0;
+    int      v, i,
+             err = 0;
+
+    if (snprintf(tmp, sizeof tmp, "%s.tmp.XXXXXX", fname) >= (int)sizeof tmp) {
+        return -ENAMETOOLONG;
+    }
+
+    nthreads = nthr(nthreads);
+
+    memset(&b, 0, sizeof b);
+    b.is64 = !!(flags & CDB_64BIT);
+    b.r    = r;
+    b.hash = NEWA(uint64_t, n + 1);
+    b.slot = NEWA(cdb_slot, n + 1);
+    if (!b.hash || !b.slot) {
+        err = -ENOMEM;
+        goto fini;
+    }
+
+    b.fd = mktmp(tmp);
+    if (b.fd < 0) {
+        err = b.fd;
+        goto fini;
+    }
+
+    ts.fd   = b.fd;
+    ts.is64 = b.is64;
+    off     = b.is64 ? CDB64_HDRSIZE : CDB_HDRSIZE;
+
+    worker *w = NEWZA(worker, nthreads);
+    if (!w) {
+        err = -ENOMEM;
+        goto done;
+    }
+
+    for (v = 0; v < nthreads; v++) {
+        w[v].lo = (n * v) / nthreads;
+        w[v].hi = (n * (v+1)) / nthreads;
+    }
+
+    if ((err = run(nthreads, hash_worker, &b, w)) < 0) goto done;
+
+    // Each worker's records follow those of the previous worker
+    for (v = 0; v < nthreads; v++) {
+        w[v].off = off;
+        off     += w[v].size;
+    }
+    if (!b.is64 && off > CDB_MAXSIZE) {
+        err = -EFBIG;
+        goto done;
+    }
+
+    // In each table, a worker's slots follow those of the previous
+    // worker; cnt[] becomes the index of its first slot.
+    for (i = 0; i < CDB_NTAB; i++) {
+        ts.t[i].s = &b.slot[pos];
+        for (v = 0; v < nthreads; v++) {
+            uint64_t c = w[v].cnt[i];
+
+            w[v].cnt[i] = pos;
+            pos += c;
+        }
+        ts.t[i].n = pos - (ts.t[i].s - b.slot);
+    }
+
+    if ((err = run(nthreads, rec_worker, &b, w)) < 0) goto done;
+
+    err = mktables(&ts, off, nthreads);
+
+done:
+    DEL(w);
+    err = commit(b.fd, tmp, fname, err);
+
+fini:
+    DEL(b.hash);
+    DEL(b.slot);
+    return err;
+}
+
+/* EOF */
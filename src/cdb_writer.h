@@ -0,0 +1,140 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * cdb_writer.h - CDB Writer Interface
+ *
+ * Copyright (c) 2016 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ */
+
+#ifndef ___CDB_WRITER_H_2207316_1470077389__
+#define ___CDB_WRITER_H_2207316_1470077389__ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/types.h>
+
+
+/*
+ * A record for the bulk builder.
+ */
+struct cdb_rec {
+    const void *key;
+    const void *val;
+    uint32_t    klen;
+    uint32_t    vlen;
+};
+typedef struct cdb_rec cdb_rec;
+
+
+/*
+ * Flags for cdb_writer_init() and cdb_build()
+ */
+#define CDB_64BIT       (1 << 0)    // write a cdb64 (no 4GB limit)
+
+
+struct cdb_slotv;
+
+/*
+ * Incremental writer of a DJB CDB that can be read by
+ * cdb_read_init(). The records are written to a temporary file as
+ * they are added; cdb_writer_finish() writes the hash tables and
+ * renames it to the final name.
+ */
+struct cdb_writer {
+    int       fd;
+    int       nthreads;
+    int       is64;
+
+    uint64_t  off;      // file offset of the next record
+
+    // records are staged in this buffer
+    uint8_t  *buf;
+    size_t    buflen;
+
+    // (hash, offset) of each record - one vector per table
+    struct cdb_slotv *tab;
+
+    char      fname[PATH_MAX];
+    char      tmp[PATH_MAX];
+};
+typedef struct cdb_writer cdb_writer;
+
+
+/*
+ * Initialize 'w' to write a new DB to 'fname'. The hash tables are
+ * built with 'nthreads' threads; if it is zero, use all the CPUs.
+ * 'flags' is zero or CDB_64BIT.
+ *
+ * Return:
+ *  0      on success
+ *  -errno on failure.
+ */
+extern int cdb_writer_init(cdb_writer* w, const char* fname, int nthreads,
+                           uint32_t flags);
+
+
+/*
+ * Add a record to the DB. Duplicate keys are not detected;
+ * cdb_find() returns the one added first.
+ *
+ * Return:
+ *  0      on success
+ *  -EFBIG if a CDB would grow beyond 4GB
+ *  -errno on I/O errors
+ */
+extern int cdb_writer_add(cdb_writer* w, const void* key, size_t klen,
+                          const void* val, size_t vlen);
+
+
+/*
+ * Write the hash tables and the index and rename the DB to its
+ * final name. 'w' is released (on success or failure).
+ *
+ * Return:
+ *  0      on success
+ *  -errno on failure.
+ */
+extern int cdb_writer_finish(cdb_writer* w);
+
+
+/*
+ * Release 'w' and remove the partially written DB.
+ */
+extern void cdb_writer_abort(cdb_writer* w);
+
+
+/*
+ * Bulk build a DB in 'fname' from 'n' records in 'r' with
+ * 'nthreads' threads (zero to use all the CPUs). 'flags' is zero or
+ * CDB_64BIT.
+ *
+ * Return:
+ *  0      on success
+ *  -EFBIG if a CDB would be larger than 4GB
+ *  -errno on failure.
+ */
+extern int cdb_build(const char* fname, const cdb_rec* r, size_t n, int nthreads,
+                     uint32_t flags);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___CDB_WRITER_H_2207316_1470077389__ */
+
+/* EOF */
@@ -99,6 +99,31 @@
  *
  *   o The marshal/unmarshal code is in bloom_marshal.c
  *
+ *   o The blocked filter [5] puts all the bits of a key in one
+ *     64-byte block - i.e., one cache miss per lookup. It sets one
+ *     bit in each 64-bit word of the block; the bit positions are
+ *     computed with one SIMD multiply (AVX2 when the CPU has it).
+ *     The blocks don't fill evenly; so it needs more bits than a
+ *     standard filter for the same FP rate at small 'e'.
+ *
+ *   o Bloom_concurrent() lets many threads add to one standard or
+ *     blocked filter; see "Concurrent mode" below.
+ *
+ *   o Filters made with Bloom_new_like() share the salt of the
+ *     original and can be merged: see bloom_merge.c.
+ *
+ *   o Bloom_find_batch() overlaps the cache misses of many lookups
+ *     by prefetching a few keys ahead; see "Batched lookups" below.
+ *
+ *   o A counting filter made with BLOOM_COUNTER4 has 4-bit counters
+ *     - half the memory of the 8-bit ones. A counter saturates at
+ *     15 and the rest of its count goes to a side table; so
+ *     removes stay exact even for the rare hot counter. See
+ *     "Compact counting filter" below.
+ *
+ *   o The cuckoo filter (cuckoo.c) also supports remove - in much
+ *     less memory than the counting filters; but it can fill up.
+ *
  * References:
  * ===========
  * [1] Less Hashing, Same Performance: Building a Better Bloom Filter
@@ -111,6 +136,9 @@
  *
  * [4] Approximate caches for packet classification
  *     http://www.ieee-infocom.org/2004/Papers/45_3.PDF
+ *
+ * [5] Cache-, Hash- and Space-Efficient Bloom Filters
+ *     Putze, Sanders & Singler
  */
 
 #include <stdio.h>
@@ -121,41 +149,19 @@
 #include <assert.h>
 #include <limits.h>
 #include <inttypes.h>
-#include <sys/random.h>
+#include <stdatomic.h>
+#include <errno.h>
 
 #include "utils/utils.h"
 #include "utils/bloom.h"
+#include "utils/arc4random.h"
+#include "fast/simd.h"
+#include "fast/fastdiv.h"
+#include "utils/fast-ht.h"
 
 #include "bloom_internal.h"
 
 
-// Compression function from fasthash
-#define mix(h) ({                   \
-            (h) ^= (h) >> 23;       \
-            (h) *= 0x2127599bf4325c37ULL;   \
-            (h) ^= (h) >> 47; h; })
-
-
-/*
- * fasthash64() - but tuned for exactly _one_ round and
- * one 64-bit word.
- *
- * Borrowed from Zilong Tan's superfast hash.
- * Copyright (C) 2012 Zilong Tan (eric.zltan@gmail.com)
- */
-static uint64_t
-hash_val(uint64_t v, uint64_t salt)
-{
-    const uint64_t m = 0x880355f21e6d1965ULL;
-    uint64_t h       = (8 * m);
-
-    h ^= mix(v);
-    h *= m;
-
-    return mix(h) ^ salt;
-}
-
-
 /*
  * Number of bits per unit of storage
  */
@@ -326,7 +332,164 @@ counting_bloom_init(bloom* b, size_t n, double e)
     b->flags  = 0;
 
     // use a random salt for the seeded hash function.
-    getentropy(&b->salt, sizeof b->salt);
+    arc4random_buf(&b->salt, sizeof b->salt);
+
+    return b;
+}
+
+
+
+/*
+ * Compact counting filter
+ *
+ * Counter 'j' is the low nibble of byte j/2 if 'j' is even and the
+ * high nibble otherwise. The counters of a key are in 'k'
+ * different partitions; so there is nothing to gain from SIMD
+ * here. Instead, the common case is branch free: a counter is
+ * bumped unless it is already at BLOOM_CTR4_MAX - and only then
+ * does the count spill into the overflow table.
+ */
+
+// Value of 4-bit counter 'j'
+static inline uint32_t
+ctr4_get(const uint8_t* bm, uint64_t j)
+{
+    return (bm[j / 2] >> ((j & 1) * 4)) & 0xf;
+}
+
+
+// Count one more for counter 'j' that is stuck at BLOOM_CTR4_MAX.
+// Without an overflow table, the count is lost; the counter then
+// stays saturated - at worst, a false positive.
+static void
+ctr4_spill(bloom* b, uint64_t j)
+{
+    if (!b->ovf && !(b->ovf = ht_new(64, 0))) {
+        b->flags |= BLOOM_CTR4_STICKY;
+        return;
+    }
+
+    uintptr_t x = (uintptr_t)ht_probe(b->ovf, OVF_KEY(j), (void *)1);
+    if (x) ht_replace(b->ovf, OVF_KEY(j), (void *)(x + 1));
+}
+
+
+// Take one count of counter 'j' back from the overflow table; return
+// false if it has none.
+static int
+ctr4_unspill(bloom* b, uint64_t j)
+{
+    void *v;
+
+    if (!b->ovf || !ht_find(b->ovf, OVF_KEY(j), &v)) return 0;
+
+    uintptr_t x = (uintptr_t)v;
+    if (x > 1) ht_replace(b->ovf, OVF_KEY(j), (void *)(x - 1));
+    else       ht_remove(b->ovf, OVF_KEY(j), 0);
+    return 1;
+}
+
+
+static void
+counting4_bloom_probe(bloom* b, uint64_t val)
+{
+    uint64_t z  = hash_val(val, b->salt);
+    uint64_t h1 = z & 0xffffffff;
+    uint64_t h2 = z >> 32;
+    uint64_t m  = b->m,
+             nk = b->k;
+    uint8_t *bm = b->bitmap;
+    uint64_t i;
+
+    // The byte stores can alias 'b'; keep its fields in locals.
+    for (i = 0; i < nk; ++i) {
+        uint64_t k = (h1 + i * h2) % m;
+        uint64_t j = k + (i * m);
+        uint8_t *p = &bm[j / 2];
+        uint32_t s = (j & 1) * 4;
+        uint32_t full = ((*p >> s) & 0xf) == BLOOM_CTR4_MAX;
+
+        *p += (!full) << s;
+        if (unlikely(full)) ctr4_spill(b, j);
+    }
+
+    b->size++;
+}
+
+
+static int
+counting4_bloom_remove(bloom* b, uint64_t val)
+{
+    uint64_t z  = hash_val(val, b->salt);
+    uint64_t h1 = z & 0xffffffff;
+    uint64_t h2 = z >> 32;
+    uint64_t i;
+    uint64_t r = 0;
+    uint64_t m  = b->m,
+             nk = b->k;
+    uint8_t *bm = b->bitmap;
+
+    for (i = 0; i < nk; ++i) {
+        uint64_t k = (h1 + i * h2) % m;
+        uint64_t j = k + (i * m);
+        uint8_t *p = &bm[j / 2];
+        uint32_t s = (j & 1) * 4;
+        uint32_t c = (*p >> s) & 0xf;
+
+        if (!c) continue;
+
+        r = 1;
+        if (unlikely(c == BLOOM_CTR4_MAX) &&
+            (ctr4_unspill(b, j) || (b->flags & BLOOM_CTR4_STICKY))) continue;
+
+        *p -= 1 << s;
+    }
+
+    b->size--;
+    return r;
+}
+
+
+static int
+counting4_bloom_find(bloom* b, uint64_t val)
+{
+    uint64_t z  = hash_val(val, b->salt);
+    uint64_t h1 = z & 0xffffffff;
+    uint64_t h2 = z >> 32;
+    uint64_t i;
+
+    for (i = 0; i < b->k; ++i) {
+        uint64_t k = (h1 + i * h2) % b->m;
+        uint64_t j = k + (i * b->m);
+        if (!ctr4_get(b->bitmap, j))  return 0;
+    }
+
+    return 1;
+}
+
+
+/*
+ * Same geometry as the 8-bit counting filter - in half the memory.
+ */
+static bloom*
+counting4_bloom_init(bloom* b, size_t n, double e)
+{
+    uint64_t k = make_k(e);
+    uint64_t m = make_m(n, e);
+    uint64_t s = m / k + ((m % k) > 0);  // counters per slice
+
+    uint64_t bytes = ((s * k) + 1) / 2;
+    b->bitmap      = NEWZA(uint8_t, bytes);
+    assert(b->bitmap);
+
+    b->k      = k;
+    b->m      = s;
+    b->e      = e;
+    b->bmsize = bytes;
+    b->flags  = 0;
+    b->ovf    = 0;
+
+    arc4random_buf(&b->salt, sizeof b->salt);
 
     return b;
 }
@@ -355,195 +518,749 @@ standard_bloom_init(bloom* b, size_t n, double e)
     b->flags   = 0;
 
     // use a random salt for the seeded hash function.
-    getentropy(&b->salt, sizeof b->salt);
+    arc4random_buf(&b->salt, sizeof b->salt);
 
     return b;
 }
 
 
 /*
- * Common finalizer for standard and counting bloom filters.
+ * Blocked bloom filter
+ *
+ * The upper 32 bits of the hash pick a block; the lower 32 bits are
+ * multiplied by a distinct odd constant for each of the 8 words of
+ * the block and the top 6 bits of the product select the bit in
+ * that word. Thus a lookup touches exactly one cache line and the
+ * 8 bit positions can be computed in one vector multiply.
  */
-static void
-bloom_fini(bloom* b)
+static const uint32_t Block_salt[BLOOM_BLOCK_K] = {
+    0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+    0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31,
+};
+
+// Return the block for hash 'z'
+static inline uint64_t*
+blocked_block(bloom* b, uint64_t z)
 {
-    if (!(b->flags & BLOOM_BITMAP_MMAP))
-        DEL(b->bitmap);
+    uint64_t i = ((z >> 32) * b->m) >> 32;
+
+    return (uint64_t *)(b->bitmap + (i * BLOOM_BLOCK_SIZE));
 }
 
 
-/*
- * Empty remove function. Always pretends that it worked!
- */
-static int
-null_remov(bloom *b, uint64_t v)
+// Make the 8 word masks of hash 'h'
+static inline void
+blocked_mask(uint64_t *msk, uint32_t h)
 {
-    USEARG(b);
-    USEARG(v);
-    return 1;
+    int i;
+
+    for (i = 0; i < BLOOM_BLOCK_K; i++) {
+        msk[i] = _U64(1) << ((h * Block_salt[i]) >> 26);
+    }
 }
 
-/*
- * Textual descriptions of each
- */
-static char*
-standard_bloom_desc(bloom* b, char *buf, size_t bsiz)
-{
-    uint64_t bits  = b->m * b->k;
-    uint64_t bytes = bits / 8;
 
-    char sz[128];
-    humanize_size(sz, sizeof sz, bytes);
+static void
+blocked_bloom_probe(bloom* b, uint64_t val)
+{
+    uint64_t z  = hash_val(val, b->salt);
+    uint64_t *w = blocked_block(b, z);
+    uint64_t msk[BLOOM_BLOCK_K];
+    int i;
 
-    snprintf(buf, bsiz, "standard-bloom: FP-prob: %5.4f: %" PRIu64 " partitions x %" PRIu64 " slots/partition = %s; "
-                        "%" PRIu64 " elem (est fill ratio %5.4f)", b->e,
-                        b->k, b->m, sz, b->size, bloom_fill_ratio_est(b));
+    blocked_mask(msk, z);
+    for (i = 0; i < BLOOM_BLOCK_K; i++) {
+        w[i] |= msk[i];
+    }
 
-    return buf;
+    b->size++;
 }
 
 
-static char*
-counting_bloom_desc(bloom* b, char *buf, size_t bsiz)
+// Return true if all the bits of hash 'h' are set in block 'w'
+static inline int
+blocked_test(const uint64_t *w, uint32_t h)
 {
-    uint64_t bytes = b->m * b->k;
+    uint64_t msk[BLOOM_BLOCK_K];
+    uint64_t r = 0;
+    int i;
 
-    char sz[128];
-    humanize_size(sz, sizeof sz, bytes);
+    blocked_mask(msk, h);
+    for (i = 0; i < BLOOM_BLOCK_K; i++) {
+        r |= msk[i] & ~w[i];
+    }
 
-    snprintf(buf, bsiz, "counting-bloom: FP-prob: %5.4f: %" PRIu64 " partitions x %" PRIu64 " slots/partition = %s; "
-                        "%" PRIu64 " elem (est fill ratio %5.4f)", b->e,
-                        b->k, b->m, sz, b->size, bloom_fill_ratio_est(b));
+    return r == 0;
+}
 
-    return buf;
+
+static int
+blocked_bloom_find(bloom* b, uint64_t val)
+{
+    uint64_t z  = hash_val(val, b->salt);
+
+    return blocked_test(blocked_block(b, z), z);
 }
 
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__amd64__)
+
 /*
- * Scalable Bloom filters
+ * AVX2 versions of the above: the 8 bit positions are made with
+ * one 32-bit multiply and widened to two vectors of 4 word masks.
  */
+static inline SIMD_TARGET_AVX2 void
+blocked_mask256(__m256i *lo, __m256i *hi, uint32_t h)
+{
+    const __m256i one = _mm256_set1_epi64x(1);
+    __m256i s = _mm256_loadu_si256((const __m256i *)Block_salt);
+    __m256i x = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(h), s), 26);
 
+    *lo = _mm256_sllv_epi64(one, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(x)));
+    *hi = _mm256_sllv_epi64(one, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(x, 1)));
+}
 
 
-static inline bloom*
-maybe_grow_filter(scalable_bloom *sb)
+static SIMD_TARGET_AVX2 void
+blocked_bloom_probe256(bloom* b, uint64_t val)
 {
-    if (sb->len == sb->cap) {
-        uint32_t x = sb->cap << 1;
-        assert(x > sb->cap);
-
-        bloom* bv = RENEWA(bloom, sb->bfa, x);
-        assert(bv);
+    uint64_t z  = hash_val(val, b->salt);
+    __m256i *w  = (__m256i *)blocked_block(b, z);
+    __m256i lo, hi;
 
-        sb->bfa = bv;
-        sb->cap = x;
-    }
+    blocked_mask256(&lo, &hi, z);
+    _mm256_storeu_si256(&w[0], _mm256_or_si256(_mm256_loadu_si256(&w[0]), lo));
+    _mm256_storeu_si256(&w[1], _mm256_or_si256(_mm256_loadu_si256(&w[1]), hi));
 
-    // Return pointer to un-initialized filter
-    return &sb->bfa[sb->len++];
+    b->size++;
 }
 
-// insert a new element 'v' into a scalable filter
-static void
-scalable_probe(scalable_bloom* sb, uint64_t v)
-{
-    uint32_t i = sb->len - 1;
 
-    assert(i < sb->len);
+static inline SIMD_TARGET_AVX2 int
+blocked_test256(const uint64_t *p, uint32_t h)
+{
+    const __m256i *w = (const __m256i *)p;
+    __m256i lo, hi;
 
-    bloom *f = &sb->bfa[i];
+    blocked_mask256(&lo, &hi, h);
 
-    if (bloom_fill_ratio_est(f) > 0.5) {
-        double e   = f->e * sb->r;
-        uint64_t m = f->m * f->k * sb->scale;
-        size_t n   = make_n(m, e);
+    // testc() is true if every bit of the mask is set in the block
+    return _mm256_testc_si256(_mm256_loadu_si256(&w[0]), lo) &
+           _mm256_testc_si256(_mm256_loadu_si256(&w[1]), hi);
+}
 
-        // Get the next filter to use
-        f = maybe_grow_filter(sb);
 
-        standard_bloom_init(f, n, e);
-    }
+static SIMD_TARGET_AVX2 int
+blocked_bloom_find256(bloom* b, uint64_t val)
+{
+    uint64_t z  = hash_val(val, b->salt);
 
-    standard_bloom_probe(f, v);
+    return blocked_test256(blocked_block(b, z), z);
 }
 
+#endif // x86_64
 
-static void
-scalable_fini(scalable_bloom *sb)
+
+/*
+ * Expected FP rate of a blocked filter of 'nb' blocks holding 'n'
+ * elements: the number of elements in a block is Poisson
+ * distributed and a block with 'j' elements has each bit of a word
+ * set with probability 1 - (1 - 1/64)^j.
+ */
+static double
+blocked_fp_rate(uint64_t n, uint64_t nb)
 {
-    uint32_t i;
+    double l   = _d(n) / _d(nb);
+    double fp  = 0.0;
+    uint64_t j = 0,
+             e = _U64(l + 10 * sqrt(l) + 20);
 
-    for (i = 0; i < sb->len; ++i) {
-        bloom_fini(&sb->bfa[i]);
-    }
+    for (j = 0; j <= e; j++) {
+        double p = exp(-l + _d(j) * log(l) - lgamma(_d(j) + 1));
+        double q = 1.0 - pow(1.0 - 1.0/64.0, _d(j));
 
-    DEL(sb->bfa);
+        fp += p * pow(q, BLOOM_BLOCK_K);
+    }
+    return fp;
 }
 
 
-// lookup 'v' in a scalable bloom filter 'sb'
-// We start from the "largest" filter in the set and work
-// down. Note that when we insert, we *always* insert at the largest filter
-// in the list.
-static int
-scalable_find(scalable_bloom* sb, uint64_t v)
+/*
+ * A blocked filter needs more bits than a standard filter for the
+ * same FP rate (the blocks don't fill evenly). We start with the
+ * size of a standard filter and grow it until the FP rate is met.
+ */
+static bloom*
+blocked_bloom_init(bloom* b, size_t n, double e)
 {
-    assert(sb->len > 0);
+    uint64_t nb = (make_m(n, e) + 511) / 512;
 
-    int64_t i = sb->len - 1;
-    for (; i >= 0; i--) {
-        bloom* f = &sb->bfa[i];
-        if (standard_bloom_find(f, v)) return 1;
+    if (nb == 0) nb = 1;
+    while (blocked_fp_rate(n, nb) > e) {
+        nb += (nb / 32) + 1;
     }
-    return 0;
-}
 
+    uint64_t bytes = nb * BLOOM_BLOCK_SIZE;
+    b->bitmap      = __alloc_bitmap(bytes);
+    assert(b->bitmap);
+
+    b->k = BLOOM_BLOCK_K;
+    b->m = nb;
+    b->e = e;
+
+    b->bmsize  = bytes;
+    b->flags   = 0;
+
+    // use a random salt for the seeded hash function.
+    arc4random_buf(&b->salt, sizeof b->salt);
+
+    return b;
+}
 
 
 /*
- * Scalable bloom filters description can get long!
+ * Concurrent mode
+ *
+ * Many threads can add to one standard or blocked filter: the bits
+ * are set with an atomic fetch-or of the 64-bit word that holds
+ * them and each thread counts its elements in its own counter.
+ * Lookups are the plain loads of the regular find(); a lookup
+ * that races with an add of the same element may miss it.
  */
-static char*
-scalable_bloom_desc(scalable_bloom* sb, char *buf, size_t bsiz)
+
+static atomic_uint_fast32_t Nctr;
+static __thread uint32_t    Myctr = UINT32_MAX;
+
+// Count one more element added by this thread
+static inline void
+bloom_count(bloom* b)
 {
-    char* ret = buf;
-    bloom* f = &sb->bfa[0];
-    char* p;
-    int r;
+    if (unlikely(Myctr == UINT32_MAX)) {
+        Myctr = atomic_fetch_add(&Nctr, 1) % BLOOM_NCTR;
+    }
+    atomic_fetch_add_explicit(&b->ctr[Myctr].n, 1, memory_order_relaxed);
+}
 
-    r = asprintf(&p, "scalable-bloom: %d filters (scale %d, err tightening factor %5.4f)\n",
-                 sb->len, sb->scale, sb->r);
-    assert(r > 0);
+
+// Set bits 'm' of word 'w' - unless they're already set; this keeps
+// the cache line shared when the bits are set.
+static inline void
+setword_atomic(uint64_t* w, uint64_t m)
+{
+    _Atomic uint64_t *a = (_Atomic uint64_t *)w;
+
+    if ((atomic_load_explicit(a, memory_order_relaxed) & m) != m) {
+        atomic_fetch_or_explicit(a, m, memory_order_relaxed);
+    }
+}
+
+
+// Atomic version of setbit(); bit 'i' is in the same place as the
+// byte addressed setbit() puts it.
+static inline void
+setbit_atomic(uint8_t* bm, uint64_t i)
+{
+#ifdef __big_endian__
+    _Atomic uint8_t *a = (_Atomic uint8_t *)&bm[i / 8];
+    uint8_t m = 1 << (i % 8);
+
+    if (!(atomic_load_explicit(a, memory_order_relaxed) & m)) {
+        atomic_fetch_or_explicit(a, m, memory_order_relaxed);
+    }
+#else
+    setword_atomic(((uint64_t *)bm) + (i / 64), _U64(1) << (i % 64));
+#endif
+}
+
+
+static void
+standard_bloom_probe_mt(bloom* b, uint64_t val)
+{
+    uint64_t z  = hash_val(val, b->salt);
+    uint64_t h1 = z & 0xffffffff;
+    uint64_t h2 = z >> 32;
+    uint64_t i;
+
+    for (i = 0; i < b->k; ++i) {
+        uint64_t k = (h1 + i * h2) % b->m; // bit to set
+        uint64_t j = k + (i * b->m);       // in parition 'i'
+        setbit_atomic(b->bitmap, j);
+    }
+
+    bloom_count(b);
+}
+
+
+static void
+blocked_bloom_probe_mt(bloom* b, uint64_t val)
+{
+    uint64_t z  = hash_val(val, b->salt);
+    uint64_t *w = blocked_block(b, z);
+    uint64_t msk[BLOOM_BLOCK_K];
+    int i;
+
+    blocked_mask(msk, z);
+    for (i = 0; i < BLOOM_BLOCK_K; i++) {
+        setword_atomic(&w[i], msk[i]);
+    }
+
+    bloom_count(b);
+}
+
+
+/*
+ * Common finalizer for standard, counting and blocked bloom filters.
+ */
+static void
+bloom_fini(bloom* b)
+{
+    if (!(b->flags & BLOOM_BITMAP_MMAP))
+        DEL(b->bitmap);
+
+    if (b->ctr) free(b->ctr);
+    b->ctr = 0;
+
+    if (b->flags & BLOOM_LAZY_OWNER) __bloom_lazy_free(b->lazy);
+    b->lazy = 0;
+
+    if (b->ovf) ht_del(b->ovf);
+    b->ovf = 0;
+}
+
+
+/*
+ * Empty remove function. Always pretends that it worked!
+ */
+static int
+null_remov(bloom *b, uint64_t v)
+{
+    USEARG(b);
+    USEARG(v);
+    return 1;
+}
+
+/*
+ * Textual descriptions of each
+ */
+static char*
+standard_bloom_desc(bloom* b, char *buf, size_t bsiz)
+{
+    uint64_t bits  = b->m * b->k;
+    uint64_t bytes = bits / 8;
+
+    char sz[128];
+    humanize_size(sz, sizeof sz, bytes);
+
+    snprintf(buf, bsiz, "standard-bloom: FP-prob: %5.4f: %" PRIu64 " partitions x %" PRIu64 " slots/partition = %s; "
+                        "%" PRIu64 " elem (est fill ratio %5.4f)", b->e,
+                        b->k, b->m, sz, bloom_size(b), bloom_fill_ratio_est(b));
+
+    return buf;
+}
+
+
+static char*
+counting_bloom_desc(bloom* b, char *buf, size_t bsiz)
+{
+    uint64_t bytes = b->m * b->k;
+
+    char sz[128];
+    humanize_size(sz, sizeof sz, bytes);
+
+    snprintf(buf, bsiz, "counting-bloom: FP-prob: %5.4f: %" PRIu64 " partitions x %" PRIu64 " slots/partition = %s; "
+                        "%" PRIu64 " elem (est fill ratio %5.4f)", b->e,
+                        b->k, b->m, sz, bloom_size(b), bloom_fill_ratio_est(b));
+
+    return buf;
+}
+
+
+static char*
+counting4_bloom_desc(bloom* b, char *buf, size_t bsiz)
+{
+    uint64_t nov = b->ovf ? b->ovf->nodes : 0;
+
+    char sz[128];
+    humanize_size(sz, sizeof sz, b->bmsize);
+
+    snprintf(buf, bsiz, "counting4-bloom: FP-prob: %5.4f: %" PRIu64 " partitions x %" PRIu64 " slots/partition = %s; "
+                        "%" PRIu64 " elem (est fill ratio %5.4f), %" PRIu64 " overflowed counters", b->e,
+                        b->k, b->m, sz, bloom_size(b), bloom_fill_ratio_est(b), nov);
+
+    return buf;
+}
+
+
+static char*
+blocked_bloom_desc(bloom* b, char *buf, size_t bsiz)
+{
+    char sz[128];
+    humanize_size(sz, sizeof sz, b->bmsize);
+
+    uint64_t n = bloom_size(b);
+
+    snprintf(buf, bsiz, "blocked-bloom: FP-prob: %5.4f: %" PRIu64 " blocks x %d bytes = %s; "
+                        "%" PRIu64 " elem (%4.2f elem/block)", b->e,
+                        b->m, BLOOM_BLOCK_SIZE, sz, n, _d(n) / _d(b->m));
+
+    return buf;
+}
+
+
+/*
+ * Scalable Bloom filters
+ */
+
+
+
+static inline bloom*
+maybe_grow_filter(scalable_bloom *sb)
+{
+    if (sb->len == sb->cap) {
+        uint32_t x = sb->cap << 1;
+        assert(x > sb->cap);
+
+        bloom* bv = RENEWA(bloom, sb->bfa, x);
+        assert(bv);
+
+        sb->bfa = bv;
+        sb->cap = x;
+    }
+
+    // Return pointer to un-initialized filter
+    return &sb->bfa[sb->len++];
+}
+
+// insert a new element 'v' into a scalable filter
+static void
+scalable_probe(scalable_bloom* sb, uint64_t v)
+{
+    uint32_t i = sb->len - 1;
+
+    assert(i < sb->len);
+
+    bloom *f = &sb->bfa[i];
+
+    if (bloom_fill_ratio_est(f) > 0.5) {
+        double e   = f->e * sb->r;
+        uint64_t m = f->m * f->k * sb->scale;
+        size_t n   = make_n(m, e);
+
+        // Get the next filter to use
+        f = maybe_grow_filter(sb);
+
+        standard_bloom_init(f, n, e);
+    }
+
+    standard_bloom_probe(f, v);
+}
+
+
+static void
+scalable_fini(scalable_bloom *sb)
+{
+    uint32_t i;
+
+    for (i = 0; i < sb->len; ++i) {
+        bloom_fini(&sb->bfa[i]);
+    }
+
+    DEL(sb->bfa);
+}
+
+
+// lookup 'v' in a scalable bloom filter 'sb'
+// We start from the "largest" filter in the set and work
+// down. Note that when we insert, we *always* insert at the largest filter
+// in the list.
+static int
+scalable_find(scalable_bloom* sb, uint64_t v)
+{
+    assert(sb->len > 0);
+
+    int64_t i = sb->len - 1;
+    for (; i >= 0; i--) {
+        bloom* f = &sb->bfa[i];
+        if (standard_bloom_find(f, v)) return 1;
+    }
+    return 0;
+}
+
+
+
+/*
+ * Scalable bloom filters description can get long!
+ */
+static char*
+scalable_bloom_desc(scalable_bloom* sb, char *buf, size_t bsiz)
+{
+    char* ret = buf;
+    bloom* f = &sb->bfa[0];
+    char* p;
+    int r;
+
+    r = asprintf(&p, "scalable-bloom: %d filters (scale %d, err tightening factor %5.4f)\n",
+                 sb->len, sb->scale, sb->r);
+    assert(r > 0);
 
     ssize_t n = strcopy(buf, bsiz, p); free(p);
     if (n < 0) return ret;
 
-    buf  += n;
-    bsiz -= n;
+    buf  += n;
+    bsiz -= n;
+
+    char sz[128];
+    uint32_t i;
+    uint64_t size;
+    for (i = 0; i < sb->len; ++i) {
+        f = &sb->bfa[i];
+        size = f->m * f->k;
+
+        // standard bloom filters use one BIT per slot. So, the
+        // total size is reduced by a factor of 8.
+        size /= 8;
+
+        humanize_size(sz, sizeof sz, size);
+        r = asprintf(&p, "    [%02u] FP-prob: %5.4f: %" PRIu64 " partitions x %" PRIu64 " slots/partition [%s]: %" PRIu64 " elem (fill %6.3f)\n",
+                i, f->e, f->k, f->m, sz, f->size, bloom_fill_ratio_est(f));
+        assert(r > 0);
+
+        n = strcopy(buf, bsiz, p); free(p);
+        if (n < 0) return ret;
+
+        buf  += n;
+        bsiz -= n;
+    }
+    return ret;
+}
+
+
+/*
+ * Lookups of filters that are verified lazily (see
+ * bloom_marshal.c): a key whose bits are in a bad block is always
+ * reported as "maybe present" - so there are never false
+ * negatives.
+ */
+static int
+standard_bloom_find_lazy(bloom* b, uint64_t val)
+{
+    uint64_t z  = hash_val(val, b->salt);
+    uint64_t h1 = z & 0xffffffff;
+    uint64_t h2 = z >> 32;
+    uint64_t i;
+
+    for (i = 0; i < b->k; ++i) {
+        uint64_t k = (h1 + i * h2) % b->m;
+        uint64_t j = k + (i * b->m);
+
+        if (!bloom_lazy_touch(b->lazy, &b->bitmap[j / UNITBITS])) return 1;
+        if (!testbit(b->bitmap, j)) return 0;
+    }
+
+    return 1;
+}
+
+
+static int
+counting_bloom_find_lazy(bloom* b, uint64_t val)
+{
+    uint64_t z  = hash_val(val, b->salt);
+    uint64_t h1 = z & 0xffffffff;
+    uint64_t h2 = z >> 32;
+    uint64_t i;
+
+    for (i = 0; i < b->k; ++i) {
+        uint64_t k = (h1 + i * h2) % b->m;
+        uint64_t j = k + (i * b->m);
+
+        if (!bloom_lazy_touch(b->lazy, &b->bitmap[j])) return 1;
+        if (!b->bitmap[j])  return 0;
+    }
+
+    return 1;
+}
+
+
+static int
+counting4_bloom_find_lazy(bloom* b, uint64_t val)
+{
+    uint64_t z  = hash_val(val, b->salt);
+    uint64_t h1 = z & 0xffffffff;
+    uint64_t h2 = z >> 32;
+    uint64_t i;
+
+    for (i = 0; i < b->k; ++i) {
+        uint64_t k = (h1 + i * h2) % b->m;
+        uint64_t j = k + (i * b->m);
+
+        if (!bloom_lazy_touch(b->lazy, &b->bitmap[j / 2])) return 1;
+        if (!ctr4_get(b->bitmap, j))  return 0;
+    }
+
+    return 1;
+}
+
+
+static int
+blocked_bloom_find_lazy(bloom* b, uint64_t val)
+{
+    uint64_t *w = blocked_block(b, hash_val(val, b->salt));
+
+    if (!bloom_lazy_touch(b->lazy, w)) return 1;
+    return b->lazy->find(b, val);
+}
+
+
+static int
+scalable_find_lazy(scalable_bloom* sb, uint64_t v)
+{
+    int64_t i = sb->len - 1;
+
+    for (; i >= 0; i--) {
+        if (standard_bloom_find_lazy(&sb->bfa[i], v)) return 1;
+    }
+    return 0;
+}
+
 
-    char sz[128];
-    uint32_t i;
-    uint64_t size;
-    for (i = 0; i < sb->len; ++i) {
-        f = &sb->bfa[i];
-        size = f->m * f->k;
+/*
+ * Batched lookups: the bits of the key BLOOM_PREFETCH places ahead
+ * are located and prefetched while the current key is tested. The
+ * bit positions are kept in a ring; so the hashing is done once per
+ * key - and the modulo by 'm' is a multiply (see fast/fastdiv.h).
+ */
+#define BLOOM_PREFETCH      16
 
-        // standard bloom filters use one BIT per slot. So, the
-        // total size is reduced by a factor of 8.
-        size /= 8;
+// Most bits per key for the batched lookup of a standard filter
+#define BLOOM_BATCH_MAXK    32
 
-        humanize_size(sz, sizeof sz, size);
-        r = asprintf(&p, "    [%02u] FP-prob: %5.4f: %" PRIu64 " partitions x %" PRIu64 " slots/partition [%s]: %" PRIu64 " elem (fill %6.3f)\n",
-                i, f->e, f->k, f->m, sz, f->size, bloom_fill_ratio_est(f));
-        assert(r > 0);
+static inline void
+setres(uint64_t *res, size_t i)
+{
+    res[i / 64] |= _U64(1) << (i % 64);
+}
 
-        n = strcopy(buf, bsiz, p); free(p);
-        if (n < 0) return ret;
 
-        buf  += n;
-        bsiz -= n;
+static size_t
+standard_bloom_find_batch(bloom* b, const uint64_t *v, size_t n, uint64_t *res)
+{
+    uint64_t ring[BLOOM_PREFETCH][BLOOM_BATCH_MAXK];
+    size_t   i, nf = 0;
+    uint64_t j;
+    fastdiv  m;
+
+    fastdiv_init(&m, b->m);
+
+    // key 'i' takes the ring slot of key 'i - BLOOM_PREFETCH'; so
+    // the latter is tested first.
+    for (i = 0; i < (n + BLOOM_PREFETCH); i++) {
+        uint64_t *pos = ring[i % BLOOM_PREFETCH];
+
+        if (i >= BLOOM_PREFETCH) {
+            for (j = 0; j < b->k; j++) {
+                if (!testbit(b->bitmap, pos[j])) break;
+            }
+            if (j == b->k) {
+                setres(res, i - BLOOM_PREFETCH);
+                nf++;
+            }
+        }
+
+        if (i < n) {
+            uint64_t z  = hash_val(v[i], b->salt);
+            uint64_t h1 = z & 0xffffffff;
+            uint64_t h2 = z >> 32;
+
+            for (j = 0; j < b->k; j++) {
+                pos[j] = fastdiv_mod(&m, h1 + j * h2) + (j * b->m);
+                __builtin_prefetch(&b->bitmap[pos[j] / UNITBITS]);
+            }
+        }
     }
-    return ret;
+    return nf;
+}
+
+
+// 'test' is inlined into each of the ISA specific versions below
+static __inline__ __attribute__((always_inline)) size_t
+__blocked_find_batch(bloom* b, const uint64_t *v, size_t n, uint64_t *res,
+                     int (*test)(const uint64_t *, uint32_t))
+{
+    uint64_t *w[BLOOM_PREFETCH];
+    uint32_t  h[BLOOM_PREFETCH];
+    size_t    i, nf = 0;
+
+    for (i = 0; i < (n + BLOOM_PREFETCH); i++) {
+        size_t r = i % BLOOM_PREFETCH;
+
+        if (i >= BLOOM_PREFETCH && test(w[r], h[r])) {
+            setres(res, i - BLOOM_PREFETCH);
+            nf++;
+        }
+
+        if (i < n) {
+            uint64_t z = hash_val(v[i], b->salt);
+
+            w[r] = blocked_block(b, z);
+            h[r] = z;
+            __builtin_prefetch(w[r]);
+        }
+    }
+    return nf;
+}
+
+
+static size_t
+blocked_bloom_find_batch(bloom* b, const uint64_t *v, size_t n, uint64_t *res)
+{
+    return __blocked_find_batch(b, v, n, res, blocked_test);
+}
+
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__amd64__)
+static SIMD_TARGET_AVX2 size_t
+blocked_bloom_find_batch256(bloom* b, const uint64_t *v, size_t n, uint64_t *res)
+{
+    return __blocked_find_batch(b, v, n, res, blocked_test256);
+}
+#endif
+
+
+size_t
+Bloom_find_batch(Bloom *b, const uint64_t *v, size_t n, uint64_t *res)
+{
+    bloom *f = b->filter;
+    size_t i, nf = 0;
+
+    memset(res, 0, ((n + 63) / 64) * sizeof res[0]);
+
+    switch (b->typ) {
+        case BLOOM_TYPE_QUICK:
+            if (f->lazy || f->k > BLOOM_BATCH_MAXK || f->m < 2) break;
+            return standard_bloom_find_batch(f, v, n, res);
+
+        case BLOOM_TYPE_BLOCKED:
+            if (f->lazy) break;
+#if defined(__x86_64__) || defined(_M_X64) || defined(__amd64__)
+            if (simd_isa() >= SIMD_ISA_256) {
+                return blocked_bloom_find_batch256(f, v, n, res);
+            }
+#endif
+            return blocked_bloom_find_batch(f, v, n, res);
+
+        default:
+            break;
+    }
+
+    // Everything else is one key at a time: the counting filter is
+    // 8x larger and batching doesn't help it.
+    for (i = 0; i < n; i++) {
+        if (b->find(b->filter, v[i])) {
+            setres(res, i);
+            nf++;
+        }
+    }
+    return nf;
 }
 
 
@@ -613,6 +1330,78 @@ setup_counting_bloom(Bloom *b)
 }
 
 
+// Initialize function pointers for the compact counting bloom
+// filter. Return true on success, false otherwise
+static inline int
+setup_counting4_bloom(Bloom *b)
+{
+    b->find   = (int  (*)(void*, uint64_t))counting4_bloom_find;
+    b->probe  = (void (*)(void*, uint64_t))counting4_bloom_probe;
+    b->remov  = (int  (*)(void*, uint64_t))counting4_bloom_remove;
+    b->fini   = (void (*)(void*          ))bloom_fini;
+    b->desc   = (char* (*)(void*, char*, size_t))counting4_bloom_desc;
+    b->name   = "counting4-bloom";
+    b->typ    = BLOOM_TYPE_COUNTING4;
+    b->filter = NEWZ(bloom);
+    assert(b->filter);
+
+    return 1;
+}
+
+
+// Initialize function pointers for the cuckoo filter.
+// Return true on success, false otherwise
+static inline int
+setup_cuckoo_bloom(Bloom *b)
+{
+    b->find   = (int  (*)(void*, uint64_t))__cuckoo_find;
+    b->probe  = (void (*)(void*, uint64_t))__cuckoo_probe;
+    b->remov  = (int  (*)(void*, uint64_t))__cuckoo_remove;
+    b->fini   = (void (*)(void*          ))bloom_fini;
+    b->desc   = (char* (*)(void*, char*, size_t))__cuckoo_desc;
+    b->name   = "cuckoo-filter";
+    b->typ    = BLOOM_TYPE_CUCKOO;
+    b->filter = NEWZ(bloom);
+    assert(b->filter);
+
+    return 1;
+}
+
+
+// Pick the best find and probe functions of a blocked filter for
+// this CPU.
+static void
+setup_blocked_probe(Bloom *b)
+{
+    b->find   = (int  (*)(void*, uint64_t))blocked_bloom_find;
+    b->probe  = (void (*)(void*, uint64_t))blocked_bloom_probe;
+#if defined(__x86_64__) || defined(_M_X64) || defined(__amd64__)
+    if (simd_isa() >= SIMD_ISA_256) {
+        b->find   = (int  (*)(void*, uint64_t))blocked_bloom_find256;
+        b->probe  = (void (*)(void*, uint64_t))blocked_bloom_probe256;
+    }
+#endif
+}
+
+
+// Initialize function pointers for blocked bloom filter.
+// Return true on success, false otherwise
+static inline int
+setup_blocked_bloom(Bloom *b)
+{
+    setup_blocked_probe(b);
+    b->remov  = (int  (*)(void*, uint64_t))null_remov;
+    b->fini   = (void (*)(void*          ))bloom_fini;
+    b->desc   = (char* (*)(void*, char*, size_t))blocked_bloom_desc;
+    b->name   = "blocked-bloom";
+    b->typ    = BLOOM_TYPE_BLOCKED;
+    b->filter = NEWZ(bloom);
+    assert(b->filter);
+
+    return 1;
+}
+
+
 
 /*
  * Internal routine to setup a naked bloom filter and its function
@@ -640,9 +1429,21 @@ __alloc_bloom(int typ, uint32_t n)
             if (setup_counting_bloom(b))    return b;
             break;
 
+        case BLOOM_TYPE_COUNTING4:
+            if (setup_counting4_bloom(b))   return b;
+            break;
+
         case BLOOM_TYPE_QUICK:
             if (setup_standard_bloom(b))    return b;
             break;
+
+        case BLOOM_TYPE_BLOCKED:
+            if (setup_blocked_bloom(b))     return b;
+            break;
+
+        case BLOOM_TYPE_CUCKOO:
+            if (setup_cuckoo_bloom(b))      return b;
+            break;
     }
 
     if (typ == BLOOM_TYPE_SCALE) scalable_fini(b->filter);
@@ -661,7 +1462,14 @@ __free_bloom(Bloom *b)
             // FALLTHROUGH
 
         case BLOOM_TYPE_COUNTING:
+        case BLOOM_TYPE_COUNTING4:
         case BLOOM_TYPE_QUICK:
+        case BLOOM_TYPE_BLOCKED:
+        case BLOOM_TYPE_CUCKOO:
+            if (b->typ == BLOOM_TYPE_COUNTING4) {
+                bloom *f = b->filter;
+                if (f->ovf) ht_del(f->ovf);
+            }
             DEL(b->filter);
             DEL(b);
             break;
@@ -696,15 +1504,38 @@ scalable_new(Bloom *b, uint64_t n, double e)
 
 #define _EPSILON    2.2204460492503131e-16
 
+// Return true if the overflowed counters of 'a' and 'b' are the same
+static int
+ovf_eq(bloom *a, bloom *b)
+{
+    uint64_t na = a->ovf ? a->ovf->nodes : 0,
+             nb = b->ovf ? b->ovf->nodes : 0;
+
+    if (na != nb) return 0;
+    if (na == 0)  return 1;
+
+    ht_iter it;
+    uint64_t j;
+    void *v, *w;
+
+    ht_iter_init(&it, a->ovf);
+    while (ht_iter_next(&it, &j, &v)) {
+        if (!ht_find(b->ovf, j, &w) || v != w) return 0;
+    }
+    return 1;
+}
+
+
 static int
 bloom_eq(bloom *a, bloom *b)
 {
     if (a->m != b->m)           return 0;
     if (a->k != b->k)           return 0;
     if (a->salt != b->salt)     return 0;
-    if (a->size != b->size)     return 0;
+    if (bloom_size(a) != bloom_size(b)) return 0;
     if (a->bmsize != b->bmsize) return 0;
     if (0 != memcmp(a->bitmap, b->bitmap, a->bmsize)) return 0;
+    if (!ovf_eq(a, b))          return 0;
 
     return 1;
 }
@@ -751,17 +1582,219 @@ Standard_bloom_init(Bloom *b, uint64_t n, double e, int scalable)
 
 Bloom*
 Counting_bloom_init(Bloom *b, uint64_t n, double e)
+{
+    return Counting_bloom_init_flags(b, n, e, 0);
+}
+
+
+Bloom*
+Counting_bloom_init_flags(Bloom *b, uint64_t n, double e, uint32_t flags)
+{
+    b->n      = n;
+    b->e      = e;
+
+    if (flags & BLOOM_COUNTER4) {
+        if (!setup_counting4_bloom(b))             return 0;
+        if (counting4_bloom_init(b->filter, n, e)) return b;
+    } else {
+        if (!setup_counting_bloom(b))              return 0;
+        if (counting_bloom_init(b->filter, n, e))  return b;
+    }
+
+    DEL(b->filter);
+    return 0;
+}
+
+Bloom*
+Blocked_bloom_init(Bloom *b, uint64_t n, double e)
+{
+    b->n      = n;
+    b->e      = e;
+
+    if (!setup_blocked_bloom(b))             return 0;
+    if (blocked_bloom_init(b->filter, n, e)) return b;
+
+    DEL(b->filter);
+    return 0;
+}
+
+Bloom*
+Cuckoo_bloom_init(Bloom *b, uint64_t n, double e)
 {
     b->n      = n;
     b->e      = e;
 
-    if (!setup_counting_bloom(b))             return 0;
-    if (counting_bloom_init(b->filter, n, e)) return b;
+    if (!setup_cuckoo_bloom(b))          return 0;
+    if (__cuckoo_init(b->filter, n, e))  return b;
 
     DEL(b->filter);
     return 0;
 }
 
+
+int
+Cuckoo_bloom_insert(Bloom *b, uint64_t v)
+{
+    if (b->typ != BLOOM_TYPE_CUCKOO) return -ENOTSUP;
+
+    return __cuckoo_insert(b->filter, v);
+}
+
+// Switch filter 'b' into (or out of) concurrent mode
+int
+Bloom_concurrent(Bloom *b, int on)
+{
+    bloom *f = b->filter;
+
+    if (b->typ != BLOOM_TYPE_QUICK && b->typ != BLOOM_TYPE_BLOCKED) return -ENOTSUP;
+
+    if (on) {
+        if (f->ctr) return 0;
+
+        size_t sz = BLOOM_NCTR * sizeof(bloom_ctr);
+        if (posix_memalign((void **)&f->ctr, BLOOM_BLOCK_SIZE, sz) != 0) {
+            f->ctr = 0;
+            return -ENOMEM;
+        }
+        memset(f->ctr, 0, sz);
+
+        if (b->typ == BLOOM_TYPE_QUICK)
+            b->probe = (void (*)(void*, uint64_t))standard_bloom_probe_mt;
+        else
+            b->probe = (void (*)(void*, uint64_t))blocked_bloom_probe_mt;
+        return 0;
+    }
+
+    if (!f->ctr) return 0;
+
+    f->size = bloom_size(f);
+    free(f->ctr);
+    f->ctr = 0;
+
+    if (b->typ == BLOOM_TYPE_QUICK)
+        b->probe = (void (*)(void*, uint64_t))standard_bloom_probe;
+    else
+        setup_blocked_probe(b);
+    return 0;
+}
+
+// Make the lookups of 'b' verify the blocks of its file lazily
+void
+__bloom_set_lazy(Bloom *b, bloom_lazy *z)
+{
+    z->find = b->find;
+
+    if (b->typ == BLOOM_TYPE_SCALE) {
+        scalable_bloom *sb = b->filter;
+        uint32_t i;
+
+        // No levels: nothing will ever touch the mapping.
+        if (sb->len == 0) {
+            __bloom_lazy_free(z);
+            return;
+        }
+
+        for (i = 0; i < sb->len; i++) sb->bfa[i].lazy = z;
+
+        sb->bfa[0].flags |= BLOOM_LAZY_OWNER;
+        b->find = (int (*)(void*, uint64_t))scalable_find_lazy;
+        return;
+    }
+
+    bloom *f  = b->filter;
+    f->lazy   = z;
+    f->flags |= BLOOM_LAZY_OWNER;
+
+    switch (b->typ) {
+        case BLOOM_TYPE_QUICK:
+            b->find = (int (*)(void*, uint64_t))standard_bloom_find_lazy;
+            break;
+
+        case BLOOM_TYPE_COUNTING:
+            b->find = (int (*)(void*, uint64_t))counting_bloom_find_lazy;
+            break;
+
+        case BLOOM_TYPE_COUNTING4:
+            b->find = (int (*)(void*, uint64_t))counting4_bloom_find_lazy;
+            break;
+
+        case BLOOM_TYPE_BLOCKED:
+            b->find = (int (*)(void*, uint64_t))blocked_bloom_find_lazy;
+            break;
+
+        case BLOOM_TYPE_CUCKOO:
+            b->find = (int (*)(void*, uint64_t))__cuckoo_find_lazy;
+            break;
+    }
+}
+
+
+bloom_lazy*
+__bloom_get_lazy(Bloom *b)
+{
+    if (b->typ == BLOOM_TYPE_SCALE) {
+        scalable_bloom *sb = b->filter;
+
+        return sb->len > 0 ? sb->bfa[0].lazy : 0;
+    }
+
+    return ((bloom *)b->filter)->lazy;
+}
+
+
+// Initialize 'nb' as an empty filter just like 'b': same type,
+// size and salt.
+Bloom*
+Bloom_init_like(Bloom *nb, Bloom *b)
+{
+    bloom *f = b->filter;
+    int ok   = 0;
+
+    switch (b->typ) {
+        case BLOOM_TYPE_QUICK:
+            ok = setup_standard_bloom(nb);
+            break;
+
+        case BLOOM_TYPE_BLOCKED:
+            ok = setup_blocked_bloom(nb);
+            break;
+
+        case BLOOM_TYPE_COUNTING:
+            ok = setup_counting_bloom(nb);
+            break;
+
+        case BLOOM_TYPE_COUNTING4:
+            ok = setup_counting4_bloom(nb);
+            break;
+
+        case BLOOM_TYPE_CUCKOO:
+            ok = setup_cuckoo_bloom(nb);
+            break;
+
+        default:
+            break;
+    }
+
+    if (!ok) return 0;
+
+    bloom *g  = nb->filter;
+    g->bitmap = __alloc_bitmap(f->bmsize);
+    if (!g->bitmap) {
+        DEL(nb->filter);
+        return 0;
+    }
+
+    g->m      = f->m;
+    g->k      = f->k;
+    g->salt   = f->salt;
+    g->e      = f->e;
+    g->bmsize = f->bmsize;
+    nb->n     = b->n;
+    nb->e     = b->e;
+
+    return nb;
+}
+
 // free memory associated with filter 'b'
 void
 Bloom_fini(Bloom *b)
@@ -775,11 +1808,18 @@ Bloom_fini(Bloom *b)
 // create a new instance of a counting bloom filter
 Bloom*
 Counting_bloom_new(uint64_t n, double e)
+{
+    return Counting_bloom_new_flags(n, e, 0);
+}
+
+
+Bloom*
+Counting_bloom_new_flags(uint64_t n, double e, uint32_t flags)
 {
     Bloom* b  = NEWZ(Bloom);
     if (!b) return 0;
 
-    if (Counting_bloom_init(b, n, e)) return b;
+    if (Counting_bloom_init_flags(b, n, e, flags)) return b;
 
     DEL(b);
     return 0;
@@ -799,6 +1839,45 @@ Standard_bloom_new(uint64_t n, double e, int scalable)
     return 0;
 }
 
+// create a new instance of a blocked bloom filter
+Bloom*
+Blocked_bloom_new(uint64_t n, double e)
+{
+    Bloom* b  = NEWZ(Bloom);
+    if (!b) return 0;
+
+    if (Blocked_bloom_init(b, n, e)) return b;
+
+    DEL(b);
+    return 0;
+}
+
+// create a new instance of a cuckoo filter
+Bloom*
+Cuckoo_bloom_new(uint64_t n, double e)
+{
+    Bloom* b  = NEWZ(Bloom);
+    if (!b) return 0;
+
+    if (Cuckoo_bloom_init(b, n, e)) return b;
+
+    DEL(b);
+    return 0;
+}
+
+// create a new, empty filter just like 'b'
+Bloom*
+Bloom_new_like(Bloom *b)
+{
+    Bloom* nb = NEWZ(Bloom);
+    if (!nb) return 0;
+
+    if (Bloom_init_like(nb, b)) return nb;
+
+    DEL(nb);
+    return 0;
+}
+
 // free all memory associated with filter 'b' and 'b' itself.
 void
 Bloom_delete(Bloom *b)
@@ -24,6 +24,9 @@ extern "C" {
 #endif /* __cplusplus */
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
 #include <math.h>
 
 /*
@@ -32,27 +35,123 @@ extern "C" {
 #define BLOOM_TYPE_COUNTING       0
 #define BLOOM_TYPE_QUICK          1
 #define BLOOM_TYPE_SCALE          2         // scalable quick bloom
+#define BLOOM_TYPE_BLOCKED        3         // cache-line blocked bloom
+#define BLOOM_TYPE_COUNTING4      4         // counting bloom with 4-bit counters
+#define BLOOM_TYPE_CUCKOO         5         // cuckoo filter
+
+// A 4-bit counter sticks at this value; the rest of its count is in
+// the overflow table of the filter.
+#define BLOOM_CTR4_MAX            15
+
+/*
+ * A blocked filter sets all the bits of a key in one cache line:
+ * one bit in each of the BLOOM_BLOCK_K 64-bit words of a
+ * BLOOM_BLOCK_SIZE byte block.
+ */
+#define BLOOM_BLOCK_SIZE          64
+#define BLOOM_BLOCK_K             8
+
+/*
+ * A cuckoo filter has 'm' (a power of 2) buckets of
+ * BLOOM_CUCKOO_WAYS fingerprints of 'k' bits each. The buckets are
+ * followed by BLOOM_CUCKOO_PAD bytes (so that a bucket can always
+ * be read with one 64-bit load) and the victim stash: the bucket
+ * index and fingerprint of the last key that couldn't be placed.
+ */
+#define BLOOM_CUCKOO_WAYS         4
+#define BLOOM_CUCKOO_PAD          8
+#define BLOOM_CUCKOO_STASH        16
 
 // List of checksum algorithms we support
 #define BLOOM_CKSUM_SHA256        0
 #define BLOOM_CKSUM_BLAKE2b       1
+#define BLOOM_CKSUM_XXH64         2         // fast, not cryptographic
 #define BLOOM_CKSUM_DEFAULT       BLOOM_CKSUM_SHA256
 
+// Size of the file header and of each checksummed block after it
+// in a BLOOM_VER1 file
+#define BLOOM_HDRSIZE             64
+#define BLOOM_CKSUM_BLKSIZE       (1024 * 1024)
+
 #define BLOOM_HASH_FASTHALF       0         // Half a round of super fast hash
 
 /*
  * Current version of the bloom filter that's serialized.
  */
 #define BLOOM_VER0                0
+#define BLOOM_VER1                1         // per-block checksums
+
+
+/*
+ * Internal flags in 'struct bloom': the filter frees the lazy
+ * verification state (see below); a 4-bit counter couldn't spill
+ * its count - so a saturated counter without an overflow entry is
+ * never decremented.
+ */
+#define BLOOM_LAZY_OWNER          (1 << 8)
+#define BLOOM_CTR4_STICKY         (1 << 9)
+
+/*
+ * Block states of lazily verified filters
+ */
+#define BLOOM_BLK_UNVERIFIED      0
+#define BLOOM_BLK_GOOD            1
+#define BLOOM_BLK_BAD             2
+
+
+/*
+ * State of a filter unmarshaled with BLOOM_VERIFY_LAZY: the blocks
+ * of the file mapping are verified when a lookup first touches
+ * them. One instance is shared by all the filters in a file.
+ */
+struct bloom_lazy
+{
+    uint8_t  *base;         // start of the file mapping
+    uint64_t  mapsz;        // size of the mapping
+    uint64_t  datasize;     // end of the checksummed data
+    uint8_t  *sums;         // table of block checksums
+    uint64_t  nblk;         // number of blocks
+    int       cktype;       // BLOOM_CKSUM_xxx
+
+    atomic_uchar        *state; // BLOOM_BLK_xxx of each block
+    atomic_uint_fast64_t bad;   // number of bad blocks seen
+
+    // find() of the filter - before it was made lazy
+    int (*find)(void *, uint64_t);
+};
+typedef struct bloom_lazy bloom_lazy;
+
+
+/*
+ * Number of element counters of a filter in concurrent mode. Each
+ * thread bumps its own counter (and shares one with another thread
+ * only if there are more than BLOOM_NCTR threads).
+ */
+#define BLOOM_NCTR                32
+
+struct bloom_ctr
+{
+    atomic_uint_fast64_t n;
+    uint8_t pad[BLOOM_BLOCK_SIZE - sizeof(atomic_uint_fast64_t)];
+};
+typedef struct bloom_ctr bloom_ctr;
 
 
 /*
  * Common bloom filter header.
  *
+ * For blocked bloom filter: 'm' is the number of blocks and 'k' is
+ * always BLOOM_BLOCK_K.
+ *
  * For counting bloom filter: The counter is 8 bit to keep the arithmetic
  * simple. Memory is cheap - so unless we are doing Zillions of
  * items, this strategy will work fine.
  *
+ * The compact counting filter (BLOOM_TYPE_COUNTING4) packs two 4-bit
+ * counters in a byte; 'ovf' maps the index of each counter that
+ * reached BLOOM_CTR4_MAX to the part of its count that didn't fit.
+ * fast-ht keys can't be zero: the key of counter 'j' is OVF_KEY(j).
+ *
  * We keep the most frequently used elements upfront - so they fill
  * an entire cache line.
  */
@@ -69,10 +168,49 @@ struct bloom
     uint32_t __pad0;    // padding
     double   e;         // expected error rate
 
+    bloom_ctr  *ctr;    // per-thread element counters (concurrent mode)
+    bloom_lazy *lazy;   // lazy verification state (mmap'd only)
+    struct ht  *ovf;    // overflowed 4-bit counters (or 0)
 };
+
+// Key of the counter 'j' in 'ovf' and back
+#define OVF_KEY(j)      ((j) + 1)
+#define OVF_IDX(k)      ((k) - 1)
 typedef struct bloom bloom;
 
 
+// Verify block 'blk' of a lazily verified file; return true if it
+// is good.
+extern int __bloom_verify_block(bloom_lazy *z, uint64_t blk);
+
+// Unmap the file and free the lazy verification state
+extern void __bloom_lazy_free(bloom_lazy *z);
+
+// Make the lookups of 'b' verify each block on first touch
+extern void __bloom_set_lazy(Bloom *b, bloom_lazy *z);
+
+// Return the lazy verification state of 'b' (or 0)
+extern bloom_lazy* __bloom_get_lazy(Bloom *b);
+
+
+/*
+ * Return true if the bytes at 'p' can be trusted; verify the block
+ * that holds them if this is the first touch.
+ */
+static inline int
+bloom_lazy_touch(bloom_lazy *z, const void *p)
+{
+    uint64_t off = (const uint8_t *)p - z->base;
+    uint64_t blk = (off - BLOOM_HDRSIZE) / BLOOM_CKSUM_BLKSIZE;
+    int st = atomic_load_explicit(&z->state[blk], memory_order_acquire);
+
+    if (st == BLOOM_BLK_GOOD) return 1;
+    if (st == BLOOM_BLK_BAD)  return 0;
+
+    return __bloom_verify_block(z, blk);
+}
+
+
 /*
  * Scalable bloom filter.
  *
@@ -101,19 +239,102 @@ typedef struct scalable_bloom scalable_bloom;
 
 
 
+/**
+ * Return the number of elements in the filter: in concurrent mode,
+ * the elements added by each thread are counted separately.
+ */
+static inline uint64_t
+bloom_size(bloom *b)
+{
+    uint64_t n = b->size;
+
+    if (b->ctr) {
+        for (int i = 0; i < BLOOM_NCTR; i++) {
+            n += atomic_load_explicit(&b->ctr[i].n, memory_order_relaxed);
+        }
+    }
+    return n;
+}
+
+
 /**
  * Return estimated fill ratio for the bloom filter.
  */
 static inline double
 bloom_fill_ratio_est(bloom *b)
 {
-    double r = (double)b->size / (double)b->m;
+    double r = (double)bloom_size(b) / (double)b->m;
     return 1 - exp(-r);
 }
 
 
 
 
+// Compression function from fasthash
+#define mix(h) ({                   \
+            (h) ^= (h) >> 23;       \
+            (h) *= 0x2127599bf4325c37ULL;   \
+            (h) ^= (h) >> 47; h; })
+
+
+/*
+ * fasthash64() - but tuned for exactly _one_ round and
+ * one 64-bit word.
+ *
+ * Borrowed from Zilong Tan's superfast hash.
+ * Copyright (C) 2012 Zilong Tan (eric.zltan@gmail.com)
+ */
+static inline uint64_t
+hash_val(uint64_t v, uint64_t salt)
+{
+    const uint64_t m = 0x880355f21e6d1965ULL;
+    uint64_t h       = (8 * m);
+
+    h ^= mix(v);
+    h *= m;
+
+    return mix(h) ^ salt;
+}
+
+
+// Bytes in a bucket of 'k' bit fingerprints
+static inline uint64_t
+cuckoo_bucket_size(uint64_t k)
+{
+    return (k * BLOOM_CUCKOO_WAYS) / 8;
+}
+
+
+// Offset of the victim stash in the bitmap of a cuckoo filter
+static inline uint64_t
+cuckoo_stash_off(uint64_t m, uint64_t k)
+{
+    return (m * cuckoo_bucket_size(k)) + BLOOM_CUCKOO_PAD;
+}
+
+
+// Return true if 'm' and 'k' make a valid cuckoo filter
+static inline int
+cuckoo_valid(uint64_t m, uint64_t k)
+{
+    if (k != 8 && k != 12 && k != 16) return 0;
+    return m >= 2 && (m & (m - 1)) == 0;
+}
+
+
+/*
+ * Cuckoo filter operations (see cuckoo.c). __cuckoo_insert() returns
+ * -ENOSPC when the filter is full.
+ */
+extern bloom* __cuckoo_init(bloom *b, uint64_t n, double e);
+extern int    __cuckoo_insert(bloom *b, uint64_t val);
+extern void   __cuckoo_probe(bloom *b, uint64_t val);
+extern int    __cuckoo_find(bloom *b, uint64_t val);
+extern int    __cuckoo_remove(bloom *b, uint64_t val);
+extern int    __cuckoo_find_lazy(bloom *b, uint64_t val);
+extern char*  __cuckoo_desc(bloom *b, char *buf, size_t bsiz);
+
+
 /*
  * Internal routine to setup a naked bloom filter and its function
  * pointers.
@@ -132,6 +353,19 @@ extern Bloom* __alloc_bloom(int typ, uint32_t n);
 extern void __free_bloom(Bloom *b);
 
 
+// Allocate a zeroed, cache-line aligned bitmap of 'n' bytes
+static inline uint8_t*
+__alloc_bitmap(uint64_t n)
+{
+    void *p = 0;
+
+    if (posix_memalign(&p, BLOOM_BLOCK_SIZE, n ? n : BLOOM_BLOCK_SIZE) != 0) return 0;
+
+    memset(p, 0, n);
+    return p;
+}
+
+
 #define _d(x)   ((double)(x))
 // Make 'k' from 'e'
 static inline uint64_t
@@ -18,8 +18,18 @@
  * o  See commentary in bloom.c.
  * o  All integers are in little endian order - to make it easy for
  *    the most common arch to just read it off the disk.
- * o  The filter data always starts at a 64-byte boundary.
- * o  For version 1 we always use SHA256 as the checksum.
+ * o  The filter data always starts at a 64-byte boundary; the blocks
+ *    of a blocked filter are thus cache-line aligned when mmap'd.
+ * o  Version 0 has one checksum over the entire file; a loader must
+ *    read all of it before it can use any of it.
+ * o  Version 1 checksums each 1MB block after the header
+ *    (BLOOM_CKSUM_BLKSIZE) and keeps a table of these checksums
+ *    after the data. The header holds the checksum of the header and
+ *    the table (the "root"). Thus a loader can verify the root and
+ *    then verify the blocks in parallel - or, for a mmap'd filter,
+ *    only when a lookup first touches them (BLOOM_VERIFY_LAZY).
+ * o  The checksum is SHA256 by default; xxhash64 (BLOOM_CKSUM_FAST)
+ *    is much faster but only guards against accidental damage.
  *
  *
  * Disk layout of data:
@@ -34,7 +44,9 @@
  *     o total entries   8  -- number of entries in the bloom filter
  *     o error ratio     8  -- the error ratio 'e' when the filter was created
  *     o marshalled size 8  -- total number of marshalled bytes
- *     o ZEROES          -  -- padding to 64 bytes
+ *     o root checksum  32  -- version 1 only: checksum of the header
+ *                             (with this field zeroed) and the table
+ *                             of block checksums
  *
  * - Filter Directory:
  *     o N filters       4  -- number of scalable bloom filters (1 for everyone else)
@@ -44,15 +56,28 @@
  *          - off        8  -- offset where the filter bits actually start (offset 0 is start of file)
  *
  *  - N entries of filter data:
- *     o m      8 -- number of slots
- *     o k      8 -- number of hash functions
+ *     o m      8 -- number of slots (blocks for a blocked filter,
+ *                   buckets for a cuckoo filter)
+ *     o k      8 -- number of hash functions (fingerprint bits for
+ *                   a cuckoo filter)
  *     o salt   8 -- hash salt
  *     o size   8 -- number of filter entries
  *     o bmsize 8 -- size of the filter bitmap
  *     o bitmap N bytes (bmsize bytes)
+ *     o compact counting filter (BLOOM_TYPE_COUNTING4) only - at the
+ *       next 8 byte boundary past the bitmap:
+ *          - nov    8 -- number of overflowed counters
+ *          - nov entries of:
+ *              * index  8 -- counter index
+ *              * count  8 -- count past BLOOM_CTR4_MAX
  *
- * - Last 'n' bytes of the marshaled data is the checksum over the
- *   _entire_ file (including header, blank spots and everything).
+ * - Version 0: Last 'n' bytes of the marshaled data is the checksum
+ *   over the _entire_ file (including header, blank spots and
+ *   everything).
+ *
+ * - Version 1: Table of 'n' byte checksums - one for each block of
+ *   the marshalled bytes after the header. The last block may be
+ *   short.
  */
 #include <string.h>
 #include <stdlib.h>
@@ -68,8 +93,14 @@
 
 #include "utils/bloom.h"
 #include "utils/utils.h"
+#include "utils/cpu.h"
 #include "fast/encdec.h"
 #include "fast/vect.h"
+#include "posix/job.h"
+#include "utils/fast-ht.h"
+
+#define XXH_STATIC_LINKING_ONLY
+#include "utils/xxhash.h"
 
 // Need libsodium to be installed.
 #include "sodium.h"
@@ -85,7 +116,10 @@ extern int fdatasync(int);
 /*
  * 64 bytes of header. See description above.
  */
-#define HDRSIZ      64
+#define HDRSIZ      BLOOM_HDRSIZE
+
+// Offset of the root checksum in the header
+#define ROOTOFF     32
 
 /*
  * Header of each individual filter:
@@ -94,6 +128,10 @@ extern int fdatasync(int);
 
 #define BLOOM_BLAKE2b_SIZE    crypto_generichash_BYTES
 #define BLOOM_SHA256_SIZE     crypto_hash_sha256_BYTES
+#define BLOOM_XXH64_SIZE      8
+
+// Block checksums of files smaller than this aren't worth the threads
+#define VERIFY_MT_MIN         (4 * 1024 * 1024)
 
 #define max_CKSUMSZ           (BLOOM_BLAKE2b_SIZE > BLOOM_SHA256_SIZE ? BLOOM_BLAKE2b_SIZE : BLOOM_SHA256_SIZE)
 
@@ -114,6 +152,7 @@ struct checksummer
     union {
         crypto_generichash_state blake2;
         crypto_hash_sha256_state sha256;
+        XXH64_state_t            xxh64;
     };
 };
 typedef struct checksummer checksummer;
@@ -147,6 +186,9 @@ struct mstate
     // Vector of offsets for filter data.
     off_vect    offs;
 
+    // Format version we're writing or reading
+    int         ver;
+
     // checksummer instance
     checksummer ck;
 };
@@ -219,6 +261,31 @@ sha256_final(checksummer* ck, void* out)
 
 
 
+static void
+xxh64_init(checksummer* ck)
+{
+    XXH64_reset(&ck->xxh64, 0);
+};
+
+
+static void
+xxh64_update(checksummer* ck, void* buf, size_t n)
+{
+    uint8_t b0[8];
+
+    enc_BE_u64(b0, n);
+    XXH64_update(&ck->xxh64, buf, n);
+    XXH64_update(&ck->xxh64, b0,  8);
+}
+
+
+static void
+xxh64_final(checksummer* ck, void* out)
+{
+    enc_LE_u64(out, XXH64_digest(&ck->xxh64));
+}
+
+
 /*
  * Map of checksum types to the handlers
  * Keep this array in-sync with the #defines above.
@@ -227,6 +294,7 @@ sha256_final(checksummer* ck, void* out)
 static const checksummer Checksums[] =  {
       _x(sha256,  BLOOM_SHA256_SIZE,  BLOOM_CKSUM_SHA256)
     , _x(blake2b, BLOOM_BLAKE2b_SIZE, BLOOM_CKSUM_BLAKE2b)
+    , _x(xxh64,   BLOOM_XXH64_SIZE,   BLOOM_CKSUM_XXH64)
 };
 
 
@@ -239,6 +307,152 @@ cksum(checksummer *ck, uint8_t *out, uint8_t *buf, uint64_t sz)
 }
 
 
+/*
+ * Block checksums of version 1 files
+ */
+
+// Number of blocks in 'datasize' bytes of data
+static inline uint64_t
+nblocks(uint64_t datasize)
+{
+    return (datasize - HDRSIZ + BLOOM_CKSUM_BLKSIZE - 1) / BLOOM_CKSUM_BLKSIZE;
+}
+
+
+// Checksum of the header (with the root zeroed) and the block table
+static void
+mkroot(checksummer *ck, uint8_t *out, uint8_t *base, uint8_t *sums, uint64_t nblk)
+{
+    uint8_t hdr[HDRSIZ];
+
+    memcpy(hdr, base, HDRSIZ);
+    memset(hdr + ROOTOFF, 0, HDRSIZ - ROOTOFF);
+
+    ck->init(ck);
+    ck->update(ck, hdr, HDRSIZ);
+    ck->update(ck, sums, nblk * ck->size);
+    ck->final(ck, out);
+}
+
+
+/*
+ * State shared by the workers that make or verify the block
+ * checksums.
+ */
+struct blkrun
+{
+    checksummer  ck;        // template; each block uses a copy
+    uint8_t     *base;
+    uint64_t     datasize;
+    uint8_t     *sums;
+    atomic_uchar *state;    // lazily verified files: BLOOM_BLK_xxx
+    int          verify;    // verify (or make) the checksums
+    atomic_uint_fast64_t bad;
+};
+typedef struct blkrun blkrun;
+
+
+// A range of blocks for one worker
+struct blkpiece
+{
+    uint64_t first;
+    uint64_t n;
+};
+typedef struct blkpiece blkpiece;
+
+
+// Make or verify the checksum of block 'i'; return true if it's good
+static int
+blk_one(checksummer *tmpl, uint8_t *base, uint64_t datasize, uint8_t *sums, uint64_t i, int verify)
+{
+    uint8_t  sum[max_CKSUMSZ];
+    uint64_t off = HDRSIZ + (i * BLOOM_CKSUM_BLKSIZE);
+    uint64_t len = datasize - off;
+    checksummer ck = *tmpl;
+
+    if (len > BLOOM_CKSUM_BLKSIZE) len = BLOOM_CKSUM_BLKSIZE;
+
+    uint8_t *want = sums + (i * ck.size);
+    if (!verify) {
+        cksum(&ck, want, base + off, len);
+        return 1;
+    }
+
+    cksum(&ck, sum, base + off, len);
+    return 0 == sodium_memcmp(sum, want, ck.size);
+}
+
+
+static void
+blk_piece(blkrun *r, blkpiece *p)
+{
+    uint64_t i;
+
+    for (i = p->first; i < p->first + p->n; i++) {
+        if (r->state && atomic_load(&r->state[i]) != BLOOM_BLK_UNVERIFIED) continue;
+
+        int ok = blk_one(&r->ck, r->base, r->datasize, r->sums, i, r->verify);
+
+        if (r->state) atomic_store(&r->state[i], ok ? BLOOM_BLK_GOOD : BLOOM_BLK_BAD);
+        if (!ok)      atomic_fetch_add(&r->bad, 1);
+    }
+}
+
+
+static int
+blk_job(void *ctx, void *job, int cpu)
+{
+    USEARG(cpu);
+
+    blk_piece(ctx, job);
+    return 0;
+}
+
+
+// Make or verify all the block checksums with up to 'nthreads'
+// threads; return the number of bad blocks.
+static uint64_t
+blk_run(blkrun *r, int nthreads)
+{
+    uint64_t nblk = nblocks(r->datasize);
+    blkpiece one  = { .first = 0, .n = nblk };
+
+    atomic_init(&r->bad, 0);
+    if (nthreads <= 0) nthreads = sys_cpu_getavail();
+
+    if (nthreads <= 1 || r->datasize < VERIFY_MT_MIN) {
+        blk_piece(r, &one);
+        return atomic_load(&r->bad);
+    }
+
+    // a few pieces per thread to even out the load
+    uint64_t  np  = nthreads * 4;
+    uint64_t  per = (nblk + np - 1) / np;
+    blkpiece *pv  = NEWZA(blkpiece, np);
+    job_manager jm;
+    uint64_t i, n = 0;
+
+    if (job_manager_init(&jm, nthreads, blk_job, r) < 0) {
+        DEL(pv);
+        blk_piece(r, &one);
+        return atomic_load(&r->bad);
+    }
+
+    for (i = 0; i < nblk; i += per, n++) {
+        blkpiece *p = &pv[n];
+
+        p->first = i;
+        p->n     = (nblk - i) > per ? per : (nblk - i);
+        job_manager_submit_job(&jm, p);
+    }
+
+    job_manager_wait(&jm);
+    job_manager_destroy(&jm);
+    DEL(pv);
+    return atomic_load(&r->bad);
+}
+
+
 // Write header, filter-offset directory and update checksum.
 static uint8_t *
 wrhdr(uint8_t *ptr, mstate *m)
@@ -251,7 +465,7 @@ wrhdr(uint8_t *ptr, mstate *m)
     memset(ptr, 0, HDRSIZ);
     memcpy(ptr, "BLOM", 4);     ptr += 4;
 
-    *ptr = BLOOM_VER0;          ptr += 1;
+    *ptr = m->ver;              ptr += 1;
     *ptr = b->typ;              ptr += 1;
     *ptr = BLOOM_HASH_FASTHALF; ptr += 1;
     *ptr = m->ck.type;          ptr += 1;
@@ -291,6 +505,25 @@ wrhdr(uint8_t *ptr, mstate *m)
 }
 
 
+// Number of overflowed counters of filter 'f'
+static inline uint64_t
+ovf_count(bloom *f)
+{
+    return f->ovf ? f->ovf->nodes : 0;
+}
+
+
+// Number of bytes of filter data of 'f' of type 'typ': the bitmap
+// and for a compact counting filter, its overflow table.
+static uint64_t
+filter_datasize(int typ, bloom *f)
+{
+    if (typ != BLOOM_TYPE_COUNTING4) return f->bmsize;
+
+    return _ALIGN_UP(f->bmsize, 8) + 8 + (ovf_count(f) * 16);
+}
+
+
 // Calculate how big the marshal'd data is going to be
 static uint64_t
 calc_marshal_size(mstate *m)
@@ -337,7 +570,7 @@ calc_marshal_size(mstate *m)
 
         o->dataoff = sz = _ALIGN_UP(sz, 64);
 
-        sz += f->bmsize;
+        sz += filter_datasize(b->typ, f);
         sz  = _ALIGN_UP(sz, 64);
     }
 
@@ -351,7 +584,7 @@ calc_marshal_size(mstate *m)
 // marshal bloom filter 'b' beginning at 'ptr'
 // 'ptr' is start of mmap'd base.
 static void
-wrfilter(uint8_t * start, offpair *o, bloom *b)
+wrfilter(uint8_t * start, offpair *o, bloom *b, int typ)
 {
     uint8_t * h = start + o->hdroff;
     uint8_t * d = start + o->dataoff;
@@ -360,17 +593,34 @@ wrfilter(uint8_t * start, offpair *o, bloom *b)
     h = enc_LE_u64(h,  b->m);
     h = enc_LE_u64(h,  b->k);
     h = enc_LE_u64(h,  b->salt);
-    h = enc_LE_u64(h,  b->size);
+    h = enc_LE_u64(h,  bloom_size(b));
     h = enc_LE_u64(h,  b->bmsize);
 
     assert((h - z) == FILT_HDRSIZ);
 
     memcpy(d, b->bitmap, b->bmsize);
+
+    if (typ == BLOOM_TYPE_COUNTING4) {
+        uint8_t *p = d + _ALIGN_UP(b->bmsize, 8);
+        uint64_t j;
+        void *v;
+
+        p = enc_LE_u64(p, ovf_count(b));
+        if (b->ovf) {
+            ht_iter it;
+
+            ht_iter_init(&it, b->ovf);
+            while (ht_iter_next(&it, &j, &v)) {
+                p = enc_LE_u64(p, OVF_IDX(j));
+                p = enc_LE_u64(p, (uintptr_t)v);
+            }
+        }
+    }
 }
 
 // Read filter data from offset pair 'o' into bloom 'b'.
 static int
-rdfilter(uint8_t *start, offpair *o, bloom *b, int dommap)
+rdfilter(uint8_t *start, uint64_t sz, offpair *o, bloom *b, int dommap)
 {
     uint8_t * h = start + o->hdroff;
     uint8_t * d = start + o->dataoff;
@@ -387,11 +637,13 @@ rdfilter(uint8_t *start, offpair *o, bloom *b, int dommap)
 
     assert((h - z) == FILT_HDRSIZ);
 
+    if (b->bmsize > sz || o->dataoff > (sz - b->bmsize)) return -EBADF;
+
     if (dommap) {
         b->bitmap = d;
         b->flags  = BLOOM_BITMAP_MMAP;
     } else {
-        b->bitmap = NEWA(uint8_t, b->bmsize);
+        b->bitmap = __alloc_bitmap(b->bmsize);
         if (!b->bitmap) return -ENOMEM;
         memcpy(b->bitmap, d, b->bmsize);
     }
@@ -423,13 +675,16 @@ rdhdr(uint8_t *buf, uint64_t sz, mstate *m)
     if (0 != memcmp(p, "BLOM", 4)) return -EBADF;
 
     p += 4;
-    if (*p != BLOOM_VER0)   return -EBADF;
+    if (*p != m->ver)       return -EBADF;
 
     p += 1;
     switch (*p) {
         case BLOOM_TYPE_SCALE:
         case BLOOM_TYPE_COUNTING:
+        case BLOOM_TYPE_COUNTING4:
         case BLOOM_TYPE_QUICK:
+        case BLOOM_TYPE_BLOCKED:
+        case BLOOM_TYPE_CUCKOO:
             typ = *p;
             break;
 
@@ -526,6 +781,7 @@ is_valid_cktyp(checksummer *ck, int typ)
     switch (typ) {
         case BLOOM_CKSUM_SHA256:
         case BLOOM_CKSUM_BLAKE2b:
+        case BLOOM_CKSUM_XXH64:
             *ck = Checksums[typ];
             return 1;
             break;
@@ -536,6 +792,32 @@ is_valid_cktyp(checksummer *ck, int typ)
     return 0;
 }
 
+
+// Return true if the bitmap of filter 'f' of type 'typ' is big
+// enough for its 'm' and 'k'.
+static int
+filter_fits(int typ, bloom *f)
+{
+    switch (typ) {
+        case BLOOM_TYPE_COUNTING:
+            return f->m * f->k <= f->bmsize;
+
+        case BLOOM_TYPE_COUNTING4:
+            return f->m * f->k <= f->bmsize * 2;
+
+        case BLOOM_TYPE_CUCKOO:
+            return cuckoo_valid(f->m, f->k) && f->m <= f->bmsize / 4 &&
+                   cuckoo_stash_off(f->m, f->k) + BLOOM_CUCKOO_STASH <= f->bmsize;
+
+        case BLOOM_TYPE_BLOCKED:
+            return f->k == BLOOM_BLOCK_K && f->m * BLOOM_BLOCK_SIZE <= f->bmsize;
+
+        default:
+            return f->m * f->k <= f->bmsize * 8;
+    }
+}
+
+
 /*
  * Marshal bloom filter 'b' to file 'fname'.
  *
@@ -544,17 +826,25 @@ is_valid_cktyp(checksummer *ck, int typ)
  * Returns 0 on success, -errno on failure.
  */
 int
-Bloom_marshal(Bloom *b, const char *fname)
+Bloom_marshal_flags(Bloom *b, const char *fname, uint32_t flags)
 {
     char file[PATH_MAX];
     int fd, r = 0;
-    uint64_t sz;
+    uint64_t sz, nblk = 0;
     mstate m;
 
     memset(&m, 0, sizeof m);
-    m.b  = b;
-    m.ck = Checksums[BLOOM_CKSUM_DEFAULT];
-    sz   = m.ck.size + calc_marshal_size(&m);
+    m.b   = b;
+    m.ver = (flags & BLOOM_MARSHAL_VER0) ? BLOOM_VER0 : BLOOM_VER1;
+    m.ck  = Checksums[(flags & BLOOM_CKSUM_FAST) ? BLOOM_CKSUM_XXH64 : BLOOM_CKSUM_DEFAULT];
+    sz    = calc_marshal_size(&m);
+
+    if (m.ver == BLOOM_VER0) {
+        sz += m.ck.size;
+    } else {
+        nblk = nblocks(sz);
+        sz  += nblk * m.ck.size;
+    }
 
     snprintf(file, sizeof file, "%s.tmp.XXXXXX", fname);
 
@@ -586,19 +876,33 @@ Bloom_marshal(Bloom *b, const char *fname)
         VECT_FOR_EACHi(&m.offs, i, o) {
             bloom *f = &sb->bfa[i];
 
-            wrfilter(start, o, f);
+            wrfilter(start, o, f, BLOOM_TYPE_QUICK);
         }
     } else {
         bloom   *f = b->filter;
         offpair *o = &VECT_ELEM(&m.offs, 0);
 
-        wrfilter(start, o, f);
+        wrfilter(start, o, f, b->typ);
+    }
+
+    if (m.ver == BLOOM_VER0) {
+        /*
+         * Calculate checksum from start m.datasize
+         */
+        cksum(&m.ck, start+m.datasize, start, m.datasize);
+    } else {
+        blkrun br = {
+            .ck       = m.ck,
+            .base     = start,
+            .datasize = m.datasize,
+            .sums     = start + m.datasize,
+            .verify   = 0,
+        };
+
+        blk_run(&br, 0);
+        mkroot(&m.ck, start + ROOTOFF, start, br.sums, nblk);
     }
 
-    /*
-     * Calculate checksum from start m.datasize
-     */
-    cksum(&m.ck, start+m.datasize, start, m.datasize);
     VECT_FINI(&m.offs);
     munmap(mptr, sz);
     fsync(fd);
@@ -619,6 +923,103 @@ fail:
 }
 
 
+int
+Bloom_marshal(Bloom *b, const char *fname)
+{
+    return Bloom_marshal_flags(b, fname, 0);
+}
+
+
+/*
+ * Verify the checksums of a version 1 file mapped at 'start'.
+ * Only the root is verified if 'lazy' is set. Return 0 on success,
+ * -errno on failure.
+ */
+static int
+verify_v1(mstate *m, uint8_t *start, uint64_t fsize, int lazy)
+{
+    uint8_t  root[max_CKSUMSZ];
+    uint64_t datasize = dec_LE_u64(start + 24);
+
+    if (datasize < (HDRSIZ+16) || datasize > fsize) return -EILSEQ;
+
+    uint64_t nblk = nblocks(datasize);
+    if (fsize != datasize + (nblk * m->ck.size)) return -EILSEQ;
+
+    mkroot(&m->ck, root, start, start + datasize, nblk);
+    if (0 != sodium_memcmp(root, start + ROOTOFF, m->ck.size)) return -EILSEQ;
+
+    m->datasize = datasize;
+    if (lazy) return 0;
+
+    blkrun br = {
+        .ck       = m->ck,
+        .base     = start,
+        .datasize = datasize,
+        .sums     = start + datasize,
+        .verify   = 1,
+    };
+
+    return blk_run(&br, 0) ? -EILSEQ : 0;
+}
+
+
+// Verify the blocks that hold 'n' bytes at offset 'off' of a lazily
+// verified file.
+static int
+verify_range(bloom_lazy *z, uint64_t off, uint64_t n)
+{
+    uint64_t end = off + n;
+
+    if (end > z->datasize) end = z->datasize;
+
+    for (; off < end; off += BLOOM_CKSUM_BLKSIZE) {
+        if (!bloom_lazy_touch(z, z->base + off)) return -EILSEQ;
+    }
+    return bloom_lazy_touch(z, z->base + end - 1) ? 0 : -EILSEQ;
+}
+
+
+/*
+ * Read the overflow table of the compact counting filter 'f' from
+ * offset pair 'o'; 'z' is the lazy verification state (or 0). The
+ * table is always copied: it is a hash table in memory.
+ */
+static int
+rdovf(uint8_t *start, uint64_t sz, offpair *o, bloom *f, bloom_lazy *z)
+{
+    uint64_t off = o->dataoff + _ALIGN_UP(f->bmsize, 8);
+    uint64_t n, i;
+    int r;
+
+    if (off > sz || (sz - off) < 8) return -EBADF;
+    if (z && (r = verify_range(z, off, 8)) < 0) return r;
+
+    uint8_t *p = start + off;
+
+    n = dec_LE_u64(p);  p += 8;
+    if (n > (sz - off - 8) / 16 || n > f->m * f->k) return -EBADF;
+    if (n == 0) return 0;
+
+    if (z && (r = verify_range(z, off + 8, n * 16)) < 0) return r;
+
+    f->ovf = ht_new(n > UINT32_MAX ? UINT32_MAX : n, 0);
+    if (!f->ovf) return -ENOMEM;
+
+    for (i = 0; i < n; i++) {
+        uint64_t j = dec_LE_u64(p);     p += 8;
+        uint64_t c = dec_LE_u64(p);     p += 8;
+
+        // Only a saturated counter can overflow - and just once. The
+        // bitmap of a lazily verified file can't be trusted yet.
+        if (j >= f->m * f->k || c == 0) return -EBADF;
+        if (!z && ((f->bitmap[j / 2] >> ((j & 1) * 4)) & 0xf) != BLOOM_CTR4_MAX) return -EBADF;
+        if (ht_probe(f->ovf, OVF_KEY(j), (void *)(uintptr_t)c)) return -EBADF;
+    }
+
+    return 0;
+}
+
 
 /*
  * Unmarshal bloom filter from file 'fname' into a newly allocated
@@ -634,6 +1035,7 @@ Bloom_unmarshal(Bloom **p_b, const char *fname, uint32_t flags)
 {
     uint8_t ckcalc[max_CKSUMSZ];
     const int do_mmap = flags & BLOOM_BITMAP_MMAP;
+    bloom_lazy *z     = 0;
     int fd, r;
     mstate m;
 
@@ -667,12 +1069,41 @@ Bloom_unmarshal(Bloom **p_b, const char *fname, uint32_t flags)
     // This is the size of the data blob (headers + filters)
     size_t  dsize  = st.st_size - m.ck.size;
 
-    // Calculate checksum before we read any other data.
-    // Checksum is in the last "n" bytes.
-    cksum(&m.ck, ckcalc, mptr, dsize);
-    if (0 != sodium_memcmp(ckcalc, start+dsize, m.ck.size)) {
-        errno = EILSEQ;
-        goto fail0;
+    m.ver = start[4];
+    switch (m.ver) {
+        case BLOOM_VER0:
+            // Calculate checksum before we read any other data.
+            // Checksum is in the last "n" bytes.
+            cksum(&m.ck, ckcalc, mptr, dsize);
+            if (0 != sodium_memcmp(ckcalc, start+dsize, m.ck.size)) {
+                errno = EILSEQ;
+                goto fail0;
+            }
+            break;
+
+        case BLOOM_VER1:
+            r = verify_v1(&m, start, st.st_size, do_mmap && (flags & BLOOM_VERIFY_LAZY));
+            if (r < 0) {
+                errno = -r;
+                goto fail0;
+            }
+            dsize = m.datasize;
+
+            if (do_mmap && (flags & BLOOM_VERIFY_LAZY)) {
+                z = NEWZ(bloom_lazy);
+                z->base     = start;
+                z->mapsz    = st.st_size;
+                z->datasize = dsize;
+                z->sums     = start + dsize;
+                z->nblk     = nblocks(dsize);
+                z->cktype   = m.ck.type;
+                z->state    = NEWZA(atomic_uchar, z->nblk);
+            }
+            break;
+
+        default:
+            errno = EBADF;
+            goto fail0;
     }
 
     r = rdhdr(start, dsize, &m);
@@ -681,30 +1112,40 @@ Bloom_unmarshal(Bloom **p_b, const char *fname, uint32_t flags)
         goto fail0;
     }
 
+    // The directory must be good before we trust the offsets in it
+    if (z && (r = verify_range(z, HDRSIZ, 16 + (VECT_LEN(&m.offs) * 8))) < 0) {
+        errno = -r;
+        goto fail0;
+    }
+
     /*
      * Now we have everything we need to build out the filters.
      * rdhdr() has already allocated the filter memory. We need to
      * decode it.
      */
-    if (m.b->typ == BLOOM_TYPE_SCALE) {
-        scalable_bloom *sb = m.b->filter;
-        offpair *o;
-        uint32_t i;
+    offpair *o;
+    uint32_t i;
 
-        VECT_FOR_EACHi(&m.offs, i, o) {
-            bloom *f = &sb->bfa[i];
+    VECT_FOR_EACHi(&m.offs, i, o) {
+        bloom *f = m.b->typ == BLOOM_TYPE_SCALE
+                        ? &((scalable_bloom *)m.b->filter)->bfa[i]
+                        : m.b->filter;
 
-            r = rdfilter(start, o, f, do_mmap);
-            if (r < 0) {
-                errno = -r;
-                goto fail0;
-            }
+        if (z && (r = verify_range(z, o->hdroff, FILT_HDRSIZ)) < 0) {
+            errno = -r;
+            goto fail0;
+        }
+
+        r = rdfilter(start, dsize, o, f, do_mmap);
+        if (r == 0 && !filter_fits(m.b->typ, f)) r = -EBADF;
+        if (r == 0 && m.b->typ == BLOOM_TYPE_COUNTING4) r = rdovf(start, dsize, o, f, z);
+        if (r < 0) {
+            errno = -r;
+            goto fail0;
         }
-    } else {
-        bloom   *f = m.b->filter;
-        offpair *o = &VECT_ELEM(&m.offs, 0);
 
-        rdfilter(start, o, f, do_mmap);
+        // 'k' of a blocked or cuckoo filter doesn't depend on 'e'
+        if (m.b->typ == BLOOM_TYPE_BLOCKED || m.b->typ == BLOOM_TYPE_CUCKOO) f->e = m.b->e;
     }
 
     VECT_FINI(&m.offs);
@@ -712,6 +1153,7 @@ Bloom_unmarshal(Bloom **p_b, const char *fname, uint32_t flags)
     assert(p_b);
     *p_b = m.b;
 
+    if (z) __bloom_set_lazy(m.b, z);
     if (!do_mmap) munmap(mptr, st.st_size);
 
 
@@ -726,6 +1168,10 @@ fail0:
     VECT_FINI(&m.offs);
     munmap(mptr, st.st_size);
     if (m.b) __free_bloom(m.b);
+    if (z) {
+        DEL(z->state);
+        DEL(z);
+    }
 
 fail:
     r = -errno;
@@ -734,3 +1180,58 @@ fail:
 }
 
 
+/*
+ * Lazy verification
+ */
+
+int
+__bloom_verify_block(bloom_lazy *z, uint64_t blk)
+{
+    checksummer ck = Checksums[z->cktype];
+    int ok = blk_one(&ck, z->base, z->datasize, z->sums, blk, 1);
+    unsigned char st = BLOOM_BLK_UNVERIFIED;
+
+    // Many threads may verify a block at the same time; count it
+    // as bad just once.
+    if (atomic_compare_exchange_strong(&z->state[blk], &st, ok ? BLOOM_BLK_GOOD : BLOOM_BLK_BAD)) {
+        if (!ok) atomic_fetch_add(&z->bad, 1);
+    }
+    return ok;
+}
+
+
+void
+__bloom_lazy_free(bloom_lazy *z)
+{
+    if (!z) return;
+
+    munmap(z->base, z->mapsz);
+    DEL(z->state);
+    DEL(z);
+}
+
+
+// Verify the blocks of 'b' that weren't verified yet
+int
+Bloom_verify(Bloom *b, int nthreads)
+{
+    bloom_lazy *z = __bloom_get_lazy(b);
+
+    if (!z) return 0;
+
+    blkrun br = {
+        .ck       = Checksums[z->cktype],
+        .base     = z->base,
+        .datasize = z->datasize,
+        .sums     = z->sums,
+        .state    = z->state,
+        .verify   = 1,
+    };
+
+    uint64_t bad = blk_run(&br, nthreads);
+
+    if (bad) atomic_fetch_add(&z->bad, bad);
+    return atomic_load(&z->bad) ? -EILSEQ : 0;
+}
+
+/* EOF */
@@ -0,0 +1,319 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * bloom_merge.c - Union and intersection of bloom filters.
+ *
+ * Copyright (c) 2025 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  Two filters can be merged if they have the same type, 'm', 'k'
+ *    and salt - i.e., one was made from the other with
+ *    Bloom_new_like(). Only standard (non-scalable) and blocked
+ *    filters can be merged.
+ *
+ * o  The bitmaps are combined with the widest vectors the CPU has
+ *    (AVX-512, AVX2 or 64-bit words) in chunks small enough to stay
+ *    in L2; for large bitmaps the chunks are handed out to a pool
+ *    of threads (see posix/job.h).
+ *
+ * o  The union of disjoint shards has exactly the sum of their
+ *    elements; so that is what we record. The number of elements
+ *    in an intersection can't be known; we estimate it from the
+ *    number of bits set in the result [1].
+ *
+ * [1] Swamidass & Baldi, Mathematical correction for fingerprint
+ *     similarity measures to improve chemical retrieval.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <assert.h>
+
+#include "utils/utils.h"
+#include "utils/bloom.h"
+#include "fast/simd.h"
+#include "posix/job.h"
+
+#include "bloom_internal.h"
+
+#define MERGE_OR        0
+#define MERGE_AND       1
+
+// Bytes processed at a time - small enough to stay in L2 for the
+// popcount that follows.
+#define MERGE_CHUNK     (64 * 1024)
+
+// Bitmaps smaller than this aren't worth the threads.
+#define MERGE_MT_MIN    (4 * 1024 * 1024)
+
+
+typedef void (*merge_fp)(uint64_t *d, const uint64_t *s, size_t nw, int op);
+
+
+static void
+merge64(uint64_t *d, const uint64_t *s, size_t nw, int op)
+{
+    size_t i;
+
+    if (op == MERGE_OR) {
+        for (i = 0; i < nw; i++) d[i] |= s[i];
+    } else {
+        for (i = 0; i < nw; i++) d[i] &= s[i];
+    }
+}
+
+
+static uint64_t
+popcount64(const uint64_t *d, size_t nw)
+{
+    uint64_t n = 0;
+    size_t i;
+
+    for (i = 0; i < nw; i++) n += __builtin_popcountll(d[i]);
+    return n;
+}
+
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__amd64__)
+
+static SIMD_TARGET_AVX2 void
+merge256(uint64_t *d, const uint64_t *s, size_t nw, int op)
+{
+    size_t i;
+
+    // 4 words per vector
+    for (i = 0; i + 4 <= nw; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)&d[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i *)&s[i]);
+
+        a = op == MERGE_OR ? _mm256_or_si256(a, b) : _mm256_and_si256(a, b);
+        _mm256_storeu_si256((__m256i *)&d[i], a);
+    }
+    merge64(&d[i], &s[i], nw - i, op);
+}
+
+
+static SIMD_TARGET_AVX512 void
+merge512(uint64_t *d, const uint64_t *s, size_t nw, int op)
+{
+    size_t i;
+
+    // 8 words per vector
+    for (i = 0; i + 8 <= nw; i += 8) {
+        __m512i a = _mm512_loadu_si512((const void *)&d[i]);
+        __m512i b = _mm512_loadu_si512((const void *)&s[i]);
+
+        a = op == MERGE_OR ? _mm512_or_si512(a, b) : _mm512_and_si512(a, b);
+        _mm512_storeu_si512((void *)&d[i], a);
+    }
+    merge64(&d[i], &s[i], nw - i, op);
+}
+
+
+// every CPU with AVX2 has popcnt
+static __attribute__((target("popcnt"))) uint64_t
+popcount_hw(const uint64_t *d, size_t nw)
+{
+    return popcount64(d, nw);
+}
+
+#endif // x86_64
+
+
+/*
+ * State shared by all the workers
+ */
+struct merge
+{
+    uint64_t       *d;
+    const uint64_t *s;
+    int             op;
+    merge_fp        merge;
+    uint64_t      (*popcount)(const uint64_t *, size_t);
+};
+typedef struct merge merge;
+
+
+// A piece of the bitmap for one worker
+struct piece
+{
+    size_t   off;       // first word
+    size_t   nw;        // number of words
+    uint64_t bits;      // bits set in the result
+};
+typedef struct piece piece;
+
+
+static void
+merge_piece(merge *m, piece *p)
+{
+    const size_t step = MERGE_CHUNK / 8;
+    size_t i;
+
+    p->bits = 0;
+    for (i = 0; i < p->nw; i += step) {
+        size_t    n = (p->nw - i) > step ? step : (p->nw - i);
+        uint64_t *d = m->d + p->off + i;
+
+        m->merge(d, m->s + p->off + i, n, m->op);
+        if (m->op == MERGE_AND) p->bits += m->popcount(d, n);
+    }
+}
+
+
+static int
+merge_job(void *ctx, void *job, int cpu)
+{
+    USEARG(cpu);
+
+    merge_piece(ctx, job);
+    return 0;
+}
+
+
+// Run the merge over 'nw' words with 'nthreads' workers; return the
+// number of bits set in the result (AND only).
+static uint64_t
+merge_all(merge *m, size_t nw, int nthreads)
+{
+    piece one = { .off = 0, .nw = nw, .bits = 0 };
+
+    if (nthreads <= 1 || (nw * 8) < MERGE_MT_MIN) {
+        merge_piece(m, &one);
+        return one.bits;
+    }
+
+    // a few pieces per thread to even out the load
+    size_t np  = nthreads * 4;
+    size_t per = _ALIGN_UP((nw + np - 1) / np, 8);
+    piece *pv  = NEWZA(piece, np);
+    job_manager jm;
+    uint64_t bits = 0;
+    size_t i, n = 0;
+
+    if (!pv || job_manager_init(&jm, nthreads, merge_job, m) < 0) {
+        DEL(pv);
+        merge_piece(m, &one);
+        return one.bits;
+    }
+
+    for (i = 0; i < nw; i += per, n++) {
+        piece *p = &pv[n];
+
+        p->off = i;
+        p->nw  = (nw - i) > per ? per : (nw - i);
+        job_manager_submit_job(&jm, p);
+    }
+
+    job_manager_wait(&jm);
+    job_manager_destroy(&jm);
+
+    for (i = 0; i < n; i++) bits += pv[i].bits;
+
+    DEL(pv);
+    return bits;
+}
+
+
+// Return 0 if 'a' and 'b' can be merged, -errno otherwise
+static int
+compatible(Bloom *a, Bloom *b)
+{
+    if (a->typ != BLOOM_TYPE_QUICK && a->typ != BLOOM_TYPE_BLOCKED) return -ENOTSUP;
+    if (a->typ != b->typ) return -EINVAL;
+
+    bloom *x = a->filter,
+          *y = b->filter;
+
+    if (x->m != y->m || x->k != y->k || x->salt != y->salt) return -EINVAL;
+    if (x->bmsize != y->bmsize) return -EINVAL;
+
+    // bitmaps are a whole number of 64-bit words
+    assert((x->bmsize % 8) == 0);
+
+    // an mmap'd bitmap is read-only; nothing must be adding to
+    // either filter
+    if (x->flags & BLOOM_BITMAP_MMAP) return -EROFS;
+    if (x->ctr || y->ctr)             return -EBUSY;
+    return 0;
+}
+
+
+static int
+bloom_merge(Bloom *dst, Bloom *src, int op, int nthreads)
+{
+    int r = compatible(dst, src);
+    if (r < 0) return r;
+
+    bloom *d = dst->filter,
+          *s = src->filter;
+    merge  m = {
+        .d        = (uint64_t *)d->bitmap,
+        .s        = (const uint64_t *)s->bitmap,
+        .op       = op,
+        .merge    = merge64,
+        .popcount = popcount64,
+    };
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__amd64__)
+    switch (simd_isa()) {
+        case SIMD_ISA_512:
+            m.merge    = merge512;
+            m.popcount = popcount_hw;
+            break;
+        case SIMD_ISA_256:
+            m.merge    = merge256;
+            m.popcount = popcount_hw;
+            break;
+        default:
+            break;
+    }
+#endif
+
+    uint64_t mx   = d->size < s->size ? d->size : s->size;
+    uint64_t bits = merge_all(&m, d->bmsize / 8, nthreads);
+
+    if (op == MERGE_OR) {
+        d->size += s->size;
+    } else {
+        // Each element sets one of 'bits/k' bits in each of the
+        // 'k' partitions (words of a block for the blocked filter).
+        double nb = _d(d->bmsize) * 8.0;
+        double p  = _d(d->m) * _d(d->k);
+
+        if (dst->typ == BLOOM_TYPE_BLOCKED) p = nb;
+
+        double f = _d(bits) / p;
+        d->size  = f < 1.0 ? _U64(-(p / _d(d->k)) * log(1.0 - f)) : mx;
+        if (d->size > mx) d->size = mx;
+    }
+    return 0;
+}
+
+
+int
+Bloom_union(Bloom *dst, Bloom *src, int nthreads)
+{
+    return bloom_merge(dst, src, MERGE_OR, nthreads);
+}
+
+
+int
+Bloom_intersect(Bloom *dst, Bloom *src, int nthreads)
+{
+    return bloom_merge(dst, src, MERGE_AND, nthreads);
+}
+
+/* EOF */
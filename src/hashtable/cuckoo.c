@@ -0,0 +1,410 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * cuckoo.c - Cuckoo filter behind the Bloom interface.
+ *
+ * Copyright (c) 2025 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  A key is a 'k' bit fingerprint in one of two buckets [1]: 'i1'
+ *    from its hash and i2 = i1 ^ hash(fingerprint). Thus either
+ *    bucket can be found from the other and the fingerprint alone -
+ *    which is what lets a full bucket move ("kick") one of its
+ *    fingerprints to its other bucket.
+ *
+ * o  Each bucket has BLOOM_CUCKOO_WAYS slots; a zero fingerprint
+ *    is an empty slot. With 4 slots per bucket the table fills to
+ *    ~95% before an insert fails - and the FP rate is about
+ *    8 * load / 2^k.
+ *
+ * o  The fingerprints are 8, 12 or 16 bits - the smallest that
+ *    meets the requested FP rate. A bucket is read with one 64-bit
+ *    load and spread out to 4 16-bit lanes; so both buckets of a
+ *    key are searched with one 128-bit compare (fast/simd.h)
+ *    regardless of the fingerprint size.
+ *
+ * o  When an insert runs out of kicks, the fingerprint in hand
+ *    goes to the victim stash; the filter is full after that and
+ *    further inserts fail with -ENOSPC. Removing a key makes room
+ *    for the stashed fingerprint. The stash is kept in the bitmap;
+ *    so marshaling (bloom_marshal.c) needs no special casing.
+ *
+ * o  Adding a key twice stores it twice; it must be removed twice.
+ *    Removing a key that was never added can remove another key
+ *    with the same fingerprint.
+ *
+ * [1] Cuckoo Filter: Practically Better Than Bloom
+ *     Fan, Andersen, Kaminsky & Mitzenmacher. CoNEXT 2014.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "utils/utils.h"
+#include "utils/bloom.h"
+#include "utils/arc4random.h"
+#include "fast/simd.h"
+#include "fast/encdec.h"
+
+#include "bloom_internal.h"
+
+
+// Number of times a fingerprint is moved before it is stashed
+#define CUCKOO_MAXKICK      500
+
+// Fill ratio the table is sized for
+#define CUCKOO_LOAD         0.95
+
+// Victim stash: the 'used' bit is above the fingerprint
+#define STASH_USED          (_U32(1) << 31)
+
+#define LANES16             0x0001000100010001ULL
+
+
+// Spread 4 8-bit fingerprints to 16-bit lanes
+static inline uint64_t
+spread8(uint64_t x)
+{
+    x &= 0xffffffff;
+    x  = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+    x  = (x | (x << 8))  & 0x00ff00ff00ff00ffULL;
+    return x;
+}
+
+
+// Spread 4 12-bit fingerprints to 16-bit lanes
+static inline uint64_t
+spread12(uint64_t x)
+{
+    x = (x & 0xffffff) | ((x & 0xffffff000000ULL) << 8);
+    x = (x & 0x00000fff00000fffULL) | ((x & 0x00fff00000fff000ULL) << 4);
+    return x;
+}
+
+
+// Return bucket 'i' of 'b' as 4 16-bit lanes
+static inline uint64_t
+bucket_get(const bloom *b, uint64_t i)
+{
+    uint64_t x = dec_LE_u64(b->bitmap + (i * cuckoo_bucket_size(b->k)));
+
+    switch (b->k) {
+        case 8:  return spread8(x);
+        case 12: return spread12(x);
+        default: return x;
+    }
+}
+
+
+// Put 'fp' in slot 's' of bucket 'i'
+static void
+bucket_put(bloom *b, uint64_t i, uint32_t s, uint64_t fp)
+{
+    uint8_t *p = b->bitmap + (i * cuckoo_bucket_size(b->k));
+    uint8_t  z[8];
+    uint64_t x;
+
+    switch (b->k) {
+        case 8:
+            p[s] = fp;
+            break;
+
+        case 12:
+            // 6 bytes of bucket and the next 2 bytes - which we
+            // write back as they were.
+            x  = dec_LE_u64(p);
+            x &= ~(_U64(0xfff) << (12 * s));
+            x |= fp << (12 * s);
+            enc_LE_u64(z, x);
+            memcpy(p, z, 6);
+            break;
+
+        default:
+            enc_LE_u16(p + (2 * s), fp);
+            break;
+    }
+}
+
+
+/*
+ * Return the slots of buckets 'b1' and 'b2' that hold 'fp': bit
+ * 2*s is set if slot 's' matches; slots 0-3 are in 'b1' and 4-7 in
+ * 'b2'.
+ */
+static inline uint32_t
+cuckoo_match(uint64_t b1, uint64_t b2, uint64_t fp)
+{
+#ifdef __NO_SIMD__
+    uint32_t r = 0;
+    int s;
+
+    for (s = 0; s < BLOOM_CUCKOO_WAYS; s++) {
+        if (((b1 >> (16 * s)) & 0xffff) == fp) r |= 1 << (2 * s);
+        if (((b2 >> (16 * s)) & 0xffff) == fp) r |= 1 << (2 * s + 8);
+    }
+    return r;
+#else
+    uint64_t      f = fp * LANES16;
+    simd_vec128_t v = SIMD_SET_EPI64X(b2, b1);
+    uint32_t      m = SIMD_MOVEMASK_EPI8(SIMD_CMPEQ_EPI8(v, SIMD_SET_EPI64X(f, f)));
+
+    // a 16-bit lane matches if both its bytes do
+    return m & (m >> 1) & 0x5555;
+#endif
+}
+
+
+// The other bucket of fingerprint 'fp' in bucket 'i'
+static inline uint64_t
+cuckoo_alt(const bloom *b, uint64_t i, uint64_t fp)
+{
+    return (i ^ (fp * 0x5bd1e995)) & (b->m - 1);
+}
+
+
+// Bucket and fingerprint of key 'val'
+static inline uint64_t
+cuckoo_index(const bloom *b, uint64_t val, uint64_t *p_fp)
+{
+    uint64_t h  = hash_val(val, b->salt);
+    uint64_t fp = (h >> 32) & ((_U64(1) << b->k) - 1);
+
+    *p_fp = fp ? fp : 1;
+    return h & (b->m - 1);
+}
+
+
+// Read the victim stash; return true if it has a fingerprint.
+static inline int
+stash_get(const bloom *b, uint64_t *p_i, uint64_t *p_fp)
+{
+    const uint8_t *p = b->bitmap + cuckoo_stash_off(b->m, b->k);
+    uint32_t w = dec_LE_u32(p + 8);
+
+    *p_i  = dec_LE_u64(p);
+    *p_fp = w & 0xffff;
+    return !!(w & STASH_USED);
+}
+
+
+static inline void
+stash_put(bloom *b, uint64_t i, uint64_t fp, int used)
+{
+    uint8_t *p = b->bitmap + cuckoo_stash_off(b->m, b->k);
+
+    enc_LE_u64(p, used ? i : 0);
+    enc_LE_u32(p + 8, used ? (STASH_USED | fp) : 0);
+}
+
+
+// Return true if the stash holds 'fp' from bucket 'i1' or 'i2'
+static inline int
+stash_match(const bloom *b, uint64_t i1, uint64_t i2, uint64_t fp)
+{
+    uint64_t si, sfp;
+
+    if (!stash_get(b, &si, &sfp)) return 0;
+    return sfp == fp && (si == i1 || si == i2);
+}
+
+
+/*
+ * Place 'fp' in bucket 'i' or its other bucket; kick out other
+ * fingerprints to make room if both are full. The fingerprint
+ * that is left when we run out of kicks is stashed.
+ */
+static void
+cuckoo_place(bloom *b, uint64_t i, uint64_t fp)
+{
+    uint64_t i2 = cuckoo_alt(b, i, fp);
+    uint64_t r  = ((i * 0x9e3779b97f4a7c15ULL) ^ fp) | 1;
+    uint32_t e  = cuckoo_match(bucket_get(b, i), bucket_get(b, i2), 0);
+    int n;
+
+    b->size++;
+    if (likely(e)) {
+        uint32_t s = __builtin_ctz(e) / 2;
+
+        bucket_put(b, s < BLOOM_CUCKOO_WAYS ? i : i2, s % BLOOM_CUCKOO_WAYS, fp);
+        return;
+    }
+
+    if (r & 2) i = i2;
+    for (n = 0; n < CUCKOO_MAXKICK; n++) {
+        // xorshift: pick the slot to kick out
+        r ^= r << 13;
+        r ^= r >> 7;
+        r ^= r << 17;
+
+        uint32_t s   = r % BLOOM_CUCKOO_WAYS;
+        uint64_t bk  = bucket_get(b, i);
+        uint64_t old = (bk >> (16 * s)) & 0xffff;
+
+        bucket_put(b, i, s, fp);
+        fp = old;
+        i  = cuckoo_alt(b, i, fp);
+
+        bk = bucket_get(b, i);
+        if ((e = cuckoo_match(bk, bk, 0) & 0xff)) {
+            bucket_put(b, i, __builtin_ctz(e) / 2, fp);
+            return;
+        }
+    }
+
+    stash_put(b, i, fp, 1);
+}
+
+
+int
+__cuckoo_insert(bloom *b, uint64_t val)
+{
+    uint64_t si, sfp, fp;
+
+    if (stash_get(b, &si, &sfp)) return -ENOSPC;
+
+    uint64_t i = cuckoo_index(b, val, &fp);
+
+    cuckoo_place(b, i, fp);
+    return 0;
+}
+
+
+void
+__cuckoo_probe(bloom *b, uint64_t val)
+{
+    __cuckoo_insert(b, val);
+}
+
+
+int
+__cuckoo_find(bloom *b, uint64_t val)
+{
+    uint64_t fp;
+    uint64_t i1 = cuckoo_index(b, val, &fp);
+    uint64_t i2 = cuckoo_alt(b, i1, fp);
+
+    if (cuckoo_match(bucket_get(b, i1), bucket_get(b, i2), fp)) return 1;
+    return stash_match(b, i1, i2, fp);
+}
+
+
+int
+__cuckoo_remove(bloom *b, uint64_t val)
+{
+    uint64_t fp, si, sfp;
+    uint64_t i1 = cuckoo_index(b, val, &fp);
+    uint64_t i2 = cuckoo_alt(b, i1, fp);
+    uint32_t e  = cuckoo_match(bucket_get(b, i1), bucket_get(b, i2), fp);
+
+    if (e) {
+        uint32_t s = __builtin_ctz(e) / 2;
+
+        bucket_put(b, s < BLOOM_CUCKOO_WAYS ? i1 : i2, s % BLOOM_CUCKOO_WAYS, 0);
+        b->size--;
+
+        // There's room now for the stashed fingerprint
+        if (stash_get(b, &si, &sfp)) {
+            stash_put(b, 0, 0, 0);
+            b->size--;
+            cuckoo_place(b, si, sfp);
+        }
+        return 1;
+    }
+
+    if (stash_match(b, i1, i2, fp)) {
+        stash_put(b, 0, 0, 0);
+        b->size--;
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Lookup of a lazily verified filter (see bloom_marshal.c): a key
+ * whose buckets are in a bad block is "maybe present".
+ */
+int
+__cuckoo_find_lazy(bloom *b, uint64_t val)
+{
+    uint64_t fp;
+    uint64_t i1 = cuckoo_index(b, val, &fp);
+    uint64_t i2 = cuckoo_alt(b, i1, fp);
+    uint64_t bs = cuckoo_bucket_size(b->k);
+
+    if (!bloom_lazy_touch(b->lazy, b->bitmap + (i1 * bs)))     return 1;
+    if (!bloom_lazy_touch(b->lazy, b->bitmap + (i1 * bs) + 7)) return 1;
+    if (!bloom_lazy_touch(b->lazy, b->bitmap + (i2 * bs)))     return 1;
+    if (!bloom_lazy_touch(b->lazy, b->bitmap + (i2 * bs) + 7)) return 1;
+
+    if (cuckoo_match(bucket_get(b, i1), bucket_get(b, i2), fp)) return 1;
+
+    const uint8_t *st = b->bitmap + cuckoo_stash_off(b->m, b->k);
+    if (!bloom_lazy_touch(b->lazy, st))                          return 1;
+    if (!bloom_lazy_touch(b->lazy, st + BLOOM_CUCKOO_STASH - 1)) return 1;
+
+    return stash_match(b, i1, i2, fp);
+}
+
+
+char *
+__cuckoo_desc(bloom *b, char *buf, size_t bsiz)
+{
+    uint64_t si, sfp;
+    char sz[128];
+
+    humanize_size(sz, sizeof sz, b->bmsize);
+
+    snprintf(buf, bsiz, "cuckoo-filter: FP-prob: %5.4f: %" PRIu64 " buckets x %d x %" PRIu64 "-bit fingerprints = %s; "
+                        "%" PRIu64 " elem (load %4.2f)%s", b->e,
+                        b->m, BLOOM_CUCKOO_WAYS, b->k, sz, b->size,
+                        _d(b->size) / _d(b->m * BLOOM_CUCKOO_WAYS),
+                        stash_get(b, &si, &sfp) ? "; full" : "");
+
+    return buf;
+}
+
+
+/*
+ * Size the filter for 'n' keys at 'e': the fingerprint is the
+ * smallest of 8, 12 or 16 bits with 2 * WAYS / 2^k <= e. A rate
+ * that even 16 bits can't meet is an error.
+ */
+bloom *
+__cuckoo_init(bloom *b, uint64_t n, double e)
+{
+    double   need = ceil(log2((2.0 * BLOOM_CUCKOO_WAYS) / e));
+    uint64_t k    = need <= 8.0 ? 8 : need <= 12.0 ? 12 : 16;
+    uint64_t m    = _U64(ceil(_d(n) / (BLOOM_CUCKOO_WAYS * CUCKOO_LOAD)));
+
+    if (!(need <= 16.0)) return 0;
+
+    m = m < 2 ? 2 : NEXTPOW2(m);
+
+    b->k      = k;
+    b->m      = m;
+    b->e      = e;
+    b->bmsize = cuckoo_stash_off(m, k) + BLOOM_CUCKOO_STASH;
+    b->bitmap = __alloc_bitmap(b->bmsize);
+    b->flags  = 0;
+    b->size   = 0;
+    if (!b->bitmap) return 0;
+
+    arc4random_buf(&b->salt, sizeof b->salt);
+    return b;
+}
+
+/* EOF */
@@ -0,0 +1,428 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * fast-ht-flat.c - Flat, open addressed engine for fast-ht
+ *
+ * Copyright (c) 2015 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o The table is a power-of-two array of slots (key + value) and
+ *   a parallel array of control bytes - one per slot. A free slot
+ *   has the high bit of its control byte set (FLAT_EMPTY); an
+ *   occupied slot holds the top 7 bits of the hashed key.
+ *
+ * o A key is placed in the first free slot at or after its "home"
+ *   slot (linear probing). Lookups load FASTHT_GROUP control bytes
+ *   at a time starting at the home slot and compare them against
+ *   the 7-bit hash with a single SIMD compare; the search ends at
+ *   the first group that has a free slot.
+ *
+ * o The first FASTHT_GROUP control bytes are mirrored past the end
+ *   of the control array; thus a group load that runs past the
+ *   last slot sees the first slots without any special casing.
+ *
+ * o Deletes shift the subsequent entries of the cluster back into
+ *   the hole ("backward shift deletion"): a later entry moves if
+ *   the hole is between its home slot and where it sits now. Thus
+ *   there are no tombstones and a lookup never probes further than
+ *   it would've had the deleted key never been inserted.
+ *
+ * o The table is doubled in one shot with a fresh salt when the
+ *   fill exceeds 'maxfill' and halved when it drops below
+ *   'minfill'.
+ *
+ * o A table returned by ht_unmarshal() with FASTHT_MMAP uses the
+ *   control bytes and slots of the (private) file mapping; the
+ *   first resize replaces them and unmaps the file.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+
+#include "fast/simd.h"
+#include "utils/utils.h"
+#include "utils/fast-ht.h"
+#include "fastht_internal.h"
+
+
+#define FLAT_EMPTY      0x80
+
+// home slot and the 7-bit control byte of a hashed key
+#define __home(h, hv)   ((hv) & ((h)->n - 1))
+#define __ctrl(hv)      _U8((hv) >> 57)
+
+
+#ifdef __NO_SIMD__
+
+// bitmask of the slots in the group at 'c' whose control is 'h2'
+static inline uint32_t
+__group_match(const uint8_t *c, uint8_t h2)
+{
+    uint32_t m = 0;
+
+    for (int i = 0; i < FASTHT_GROUP; i++) {
+        if (c[i] == h2) m |= 1 << i;
+    }
+    return m;
+}
+
+// bitmask of the free slots in the group at 'c'
+static inline uint32_t
+__group_empty(const uint8_t *c)
+{
+    uint32_t m = 0;
+
+    for (int i = 0; i < FASTHT_GROUP; i++) {
+        if (c[i] & FLAT_EMPTY) m |= 1 << i;
+    }
+    return m;
+}
+
+#else
+
+static inline uint32_t
+__group_match(const uint8_t *c, uint8_t h2)
+{
+    simd_vec128_t g = SIMD_LOADU_128(c);
+
+    return SIMD_MOVEMASK_EPI8(SIMD_CMPEQ_EPI8(g, SIMD_SET1_EPI8(h2)));
+}
+
+// FLAT_EMPTY is the high bit: movemask gives us the free slots
+static inline uint32_t
+__group_empty(const uint8_t *c)
+{
+    return SIMD_MOVEMASK_EPI8(SIMD_LOADU_128(c));
+}
+
+#endif // __NO_SIMD__
+
+
+// Set the control byte of slot 'i' (and its mirror)
+static inline void
+__set_ctrl(ht *h, uint64_t i, uint8_t c)
+{
+    h->ctrl[i] = c;
+    if (i < FASTHT_GROUP) h->ctrl[h->n + i] = c;
+}
+
+
+// Allocate 'n' free slots
+static void
+__flat_alloc(ht *h, uint64_t n)
+{
+    h->n    = n;
+    h->ctrl = __alloc(n + FASTHT_GROUP);
+    h->slot = __NEWZA(ht_slot, n);
+    memset(h->ctrl, FLAT_EMPTY, n + FASTHT_GROUP);
+}
+
+
+// Find 'k'; return its slot or -1 if it isn't in the table.
+static inline int64_t
+__flat_lookup(ht *h, uint64_t k)
+{
+    uint64_t hv  = __hash64(k, h->salt);
+    uint64_t msk = h->n - 1;
+    uint64_t pos = __home(h, hv);
+    uint8_t  h2  = __ctrl(hv);
+
+    for (;;) {
+        const uint8_t *c = &h->ctrl[pos];
+        uint32_t m = __group_match(c, h2);
+
+        while (m) {
+            uint64_t i = (pos + __builtin_ctz(m)) & msk;
+
+            if (likely(h->slot[i].hk == k)) return i;
+            m &= m - 1;
+        }
+
+        if (likely(__group_empty(c))) return -1;
+        pos = (pos + FASTHT_GROUP) & msk;
+    }
+}
+
+
+// Free the control bytes and slots; the ones that live in an
+// unmarshaled image are unmapped along with the image.
+static void
+__flat_free(ht *h, uint8_t *ctrl, ht_slot *slot)
+{
+    if (h->map) {
+        munmap(h->map, h->mapsz);
+        h->map   = 0;
+        h->mapsz = 0;
+        return;
+    }
+
+    DEL(ctrl);
+    DEL(slot);
+}
+
+
+// Put 'k' in the first free slot at or after its home. The caller
+// guarantees that 'k' isn't in the table.
+static inline void
+__flat_insert_quick(ht *h, uint64_t k, void *v)
+{
+    uint64_t hv   = __hash64(k, h->salt);
+    uint64_t msk  = h->n - 1;
+    uint64_t home = __home(h, hv);
+    uint64_t pos  = home;
+    uint32_t e;
+
+    while (!(e = __group_empty(&h->ctrl[pos]))) {
+        pos = (pos + FASTHT_GROUP) & msk;
+    }
+
+    uint64_t i = (pos + __builtin_ctz(e)) & msk;
+    uint64_t d = (i - home) & msk;
+
+    h->slot[i].hk = k;
+    h->slot[i].hv = v;
+    __set_ctrl(h, i, __ctrl(hv));
+
+    if (d > h->maxn) h->maxn = d;
+}
+
+
+// Remove the entry in slot 'i' and shift the rest of its cluster
+// back to fill the hole.
+static void
+__flat_erase(ht *h, uint64_t i)
+{
+    uint64_t msk = h->n - 1;
+    uint64_t j   = i;
+
+    for (;;) {
+        j = (j + 1) & msk;
+
+        uint8_t c = h->ctrl[j];
+        if (c & FLAT_EMPTY) break;
+
+        // 'j' can move to 'i' unless its home is in (i, j]
+        uint64_t home = __home(h, __hash64(h->slot[j].hk, h->salt));
+        if (((j - home) & msk) >= ((j - i) & msk)) {
+            h->slot[i] = h->slot[j];
+            __set_ctrl(h, i, c);
+            i = j;
+        }
+    }
+
+    h->slot[i].hk = 0;
+    h->slot[i].hv = 0;
+    __set_ctrl(h, i, FLAT_EMPTY);
+    h->nodes--;
+    h->fill--;
+}
+
+
+// Rehash all the entries into 'n' slots
+static void
+__flat_resize(ht *h, uint64_t n)
+{
+    uint8_t *oc = h->ctrl;
+    ht_slot *os = h->slot;
+    uint64_t on = h->n;
+
+    if (n > on) h->splits++;
+    else        h->shrinks++;
+
+    // A fresh salt avoids the pathological clustering of inserting
+    // keys in the hash order of the old table.
+    h->salt = rand64();
+    h->maxn = 0;
+    __flat_alloc(h, n);
+
+    for (uint64_t i = 0; i < on; i++) {
+        if (!(oc[i] & FLAT_EMPTY)) __flat_insert_quick(h, os[i].hk, os[i].hv);
+    }
+
+    __flat_free(h, oc, os);
+}
+
+
+void
+htflat_init(ht *h, uint64_t n)
+{
+    if (n < FASTHT_GROUP)           n = FASTHT_GROUP;
+    if (h->minn < FASTHT_GROUP)     h->minn = FASTHT_GROUP;
+    if (h->maxfill > FASTHT_FLAT_MAXFILL) h->maxfill = FASTHT_FLAT_MAXFILL;
+
+    __flat_alloc(h, n);
+}
+
+
+void
+htflat_fini(ht *h)
+{
+    __flat_free(h, h->ctrl, h->slot);
+}
+
+
+void
+htflat_insert_quick(ht *h, uint64_t k, void *v)
+{
+    __flat_insert_quick(h, k, v);
+}
+
+
+void*
+htflat_probe(ht *h, uint64_t k, void *v)
+{
+    uint64_t hv   = __hash64(k, h->salt);
+    uint64_t msk  = h->n - 1;
+    uint64_t home = __home(h, hv);
+    uint64_t pos  = home;
+    uint8_t  h2   = __ctrl(hv);
+    uint32_t e;
+
+    for (;;) {
+        const uint8_t *c = &h->ctrl[pos];
+        uint32_t m = __group_match(c, h2);
+
+        while (m) {
+            uint64_t i = (pos + __builtin_ctz(m)) & msk;
+
+            if (likely(h->slot[i].hk == k)) return h->slot[i].hv;
+            m &= m - 1;
+        }
+
+        if (likely(e = __group_empty(c))) break;
+        pos = (pos + FASTHT_GROUP) & msk;
+    }
+
+    uint64_t i = (pos + __builtin_ctz(e)) & msk;
+    uint64_t d = (i - home) & msk;
+
+    h->slot[i].hk = k;
+    h->slot[i].hv = v;
+    __set_ctrl(h, i, h2);
+
+    if (d > h->maxn) h->maxn = d;
+
+    h->nodes++;
+    h->fill++;
+    if (((h->fill * 100)/h->n) > h->maxfill) {
+        __flat_resize(h, h->n * 2);
+    }
+    return 0;
+}
+
+
+int
+htflat_find(ht *h, uint64_t k, void **p_ret)
+{
+    int64_t i = __flat_lookup(h, k);
+
+    if (i < 0) return 0;
+
+    if (p_ret) *p_ret = h->slot[i].hv;
+    return 1;
+}
+
+
+int
+htflat_replace(ht *h, uint64_t k, void *v)
+{
+    int64_t i = __flat_lookup(h, k);
+
+    if (i < 0) return 0;
+
+    h->slot[i].hv = v;
+    return 1;
+}
+
+
+int
+htflat_remove(ht *h, uint64_t k, void **p_ret)
+{
+    int64_t i = __flat_lookup(h, k);
+
+    if (i < 0) return 0;
+
+    if (p_ret) *p_ret = h->slot[i].hv;
+    __flat_erase(h, i);
+
+    // time to shrink?
+    if (h->minfill && h->n > h->minn) {
+        uint64_t fpct = (h->fill * 100)/h->n;
+
+        if (fpct < h->minfill) {
+            __flat_resize(h, h->n / 2);
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Iterator: the walk starts at a free slot and goes around the
+ * table once. A backward shift never moves an entry across a free
+ * slot; so an entry moved by ht_iter_remove() only ever moves into
+ * the slot just removed - which the walk then visits again. And
+ * nothing moves into the start slot; thus no entry is seen twice.
+ */
+void
+htflat_iter_init(ht_iter *it)
+{
+    ht *h = it->h;
+    uint64_t i;
+
+    for (i = 0; i < h->n; i++) {
+        if (h->ctrl[i] & FLAT_EMPTY) break;
+    }
+
+    it->pos  = i;
+    it->end  = i + h->n;
+    it->last = 0;
+}
+
+
+int
+htflat_iter_next(ht_iter *it, uint64_t *p_key, void **p_val)
+{
+    ht *h = it->h;
+    uint64_t msk = h->n - 1;
+
+    while (it->pos < it->end) {
+        uint64_t i = it->pos++ & msk;
+
+        if (h->ctrl[i] & FLAT_EMPTY) continue;
+
+        it->last = i + 1;
+        if (p_key) *p_key = h->slot[i].hk;
+        if (p_val) *p_val = h->slot[i].hv;
+        return 1;
+    }
+    return 0;
+}
+
+
+int
+htflat_iter_remove(ht_iter *it)
+{
+    if (!it->last) return 0;
+
+    // revisit the slot: the next entry of the cluster may be
+    // shifted into it.
+    __flat_erase(it->h, it->last - 1);
+    it->pos--;
+    it->last = 0;
+    return 1;
+}
+
+/* EOF */
@@ -0,0 +1,343 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * fast-ht-marshal.c - Marshal/Unmarshal of fast-ht
+ *
+ * Copyright (c) 2015 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  The image is a flat table (see fast-ht-flat.c): it has no
+ *    pointers and a key is found at the same slot regardless of
+ *    where the image is mapped. Thus it can be served directly
+ *    from a mapping of the file.
+ * o  All encoded integers are in Little Endian order
+ * o  The control bytes and the slots each start on a page boundary
+ * o  All information is checksummed using SHA256
+ * o  Disk Layout:
+ *     - 44 byte header:
+ *        * magic         4 bytes [FSHT]
+ *        * version       1 byte
+ *        * reserved      3 bytes
+ *        * salt          8 bytes
+ *        * n slots       8 bytes
+ *        * n nodes       8 bytes
+ *        * maxfill       4 bytes
+ *        * minfill       4 bytes
+ *        * maxn          4 bytes (longest probe distance)
+ *     - padding to 4k boundary
+ *     - n + FASTHT_GROUP control bytes
+ *     - padding to 4k boundary
+ *     - n slots: 8 byte key followed by 8 byte value
+ *     - 32 byte SHA256 sum
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "utils/utils.h"
+#include "fast/encdec.h"
+#include "fast/byteorder.h"
+#include "utils/fast-ht.h"
+#include "fastht_internal.h"
+
+// Need libsodium to be installed.
+#include "sodium.h"
+
+/* Darwin doesn't have fdatasync() prototype */
+#ifdef __Darwin__
+extern int fdatasync(int);
+#endif // __Darwin__
+
+
+#define SHASIZE     crypto_hash_sha256_BYTES
+
+// Offsets and sizes of the image components
+struct layout
+{
+    uint64_t ctrl;      // offset of the control bytes
+    uint64_t slot;      // offset of the slots
+    uint64_t size;      // total file size
+};
+typedef struct layout layout;
+
+
+static inline uint64_t
+pagesz()
+{
+    return sysconf(_SC_PAGESIZE);
+}
+
+
+static void
+mklayout(layout *l, uint64_t n)
+{
+    uint64_t pg = pagesz();
+
+    l->ctrl = pg;
+    l->slot = l->ctrl + _ALIGN_UP(n + FASTHT_GROUP, pg);
+    l->size = l->slot + (n * sizeof(ht_slot)) + SHASIZE;
+}
+
+
+// Convert the slots between host and little endian order
+static void
+swab_slots(ht_slot *s, uint64_t n)
+{
+#ifdef __big_endian__
+    for (uint64_t i = 0; i < n; i++, s++) {
+        s->hk = __builtin_bswap64(s->hk);
+        s->hv = (void *)__builtin_bswap64((uint64_t)s->hv);
+    }
+#else
+    (void)s;
+    (void)n;
+#endif
+}
+
+
+static void
+cksum(uint8_t *out, uint8_t *buf, uint64_t sz)
+{
+    uint8_t sbuf[8];
+    crypto_hash_sha256_state h;
+
+    enc_LE_u64(sbuf, sz);
+    crypto_hash_sha256_init(&h);
+    crypto_hash_sha256_update(&h, sbuf, 8);
+    crypto_hash_sha256_update(&h, buf, sz - SHASIZE);
+    crypto_hash_sha256_final(&h, out);
+}
+
+
+static void
+wrhdr(uint8_t *p, ht *h)
+{
+    memcpy(p, "FSHT", 4);   p += 4;
+
+    // version #
+    *p = 1;                 p += 1;
+    p += 3; // padding
+
+    enc_LE_u64(p, h->salt);     p += 8;
+    enc_LE_u64(p, h->n);        p += 8;
+    enc_LE_u64(p, h->nodes);    p += 8;
+    enc_LE_u32(p, h->maxfill);  p += 4;
+    enc_LE_u32(p, h->minfill);  p += 4;
+    enc_LE_u32(p, h->maxn);     p += 4;
+}
+
+
+// Read and sanity check the header in a file of 'sz' bytes
+static int
+rdhdr(uint8_t *p, uint64_t sz, ht *h)
+{
+    if (memcmp(p, "FSHT", 4) != 0) return -EILSEQ;
+
+    p += 4;
+    if (*p != 1) return -EILSEQ;    // we only support version #1
+
+    p += 4;
+    h->salt    = dec_LE_u64(p); p += 8;
+    h->n       = dec_LE_u64(p); p += 8;
+    h->nodes   = dec_LE_u64(p); p += 8;
+    h->maxfill = dec_LE_u32(p); p += 4;
+    h->minfill = dec_LE_u32(p); p += 4;
+    h->maxn    = dec_LE_u32(p); p += 4;
+
+    if (h->n < FASTHT_GROUP || (h->n & (h->n - 1))) return -EILSEQ;
+    if (h->nodes >= h->n) return -EILSEQ;
+
+    layout l;
+    mklayout(&l, h->n);
+    if (l.size != sz) return -EINVAL;
+
+    return 0;
+}
+
+
+// Marshal ht 'h' to file 'fname'
+int
+ht_marshal(ht *h, const char *fname)
+{
+    char file[PATH_MAX];
+    int fd,
+        r = 0;
+    ht  t;
+
+    // 't' describes the image; its arrays live in the file.
+    memset(&t, 0, sizeof t);
+    t.maxfill = h->maxfill;
+    t.minfill = h->minfill;
+    t.nodes   = h->nodes;
+    if (h->flags & FASTHT_FLAT) {
+        t.n    = h->n;
+        t.salt = h->salt;
+        t.maxn = h->maxn;
+    } else {
+        if (t.maxfill > FASTHT_FLAT_MAXFILL) t.maxfill = FASTHT_FLAT_MAXFILL;
+
+        t.n    = NEXTPOW2(((h->nodes * 100) / t.maxfill) + 1);
+        t.salt = rand64();
+        if (t.n < FASTHT_GROUP) t.n = FASTHT_GROUP;
+    }
+
+    layout l;
+    mklayout(&l, t.n);
+
+    snprintf(file, sizeof file, "%s.tmp.XXXXXX", fname);
+    fd = mkostemp(file, 0);
+    if (fd < 0) return -errno;
+
+    if (ftruncate(fd, l.size) < 0) {
+        r = errno;
+        goto fail;
+    }
+
+    uint8_t *mptr = mmap(0, l.size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mptr == ((void *)-1)) {
+        r = errno;
+        goto fail;
+    }
+
+    t.ctrl = mptr + l.ctrl;
+    t.slot = (ht_slot *)(mptr + l.slot);
+    if (h->flags & FASTHT_FLAT) {
+        memcpy(t.ctrl, h->ctrl, t.n + FASTHT_GROUP);
+        memcpy(t.slot, h->slot, t.n * sizeof(ht_slot));
+    } else {
+        ht_iter it;
+        uint64_t k;
+        void *v;
+
+        memset(t.ctrl, 0x80, t.n + FASTHT_GROUP);
+        ht_iter_init(&it, h);
+        while (ht_iter_next(&it, &k, &v)) {
+            htflat_insert_quick(&t, k, v);
+        }
+    }
+    swab_slots(t.slot, t.n);
+
+    wrhdr(mptr, &t);
+    cksum(mptr + l.size - SHASIZE, mptr, l.size);
+
+    munmap(mptr, l.size);
+    fsync(fd);
+    fdatasync(fd);
+    close(fd);
+
+    if (rename(file, fname) < 0) {
+        r = errno;
+        unlink(file);
+        return -r;
+    }
+    return 0;
+
+fail:
+    close(fd);
+    unlink(file);
+    return -r;
+}
+
+
+// Unmarshal ht 'h' from file 'fname'
+int
+ht_unmarshal(ht *h, const char *fname, uint32_t flags)
+{
+    const int do_mmap = (flags & FASTHT_MMAP);
+    int r  = 0;
+
+#ifdef __big_endian__
+    if (do_mmap) return -EOPNOTSUPP;
+#endif
+
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) return -errno;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)  {
+        r = -errno;
+        goto fail2;
+    }
+
+    if (st.st_size < (off_t)(SHASIZE + pagesz())) {
+        r = -EINVAL;
+        goto fail2;
+    }
+
+    // A private writable mapping: the table can be modified
+    // (copy-on-write) without ever changing the file.
+    uint8_t *mptr = mmap(0, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (mptr == ((void *)-1)) {
+        r = -errno;
+        goto fail2;
+    }
+
+    if (!(flags & FASTHT_NOVERIFY)) {
+        uint8_t sha[SHASIZE];
+
+        cksum(sha, mptr, st.st_size);
+        if (sodium_memcmp(sha, mptr + st.st_size - SHASIZE, SHASIZE) != 0) {
+            r = -EILSEQ;
+            goto fail1;
+        }
+    }
+
+    ht zh;
+    memset(&zh, 0, sizeof zh);
+    if ((r = rdhdr(mptr, st.st_size, &zh)) < 0) goto fail1;
+
+    layout l;
+    mklayout(&l, zh.n);
+
+    zh.flags = FASTHT_FLAT;
+    zh.fill  = zh.nodes;
+    zh.minn  = zh.n;
+    if (do_mmap) {
+        zh.flags |= FASTHT_MMAP;
+        zh.ctrl   = mptr + l.ctrl;
+        zh.slot   = (ht_slot *)(mptr + l.slot);
+        zh.map    = mptr;
+        zh.mapsz  = st.st_size;
+
+        // lookups are random; don't read ahead.
+        madvise(mptr, st.st_size, MADV_RANDOM);
+    } else {
+        zh.ctrl = __alloc(zh.n + FASTHT_GROUP);
+        zh.slot = __NEWZA(ht_slot, zh.n);
+
+        memcpy(zh.ctrl, mptr + l.ctrl, zh.n + FASTHT_GROUP);
+        memcpy(zh.slot, mptr + l.slot, zh.n * sizeof(ht_slot));
+        swab_slots(zh.slot, zh.n);
+        munmap(mptr, st.st_size);
+    }
+
+    *h = zh;
+    close(fd);
+    return 0;
+
+fail1:
+    munmap(mptr, st.st_size);
+
+fail2:
+    close(fd);
+    return r;
+}
+
+/* EOF */
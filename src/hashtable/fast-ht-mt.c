@@ -0,0 +1,617 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * fast-ht-mt.c - Concurrent, read-mostly fast hashtable
+ *
+ * Copyright (c) 2015 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o The bags and fingerprints are identical to fast-ht.c; the
+ *   fields are C11 atomics so that readers can safely race with
+ *   writers.
+ *
+ * o Each bucket has a sequence counter. Writers make it odd
+ *   before modifying the bucket and even after. Readers sample
+ *   the counter, scan the bags and retry if the counter changed.
+ *
+ * o Bags of a table are never freed while the table is in use. New
+ *   bags are always added to the head of a bucket; so a reader
+ *   chasing the 'next' pointer always reaches the end of the list.
+ *
+ * o Writers take one of CHT_STRIPES mutexes (picked by bucket#).
+ *   A resize takes all of them, copies every node into a new table
+ *   and publishes the new table. Readers that started before the
+ *   new table was published may still be using the old table; they
+ *   are tracked by per-thread counters in one of two "phases". The
+ *   resizer flips the phase and waits for the counters of the old
+ *   phase to drain before freeing the old table.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "fast/simd.h"
+#include "utils/utils.h"
+#include "utils/fast-ht.h"
+#include "utils/fast-ht-mt.h"
+#include "fastht_internal.h"
+
+
+// Number of writer lock stripes; must be a power of 2
+#define CHT_STRIPES     256
+
+// Number of reader counters per phase
+#define CHT_RSLOTS      64
+
+
+/*
+ * Same layout as 'bag' in fast-ht.h
+ */
+struct cbag
+{
+    // first cache line
+    _Atomic uint64_t fp;
+    _Atomic uint64_t hk[FASTHT_BAGSZ];
+
+    // next cache line
+    struct cbag * _Atomic next;
+    void * _Atomic hv[FASTHT_BAGSZ];
+};
+typedef struct cbag __CACHELINE_ALIGNED cbag;
+
+
+struct cbucket
+{
+    _Atomic uint32_t seq;   // odd when a writer is active
+    uint32_t nodes;         // protected by the stripe lock
+    cbag * _Atomic head;
+};
+typedef struct cbucket cbucket;
+
+
+// One instance of the table; replaced wholesale on resize.
+struct ctab
+{
+    uint64_t n;
+    uint64_t salt;
+    cbucket  b[];
+};
+typedef struct ctab ctab;
+
+
+// Each of these is in its own cache line
+union stripe
+{
+    pthread_mutex_t lk;
+    uint8_t pad[CACHELINE_SIZE];
+};
+typedef union stripe stripe;
+
+struct rslot
+{
+    atomic_uint_fast64_t n;
+    uint8_t pad[CACHELINE_SIZE - sizeof(atomic_uint_fast64_t)];
+};
+typedef struct rslot rslot;
+
+
+struct cht
+{
+    ctab * _Atomic tab;
+    uint32_t maxfill;
+    atomic_uint_fast32_t phase;
+    atomic_uint_fast32_t splits;
+    atomic_uint_fast64_t nodes;
+    atomic_uint_fast64_t fill;
+
+    pthread_mutex_t resize_lk;
+
+    stripe lk[CHT_STRIPES] __CACHELINE_ALIGNED;
+    rslot  rs[2][CHT_RSLOTS];
+};
+
+
+#define _rd(x)      atomic_load_explicit(&(x), memory_order_relaxed)
+#define _wr(x, v)   atomic_store_explicit(&(x), (v), memory_order_relaxed)
+
+
+/*
+ * Reader tracking
+ */
+
+static atomic_uint_fast32_t Nslots;
+static __thread uint32_t    Myslot = UINT32_MAX;
+
+static inline uint32_t
+__myslot(void)
+{
+    if (unlikely(Myslot == UINT32_MAX)) {
+        Myslot = atomic_fetch_add(&Nslots, 1) % CHT_RSLOTS;
+    }
+    return Myslot;
+}
+
+
+// Mark the start of a read-side section; return the counter to be
+// passed to __rcu_exit().
+//
+// NB: The increment below and the load of h->tab that follows are
+//     both sequentially consistent; this pairs with the store of
+//     the new table and the reads of the counters in __rcu_sync().
+//
+//     A reader that stalls between reading the phase and the
+//     increment can count itself in a phase that a resize has
+//     already drained; a second resize would then not wait for it.
+//     So, re-read the phase after the increment and retry if it
+//     changed.
+static inline atomic_uint_fast64_t *
+__rcu_enter(cht *h)
+{
+    uint32_t slot = __myslot();
+
+    for (;;) {
+        uint32_t p = atomic_load(&h->phase) & 1;
+        atomic_uint_fast64_t *c = &h->rs[p][slot].n;
+
+        atomic_fetch_add(c, 1);
+        if (likely((atomic_load(&h->phase) & 1) == p)) return c;
+
+        atomic_fetch_sub_explicit(c, 1, memory_order_release);
+    }
+}
+
+static inline void
+__rcu_exit(atomic_uint_fast64_t *c)
+{
+    atomic_fetch_sub_explicit(c, 1, memory_order_release);
+}
+
+
+// Wait for all readers that may have seen the previous table.
+// Caller must hold the resize lock.
+static void
+__rcu_sync(cht *h)
+{
+    uint32_t p = atomic_load(&h->phase) & 1;
+
+    atomic_store(&h->phase, p ^ 1);
+    for (int i = 0; i < CHT_RSLOTS; i++) {
+        atomic_uint_fast64_t *c = &h->rs[p][i].n;
+
+        while (atomic_load(c) > 0) {
+            sched_yield();
+        }
+    }
+}
+
+
+/*
+ * Bucket sequence lock
+ */
+
+static inline void
+__wbegin(cbucket *b)
+{
+    _wr(b->seq, _rd(b->seq) + 1);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void
+__wend(cbucket *b)
+{
+    atomic_store_explicit(&b->seq, _rd(b->seq) + 1, memory_order_release);
+}
+
+
+static ctab *
+__new_tab(uint64_t n)
+{
+    ctab *t = __alloc(sizeof(ctab) + (n * sizeof(cbucket)));
+
+    t->n    = n;
+    t->salt = rand64();
+    return t;
+}
+
+static void
+__free_tab(ctab *t)
+{
+    cbucket *b = t->b,
+            *e = b + t->n;
+
+    for (; b < e; b++) {
+        cbag *g = _rd(b->head);
+        while (g) {
+            cbag *next = _rd(g->next);
+            DEL(g);
+            g = next;
+        }
+    }
+    DEL(t);
+}
+
+
+static inline cbag *
+__new_bag(cbucket *b)
+{
+    cbag *g = __NEWZ(cbag);
+
+    _wr(g->fp, __FP_EMPTY);
+    _wr(g->next, _rd(b->head));
+    atomic_store_explicit(&b->head, g, memory_order_release);
+    return g;
+}
+
+
+// Find 'k' in bag 'g'; return slot# or -1
+static inline int
+__find_key(cbag *g, uint64_t k)
+{
+    uint64_t fp = _rd(g->fp);
+    uint16_t m  = __find_matches(__fp(fp), __h2(k));
+    uint16_t p  = m & (~__control(fp) & 0x7f);
+
+    while (p) {
+        int j = __builtin_ctz(p);
+        p &= ~(1 << _U16(j));
+        if (likely(_rd(g->hk[j]) == k)) return j;
+    }
+    return -1;
+}
+
+
+// Lock-free lookup of 'k' in bucket 'b'.
+static int
+__lookup(cbucket *b, uint64_t k, void **p_val)
+{
+    uint32_t s0;
+    void *val;
+    int found;
+
+    do {
+        while ((s0 = atomic_load_explicit(&b->seq, memory_order_acquire)) & 1) {
+            sys_cpu_pause();
+        }
+
+        val   = 0;
+        found = 0;
+
+        cbag *g = atomic_load_explicit(&b->head, memory_order_acquire);
+        for (; g; g = atomic_load_explicit(&g->next, memory_order_acquire)) {
+            int j = __find_key(g, k);
+            if (j >= 0) {
+                val   = _rd(g->hv[j]);
+                found = 1;
+                break;
+            }
+            SIMD_PREFETCH_T0(&g->next);
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+    } while (s0 != _rd(b->seq));
+
+    if (found && p_val) *p_val = val;
+    return found;
+}
+
+
+// Find 'k' in bucket 'b' with the stripe lock held; return the bag
+// and slot in 'pg' and 'pj'.
+static inline int
+__wfind(cbucket *b, uint64_t k, cbag **pg, int *pj)
+{
+    for (cbag *g = _rd(b->head); g; g = _rd(g->next)) {
+        int j = __find_key(g, k);
+        if (j >= 0) {
+            *pg = g;
+            *pj = j;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// Return the bucket for 'k' in the current table with its stripe
+// lock held. Caller must be in a read-side section.
+static cbucket *
+__wlock(cht *h, uint64_t k, ctab **pt, pthread_mutex_t **pl)
+{
+    for (;;) {
+        ctab *t = atomic_load(&h->tab);
+        uint64_t i = __hash(k, t->n, t->salt);
+        pthread_mutex_t *l = &h->lk[i & (CHT_STRIPES-1)].lk;
+
+        pthread_mutex_lock(l);
+
+        // A resize may have swapped the table while we waited.
+        if (likely(t == atomic_load(&h->tab))) {
+            *pt = t;
+            *pl = l;
+            return &t->b[i];
+        }
+        pthread_mutex_unlock(l);
+    }
+}
+
+
+// Insert 'k' into a bucket of a table that is not yet visible to
+// anyone else.
+static inline void
+__insert_quick(cbucket *b, uint64_t k, void *v)
+{
+    cbag *g = _rd(b->head);
+    int   j = -1;
+
+    if (g) {
+        uint8_t ctrl = __control(_rd(g->fp));
+        if (ctrl) j = __builtin_ctz(ctrl);
+    }
+
+    if (j < 0) {
+        g = __new_bag(b);
+        j = 0;
+    }
+
+    _wr(g->hk[j], k);
+    _wr(g->hv[j], v);
+    _wr(g->fp, __update_fp(_rd(g->fp), k, j));
+    b->nodes++;
+}
+
+
+/*
+ * Double the table if it is still over the fill threshold once we
+ * hold all the stripe locks.
+ */
+static void
+__resize(cht *h)
+{
+    // Someone else is already resizing
+    if (pthread_mutex_trylock(&h->resize_lk) != 0) return;
+
+    for (int i = 0; i < CHT_STRIPES; i++) {
+        pthread_mutex_lock(&h->lk[i].lk);
+    }
+
+    ctab *t = atomic_load(&h->tab);
+    if (((atomic_load(&h->fill) * 100) / t->n) <= h->maxfill) {
+        for (int i = 0; i < CHT_STRIPES; i++) {
+            pthread_mutex_unlock(&h->lk[i].lk);
+        }
+        goto out;
+    }
+
+    ctab *nt = __new_tab(t->n * 2);
+    uint64_t fill = 0;
+
+    for (uint64_t i = 0; i < t->n; i++) {
+        cbucket *o = &t->b[i];
+
+        for (cbag *g = _rd(o->head); g; g = _rd(g->next)) {
+            uint8_t ctrl = __control(_rd(g->fp));
+
+            SIMD_PREFETCH_T0(&g->next);
+            for (int j = 0; j < FASTHT_BAGSZ; j++) {
+                if (ctrl & (1 << j)) continue;
+
+                uint64_t k = _rd(g->hk[j]);
+                cbucket *x = &nt->b[__hash(k, nt->n, nt->salt)];
+
+                __insert_quick(x, k, _rd(g->hv[j]));
+                if (x->nodes == 1) fill++;
+            }
+        }
+    }
+
+    atomic_store(&h->fill, fill);
+    atomic_store(&h->tab, nt);
+    atomic_fetch_add(&h->splits, 1);
+
+    for (int i = 0; i < CHT_STRIPES; i++) {
+        pthread_mutex_unlock(&h->lk[i].lk);
+    }
+
+    // Readers (and waiting writers) may still hold 't'.
+    __rcu_sync(h);
+    __free_tab(t);
+
+out:
+    pthread_mutex_unlock(&h->resize_lk);
+}
+
+
+/*
+ * Public API
+ */
+
+
+cht*
+cht_new(uint32_t size, uint32_t maxfill)
+{
+    if (!size) size = 128;
+    else if (size & (size-1)) size = NEXTPOW2(size);
+
+    if (!maxfill) maxfill = FILLPCT;
+
+    cht *h = __NEWZ(cht);
+
+    h->maxfill = maxfill;
+    pthread_mutex_init(&h->resize_lk, 0);
+    for (int i = 0; i < CHT_STRIPES; i++) {
+        pthread_mutex_init(&h->lk[i].lk, 0);
+    }
+
+    atomic_store(&h->tab, __new_tab(size));
+    return h;
+}
+
+
+void
+cht_del(cht *h)
+{
+    __free_tab(atomic_load(&h->tab));
+
+    for (int i = 0; i < CHT_STRIPES; i++) {
+        pthread_mutex_destroy(&h->lk[i].lk);
+    }
+    pthread_mutex_destroy(&h->resize_lk);
+    DEL(h);
+}
+
+
+int
+cht_find(cht *h, uint64_t k, void **p_ret)
+{
+    atomic_uint_fast64_t *c = __rcu_enter(h);
+    ctab *t = atomic_load(&h->tab);
+    int   r = __lookup(&t->b[__hash(k, t->n, t->salt)], k, p_ret);
+
+    __rcu_exit(c);
+    return r;
+}
+
+
+void*
+cht_probe(cht *h, uint64_t k, void *v)
+{
+    atomic_uint_fast64_t *c = __rcu_enter(h);
+    pthread_mutex_t *l;
+    ctab *t;
+    cbucket *b = __wlock(h, k, &t, &l);
+    cbag *g;
+    int   j;
+
+    if (__wfind(b, k, &g, &j)) {
+        void *ov = _rd(g->hv[j]);
+
+        pthread_mutex_unlock(l);
+        __rcu_exit(c);
+        return ov;
+    }
+
+    // look for the first free slot
+    j = -1;
+    for (g = _rd(b->head); g; g = _rd(g->next)) {
+        uint8_t ctrl = __control(_rd(g->fp));
+        if (ctrl) {
+            j = __builtin_ctz(ctrl);
+            break;
+        }
+    }
+
+    __wbegin(b);
+    if (j < 0) {
+        g = __new_bag(b);
+        j = 0;
+    }
+    _wr(g->hk[j], k);
+    _wr(g->hv[j], v);
+    _wr(g->fp, __update_fp(_rd(g->fp), k, j));
+    __wend(b);
+
+    uint64_t fill = 0,
+             n    = t->n;
+
+    atomic_fetch_add_explicit(&h->nodes, 1, memory_order_relaxed);
+    if (++b->nodes == 1) {
+        fill = 1 + atomic_fetch_add_explicit(&h->fill, 1, memory_order_relaxed);
+    }
+
+    pthread_mutex_unlock(l);
+    __rcu_exit(c);
+
+    // time to split? We must not be in a read-side section for this.
+    if (fill && ((fill * 100) / n) > h->maxfill) {
+        __resize(h);
+    }
+    return 0;
+}
+
+
+int
+cht_replace(cht *h, uint64_t k, void *v)
+{
+    atomic_uint_fast64_t *c = __rcu_enter(h);
+    pthread_mutex_t *l;
+    ctab *t;
+    cbucket *b = __wlock(h, k, &t, &l);
+    cbag *g;
+    int   j, r = 0;
+
+    if (__wfind(b, k, &g, &j)) {
+        __wbegin(b);
+        _wr(g->hv[j], v);
+        __wend(b);
+        r = 1;
+    }
+
+    pthread_mutex_unlock(l);
+    __rcu_exit(c);
+    return r;
+}
+
+
+int
+cht_remove(cht *h, uint64_t k, void **p_ret)
+{
+    atomic_uint_fast64_t *c = __rcu_enter(h);
+    pthread_mutex_t *l;
+    ctab *t;
+    cbucket *b = __wlock(h, k, &t, &l);
+    cbag *g;
+    int   j, r = 0;
+
+    if (__wfind(b, k, &g, &j)) {
+        if (p_ret) *p_ret = _rd(g->hv[j]);
+
+        __wbegin(b);
+        _wr(g->fp, __clear_fp(_rd(g->fp), j));
+        _wr(g->hk[j], 0);
+        _wr(g->hv[j], 0);
+        __wend(b);
+
+        atomic_fetch_sub_explicit(&h->nodes, 1, memory_order_relaxed);
+        if (--b->nodes == 0) {
+            atomic_fetch_sub_explicit(&h->fill, 1, memory_order_relaxed);
+        }
+        r = 1;
+    }
+
+    pthread_mutex_unlock(l);
+    __rcu_exit(c);
+    return r;
+}
+
+
+void
+cht_stat(cht *h, cht_stats *s)
+{
+    atomic_uint_fast64_t *c = __rcu_enter(h);
+    ctab *t = atomic_load(&h->tab);
+
+    s->n       = t->n;
+    s->nodes   = atomic_load(&h->nodes);
+    s->fill    = atomic_load(&h->fill);
+    s->maxfill = h->maxfill;
+    s->splits  = atomic_load(&h->splits);
+
+    __rcu_exit(c);
+}
+
+/* EOF */
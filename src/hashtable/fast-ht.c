@@ -27,7 +27,23 @@
  * o The last byte of the fingerprint is a "control" byte: Each bit
  *   indicates if a slot is occupied (0) or free (1).
  *
- * o Bags once allocated are never freed.
+ * o A bag is freed when its last node is removed. Removing nodes
+ *   can still leave a bucket with several sparse bags;
+ *   ht_compact() coalesces them.
+ *
+ * o If 'minfill' is set (ht_set_minfill()), the table is halved
+ *   when the fill drops below it - but never below its initial
+ *   size.
+ *
+ * o In incremental mode (FASTHT_INCREMENTAL), a resize only
+ *   allocates the new buckets; the old buckets are drained a few at
+ *   a time by subsequent probe/find/replace/remove calls. Before
+ *   any of these calls touches the new buckets, the old bucket of
+ *   the key is migrated; thus a key is only ever looked up in the
+ *   new buckets.
+ *
+ * o FASTHT_FLAT selects the flat, open addressed engine in
+ *   fast-ht-flat.c; the public functions below dispatch to it.
  *
  * o Callers must use a "good" hash function; the hash table relies
  *   on a 64-bit hash value as input.
@@ -45,6 +61,7 @@
 #include "utils/utils.h"
 #include "utils/fast-ht.h"
 #include "utils/nospec.h"
+#include "fastht_internal.h"
 
 // Return value from an internal function
 struct tuple
@@ -57,131 +74,17 @@ typedef struct tuple tuple;
 
 #define _d(z)       ((double)(z))
 
-// alloc and zero an instance of type 'ty'
-#define __NEWZ(ty) ({                           \
-                ty *_x = __alloc(sizeof(ty));   \
-                _x;                             \
-                })
-
-// make an 'n' element array of type 'ty'
-#define __NEWZA(ty, n) ({                           \
-                ty *_x = __alloc((n) * sizeof(ty)); \
-                _x;                                 \
-                })
-
-
-// extract the individual fingerprints
-#define __fp(fp)       ((fp) & ((_U64(1) << 56)-1))
-
-#define __h2(fp)        ((fp) & 0xff)
-
-// extract the control bits
-#define __control(fp)  _U8(0x7f & (fp) >> 56)
-
-// Create a new fingerprint from constituent bits
-#define __mkfp(h2, ctrl) (_U64(h2) | (_U64(ctrl) << 56))
-
-
-// fast/simd.h exports this symbol if we are not on arm64 or amd64
-#ifdef __NO_SIMD__
-
-// software fallback to find matches using bit tricks
-static inline uint8_t
-__find_matches(uint64_t fp_h2, uint8_t h2)
-{
-    uint64_t splat = 0x0101010101010101ULL * h2;
-    uint64_t m = (fp_h2 ^ splat);
-    uint64_t x = ((m - 0x0101010101010101ULL) & ~m) & 0x8080808080808080ULL;
-
-    /* Now use multiplication to gather bits */
-    return 0x7f & ((x * 0x0002040810204081ULL) >> 56);
-}
-
-#else
-
-// Fast version using SIMD on arm64 and amd64
-static inline uint8_t
-__find_matches(uint64_t fp_h2, uint8_t h2)
-{
-    simd_vec128_t h2v = SIMD_SET_EPI64X(0, fp_h2);
-    simd_vec128_t qv  = SIMD_SET1_EPI8(h2);
-    return 0x7f & SIMD_MOVEMASK_EPI8(SIMD_CMPEQ_EPI8(h2v, qv));
-}
-
-#endif  // __NO_SIMD__
-
-
-// get me a random 64-bit number
-static inline uint64_t
-rand64()
-{
-    uint64_t v;
-
-    getentropy(&v, sizeof v);
-    return v;
-}
-
-
-// Mix function from Zi Long Tan's superfast hash
-static inline uint64_t
-_hashmix(uint64_t h)
-{
-    h ^= h >> 23;
-    h *= 0x2127599bf4325c37ULL;
-    h ^= h >> 47;
-    return h;
-}
-
-
-/*
- * One round of Zi Long Tan's superfast hash
- */
-static inline uint64_t
-__hash(uint64_t hv, uint64_t n, uint64_t salt)
-{
-    const uint64_t m = 0x880355f21e6d1965ULL;
-
-    hv ^= (_hashmix(hv) ^ salt);
-    hv *= m;
-    return (n-1) & hv;
-}
-
-
-static inline void *
-__alloc(size_t n)
-{
-    void *ptr = 0;
-    int     r = posix_memalign(&ptr, CACHELINE_SIZE, n);
-    assert(r == 0);
-    assert(ptr);
-
-    return memset(ptr, 0, n);
-}
-
 
-// Update the fingerprint to show slot as now occupied.
-// NB: 0 is occupied, 1 is free.
-static inline uint64_t
-__update_fp(uint64_t fp, uint64_t k, int slot)
+// Make a new bag with all slots free
+static inline bag *
+__new_bag(void)
 {
-    uint8_t ctrl = __control(fp) & ~(1 << slot);
-    uint64_t h2  = ((k & 0xff) << (8 * slot)) | __h2(fp);
+    bag *g = __NEWZ(bag);
 
-    return h2 | (_U64(ctrl) << 56);
+    g->fp = __FP_EMPTY;
+    return g;
 }
 
-
-// clear the fingerprint in 'slot'
-// NB: 0 is occupied, 1 is free.
-static inline uint64_t
-__clear_fp(uint64_t fp, int slot)
-{
-    uint8_t ctrl = __control(fp) | (1 << slot);
-    uint64_t h2  = __h2(fp) & ~(_U64(0xff) << (8 * slot));
-    return h2 | (_U64(ctrl) << 56);
-}
-
-
 // Find the key 'k' in bag 'g' and return the matching index.
 // Return -1 on ENOENT
 static inline int
@@ -283,7 +186,7 @@ __insert(hb *b, uint64_t k, void *v)
     }
 
     if (!bg) {
-        bg   = __NEWZ(bag);
+        bg   = __new_bag();
         slot = 0;
         b->bags++;
         SL_INSERT_HEAD(&b->head, bg, link);
@@ -320,7 +223,7 @@ __insert_quick(hb *b, uint64_t k, void *v)
     }
 
     // Make a new bag and put our element there.
-    g = __NEWZ(bag);
+    g = __new_bag();
     g->fp = __update_fp(g->fp, k, 0);
     g->hk[0] = k;
     g->hv[0] = v;
@@ -351,60 +254,258 @@ __findx(tuple *t, hb *b, uint64_t hk)
 }
 
 
+// Allocate an array of 'n' buckets. In incremental mode we use
+// calloc(); large arrays then come straight from the OS as zero
+// pages - and we don't pay for a memset of the whole array in the
+// middle of an insert.
+static inline hb *
+__alloc_buckets(uint64_t n, uint32_t flags)
+{
+    if (flags & FASTHT_INCREMENTAL) {
+        hb *b = (hb *)calloc(n, sizeof(hb));
+        assert(b);
+        return b;
+    }
+    return __NEWZA(hb, n);
+}
+
+
+// Free all the bags in the 'n' buckets of 'b' and the array itself.
+static void
+__free_buckets(hb *b, uint64_t n)
+{
+    hb *e = b + n;
+
+    for (hb *x = b; x < e; x++) {
+        bag *g, *next;
+        SL_FOREACH_SAFE(g, &x->head, link, next) {
+            DEL(g);
+        }
+    }
+    DEL(b);
+}
+
+
+// Move every node in the old bucket 'o' to the current buckets of
+// 'h'; the old bucket is left empty.
+static void
+__migrate_bucket(ht *h, hb *o)
+{
+    bag *g, *tmp;
+
+    SL_FOREACH_SAFE(g, &o->head, link, tmp) {
+        uint8_t ctrl = __control(g->fp);
+
+        SIMD_PREFETCH_T0(&SL_NEXT(g, link));
+
+        for (int i = 0; i < FASTHT_BAGSZ; i++) {
+            // skip empty slots
+            if (ctrl & (1 << i)) continue;
+
+            uint64_t p = g->hk[i];
+            if (p) {
+                hb *x = &h->b[__hash(p, h->n, h->salt)];
+
+                __insert_quick(x, p, g->hv[i]);
+                if (x->bags  > h->bagmax) h->bagmax = x->bags;
+                if (x->nodes > h->maxn)   h->maxn   = x->nodes;
+                if (x->nodes == 1)        h->fill++;
+            }
+        }
+
+        DEL(g);
+    }
+
+    SL_INIT(&o->head);
+    o->nodes = 0;
+    o->bags  = 0;
+}
+
+
+// Resize the table to 'n' buckets; the current buckets become the
+// "old" buckets and are drained by __migrate_bucket().
+static void
+__resize_start(ht *h, uint64_t n)
+{
+    if (n > h->n) h->splits++;
+    else          h->shrinks++;
+
+    h->ob    = h->b;
+    h->on    = h->n;
+    h->osalt = h->salt;
+    h->omig  = 0;
+
+    h->salt   = rand64();
+    h->n      = n;
+    h->b      = __alloc_buckets(n, h->flags);
+    h->bagmax = 0;
+    h->maxn   = 0;
+    h->fill   = 0;
+}
+
+
+// Migrate the remaining old buckets and free them.
+static void
+__resize_finish(ht *h)
+{
+    hb *o = h->ob + h->omig,
+       *e = h->ob + h->on;
+
+    for (; o < e; o++) {
+        __migrate_bucket(h, o);
+    }
+
+    DEL(h->ob);
+    h->ob   = 0;
+    h->on   = 0;
+    h->omig = 0;
+}
+
+
 /*
- * Double the hash buckets and redistribute all the nodes.
+ * Resize the table to 'n' buckets and redistribute all the nodes.
  */
 static ht*
-resize(ht* h)
+resize(ht* h, uint64_t n)
 {
-    uint64_t salt = rand64();
-    uint64_t n    = h->n * 2;
+    __resize_start(h, n);
+    __resize_finish(h);
+    return h;
+}
 
-    hb *b = __NEWZA(hb, n),
-       *o = h->b,
-       *e = o + h->n;
-    uint64_t maxbags = 0,
-             maxn    = 0,
-             fill    = 0;
 
+// Resize 'h' to 'n' buckets - either in one shot or incrementally.
+// Return true if the resize is complete.
+static int
+__resize(ht *h, uint64_t n)
+{
+    if (h->flags & FASTHT_INCREMENTAL) {
+        // A previous migration can't be pending unless the
+        // table filled up faster than we drained it.
+        if (unlikely(h->ob)) __resize_finish(h);
 
-    for (; o < e; o++) {
-        bag *g, *tmp;
+        __resize_start(h, n);
+        return 0;
+    }
+
+    resize(h, n);
+    return 1;
+}
+
+
+// Remove bag 'g' from bucket 'b' and free it.
+static void
+__free_bag(hb *b, bag *g)
+{
+    bag *p = SL_FIRST(&b->head);
+
+    if (p == g) {
+        SL_REMOVE_HEAD(&b->head, link);
+    } else {
+        while (SL_NEXT(p, link) != g) p = SL_NEXT(p, link);
+        SL_NEXT(p, link) = SL_NEXT(g, link);
+    }
 
-        SL_FOREACH_SAFE(g, &o->head, link, tmp) {
-            uint8_t ctrl = __control(g->fp);
+    b->bags--;
+    DEL(g);
+}
 
-            SIMD_PREFETCH_T0(&SL_NEXT(g, link));
 
-            for (int i = 0; i < FASTHT_BAGSZ; i++) {
-                // skip empty slots
-                if (ctrl & (1 << i)) continue;
+// Clear 'slot' of bag 'g' in bucket 'b' and update the counters.
+// Return the number of nodes left in the bucket.
+static inline uint32_t
+__clear_slot(ht *h, hb *b, bag *g, int slot)
+{
+    g->fp = __clear_fp(g->fp, slot);
+    g->hk[slot] = 0;
+    g->hv[slot] = 0;
+    h->nodes--;
+    return --b->nodes;
+}
 
-                uint64_t p = g->hk[i];
-                if (p) {
-                    uint64_t j = __hash(p, n, salt);
-                    hb *x      = b+j;
 
-                    __insert_quick(x, p, g->hv[i]);
-                    if (x->bags > maxbags) maxbags = x->bags;
-                    if (x->nodes > maxn)   maxn    = x->nodes;
-                    if (x->nodes == 1)     fill++;
-                }
+// Move the nodes of a bucket into as few bags as possible; the
+// first ceil(nodes/BAGSZ) bags are kept and the nodes in the rest
+// are moved into the free slots of the bags we kept.
+//
+// Return the number of bags freed.
+static uint32_t
+__compact_bucket(hb *b)
+{
+    uint32_t need = (b->nodes + FASTHT_BAGSZ - 1) / FASTHT_BAGSZ;
+
+    if (b->bags <= need) return 0;
+
+    bag *last = 0,
+        *g, *tmp;
+    uint32_t i = 0,
+             nfree = 0;
+
+    for (g = SL_FIRST(&b->head); i < need; i++, g = SL_NEXT(g, link)) {
+        last = g;
+    }
+
+    if (last) SL_NEXT(last, link) = 0;
+    else      SL_INIT(&b->head);
+
+    bag *dst = SL_FIRST(&b->head);
+    for (; g; g = tmp) {
+        uint8_t occ = ~__control(g->fp) & 0x7f;
+
+        tmp = SL_NEXT(g, link);
+        while (occ) {
+            int j = __builtin_ctz(occ);
+            int s;
+
+            occ &= occ - 1;
+            while ((s = __find_empty_slot(dst)) < 0) {
+                dst = SL_NEXT(dst, link);
             }
 
-            DEL(g);
+            dst->fp    = __update_fp(dst->fp, g->hk[j], s);
+            dst->hk[s] = g->hk[j];
+            dst->hv[s] = g->hv[j];
         }
+
+        DEL(g);
+        nfree++;
     }
 
-    DEL(h->b);
+    b->bags = need;
+    return nfree;
+}
 
-    h->salt   = salt;
-    h->n      = n;
-    h->b      = b;
-    h->bagmax = maxbags;
-    h->maxn   = maxn;
-    h->fill   = fill;
-    return h;
+
+// Incremental resize: make sure the old bucket of 'k' is drained
+// before we touch the current buckets and then migrate old buckets
+// in sequence until FASTHT_MIGRATE nodes have moved - but look at
+// no more than FASTHT_MIGRATE buckets. Every moved node is a cache
+// miss in the new buckets; thus we bound the nodes, not the buckets.
+static void
+__migrate(ht *h, uint64_t k)
+{
+    hb *o = &h->ob[__hash(k, h->on, h->osalt)];
+    uint32_t moved = o->nodes;
+
+    if (!SL_EMPTY(&o->head)) __migrate_bucket(h, o);
+
+    uint64_t e = h->omig + FASTHT_MIGRATE;
+    if (e > h->on) e = h->on;
+
+    // Always take one step; else a few hot keys in large buckets
+    // can stall the migration.
+    do {
+        o = &h->ob[h->omig];
+        moved += o->nodes;
+        if (!SL_EMPTY(&o->head)) __migrate_bucket(h, o);
+    } while (++h->omig < e && moved < FASTHT_MIGRATE);
+
+    if (h->omig == h->on) {
+        DEL(h->ob);
+        h->ob   = 0;
+        h->on   = 0;
+        h->omig = 0;
+    }
 }
 
 
@@ -417,7 +518,7 @@ resize(ht* h)
  * Initialize a pre-allocated instance.
  */
 ht*
-ht_init(ht* h, uint32_t size, uint32_t maxfill)
+ht_init_flags(ht* h, uint32_t size, uint32_t maxfill, uint32_t flags)
 {
     if (!size) size = 128;
     else if (size & (size-1)) size = NEXTPOW2(size);
@@ -426,32 +527,41 @@ ht_init(ht* h, uint32_t size, uint32_t maxfill)
 
     memset(h, 0, sizeof *h);
 
-    h->n = size;
-    h->b = __NEWZA(hb, h->n);
-
     h->maxfill = maxfill;
+    h->flags   = flags;
+    h->minn    = size;
     h->salt    = rand64();
 
+    if (flags & FASTHT_FLAT) {
+        htflat_init(h, size);
+        return h;
+    }
+
+    h->n = size;
+    h->b = __alloc_buckets(h->n, flags);
     return h;
 }
 
+
+ht*
+ht_init(ht* h, uint32_t size, uint32_t maxfill)
+{
+    return ht_init_flags(h, size, maxfill, 0);
+}
+
 /*
  * Finalize a pre-allocated instance.
  */
 void
 ht_fini(ht* h)
 {
-    hb *b = h->b,
-       *e = b + h->n;
+    if (h->flags & FASTHT_FLAT) {
+        htflat_fini(h);
+    } else {
+        if (h->ob) __free_buckets(h->ob, h->on);
 
-    for (; b < e; b++) {
-        bag *g, *next;
-        SL_FOREACH_SAFE(g, &b->head, link, next) {
-            DEL(g);
-        }
+        __free_buckets(h->b, h->n);
     }
-
-    DEL(h->b);
     memset(h, 0, sizeof *h);
 }
 
@@ -468,6 +578,15 @@ ht_new(uint32_t size, uint32_t maxfill)
 }
 
 
+ht*
+ht_new_flags(uint32_t size, uint32_t maxfill, uint32_t flags)
+{
+    ht* h = __NEWZ(ht);
+
+    return ht_init_flags(h, size, maxfill, flags);
+}
+
+
 /*
  * Finalize a dynamically allocated hash table instance and free
  * memory.
@@ -488,6 +607,10 @@ ht_del(ht* h)
 void*
 ht_probe(ht* h, uint64_t k, void* v)
 {
+    if (h->flags & FASTHT_FLAT) return htflat_probe(h, k, v);
+
+    if (h->ob) __migrate(h, k);
+
     uint64_t hh  =__hash(k, h->n, h->salt);
     hb   *b  = &h->b[hh];
     void *nv = __insert(b, k, v);
@@ -505,8 +628,11 @@ ht_probe(ht* h, uint64_t k, void* v)
             // compilers from caching h->n and h->salt.
             OPTIMIZER_HIDE_VAR(h);
 
-            h->splits++;
-            h = resize(h);
+            // In incremental mode, 'k' now lives in the old
+            // buckets; it will be migrated along with its
+            // neighbors.
+            if (!__resize(h, h->n * 2)) return 0;
+
             b = &h->b[__hash(k, h->n, h->salt)];
         }
     }
@@ -527,6 +653,10 @@ int
 ht_find(ht* h, uint64_t k, void** p_ret)
 {
     tuple r;
+
+    if (h->flags & FASTHT_FLAT) return htflat_find(h, k, p_ret);
+    if (h->ob) __migrate(h, k);
+
     hb *b = &h->b[__hash(k, h->n, h->salt)];
 
     if (__findx(&r, b, k)) {
@@ -547,6 +677,10 @@ int
 ht_replace(ht* h, uint64_t k, void* val)
 {
     tuple r;
+
+    if (h->flags & FASTHT_FLAT) return htflat_replace(h, k, val);
+    if (h->ob) __migrate(h, k);
+
     hb *b = &h->b[__hash(k, h->n, h->salt)];
 
     if (__findx(&r, b, k)) {
@@ -568,6 +702,10 @@ int
 ht_remove(ht* h, uint64_t k, void** p_ret)
 {
     tuple r;
+
+    if (h->flags & FASTHT_FLAT) return htflat_remove(h, k, p_ret);
+    if (h->ob) __migrate(h, k);
+
     hb *b = &h->b[__hash(k, h->n, h->salt)];
 
     if (__findx(&r, b, k)) {
@@ -576,11 +714,18 @@ ht_remove(ht* h, uint64_t k, void** p_ret)
 
         if (p_ret) *p_ret = r.val;
 
-        g->fp = __clear_fp(g->fp, slot);
-        g->hk[slot] = 0;
-        g->hv[slot] = 0;
-        b->nodes--;
-        h->nodes--;
+        if (!__clear_slot(h, b, g, slot)) h->fill--;
+        if (__control(g->fp) == 0x7f) __free_bag(b, g);
+
+        // time to shrink?
+        if (h->minfill && !h->ob && h->n > h->minn) {
+            uint64_t fpct = (h->fill * 100)/h->n;
+
+            if (fpct < h->minfill) {
+                OPTIMIZER_HIDE_VAR(h);
+                __resize(h, h->n / 2);
+            }
+        }
         return 1;
     }
 
@@ -588,6 +733,273 @@ ht_remove(ht* h, uint64_t k, void** p_ret)
 }
 
 
+/*
+ * Set the fill % below which the table is halved; 0 disables it.
+ */
+void
+ht_set_minfill(ht* h, uint32_t minfill)
+{
+    // A freshly shrunk table has roughly twice the fill; make sure
+    // it isn't immediately split again.
+    if (minfill && (minfill * 2) >= h->maxfill) minfill = h->maxfill / 4;
+
+    h->minfill = minfill;
+}
+
+
+/*
+ * Coalesce sparse bags and recompute the stats.
+ */
+uint64_t
+ht_compact(ht* h)
+{
+    uint64_t nfree  = 0;
+    uint32_t bagmax = 0,
+             maxn   = 0;
+
+    // nothing to coalesce in the flat engine
+    if (h->flags & FASTHT_FLAT) return 0;
+
+    if (h->ob) __resize_finish(h);
+
+    hb *b = h->b,
+       *e = b + h->n;
+
+    for (; b < e; b++) {
+        nfree += __compact_bucket(b);
+        if (b->bags  > bagmax) bagmax = b->bags;
+        if (b->nodes > maxn)   maxn   = b->nodes;
+    }
+
+    h->bagmax = bagmax;
+    h->maxn   = maxn;
+    return nfree;
+}
+
+
+/*
+ * Iterator
+ */
+
+// Make 'b' the current bucket of the iterator and prefetch the
+// first bag of the next one.
+static inline void
+__iter_bucket(ht_iter *it, hb *b)
+{
+    it->b    = b;
+    it->g    = SL_FIRST(&b->head);
+    it->slot = 0;
+
+    if ((b+1) < it->e) {
+        bag *n = SL_FIRST(&b[1].head);
+        if (n) SIMD_PREFETCH_T0(n);
+    }
+}
+
+
+void
+ht_iter_init(ht_iter *it, ht *h)
+{
+    memset(it, 0, sizeof *it);
+    it->h = h;
+
+    if (h->flags & FASTHT_FLAT) {
+        htflat_iter_init(it);
+    } else if (h->ob) {
+        it->old = 1;
+        it->e   = h->ob + h->on;
+        __iter_bucket(it, h->ob + h->omig);
+    } else {
+        it->e   = h->b + h->n;
+        __iter_bucket(it, h->b);
+    }
+}
+
+
+int
+ht_iter_next(ht_iter *it, uint64_t *p_key, void **p_val)
+{
+    if (it->h->flags & FASTHT_FLAT) return htflat_iter_next(it, p_key, p_val);
+    if (!it->b) return 0;
+
+    for (;;) {
+        while (it->g) {
+            bag *g = it->g;
+            uint8_t occ = ~__control(g->fp) & 0x7f & ~((1 << it->slot) - 1);
+
+            if (occ) {
+                int j = __builtin_ctz(occ);
+
+                it->slot = j + 1;
+                it->lb   = it->b;
+                it->lg   = g;
+                it->ls   = j;
+
+                if (p_key) *p_key = g->hk[j];
+                if (p_val) *p_val = g->hv[j];
+                return 1;
+            }
+
+            it->g    = SL_NEXT(g, link);
+            it->slot = 0;
+            if (it->g) SIMD_PREFETCH_T0(&SL_NEXT(it->g, link));
+        }
+
+        hb *b = it->b + 1;
+        if (b >= it->e) {
+            if (!it->old) {
+                it->b = 0;
+                return 0;
+            }
+
+            ht *h   = it->h;
+            it->old = 0;
+            it->e   = h->b + h->n;
+            b       = h->b;
+        }
+        __iter_bucket(it, b);
+    }
+}
+
+
+int
+ht_iter_remove(ht_iter *it)
+{
+    if (it->h->flags & FASTHT_FLAT) return htflat_iter_remove(it);
+    if (!it->lg) return 0;
+
+    ht *h = it->h;
+
+    // buckets in the old array aren't counted in 'fill'
+    if (!__clear_slot(h, it->lb, it->lg, it->ls) && !it->old) h->fill--;
+
+    it->lg = 0;
+    return 1;
+}
+
+
+// Batched operations are pipelined in three stages: the bucket of
+// key 'i + 2W' and the first bag of key 'i + W' are prefetched while
+// key 'i' is resolved. W is FASTHT_BATCH_WINDOW. The flat engine
+// prefetches the control group and the home slot instead.
+static inline void
+__prefetch_bucket(ht *h, uint64_t k)
+{
+    uint64_t i = __hash(k, h->n, h->salt);
+
+    if (h->flags & FASTHT_FLAT) {
+        SIMD_PREFETCH_T0(&h->ctrl[i]);
+        return;
+    }
+    SIMD_PREFETCH_T0(&h->b[i]);
+}
+
+static inline void
+__prefetch_bag(ht *h, uint64_t k)
+{
+    if (h->flags & FASTHT_FLAT) {
+        SIMD_PREFETCH_T0(&h->slot[__hash(k, h->n, h->salt)]);
+        return;
+    }
+
+    hb  *b = &h->b[__hash(k, h->n, h->salt)];
+    bag *g = SL_FIRST(&b->head);
+
+    if (g) {
+        SIMD_PREFETCH_T0(g);
+        SIMD_PREFETCH_T0(&SL_NEXT(g, link));
+    }
+}
+
+#define __PIPELINE(h, keys, n, i, resolve) do {                         \
+        const size_t _w = FASTHT_BATCH_WINDOW;                          \
+        size_t _j;                                                      \
+        for (_j = 0; _j < (n) && _j < 2*_w; _j++)                       \
+            __prefetch_bucket(h, keys[_j]);                             \
+        for (_j = 0; _j < (n) && _j < _w; _j++)                         \
+            __prefetch_bag(h, keys[_j]);                                \
+        for (i = 0; i < (n); i++) {                                     \
+            if ((i + 2*_w) < (n)) __prefetch_bucket(h, keys[i + 2*_w]); \
+            if ((i + _w)   < (n)) __prefetch_bag(h, keys[i + _w]);      \
+            resolve;                                                    \
+        }                                                               \
+    } while (0)
+
+
+/*
+ * Find 'n' keys; return the number of keys found.
+ */
+size_t
+ht_find_batch(ht* h, const uint64_t *keys, size_t n, void **vals, uint8_t *found)
+{
+    size_t i, nf = 0;
+
+    // Migration moves nodes around; resolve one key at a time.
+    if (h->ob) {
+        for (i = 0; i < n; i++) {
+            vals[i]   = 0;
+            found[i]  = ht_find(h, keys[i], &vals[i]);
+            nf       += found[i];
+        }
+        return nf;
+    }
+
+    if (h->flags & FASTHT_FLAT) {
+        __PIPELINE(h, keys, n, i, ({
+            vals[i]   = 0;
+            found[i]  = htflat_find(h, keys[i], &vals[i]);
+            nf       += found[i];
+        }));
+        return nf;
+    }
+
+    __PIPELINE(h, keys, n, i, ({
+        tuple r;
+        uint64_t k = keys[i];
+        hb *b = &h->b[__hash(k, h->n, h->salt)];
+
+        if (__findx(&r, b, k)) {
+            vals[i]  = r.val;
+            found[i] = 1;
+            nf++;
+        } else {
+            vals[i]  = 0;
+            found[i] = 0;
+        }
+    }));
+
+    return nf;
+}
+
+
+/*
+ * Insert 'n' keys if not already present; return the number of
+ * keys inserted.
+ */
+size_t
+ht_probe_batch(ht* h, const uint64_t *keys, size_t n, void **vals, uint8_t *found)
+{
+    size_t i, ni = 0;
+
+    // NB: an insert may resize the table; the prefetch stages
+    //     recompute the buckets from the current table. A stale
+    //     prefetch is harmless.
+    __PIPELINE(h, keys, n, i, ({
+        void *v = ht_probe(h, keys[i], vals[i]);
+
+        if (v) {
+            vals[i]  = v;
+            found[i] = 1;
+        } else {
+            found[i] = 0;
+            ni++;
+        }
+    }));
+
+    return ni;
+}
+
+
 /*
  * Dump hash table via caller provided output function.
  */
@@ -607,6 +1019,24 @@ ht_dump(ht *h, const char *start, void (*dump)(const char *str, size_t n))
     pr("%s: ht %p: %" PRIu64 " elems; %" PRIu64 "/%" PRIu64 " buckets filled\n",
             start, h, h->nodes, h->fill, h->n);
 
+    if (h->flags & FASTHT_FLAT) {
+        pr("  flat: longest probe %u slots\n", h->maxn);
+        for (uint64_t i = 0; i < h->n; i++) {
+            if (h->ctrl[i] & 0x80) continue;
+            pr("[%" PRIu64 "]: %#2.2x [%#16.16" PRIx64 ", %p]\n", i, h->ctrl[i],
+                    h->slot[i].hk, h->slot[i].hv);
+        }
+        return;
+    }
+
+    if (h->ob) {
+        pr("  migrating: %" PRIu64 "/%" PRIu64 " old buckets done\n", h->omig, h->on);
+        for (uint64_t i = h->omig; i < h->on; i++) {
+            hb *b = &h->ob[i];
+            if (b->nodes) pr("  old [%" PRIu64 "]: %u elems in %u bags\n", i, b->nodes, b->bags);
+        }
+    }
+
     for (uint64_t i = 0; i < h->n; i++) {
         hb *b = &h->b[i];
         pr("[%" PRIu64 "]: %u elems in %u bags\n", i, b->nodes, b->bags);
@@ -0,0 +1,200 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * fastht_internal.h - Internal header for fast-ht and its variants
+ *
+ * Copyright (c) 2015 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o The fingerprint of a bag is a 64-bit word: bytes 0..6 hold the
+ *   low byte of the key in the corresponding slot; the low 7 bits
+ *   of byte 7 are the "control" bits - one per slot (1 = free,
+ *   0 = occupied).
+ */
+
+#ifndef ___FASTHT_INTERNAL_H__tM3qkVb8WcZx1PnD___
+#define ___FASTHT_INTERNAL_H__tM3qkVb8WcZx1PnD___ 1
+
+    /* Provide C linkage for symbols declared here .. */
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "fast/simd.h"
+#include "utils/typeutils.h"
+#include "utils/fast-ht.h"
+#include "utils/arc4random.h"
+
+// alloc and zero an instance of type 'ty'
+#define __NEWZ(ty) ({                           \
+                ty *_x = __alloc(sizeof(ty));   \
+                _x;                             \
+                })
+
+// make an 'n' element array of type 'ty'
+#define __NEWZA(ty, n) ({                           \
+                ty *_x = __alloc((n) * sizeof(ty)); \
+                _x;                                 \
+                })
+
+
+// extract the individual fingerprints
+#define __fp(fp)       ((fp) & ((_U64(1) << 56)-1))
+
+#define __h2(fp)        ((fp) & 0xff)
+
+// extract the control bits
+#define __control(fp)  _U8(0x7f & (fp) >> 56)
+
+// Create a new fingerprint from constituent bits
+#define __mkfp(h2, ctrl) (_U64(h2) | (_U64(ctrl) << 56))
+
+
+// fast/simd.h exports this symbol if we are not on arm64 or amd64
+#ifdef __NO_SIMD__
+
+// software fallback to find matches using bit tricks
+static inline uint8_t
+__find_matches(uint64_t fp_h2, uint8_t h2)
+{
+    uint64_t splat = 0x0101010101010101ULL * h2;
+    uint64_t m = (fp_h2 ^ splat);
+    uint64_t x = ((m - 0x0101010101010101ULL) & ~m) & 0x8080808080808080ULL;
+
+    /* Now use multiplication to gather bits */
+    return 0x7f & ((x * 0x0002040810204081ULL) >> 56);
+}
+
+#else
+
+// Fast version using SIMD on arm64 and amd64
+static inline uint8_t
+__find_matches(uint64_t fp_h2, uint8_t h2)
+{
+    simd_vec128_t h2v = SIMD_SET_EPI64X(0, fp_h2);
+    simd_vec128_t qv  = SIMD_SET1_EPI8(h2);
+    return 0x7f & SIMD_MOVEMASK_EPI8(SIMD_CMPEQ_EPI8(h2v, qv));
+}
+
+#endif  // __NO_SIMD__
+
+
+// get me a random 64-bit number
+static inline uint64_t
+rand64()
+{
+    uint64_t v;
+
+    arc4random_buf(&v, sizeof v);
+    return v;
+}
+
+
+// Mix function from Zi Long Tan's superfast hash
+static inline uint64_t
+_hashmix(uint64_t h)
+{
+    h ^= h >> 23;
+    h *= 0x2127599bf4325c37ULL;
+    h ^= h >> 47;
+    return h;
+}
+
+
+/*
+ * One round of Zi Long Tan's superfast hash
+ */
+static inline uint64_t
+__hash64(uint64_t hv, uint64_t salt)
+{
+    const uint64_t m = 0x880355f21e6d1965ULL;
+
+    hv ^= (_hashmix(hv) ^ salt);
+    return hv * m;
+}
+
+
+static inline uint64_t
+__hash(uint64_t hv, uint64_t n, uint64_t salt)
+{
+    return (n-1) & __hash64(hv, salt);
+}
+
+
+static inline void *
+__alloc(size_t n)
+{
+    void *ptr = 0;
+    int     r = posix_memalign(&ptr, CACHELINE_SIZE, n);
+    assert(r == 0);
+    assert(ptr);
+
+    return memset(ptr, 0, n);
+}
+
+
+// Update the fingerprint to show slot as now occupied.
+// NB: 0 is occupied, 1 is free.
+static inline uint64_t
+__update_fp(uint64_t fp, uint64_t k, int slot)
+{
+    uint8_t ctrl = __control(fp) & ~(1 << slot);
+    uint64_t h2  = __fp(fp) & ~(_U64(0xff) << (8 * slot));
+
+    h2 |= (k & 0xff) << (8 * slot);
+    return h2 | (_U64(ctrl) << 56);
+}
+
+
+// clear the fingerprint in 'slot'
+// NB: 0 is occupied, 1 is free.
+static inline uint64_t
+__clear_fp(uint64_t fp, int slot)
+{
+    uint8_t ctrl = __control(fp) | (1 << slot);
+    uint64_t h2  = __fp(fp) & ~(_U64(0xff) << (8 * slot));
+    return h2 | (_U64(ctrl) << 56);
+}
+
+
+// fingerprint of a bag with all slots free
+#define __FP_EMPTY      __mkfp(0, 0x7f)
+
+
+/*
+ * Flat engine (fast-ht-flat.c); ht_xxx() dispatch to these when
+ * FASTHT_FLAT is set.
+ */
+void  htflat_init(ht *h, uint64_t n);
+void  htflat_fini(ht *h);
+void  htflat_insert_quick(ht *h, uint64_t k, void *v);
+void* htflat_probe(ht *h, uint64_t k, void *v);
+int   htflat_find(ht *h, uint64_t k, void **p_ret);
+int   htflat_replace(ht *h, uint64_t k, void *v);
+int   htflat_remove(ht *h, uint64_t k, void **p_ret);
+void  htflat_iter_init(ht_iter *it);
+int   htflat_iter_next(ht_iter *it, uint64_t *p_key, void **p_val);
+int   htflat_iter_remove(ht_iter *it);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* ! ___FASTHT_INTERNAL_H__tM3qkVb8WcZx1PnD___ */
+
+/* EOF */
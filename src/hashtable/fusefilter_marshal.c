@@ -0,0 +1,288 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * fusefilter_marshal.c - Marshal/Unmarshal of Binary Fuse Filters
+ *
+ * Copyright (c) 2025 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  Same conventions as xorfilter_marshal.c
+ * o  All encoded integers are in Little Endian order
+ * o  Filter data starts on a page boundary (so we can mmap it if
+ *    needed)
+ * o  All information is checksummed using SHA256
+ * o  Disk Layout:
+ *     - 64 byte header:
+ *        * magic         4 bytes [FUSE]
+ *        * version       1 byte
+ *        * isfuse16      1 byte
+ *        * reserved      2 bytes
+ *        * seed          8 bytes
+ *        * seglen        4 bytes
+ *        * segcount      4 bytes
+ *        * size          4 bytes
+ *        * n elems       4 bytes
+ *     - padding to 4k boundary
+ *     - actual filter bytes
+ *     - 32 byte SHA256 sum
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "utils/utils.h"
+#include "fast/encdec.h"
+#include "utils/fusefilter.h"
+#include "xorfilt_internal.h"
+
+// Need libsodium to be installed.
+#include "sodium.h"
+
+/* Darwin doesn't have fdatasync() prototype */
+#ifdef __Darwin__
+extern int fdatasync(int);
+#endif // __Darwin__
+
+
+#define SHASIZE  crypto_hash_sha256_BYTES
+
+static inline uint64_t
+pagesz()
+{
+    return sysconf(_SC_PAGESIZE);
+}
+
+
+static void
+cksum(uint8_t *out, uint8_t *buf, uint64_t sz)
+{
+    uint8_t sbuf[8];
+    crypto_hash_sha256_state h;
+
+    enc_LE_u64(sbuf, sz);
+    crypto_hash_sha256_init(&h);
+    crypto_hash_sha256_update(&h, sbuf, 8);
+    crypto_hash_sha256_update(&h, buf, sz - SHASIZE);
+    crypto_hash_sha256_final(&h, out);
+}
+
+
+/*
+ * Write header to 'p' from Fusefilter 'f' and advance p to next
+ * writable boundary.
+ */
+static uint8_t*
+wrhdr(uint8_t *p, Fusefilter *f)
+{
+    uint8_t *st  = p;
+
+    memcpy(p, "FUSE", 4);  p += 4;
+
+    // version #
+    *p = 1;                p += 1;
+
+    // Filter type
+    *p = f->is_16 ? 1 : 0;  p += 1;
+    p += 2; // padding
+
+    enc_LE_u64(p, f->seed);     p += 8;
+    enc_LE_u32(p, f->seglen);   p += 4;
+    enc_LE_u32(p, f->segcount); p += 4;
+    enc_LE_u32(p, f->size);     p += 4;
+    enc_LE_u32(p, f->n);        p += 4;
+
+    uint64_t pad = pagesz() - (p - st);
+    return p + pad;
+}
+
+/*
+ * Read header at 'p' into Fusefilter 'f' and advance p to next
+ * readable boundary.
+ */
+static uint8_t*
+rdhdr(uint8_t *p, Fusefilter *f)
+{
+    uint8_t *st = p;
+
+    memset(f, 0, sizeof *f);
+
+    if (memcmp(p, "FUSE", 4) != 0) return 0;
+
+    p += 4;
+    if (*p != 1) return 0;  // we only support version #1
+
+    p += 1;
+    f->is_16 = *p;              p += 1;
+    p += 2; // padding
+
+    f->seed     = dec_LE_u64(p); p += 8;
+    f->seglen   = dec_LE_u32(p); p += 4;
+    f->segcount = dec_LE_u32(p); p += 4;
+    f->size     = dec_LE_u32(p); p += 4;
+    f->n        = dec_LE_u32(p); p += 4;
+
+    uint64_t pad = pagesz() - (p - st);
+    return p + pad;
+}
+
+
+// Marshal Fusefilter 'f' to file 'fname'
+int
+Fusefilter_marshal(Fusefilter *f, const char *fname)
+{
+    char file[PATH_MAX];
+    int fd,
+        r = 0;
+    uint64_t fsz    = fusefilter_size(f);
+    uint64_t filesz = fsz;   // total file size
+
+    filesz += pagesz(); // Header is within the first page
+    filesz += SHASIZE;  // trailer has SHA256
+
+    snprintf(file, sizeof file, "%s.tmp.XXXXXX", fname);
+    fd = mkostemp(file, 0);
+    if (fd < 0) return -errno;
+
+    if (ftruncate(fd, filesz) < 0) {
+        r = errno;
+        goto fail;
+    }
+
+    void *mptr = mmap(0, filesz, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mptr == ((void *)-1)) {
+        r = errno;
+        goto fail;
+    }
+
+    uint8_t *st = mptr;
+
+    st = wrhdr(st, f);
+    memcpy(st, f->ptr, fsz);   st += fsz;
+    cksum(st, mptr, filesz);
+
+    munmap(mptr, filesz);
+    fsync(fd);
+    fdatasync(fd);
+    close(fd);
+
+    if (rename(file, fname) < 0) {
+        r = errno;
+        unlink(file);
+        return -r;
+    }
+    return 0;
+
+fail:
+    close(fd);
+    unlink(file);
+    return -r;
+}
+
+
+// Unmarshal Fusefilter from file 'fname' into 'p_f'
+int
+Fusefilter_unmarshal(Fusefilter **p_f, const char *fname, uint32_t flags)
+{
+    const int do_mmap = (flags & FUSEFILTER_MMAP);
+    int r  = 0;
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) return -errno;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)  {
+        r = errno;
+        goto fail2;
+    }
+
+    if (st.st_size < (off_t)(SHASIZE + pagesz())) {
+        r = EILSEQ;
+        goto fail2;
+    }
+
+    void *mptr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mptr == ((void *)-1)) {
+        r = errno;
+        goto fail2;
+    }
+
+    uint8_t *p = mptr;
+    uint8_t sha[SHASIZE];
+
+    cksum(sha, mptr, st.st_size);
+    if (sodium_memcmp(sha, p + st.st_size - SHASIZE, SHASIZE) != 0) {
+        r = EILSEQ;
+        goto fail1;
+    }
+
+    Fusefilter zf;
+    p = rdhdr(p, &zf);
+    if (!p) {
+        r = EINVAL;
+        goto fail1;
+    }
+
+    // Sanity check: the geometry must be what we'd have made for
+    // 'n' elements.
+    Fusefilter g;
+
+    fusefilter_calc_size(&g, zf.n);
+    if (zf.seglen != g.seglen || zf.segcount != g.segcount || zf.size != g.size) {
+        r = EINVAL;
+        goto fail1;
+    }
+
+    if ((uint64_t)(st.st_size - SHASIZE - pagesz()) < fusefilter_size(&zf)) {
+        r = E2BIG;
+        goto fail1;
+    }
+
+    if (do_mmap) {
+        zf.ptr     = p;
+        zf.is_mmap = 1;
+        zf.map     = mptr;
+        zf.mapsz   = st.st_size;
+    } else {
+        uint64_t sz = fusefilter_size(&zf);
+        zf.ptr = NEWZA(uint8_t, sz);
+        assert(zf.ptr);
+
+        memcpy(zf.ptr, p, sz);
+        munmap(mptr, st.st_size);
+    }
+
+    Fusefilter *f = NEWZ(Fusefilter);
+    assert(f);
+    assert(p_f);
+
+    *f   = zf;
+    *p_f = f;
+
+    close(fd);
+    return 0;
+
+fail1:
+    munmap(mptr, st.st_size);
+
+fail2:
+    close(fd);
+    return -r;
+}
+
+/* EOF */
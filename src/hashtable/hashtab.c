@@ -16,6 +16,38 @@
  * suitability for any purpose.
  *
  * Creation date: Wed Jul 14 15:22:47 1997
+ *
+ * Notes
+ * =====
+ * o There is no table lock. The buckets are striped across a fixed
+ *   set of locks (as many as the initial table size); an operation
+ *   only takes the stripe lock of its bucket - shared for lookups
+ *   and exclusive for updates.
+ *
+ * o A bucket and the buckets it splits into are in the same stripe.
+ *   Thus a resize moves the nodes one stripe at a time: it locks a
+ *   stripe, relinks its chains into the new bucket array and points
+ *   the stripe at the new array. Operations on the other stripes
+ *   carry on meanwhile; the old array is freed once every stripe
+ *   has moved. Only one thread resizes at a time ('resizing');
+ *   others that cross the fill threshold meanwhile carry on.
+ *
+ * o Lookup counters are kept in the buckets and the remaining
+ *   statistics are atomics - so that concurrent operations under
+ *   different stripe locks don't contend on a single cache line.
+ *
+ * o Nodes come from a per-table mempool under its own lock. If the
+ *   policy sets 'thread_cache', a table with a locker uses a thread
+ *   caching mempool_mt instead - thus inserts and deletes in
+ *   different stripes share no lock. It is opt-in: each mempool_mt
+ *   uses up a pthread key.
+ *
+ * o With inline keys, a node also holds a copy of the key (if short
+ *   enough); a chain walk then compares the hash and the key bytes
+ *   in the node - and never calls 'cmp' for it. This is not a
+ *   cache win: the node grows by 'keymax' bytes and every lookup
+ *   calls 'key' for the search key. On test/in t_hashbench has
+ *   plain nodes ahead of inline-24 and inline-128.
  */
 
 #include "hashtab_imp.h"
@@ -44,6 +76,106 @@ hashfunc(hash_table * tab, const void * key)
 }
 
 
+/*
+ * The key being looked for: the caller's element and its key bytes
+ * (if the table has inline keys).
+ */
+struct search_key
+{
+    const void * elem;
+    const void * key;
+    size_t       len;
+};
+typedef struct search_key search_key;
+
+
+static inline void
+mkkey(hash_table * tab, search_key * k, const void * elem)
+{
+    k->elem = elem;
+    k->key  = 0;
+    k->len  = 0;
+    if (tab->keymax)
+        k->key = (*tab->key)(elem, &k->len);
+}
+
+
+/* Return true if node 'p' (whose hash is known to match) has key 'k' */
+static inline int
+node_match(hash_table * tab, hash_node * p, const search_key * k)
+{
+    if (p->klen != NODE_KEY_EXT)
+        return p->klen == k->len && 0 == memcmp(p->key, k->key, k->len);
+
+    // A key that isn't inline can't equal one that is.
+    if (k->key && k->len <= tab->keymax)
+        return 0;
+
+    return 0 == (*tab->cmp)(k->elem, p->data);
+}
+
+
+static inline hash_node *
+new_node(hash_table * tab)
+{
+    hash_node * n;
+
+    if (tab->mtpool)
+        return (hash_node *)mempool_mt_alloc(tab->mtpool);
+
+    lockmgr_lock(&tab->plock);
+    n = (hash_node *)mempool_alloc(&tab->pool);
+    lockmgr_unlock(&tab->plock);
+    return n;
+}
+
+
+static inline void
+free_node(hash_table * tab, hash_node * n)
+{
+    if (tab->mtpool) {
+        mempool_mt_free(tab->mtpool, n);
+        return;
+    }
+
+    lockmgr_lock(&tab->plock);
+    mempool_free(&tab->pool, n);
+    lockmgr_unlock(&tab->plock);
+}
+
+
+/* Make the node pool; see the notes above */
+static int
+new_pool(hash_table * tab, const hash_table_policy * tr, size_t n)
+{
+    unsigned int sz = sizeof(hash_node) + tab->keymax;
+    int r;
+
+    if (tr->thread_cache && tr->lock.lock)
+        return mempool_mt_new(&tab->mtpool, &tab->mem, sz, 0, n, 0);
+
+    if ((r = mempool_init(&tab->pool, &tab->mem, sz, 0, n)) < 0)
+        return r;
+
+    tab->plock = tr->lock;
+    lockmgr_create(&tab->plock);
+    return 0;
+}
+
+
+static void
+del_pool(hash_table * tab)
+{
+    if (tab->mtpool) {
+        mempool_mt_delete(tab->mtpool);
+        return;
+    }
+
+    mempool_fini(&tab->pool);
+    lockmgr_delete(&tab->plock);
+}
+
+
 /*
  * Create a new hash table.
  */
@@ -51,7 +183,8 @@ int
 hash_table_new(hash_table_t * ptab, const hash_table_policy * tr)
 {
     hash_table * tab;
-    size_t i;
+    hash_bucket * buckets;
+    size_t i, size;
 
     if ( ! (ptab && tr && tr->mem.alloc && tr->hash && tr->cmp) )
         return -EINVAL;
@@ -64,32 +197,50 @@ hash_table_new(hash_table_t * ptab, const hash_table_policy * tr)
 
     i = tr->logsize <= 0 || (tr->logsize >= (8*sizeof(size_t))) ? 10 : tr->logsize;
 
-    tab->fillmax = tr->fillmax <= 0 || tr->fillmax >= 100 ? 80 : tr->fillmax;
-    tab->size    = 1 << i;
-    tab->random  = arc4random();
-    tab->hash    = tr->hash;
-    tab->cmp     = tr->cmp;
-    tab->dtor    = tr->dtor;
-    tab->mem     = tr->mem;
-    tab->lock    = tr->lock;
-    tab->buckets = tNEWA(hash_bucket, tab, tab->size);
-    if ( !tab->buckets )
+    size = (size_t)1 << i;
+
+    tab->fillmax  = tr->fillmax <= 0 || tr->fillmax >= 100 ? 80 : tr->fillmax;
+    tab->nstripes = size;
+    tab->random   = arc4random();
+    tab->hash     = tr->hash;
+    tab->cmp      = tr->cmp;
+    tab->dtor     = tr->dtor;
+    tab->mem      = tr->mem;
+
+    if (tr->key && tr->keymax) {
+        tab->key    = tr->key;
+        tab->keymax = tr->keymax > HASH_TABLE_KEYMAX ? HASH_TABLE_KEYMAX : tr->keymax;
+    }
+
+    // Start with enough nodes to fill the initial table.
+    if (new_pool(tab, tr, size) < 0)
     {
         memmgr_free(&tr->mem, tab);
         return -ENOMEM;
     }
 
-    memset(tab->buckets, 0, sizeof(hash_bucket) * tab->size);
+    buckets      = tNEWA(hash_bucket, tab, size);
+    tab->stripes = tNEWA(hash_stripe, tab, size);
+    if ( !(buckets && tab->stripes) )
+    {
+        if (buckets)      tFREE(tab, buckets);
+        if (tab->stripes) tFREE(tab, tab->stripes);
+        del_pool(tab);
+        memmgr_free(&tr->mem, tab);
+        return -ENOMEM;
+    }
 
-    /* Initialize locks - hash-table and per-bucket */
-    lockmgr_create(&tab->lock);
+    memset(buckets, 0, sizeof(hash_bucket) * size);
 
-    for (i = 0; i < tab->size; ++i)
+    /* Initialize per-stripe locks */
+    for (i = 0; i < size; ++i)
     {
-        hash_bucket* b = &tab->buckets[i];
+        hash_stripe* st = &tab->stripes[i];
 
-        b->lock = tab->lock;
-        lockmgr_create(&b->lock);
+        st->lock    = tr->lock;
+        st->buckets = buckets;
+        st->size    = size;
+        lockmgr_create(&st->lock);
     }
 
     *ptab        = tab;
@@ -105,10 +256,9 @@ hash_table_new(hash_table_t * ptab, const hash_table_policy * tr)
 void
 hash_table_delete(hash_table * tab)
 {
-    size_t i;
+    size_t i, s;
     void (*dtor)(void*);
     memmgr mem;
-    lockmgr lock;
 
     if (!tab) return;
 
@@ -117,36 +267,35 @@ hash_table_delete(hash_table * tab)
      * Save vital information. We won't have access to it after
      * deleting the table.
      */
-    lock = tab->lock;
     dtor = tab->dtor;
     mem  = tab->mem;
 
     /*
-     * Walk thru each node and dispose of stuff.
+     * Walk thru each node and dispose of stuff. The nodes
+     * themselves go away with the pool. No one else can be using
+     * the table; so every stripe is in the same bucket array.
      */
-    lockmgr_lock(&lock);
-    for (i = 0; i < tab->size; ++i)
+    for (s = 0; s < tab->nstripes; ++s)
     {
-        hash_bucket* b  = &tab->buckets[i];
-        hash_node* gone = SL_FIRST(&b->head);
-        while (gone)
-        {
-            hash_node* next = SL_NEXT(gone, link);
+        hash_stripe* st = &tab->stripes[s];
 
-            if (dtor) (*dtor)(gone->data);
+        for (i = s; dtor && i < st->size; i += tab->nstripes)
+        {
+            hash_bucket* b  = &st->buckets[i];
+            hash_node* gone;
 
-            memmgr_free(&mem, gone);
-            gone = next;
+            SL_FOREACH(gone, &b->head, link) {
+                (*dtor)(gone->data);
+            }
         }
 
-        lockmgr_delete(&b->lock);
+        lockmgr_delete(&st->lock);
     }
 
-    memmgr_free(&mem, tab->buckets);
+    del_pool(tab);
+    memmgr_free(&mem, tab->stripes[0].buckets);
+    memmgr_free(&mem, tab->stripes);
     memmgr_free(&mem, tab);
-
-    lockmgr_unlock(&lock);
-    lockmgr_delete(&lock);
 }
 
 
@@ -199,33 +348,38 @@ int
 hash_table_lookup(hash_table * tab, const void * key, void** p_ret)
 {
     void * ret = 0;
+    hash_stripe * st;
     hash_bucket * b;
-    int (*cmp)(const void*, const void*);
     hash_node   * p;
     int retval = 0;
     uint32_t   hash;
+    search_key k;
 
     if (!(tab && key)) return -EINVAL;
 
     hash  = hashfunc(tab, key);
-    b     = &tab->buckets[hash & (tab->size -1)];
-    cmp   = tab->cmp;
+    mkkey(tab, &k, key);
 
-    lockmgr_lock(&b->lock);
+    st    = tab_stripe(tab, hash);
+    lockmgr_rdlock(&st->lock);
 
+    b     = &st->buckets[hash & (st->size -1)];
     SL_FOREACH(p, &b->head, link) {
         if (p->hash != hash)            continue;
-        if (0 != (*cmp)(key, p->data))  continue;
+        if (!node_match(tab, p, &k))    continue;
 
         ret    = p->data;
         retval = 1;
-        ++tab->stats.lookups;
         break;
     }
 
-    lockmgr_unlock(&b->lock);
+    if (ret)
+        atomic_fetch_add_explicit(&b->lookups, 1, memory_order_relaxed);
+    else
+        atomic_fetch_add_explicit(&b->failed_lookups, 1, memory_order_relaxed);
+
+    lockmgr_rdunlock(&st->lock);
 
-    if (!ret) ++tab->stats.failed_lookups;
     if (p_ret) *p_ret = ret;
 
     return retval;
@@ -240,23 +394,26 @@ hash_table_remove(hash_table * tab, const void * key, void** p_val)
 {
     int retval;
     uint32_t   hash;
+    hash_stripe * st;
     hash_bucket * b;
-    int (*cmp)(const void*, const void*);
     hash_node   * p,
                 ** p_next;
+    search_key k;
 
     if (!(tab && key)) return -EINVAL;
 
     retval = -ENOENT;
     hash   = hashfunc(tab, key);
-    b      = &tab->buckets[hash & (tab->size -1)];
-    cmp    = tab->cmp;
+    mkkey(tab, &k, key);
+
+    st     = tab_stripe(tab, hash);
+    lockmgr_lock(&st->lock);
 
-    lockmgr_lock(&b->lock);
+    b      = &st->buckets[hash & (st->size -1)];
 
     p_next = &SL_FIRST(&b->head);
     while ((p = *p_next)) {
-        if (p->hash == hash && (0 == (*cmp)(key, p->data))) {
+        if (p->hash == hash && node_match(tab, p, &k)) {
             *p_next = SL_NEXT(p, link);
             retval  = 0;
             if (p_val) *p_val = p->data;
@@ -268,7 +425,7 @@ hash_table_remove(hash_table * tab, const void * key, void** p_val)
         }
     }
 
-    lockmgr_unlock(&b->lock);
+    lockmgr_unlock(&st->lock);
 
     return retval;
 }
@@ -281,40 +438,38 @@ hash_table_remove_if(hash_table * tab,
          int (*pred)(void *, const void * p), void * cookie)
 {
     int retval;
-    size_t i, 
-           n;
+    size_t i,
+           s;
 
     if (!(tab && pred)) return -EINVAL;
 
 
-    // have to lock the entire table to protect against resizes when
-    // we are traversing!
-    lockmgr_lock(&tab->lock);
-
+    // Walk the table a stripe at a time; a resize can't move the
+    // buckets of a stripe while we hold its lock.
     retval = 0;
-    n      = tab->size;
-    for (i = 0; i < n; ++i) {
-        hash_bucket* b = &tab->buckets[i];
-        hash_node *  p,
-                  ** p_next;
-
-        // And, protect the bucket against nodes that are being
-        // deleted whilst we are walking the bucket.
-        lockmgr_lock(&b->lock);
-        p_next = &SL_FIRST(&b->head);
-        while ((p = *p_next)) {
-            if ((*pred)(cookie, &p->data)) {
-                ++retval;
-                *p_next = SL_NEXT(p, link);
-                remove_node(tab, b, p);
+    for (s = 0; s < tab->nstripes; ++s) {
+        hash_stripe* st = &tab->stripes[s];
+
+        lockmgr_lock(&st->lock);
+        for (i = s; i < st->size; i += tab->nstripes) {
+            hash_bucket* b = &st->buckets[i];
+            hash_node *  p,
+                      ** p_next;
+
+            p_next = &SL_FIRST(&b->head);
+            while ((p = *p_next)) {
+                if ((*pred)(cookie, &p->data)) {
+                    ++retval;
+                    *p_next = SL_NEXT(p, link);
+                    remove_node(tab, b, p);
+                }
+                else
+                    p_next = &SL_NEXT(p, link);
             }
-            else
-                p_next = &SL_NEXT(p, link);
         }
-        lockmgr_unlock(&b->lock);
+        lockmgr_unlock(&st->lock);
     }
 
-    lockmgr_unlock(&tab->lock);
     return retval;
 }
 
@@ -325,25 +480,25 @@ void
 hash_table_apply(hash_table * tab,
         void (*apply)(void*, const void*), void* cookie)
 {
-    size_t i, n;
+    size_t i, s;
 
     if (!tab || !apply) return;
 
 
-    lockmgr_lock(&tab->lock);
-    n = tab->size;
-    for (i = 0; i < n; ++i) {
-        hash_node * p;
-        hash_bucket* b = &tab->buckets[i];
+    for (s = 0; s < tab->nstripes; ++s) {
+        hash_stripe* st = &tab->stripes[s];
 
-        lockmgr_lock(&b->lock);
-        SL_FOREACH(p, &b->head, link) {
-            (*apply)(cookie, p->data);
+        lockmgr_rdlock(&st->lock);
+        for (i = s; i < st->size; i += tab->nstripes) {
+            hash_node * p;
+            hash_bucket* b = &st->buckets[i];
+
+            SL_FOREACH(p, &b->head, link) {
+                (*apply)(cookie, p->data);
+            }
         }
-        lockmgr_unlock(&b->lock);
+        lockmgr_rdunlock(&st->lock);
     }
-
-    lockmgr_unlock(&tab->lock);
 }
 
 
@@ -351,14 +506,39 @@ hash_table_apply(hash_table * tab,
 hash_table_stat *
 hash_table_stats(hash_table * tab, hash_table_stat * stat)
 {
+    hash_table_counters * c;
+    size_t i, s;
+
     if (!(tab && stat)) return 0;
 
-    lockmgr_lock(&tab->lock);
+    c = &tab->stats;
+
+    stat->size           = 0;
+    stat->nodes          = atomic_load(&c->nodes);
+    stat->fill           = atomic_load(&c->fill);
+    stat->maxchainlen    = atomic_load(&c->maxchainlen);
+    stat->splits         = atomic_load(&c->splits);
+    stat->inserts        = atomic_load(&c->inserts);
+    stat->lookups        = atomic_load(&c->lookups);
+    stat->failed_lookups = atomic_load(&c->failed_lookups);
+    stat->replaces       = atomic_load(&c->replaces);
+    stat->deletes        = atomic_load(&c->deletes);
+
+    for (s = 0; s < tab->nstripes; ++s) {
+        hash_stripe* st = &tab->stripes[s];
+
+        lockmgr_rdlock(&st->lock);
+        if (st->size > stat->size) stat->size = st->size;
 
-    *stat      = tab->stats;
-    stat->size = tab->size;
+        for (i = s; i < st->size; i += tab->nstripes) {
+            hash_bucket* b = &st->buckets[i];
+
+            stat->lookups        += atomic_load_explicit(&b->lookups, memory_order_relaxed);
+            stat->failed_lookups += atomic_load_explicit(&b->failed_lookups, memory_order_relaxed);
+        }
+        lockmgr_rdunlock(&st->lock);
+    }
 
-    lockmgr_unlock(&tab->lock);
     return stat;
 }
 
@@ -368,6 +548,27 @@ hash_table_stats(hash_table * tab, hash_table_stat * stat)
  */
 
 
+/* raise '*p' to 'v' if it is smaller */
+static inline void
+stat_max(atomic_size_t * p, size_t v)
+{
+    size_t o = atomic_load_explicit(p, memory_order_relaxed);
+
+    while (v > o &&
+           !atomic_compare_exchange_weak_explicit(p, &o, v,
+                        memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+
+/* return true if a table of 'size' buckets, 'fill' occupied, must grow */
+static inline int
+must_grow(hash_table * tab, size_t size, size_t fill)
+{
+    return ((fill * 100) / (size + 1)) > tab->fillmax;
+}
+
+
 /*
  * Return 0 on success, -errno on failure.
  */
@@ -376,16 +577,24 @@ insert_internal(hash_table * tab, void ** p_data, int op)
 {
     void * data = *p_data;
     int retval  = -ENOMEM;
+    int grow    = 0;
+    size_t count;
     hash_node* e;
-    int (*cmp)(const void*, const void*) = tab->cmp;
+    search_key k;
 
     uint32_t hash  = hashfunc(tab, data);
-    hash_bucket* b = &tab->buckets[hash & (tab->size-1)];
+    hash_stripe* st;
+    hash_bucket* b;
+
+    mkkey(tab, &k, data);
+
+    st = tab_stripe(tab, hash);
+    lockmgr_lock(&st->lock);
 
-    lockmgr_lock(&b->lock);
+    b = &st->buckets[hash & (st->size-1)];
     SL_FOREACH(e, &b->head, link) {
         if (e->hash != hash)            continue;
-        if (0 != (*cmp)(data, e->data)) continue;
+        if (!node_match(tab, e, &k))    continue;
 
 
         /*
@@ -402,7 +611,7 @@ insert_internal(hash_table * tab, void ** p_data, int op)
                 if (tab->dtor) (*tab->dtor)(e->data);
                 *p_data = e->data;
                 e->data = data;
-                ++tab->stats.replaces;
+                atomic_fetch_add_explicit(&tab->stats.replaces, 1, memory_order_relaxed);
                 retval  = 0;
                 break;
 
@@ -421,42 +630,49 @@ insert_internal(hash_table * tab, void ** p_data, int op)
      * element in question.
      */
 
-    e = tNEW(hash_node, tab);
+    e = new_node(tab);
     if (!e) goto _done;
 
     retval  = 0;
     e->data = data;
     e->hash = hash;
+    e->klen = NODE_KEY_EXT;
+    if (k.key && k.len <= tab->keymax) {
+        e->klen = k.len;
+        memcpy(e->key, k.key, k.len);
+    }
     SL_INSERT_HEAD(&b->head, e, link);
-    lockmgr_unlock(&b->lock);
-
+    count   = ++b->count;
 
     /*
-     * Update statistics and see if table needs to grow.
+     * If one more bucket got filled, examine the total number of
+     * filled buckets and determine if we need to grow the hash
+     * table.
      */
-    lockmgr_lock(&tab->lock);
+    if (count == 1) {
+        size_t fill = 1 + atomic_fetch_add_explicit(&tab->stats.fill, 1, memory_order_relaxed);
 
-    ++tab->stats.inserts;
-    ++tab->stats.nodes;
-    ++b->count;
-    if (b->count > tab->stats.maxchainlen)
-        tab->stats.maxchainlen = b->count;
+        grow = must_grow(tab, st->size, fill);
+    }
+    lockmgr_unlock(&st->lock);
 
 
     /*
-     * If one more bucket got filled, examine the total number of
-     * filled buckets and determine if we need to grow the hash
-     * table.
+     * Update statistics and see if table needs to grow.
      */
-    if (b->count == 1) {
-        ++tab->stats.fill;
-        if ( ((tab->stats.fill * 100) / (tab->size + 1)) > tab->fillmax )
-            retval = resize(tab);
-    }
+    atomic_fetch_add_explicit(&tab->stats.inserts, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&tab->stats.nodes, 1, memory_order_relaxed);
+    stat_max(&tab->stats.maxchainlen, count);
+
+    // The resize takes the stripe locks one by one; it must be
+    // called after we relinquish ours.
+    if (grow)
+        retval = resize(tab);
 
-    lockmgr_unlock(&tab->lock);
+    return retval;
 
 _done:
+    lockmgr_unlock(&st->lock);
     return retval;
 }
 
@@ -464,82 +680,120 @@ _done:
 
 /*
  * Grow the hash table.
+ *
+ * Called without holding any locks.
  */
 static int
 resize(hash_table * tab)
 {
     size_t  i,
-            n       = tab->size,
-            newsize = n << 1,
-            fill    = 0,
-            maxchainlen = 0;
-
-    lockmgr* lock = &tab->lock;
-    hash_bucket * buckets = tNEWA(hash_bucket, tab, newsize);
+            s,
+            n,
+            ns = tab->nstripes,
+            newsize;
+    int busy = 0;
+
+    hash_bucket * old,
+                * buckets;
+
+    // Someone else is already on it.
+    if (!atomic_compare_exchange_strong(&tab->resizing, &busy, 1))
+        return 0;
+
+    // Only the resizer changes the bucket arrays of the stripes; so
+    // it can read them without the locks. And a resize may've
+    // completed since our caller checked the fill.
+    old = tab->stripes[0].buckets;
+    n   = tab->stripes[0].size;
+    if (!must_grow(tab, n, atomic_load(&tab->stats.fill))) {
+        atomic_store(&tab->resizing, 0);
+        return 0;
+    }
 
-    if (!buckets) return -ENOMEM;
+    newsize = n << 1;
+    buckets = tNEWA(hash_bucket, tab, newsize);
+    if (!buckets) {
+        atomic_store(&tab->resizing, 0);
+        return -ENOMEM;
+    }
 
     memset(buckets, 0, newsize * sizeof(hash_bucket));
 
-    // Now, redistribute old nodes into new buckets
-    for (i = 0; i < n; ++i) {
-        hash_bucket* b = &tab->buckets[i];
+    // The chains are recounted as they move.
+    atomic_store(&tab->stats.maxchainlen, 0);
+
+    // Move the buckets of each stripe into the new array. The
+    // buckets of stripe 's' land in buckets that are also in 's';
+    // thus the other stripes don't see the new array until we get
+    // to them.
+    for (s = 0; s < ns; ++s) {
+        hash_stripe* st = &tab->stripes[s];
+        size_t filled  = 0,
+               emptied = 0,
+               maxchainlen = 0;
+
+        lockmgr_lock(&st->lock);
+        for (i = s; i < n; i += ns) {
+            hash_bucket* b = &old[i];
+            hash_node * p  = SL_FIRST(&b->head);
 
-        lockmgr_lock(&b->lock);
-        hash_node * p  = SL_FIRST(&b->head);
-        while (p) {
-            hash_node * next   = SL_NEXT(p, link);
-            hash_bucket * newb = &buckets[p->hash & (newsize-1)];
+            if (p) ++emptied;
 
-            SL_INSERT_HEAD(&newb->head, p, link);
-            if ( ++newb->count > maxchainlen )
-                maxchainlen = newb->count;
+            while (p) {
+                hash_node * next   = SL_NEXT(p, link);
+                hash_bucket * newb = &buckets[p->hash & (newsize-1)];
 
-            if (newb->count == 1)
-                ++fill;
+                SL_INSERT_HEAD(&newb->head, p, link);
+                if (++newb->count == 1)
+                    ++filled;
 
-            p = next;
+                if (newb->count > maxchainlen)
+                    maxchainlen = newb->count;
+
+                p = next;
+            }
+
+            // retire the lookup counters of the old bucket
+            atomic_fetch_add(&tab->stats.lookups, atomic_load(&b->lookups));
+            atomic_fetch_add(&tab->stats.failed_lookups, atomic_load(&b->failed_lookups));
         }
-        lockmgr_unlock(&b->lock);
 
-        // Copy the lock to the new buckets
-        buckets[i].lock = b->lock;
-    }
+        atomic_fetch_add(&tab->stats.fill, filled);
+        atomic_fetch_sub(&tab->stats.fill, emptied);
+        stat_max(&tab->stats.maxchainlen, maxchainlen);
 
-    // initialize locks for new buckets.
-    for (i = n; i < newsize; ++i) {
-        hash_bucket* new = &buckets[i];
-        new->lock = *lock;
-        lockmgr_create(&new->lock);
+        st->buckets = buckets;
+        st->size    = newsize;
+        lockmgr_unlock(&st->lock);
     }
 
-    hash_bucket* oldb = tab->buckets;
-    tab->buckets = buckets;
-    tab->size    = newsize;
+    // Every stripe is in the new array; no one can be looking at
+    // the old one.
+    tFREE(tab, old);
 
-    ++tab->stats.splits;
-    tab->stats.maxchainlen = maxchainlen;
-    tab->stats.fill        = fill;
-
-    tFREE(tab, oldb);
+    atomic_fetch_add(&tab->stats.splits, 1);
+    atomic_store(&tab->resizing, 0);
 
     return 0;
 }
 
 
-/* delete 'gone' and adjust statistics for bucket 'b' */
+/*
+ * delete 'gone' and adjust statistics for bucket 'b'.
+ * Called with the stripe of 'b' locked exclusively.
+ */
 static void
 remove_node(hash_table * tab, hash_bucket * b, hash_node * gone)
 {
     if (tab->dtor) (*tab->dtor) (gone->data);
 
-    tFREE(tab, gone);
+    free_node(tab, gone);
 
-    ++tab->stats.deletes;
-    --tab->stats.nodes;
+    atomic_fetch_add_explicit(&tab->stats.deletes, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&tab->stats.nodes, 1, memory_order_relaxed);
 
     if (0 == --b->count) {
-        --tab->stats.fill;
+        atomic_fetch_sub_explicit(&tab->stats.fill, 1, memory_order_relaxed);
         assert(!SL_FIRST(&b->head));
     } else {
         assert(SL_FIRST(&b->head));
@@ -20,6 +20,8 @@
 #define __HASH2_IMP_H__
 
 #include "utils/hashtab.h"
+#include "utils/mempool.h"
+#include "utils/mempool-mt.h"
 #include "fast/list.h"
 
 #include <stdio.h>
@@ -28,27 +30,60 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdatomic.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 
+/*
+ * Statistics that are updated concurrently by threads holding
+ * different stripe locks. The lookup counters live in the buckets;
+ * the ones here hold the totals of the buckets that were retired by
+ * a resize.
+ */
+struct hash_table_counters
+{
+    atomic_size_t nodes;
+    atomic_size_t fill;
+    atomic_size_t maxchainlen;
+
+    atomic_int  splits;
+    atomic_int  inserts;
+    atomic_int  lookups;
+    atomic_int  failed_lookups;
+    atomic_int  replaces;
+    atomic_int  deletes;
+};
+typedef struct hash_table_counters hash_table_counters;
+
+
 /*
  * Each item in a collision chain is called a hash-node.
  *
  * The hash_node_head points to the beginning of such nodes.
+ *
+ * When the table has inline keys, 'key' holds 'keymax' bytes and
+ * 'klen' is the length of the key copied into it; keys that don't
+ * fit have 'klen' set to NODE_KEY_EXT. Without inline keys, every
+ * node is NODE_KEY_EXT and has no room for the key.
  */
 struct hash_node
 {
     SL_LINK(hash_node) link;
 
     uint32_t hash;
+    uint16_t klen;
 
     void*   data;
+
+    uint8_t key[];
 };
 typedef struct hash_node hash_node;
 
+#define NODE_KEY_EXT        0xffff
+
 
 /*
  * Head of the collision chain.
@@ -65,20 +100,46 @@ struct hash_bucket
     /* Number of nodes in this bucket. */
     size_t count;
 
-    /* Per bucket locking. */
-    lockmgr lock;
+    /*
+     * Lookup counters; these are updated under a shared lock. Keeping
+     * them in the bucket spreads the cache line traffic of concurrent
+     * readers across the table.
+     */
+    atomic_uint lookups;
+    atomic_uint failed_lookups;
 };
 typedef struct hash_bucket  hash_bucket;
 
 
+/*
+ * Lock stripe: bucket 'i' is guarded by stripe 'i % nstripes'. The
+ * number of stripes is the initial table size; since the table only
+ * doubles, a bucket and the two it splits into are in the same
+ * stripe.
+ *
+ * A stripe also points to the bucket array its buckets are in. A
+ * resize moves the buckets one stripe at a time under that stripe's
+ * lock; until it is done, some stripes point to the old array and
+ * the rest to the new one.
+ */
+struct hash_stripe
+{
+    lockmgr lock;
+
+    hash_bucket * buckets;
+    size_t  size;
+};
+typedef struct hash_stripe hash_stripe;
+
+
 
 struct hash_table
 {
-    /* Hash buckets. */
-    hash_bucket *  buckets;
+    /* Lock stripes and their bucket arrays; see above. */
+    hash_stripe *  stripes;
 
-    /* table size; always a power of two. */
-    size_t  size;
+    /* number of stripes; always a power of two. */
+    size_t  nstripes;
 
     /* max fill percentage - after which the table is split */
     size_t fillmax;
@@ -93,18 +154,38 @@ struct hash_table
     uint32_t (*hash)(const void*);
     int       (*cmp)(const void*, const void*);
     void     (*dtor)(void *);
+    hash_key_f* key;
+
+    /* max length of an inline key; 0 if keys aren't inline */
+    size_t keymax;
+
+    /*
+     * Hash nodes come from a per-table pool (all the nodes of a
+     * table are the same size): a plain mempool ('pool') guarded
+     * by 'plock' - or, if the policy asks for it, a thread caching
+     * pool ('mtpool') that needs no lock.
+     */
+    mempool_mt * mtpool;
+    mempool      pool;
+    lockmgr      plock;
 
 
-    /* Memory allocator and lock manager */
+    /*
+     * Memory allocator. There is no table lock: lookups take the
+     * stripe lock of their bucket shared and updates take it
+     * exclusive.
+     */
     memmgr   mem;
-    lockmgr  lock;
+
+    /* Set while a thread is resizing the table. */
+    atomic_int resizing;
 
     /*
      * Statistics about the hash table. 
      * The information above (size,nodes,fill) are duplicates of
      * items in this struct to provide some speed benefits.
      */
-    hash_table_stat stats;
+    hash_table_counters stats;
 };
 typedef struct hash_table hash_table;
 
@@ -151,7 +232,7 @@ typedef struct sorted_iter sorted_iter;
  */
 struct bucket_iter
 {
-    hash_bucket *bucket;
+    uint32_t hash;
 };
 typedef struct bucket_iter bucket_iter;
 
@@ -207,6 +288,14 @@ struct hash_table_iter
 
 
 
+/* Return the stripe of the bucket with hash value (or index) 'h' */
+static inline hash_stripe *
+tab_stripe(hash_table * tab, size_t h)
+{
+    return &tab->stripes[h & (tab->nstripes - 1)];
+}
+
+
 #define tNEW(typ,tab)       (typ*)memmgr_alloc(&(tab)->mem, sizeof(typ))
 #define tNEWA(typ,tab,n)    (typ*)memmgr_alloc(&(tab)->mem, (n)*sizeof(typ))
 #define tFREE(tab,p)        memmgr_free(&(tab)->mem, (p))
@@ -119,13 +119,9 @@ hash_table_iter_delete(hash_table_iter * it)
         assert (it->table);
         assert (it->op);
 
-        lockmgr_lock(&tab->lock);
-
         (*it->op->end)(it);
 
         tFREE(tab, it);
-
-        lockmgr_unlock(&tab->lock);
     }
 }
 
@@ -145,12 +141,8 @@ hash_table_iter_item(hash_table_iter * it)
     assert(it->table);
     assert(it->op);
 
-    lockmgr_lock(&it->table->lock);
-
     p = (*it->op->item)(it);
 
-    lockmgr_unlock(&it->table->lock);
-
     return p;
 }
 
@@ -171,12 +163,8 @@ hash_table_iter_first(hash_table_iter * it)
     assert(it->table);
     assert(it->op);
 
-    lockmgr_lock(&it->table->lock);
-
     v = (*it->op->begin)(it);
 
-    lockmgr_unlock(&it->table->lock);
-
     return v;
 }
 
@@ -197,12 +185,8 @@ hash_table_iter_next(hash_table_iter * it)
     assert(it->table);
     assert(it->op);
 
-    lockmgr_lock(&it->table->lock);
-
     v = (*it->op->next)(it);
 
-    lockmgr_unlock(&it->table->lock);
-
     return v;
 }
 
@@ -220,14 +204,11 @@ _mk_iter(hash_table_iter_t* p_ret,
          hash_table * tab, int type, const void * param)
 {
     hash_table_iter * it;
-    int retval = 0;
-
-    lockmgr_lock(&tab->lock);
 
     it = tNEW(hash_table_iter, tab);
     if (!it) {
-        retval = -ENOMEM;
-        goto _done;
+        *p_ret = 0;
+        return -ENOMEM;
     }
 
     memset (it, 0, sizeof (*it));
@@ -237,24 +218,33 @@ _mk_iter(hash_table_iter_t* p_ret,
     if (it->op->init)
         (*it->op->init)(it, param);
 
-_done:
-    lockmgr_unlock(&tab->lock);
-
     *p_ret = it;
-    return retval;
+    return 0;
 }
 
 
 /* -- Unsorted iterator -- */
 
+/*
+ * Point at the first node of the first non-empty bucket from 'i'
+ * onwards. Each bucket is looked at under its stripe lock; the
+ * stripe may be in the old or the new array of a resize.
+ */
 static inline void
 find_next_node(hash_table_iter* it, size_t i)
 {
     hash_table* tab = it->table;
-    size_t n = tab->size;
 
-    for (; i < n; ++i) {
-        it->cur = SL_FIRST(&tab->buckets[i].head);
+    for (;; ++i) {
+        hash_stripe* st = tab_stripe(tab, i);
+        int end;
+
+        lockmgr_rdlock(&st->lock);
+        end     = i >= st->size;
+        it->cur = end ? 0 : SL_FIRST(&st->buckets[i].head);
+        lockmgr_rdunlock(&st->lock);
+
+        if (end) return;
         if (it->cur)  {
             it->un.table.bucket = i;
             return;
@@ -324,9 +314,10 @@ static int
 sorted_iter_init(hash_table_iter * it, const void * param)
 {
     hash_table * tab = it->table;
-    indir_node * nodes;
+    indir_node * nodes,
+               * end;
     sorted_iter * sorted = &it->un.sorted;
-    size_t i, n;
+    size_t i, s;
     hash_cmp_f * cmp;
     int ok = EOF;
 
@@ -334,29 +325,38 @@ sorted_iter_init(hash_table_iter * it, const void * param)
 
     USEARG(param);
 
-    lockmgr_lock(&tab->lock);
-    sorted->max = tab->stats.nodes;
+    // Other threads may add nodes while we walk the buckets; we
+    // only take as many as we sized the array for.
+    sorted->max = atomic_load(&tab->stats.nodes);
     if (sorted->max == 0) goto _done;
 
     cmp         = tab->cmp;
     sorted->nodes = tNEWA(indir_node, tab, sorted->max);
 
     nodes = sorted->nodes;
-    n     = tab->size;
-    for (i = 0; i < n; ++i)
+    end   = nodes + sorted->max;
+    for (s = 0; s < tab->nstripes && nodes < end; ++s)
     {
-        hash_bucket * b = &tab->buckets[i];
-        hash_node * node;
+        hash_stripe * st = &tab->stripes[s];
 
-        lockmgr_lock(&b->lock);
-        SL_FOREACH(node, &b->head, link)
+        lockmgr_rdlock(&st->lock);
+        for (i = s; i < st->size && nodes < end; i += tab->nstripes)
         {
-            nodes->node = node;
-            nodes->cmp = cmp;
-            ++nodes;
+            hash_bucket * b = &st->buckets[i];
+            hash_node * node;
+
+            SL_FOREACH(node, &b->head, link)
+            {
+                if (nodes == end) break;
+
+                nodes->node = node;
+                nodes->cmp = cmp;
+                ++nodes;
+            }
         }
-        lockmgr_unlock(&b->lock);
+        lockmgr_rdunlock(&st->lock);
     }
+    sorted->max = nodes - sorted->nodes;
 
     // XXX We are holding a pointer to 'node'. A different thread
     // can delete it after we relinquish the lock!
@@ -366,7 +366,6 @@ sorted_iter_init(hash_table_iter * it, const void * param)
     ok = 0;
 
 _done:
-    lockmgr_unlock(&tab->lock);
     return ok;
 }
 
@@ -443,11 +442,11 @@ static int
 bucket_iter_init(hash_table_iter * it, const void * key)
 {
     hash_table * tab = it->table;
-    uint32_t  hash  = (*tab->hash)(key);
-    hash_bucket * b  = &tab->buckets[hash & (tab->size -1)];
 
-    it->un.bucket.bucket = b;
-    it->cur = SL_FIRST(&b->head);
+    // The bucket can move in a resize; so we remember the hash
+    // (salted like the table does) and find the bucket on begin.
+    it->un.bucket.hash = tab->random ^ (*tab->hash)(key);
+    bucket_iter_begin(it);
 
     return 0;
 }
@@ -457,9 +456,14 @@ bucket_iter_init(hash_table_iter * it, const void * key)
 static int
 bucket_iter_begin(hash_table_iter * it)
 {
-    bucket_iter * bi = &it->un.bucket;
+    hash_table * tab = it->table;
+    uint32_t  hash   = it->un.bucket.hash;
+    hash_stripe * st = tab_stripe(tab, hash);
+
+    lockmgr_rdlock(&st->lock);
+    it->cur = SL_FIRST(&st->buckets[hash & (st->size -1)].head);
+    lockmgr_rdunlock(&st->lock);
 
-    it->cur = SL_FIRST(&bi->bucket->head);
     return it->cur ? 0 : EOF;
 }
 
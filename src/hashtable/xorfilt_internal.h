@@ -24,6 +24,8 @@ extern "C" {
 
 #include <stdint.h>
 #include <math.h>
+#include "fast/vect.h"
+#include "utils/arc4random.h"
 
 /*
  * Holds the state for the Xorfilter. We keep this opaque to
@@ -44,6 +46,13 @@ struct Xorfilter {
 };
 typedef struct Xorfilter Xorfilter;
 
+/*
+ * Slack after the fingerprints: the batched lookups gather 32-bit
+ * words at fingerprint offsets. A marshaled filter has the
+ * checksum after the fingerprints.
+ */
+#define XORFILTER_PAD       4
+
 // Return filter size in bytes
 static inline uint64_t
 xorfilter_size(Xorfilter *x)
@@ -63,6 +72,248 @@ xorfilter_calc_size(size_t n)
     return size;
 }
 
+
+/*
+ * Binary fuse filter (see fusefilter.c). The 'size' fingerprints
+ * are 'segcount + 2' segments of 'seglen' each; the fields up to
+ * 'n' are what's marshaled.
+ */
+struct Fusefilter {
+    union {
+        uint8_t *fp8;
+        uint16_t *fp16;
+        void *ptr;
+    };
+    uint64_t seed;
+    uint32_t seglen;        // segment length (power of 2)
+    uint32_t segcount;      // number of segments a key can start in
+    uint32_t size;          // number of fingerprints
+    uint32_t n;             // number of elements
+    uint8_t  is_16;
+    uint8_t  is_mmap;
+
+    // file mapping for an unmarshaled filter
+    void    *map;
+    uint64_t mapsz;
+};
+typedef struct Fusefilter Fusefilter;
+
+// Largest segment
+#define FUSEFILTER_MAXSEG       (1 << 18)
+
+// Return filter size in bytes
+static inline uint64_t
+fusefilter_size(Fusefilter *f)
+{
+    uint64_t sz = f->size;
+
+    return f->is_16 ? sz * 2 : sz;
+}
+
+/*
+ * Given number of elements, calculate the segment length, segment
+ * count and size of the fuse filter. The constants are from the
+ * reference implementation of the paper.
+ */
+static inline void
+fusefilter_calc_size(Fusefilter *f, uint32_t n)
+{
+    double   dn  = (double)n;
+    uint32_t len = n > 1 ? 1 << (int)floor((log(dn) / log(3.33)) + 2.25) : 4;
+    double   sf  = n > 1 ? fmax(1.125, 0.875 + (0.25 * log(1000000.0) / log(dn))) : 0.0;
+    uint64_t cap = (uint64_t)round(dn * sf);
+    uint64_t nseg;
+
+    if (len > FUSEFILTER_MAXSEG) len = FUSEFILTER_MAXSEG;
+
+    // 'cap' fingerprints, less the two segments past the last start
+    nseg = (cap + len - 1) / len;
+    nseg = nseg > 2 ? nseg - 2 : 1;
+
+    f->seglen   = len;
+    f->segcount = nseg;
+    f->size     = (nseg + 2) * len;
+}
+
+
+// get me a random 64-bit number
+static inline uint64_t
+rand64()
+{
+    uint64_t x;
+
+    arc4random_buf(&x, sizeof x);
+    return x;
+}
+
+
+/*
+ * Index into the linear Fingerprint array.
+ * These are derived from three hashes h0, h1, h2
+ */
+struct fpidx {
+    uint32_t i, j, k;
+};
+typedef struct fpidx fpidx;
+
+
+// Compression function from fasthash
+static inline uint64_t
+mix(uint64_t h)
+{
+    h ^= h >> 23;
+    h *= 0x2127599bf4325c37ULL;
+    h ^= h >> 47;
+    return h;
+}
+
+static inline uint64_t
+__mix(uint64_t h)
+{
+    h = (h << 27) | (h >> (64 - 27));
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+ * fasthash64() - but tuned for exactly _one_ round and
+ * one 64-bit word.
+ *
+ * Borrowed from Zilong Tan's superfast hash.
+ * Copyright (C) 2012 Zilong Tan (eric.zltan@gmail.com)
+ */
+static inline uint64_t
+hashkey(uint64_t v, uint64_t salt)
+{
+    const uint64_t m = 0x880355f21e6d1965ULL;
+    uint64_t h       = salt ^ (8 * m);
+
+    h ^= mix(v);
+    h *= m;
+
+    return mix(h);
+}
+
+static inline uint32_t
+__geth0(uint64_t h, uint32_t size)
+{
+    return h % size;
+}
+
+static inline uint32_t
+__geth1(uint64_t h, uint32_t size)
+{
+    return __mix(h) % size;
+}
+
+static inline uint32_t
+__geth2(uint64_t h, uint32_t size)
+{
+    return __mix(__mix(h)) % size;
+}
+
+/*
+ * We compute all 3 indices to access the fingerprints in the large
+ * linear fp8/fp16 array.
+ */
+static inline fpidx
+hash3(uint64_t h, uint32_t size)
+{
+    fpidx z = {
+        .i = __geth0(h, size),
+        .j = __geth1(h, size) + size,
+        .k = __geth2(h, size) + (2 * size),
+    };
+
+    return z;
+};
+
+// Given a hashed quantity, return its 8 bit fingerprint
+static inline uint8_t
+__xfp8(uint64_t h)
+{
+    return 0xff & (h ^ (h >> 32));
+}
+
+// Given a hashed quantity, return its 16 bit fingerprint
+static inline uint16_t
+__xfp16(uint64_t h)
+{
+    return 0xffff & (h ^ (h >> 32));
+}
+
+
+// hash-mask and # of times we saw it
+struct xorset
+{
+    uint64_t mask;
+    uint64_t n;
+};
+typedef struct xorset xorset;
+
+// reverse map of hashmask to the index we saw it
+struct keyidx
+{
+    uint64_t hash;
+    uint64_t idx;
+};
+typedef struct keyidx keyidx;
+
+VECT_TYPEDEF(keyvect, keyidx);
+
+
+// Give up after these many attempts to build a filter
+#define XORFILTER_MAXTRIES      1000000
+
+
+/*
+ * Update xorset 's' with new entry from index 'i'
+ */
+static inline void
+__update_q(keyvect *q, xorset *xs, uint32_t i, uint64_t h)
+{
+    xorset *x = &xs[i];
+
+    x->mask ^= h;
+    if (--x->n == 1) {
+        keyidx ki = {
+            .hash = x->mask,
+            .idx  = i,
+        };
+        VECT_PUSH_BACK(q, ki);
+    }
+}
+
+
+/*
+ * Peel the singletons in 'q' and all the ones that uncovers; each
+ * peeled key is pushed on 'stack'.
+ */
+static inline void
+xorfilter_peel(keyvect *q, keyvect *stack, xorset *H, uint32_t size)
+{
+    while (VECT_LEN(q) > 0) {
+        keyidx ki = VECT_POP_BACK(q);
+
+        if (H[ki.idx].n != 1) continue;
+
+        // sole element in H[i]
+        VECT_PUSH_BACK(stack, ki);
+        fpidx z = hash3(ki.hash, size);
+
+        __update_q(q, H, z.i, ki.hash);
+        __update_q(q, H, z.j, ki.hash);
+        __update_q(q, H, z.k, ki.hash);
+    }
+}
+
+
+/*
+ * Assign the fingerprints of the peeled keys in 'stack' (in reverse
+ * order of peeling) and return 'x'; consumes 'stack'.
+ */
+extern Xorfilter *__xorfilter_assign(Xorfilter *x, keyvect *stack, int is16);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -40,152 +40,16 @@
  *               h2 = mix(mix(h))
  */
 #include <stdint.h>
+#include <string.h>
 #include <inttypes.h>
 #include <math.h>
-#include <sys/random.h>
 #include "fast/vect.h"
+#include "fast/simd.h"
+#include "fast/fastdiv.h"
+#include "utils/utils.h"
 #include "utils/xorfilter.h"
 #include "xorfilt_internal.h"
 
-/*
- * Index into the linear Fingerprint array.
- * These are derived from three hashes h0, h1, h2
- */
-struct fpidx {
-    uint32_t i, j, k;
-};
-typedef struct fpidx fpidx;
-
-static uint64_t
-rand64()
-{
-    uint64_t x;
-    getentropy(&x, sizeof x);
-    return x;
-}
-
-// Compression function from fasthash
-static inline uint64_t
-mix(uint64_t h)
-{
-    h ^= h >> 23;
-    h *= 0x2127599bf4325c37ULL;
-    h ^= h >> 47;
-    return h;
-}
-
-static inline uint64_t
-__mix(uint64_t h)
-{
-    h = (h << 27) | (h >> (64 - 27));
-    h ^= h >> 32;
-    return h;
-}
-
-/*
- * fasthash64() - but tuned for exactly _one_ round and
- * one 64-bit word.
- *
- * Borrowed from Zilong Tan's superfast hash.
- * Copyright (C) 2012 Zilong Tan (eric.zltan@gmail.com)
- */
-static uint64_t
-hashkey(uint64_t v, uint64_t salt)
-{
-    const uint64_t m = 0x880355f21e6d1965ULL;
-    uint64_t h       = salt ^ (8 * m);
-
-    h ^= mix(v);
-    h *= m;
-
-    return mix(h);
-}
-
-static inline uint32_t
-__geth0(uint64_t h, uint32_t size)
-{
-    return h % size;
-}
-
-static inline uint32_t
-__geth1(uint64_t h, uint32_t size)
-{
-    return __mix(h) % size;
-}
-
-static inline uint32_t
-__geth2(uint64_t h, uint32_t size)
-{
-    return __mix(__mix(h)) % size;
-}
-
-/*
- * We compute all 3 indices to access the fingerprints in the large
- * linear fp8/fp16 array.
- */
-static inline fpidx
-hash3(uint64_t h, uint32_t size)
-{
-    fpidx z = {
-        .i = __geth0(h, size),
-        .j = __geth1(h, size) + size,
-        .k = __geth2(h, size) + (2 * size),
-    };
-
-    return z;
-};
-
-// Given a hashed quantity, return its 8 bit fingerprint
-static inline uint8_t
-__xfp8(uint64_t h)
-{
-    return 0xff & (h ^ (h >> 32));
-}
-
-// Given a hashed quantity, return its 16 bit fingerprint
-static inline uint16_t
-__xfp16(uint64_t h)
-{
-    return 0xffff & (h ^ (h >> 32));
-}
-
-// hash-mask and # of times we saw it
-struct xorset
-{
-    uint64_t mask;
-    uint64_t n;
-};
-typedef struct xorset xorset;
-
-// reverse map of hashmask to the index we saw it
-struct keyidx
-{
-    uint64_t hash;
-    uint64_t idx;
-};
-typedef struct keyidx keyidx;
-
-VECT_TYPEDEF(keyvect, keyidx);
-
-
-/*
- * Update xorset 's' with new entry from index 'i'
- */
-static void
-__update_q(keyvect *q, xorset *xs, uint32_t i, uint64_t h)
-{
-    xorset *x = &xs[i];
-
-    x->mask ^= h;
-    if (--x->n == 1) {
-        keyidx ki = {
-            .hash = x->mask,
-            .idx  = i,
-        };
-        VECT_PUSH_BACK(q, ki);
-    }
-}
-
 static keyvect
 xorfilter_init(Xorfilter *x, uint64_t *keys, size_t n)
 {
@@ -235,23 +99,11 @@ xorfilter_init(Xorfilter *x, uint64_t *keys, size_t n)
         }
 
         VECT_RESET(&stack);
-        while (VECT_LEN(&q) > 0) {
-            keyidx ki = VECT_POP_BACK(&q);
-
-            if (H[ki.idx].n != 1) continue;
-
-            // sole element in H[i]
-            VECT_PUSH_BACK(&stack, ki);
-            fpidx z = hash3(ki.hash, size);
-
-            __update_q(&q, H, z.i, ki.hash);
-            __update_q(&q, H, z.j, ki.hash);
-            __update_q(&q, H, z.k, ki.hash);
-        }
+        xorfilter_peel(&q, &stack, H, size);
 
         if (VECT_LEN(&stack) == n) break;
 
-        if (++tries > 1000000) {
+        if (++tries > XORFILTER_MAXTRIES) {
             VECT_RESET(&stack);
             goto fini;
         }
@@ -270,6 +122,35 @@ fini:
 
 
 
+Xorfilter *
+__xorfilter_assign(Xorfilter *x, keyvect *stack, int is16)
+{
+    if (is16) {
+        x->is_16 = 1;
+        x->fp16  = (uint16_t *)NEWZA(uint8_t, xorfilter_size(x) + XORFILTER_PAD);
+        while (VECT_LEN(stack) > 0) {
+            keyidx   ki = VECT_POP_BACK(stack);
+            uint16_t fp = __xfp16(ki.hash);
+            fpidx    z = hash3(ki.hash, x->size);
+
+            x->fp16[ki.idx] = fp ^ x->fp16[z.i] ^ x->fp16[z.j] ^ x->fp16[z.k];
+        }
+    } else {
+        x->fp8 = NEWZA(uint8_t, xorfilter_size(x) + XORFILTER_PAD);
+        while (VECT_LEN(stack) > 0) {
+            keyidx  ki = VECT_POP_BACK(stack);
+            uint8_t fp = __xfp8(ki.hash);
+            fpidx    z = hash3(ki.hash, x->size);
+
+            x->fp8[ki.idx] = fp ^ x->fp8[z.i] ^ x->fp8[z.j] ^ x->fp8[z.k];
+        }
+    }
+
+    VECT_FINI(stack);
+    return x;
+}
+
+
 Xorfilter *
 Xorfilter_new8(uint64_t *keys, size_t n)
 {
@@ -277,21 +158,12 @@ Xorfilter_new8(uint64_t *keys, size_t n)
     keyvect stack = xorfilter_init(x, keys, n);
 
     if (VECT_LEN(&stack) == 0) {
+        VECT_FINI(&stack);
         DEL(x);
         return 0;
     }
 
-    x->fp8 = NEWZA(uint8_t, VECT_LEN(&stack) * 3);
-    while (VECT_LEN(&stack) > 0) {
-        keyidx  ki = VECT_POP_BACK(&stack);
-        uint8_t fp = __xfp8(ki.hash);
-        fpidx    z = hash3(ki.hash, x->size);
-
-        x->fp8[ki.idx] = fp ^ x->fp8[z.i] ^ x->fp8[z.j] ^ x->fp8[z.k];
-    }
-
-    VECT_FINI(&stack);
-    return x;
+    return __xorfilter_assign(x, &stack, 0);
 }
 
 Xorfilter *
@@ -301,22 +173,12 @@ Xorfilter_new16(uint64_t *keys, size_t n)
     keyvect stack = xorfilter_init(x, keys, n);
 
     if (VECT_LEN(&stack) == 0) {
+        VECT_FINI(&stack);
         DEL(x);
         return 0;
     }
 
-    x->fp16  = NEWZA(uint16_t, VECT_LEN(&stack) * 3);
-    x->is_16 = 1;
-    while (VECT_LEN(&stack) > 0) {
-        keyidx   ki = VECT_POP_BACK(&stack);
-        uint16_t fp = __xfp16(ki.hash);
-        fpidx    z = hash3(ki.hash, x->size);
-
-        x->fp16[ki.idx] = fp ^ x->fp16[z.i] ^ x->fp16[z.j] ^ x->fp16[z.k];
-    }
-
-    VECT_FINI(&stack);
-    return x;
+    return __xorfilter_assign(x, &stack, 1);
 }
 
 
@@ -337,6 +199,218 @@ Xorfilter_contains(Xorfilter *x, uint64_t key)
 }
 
 
+/*
+ * Batched lookups: a chunk of XOR_BATCH keys is hashed first; then
+ * the keys are probed in order while the fingerprints of the key
+ * XOR_PREFETCH places ahead are prefetched. With AVX2, 8 keys are
+ * probed at a time with one gather for each of the 3 fingerprints.
+ *
+ * The 3 divisions of hash3() cost more than the rest of a lookup;
+ * a batch divides by the (invariant) 'size' with a multiply and
+ * shifts instead (see fast/fastdiv.h).
+ *
+ * A filter that fits in L2 has no misses to overlap: staging the
+ * hashes, the prefetches and the gathers are pure overhead there.
+ * Such filters are probed one key at a time as the keys are hashed
+ * (only the divisions are saved).
+ */
+#define XOR_BATCH       256
+#define XOR_PREFETCH    16
+#define XOR_INCACHE     (256 * 1024)
+
+// Hashed keys of a chunk
+struct xbatch
+{
+    uint32_t i[XOR_BATCH];
+    uint32_t j[XOR_BATCH];
+    uint32_t k[XOR_BATCH];
+    uint32_t fp[XOR_BATCH];
+};
+typedef struct xbatch xbatch;
+
+typedef size_t (*xprobe_fp)(Xorfilter *, xbatch *, size_t, uint64_t *);
+
+
+static void
+xor_hash_batch(Xorfilter *x, const fastdiv *v, xbatch *b, const uint64_t *keys, size_t m)
+{
+    uint32_t size = x->size;
+    size_t i;
+
+    for (i = 0; i < m; i++) {
+        uint64_t h  = hashkey(keys[i], x->seed);
+        uint64_t h1 = __mix(h);
+
+        b->i[i]  = fastdiv_mod(v, h);
+        b->j[i]  = fastdiv_mod(v, h1) + size;
+        b->k[i]  = fastdiv_mod(v, __mix(h1)) + (2 * size);
+        b->fp[i] = x->is_16 ? __xfp16(h) : __xfp8(h);
+    }
+}
+
+
+static inline void
+xor_prefetch(Xorfilter *x, xbatch *b, size_t i)
+{
+    const uint8_t *p = x->ptr;
+    int sh = x->is_16;
+
+    __builtin_prefetch(p + ((size_t)b->i[i] << sh));
+    __builtin_prefetch(p + ((size_t)b->j[i] << sh));
+    __builtin_prefetch(p + ((size_t)b->k[i] << sh));
+}
+
+
+// Probe keys [s, m) of the chunk; bit 'i' of 'res' is key 'i'.
+static size_t
+xor_probe_from(Xorfilter *x, xbatch *b, size_t s, size_t m, uint64_t *res)
+{
+    size_t i, nf = 0;
+
+    for (i = s; i < m && i < (s + XOR_PREFETCH); i++) xor_prefetch(x, b, i);
+
+    for (i = s; i < m; i++) {
+        uint32_t v;
+
+        if ((i + XOR_PREFETCH) < m) xor_prefetch(x, b, i + XOR_PREFETCH);
+
+        if (x->is_16) {
+            uint16_t *f = x->fp16;
+            v = f[b->i[i]] ^ f[b->j[i]] ^ f[b->k[i]];
+        } else {
+            uint8_t *f = x->fp8;
+            v = f[b->i[i]] ^ f[b->j[i]] ^ f[b->k[i]];
+        }
+
+        if (v == b->fp[i]) {
+            res[i / 64] |= _U64(1) << (i % 64);
+            nf++;
+        }
+    }
+    return nf;
+}
+
+
+static size_t
+xor_probe(Xorfilter *x, xbatch *b, size_t m, uint64_t *res)
+{
+    return xor_probe_from(x, b, 0, m, res);
+}
+
+
+// Hash and probe each key in turn; for filters that are in cache.
+static size_t
+xor_probe_incache(Xorfilter *x, const fastdiv *v, const uint64_t *keys, size_t n, uint64_t *res)
+{
+    uint32_t size = x->size;
+    uint64_t w = 0;
+    size_t i, nf = 0;
+
+    for (i = 0; i < n; i++) {
+        uint64_t h  = hashkey(keys[i], x->seed);
+        uint64_t h1 = __mix(h);
+        uint32_t a  = fastdiv_mod(v, h),
+                 b  = fastdiv_mod(v, h1) + size,
+                 c  = fastdiv_mod(v, __mix(h1)) + (2 * size);
+        uint64_t ok;
+
+        if (x->is_16) {
+            uint16_t *f = x->fp16;
+            ok = __xfp16(h) == (f[a] ^ f[b] ^ f[c]);
+        } else {
+            uint8_t *f = x->fp8;
+            ok = __xfp8(h) == (f[a] ^ f[b] ^ f[c]);
+        }
+
+        w |= ok << (i % 64);
+        if ((i % 64) == 63) {
+            res[i / 64] = w;
+            nf += __builtin_popcountll(w);
+            w = 0;
+        }
+    }
+
+    if (i % 64) {
+        res[i / 64] = w;
+        nf += __builtin_popcountll(w);
+    }
+    return nf;
+}
+
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__amd64__)
+
+/*
+ * Gather 32-bit words at the fingerprint offsets and keep the low
+ * 8 or 16 bits; the array has XORFILTER_PAD bytes of slack for the
+ * last fingerprint. The offsets are signed 32-bit; so this is only
+ * used for filters smaller than 2GB.
+ */
+static SIMD_TARGET_AVX2 size_t
+xor_probe256(Xorfilter *x, xbatch *b, size_t m, uint64_t *res)
+{
+    const int     *p   = x->ptr;
+    const __m128i  sh  = _mm_cvtsi32_si128(x->is_16);
+    const __m256i  msk = _mm256_set1_epi32(x->is_16 ? 0xffff : 0xff);
+    size_t i, r, nf = 0;
+
+    for (i = 0; i < m && i < XOR_PREFETCH; i++) xor_prefetch(x, b, i);
+
+    for (i = 0; (i + 8) <= m; i += 8) {
+        for (r = i + XOR_PREFETCH; r < m && r < (i + XOR_PREFETCH + 8); r++) {
+            xor_prefetch(x, b, r);
+        }
+
+        __m256i vi = _mm256_sll_epi32(_mm256_loadu_si256((const __m256i *)&b->i[i]), sh);
+        __m256i vj = _mm256_sll_epi32(_mm256_loadu_si256((const __m256i *)&b->j[i]), sh);
+        __m256i vk = _mm256_sll_epi32(_mm256_loadu_si256((const __m256i *)&b->k[i]), sh);
+        __m256i v  = _mm256_xor_si256(_mm256_i32gather_epi32(p, vi, 1),
+                                      _mm256_i32gather_epi32(p, vj, 1));
+
+        v = _mm256_and_si256(_mm256_xor_si256(v, _mm256_i32gather_epi32(p, vk, 1)), msk);
+        v = _mm256_cmpeq_epi32(v, _mm256_loadu_si256((const __m256i *)&b->fp[i]));
+
+        uint64_t eq = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(v));
+
+        res[i / 64] |= eq << (i % 64);
+        nf += __builtin_popcountll(eq);
+    }
+
+    return nf + xor_probe_from(x, b, i, m, res);
+}
+
+#endif // x86_64
+
+
+size_t
+Xorfilter_contains_batch(Xorfilter *x, const uint64_t *keys, size_t n, uint64_t *res)
+{
+    xprobe_fp probe = xor_probe;
+    xbatch    b;
+    fastdiv   v;
+    size_t    off, nf = 0;
+
+    fastdiv_init(&v, x->size);
+    memset(res, 0, ((n + 63) / 64) * sizeof res[0]);
+
+    if (xorfilter_size(x) <= XOR_INCACHE) return xor_probe_incache(x, &v, keys, n, res);
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__amd64__)
+    if (simd_isa() >= SIMD_ISA_256 && xorfilter_size(x) < INT32_MAX) probe = xor_probe256;
+#endif
+
+    // XOR_BATCH is a multiple of 64; so each chunk starts on a word
+    // of 'res'.
+    for (off = 0; off < n; off += XOR_BATCH) {
+        size_t m = (n - off) > XOR_BATCH ? XOR_BATCH : (n - off);
+
+        xor_hash_batch(x, &v, &b, &keys[off], m);
+        nf += probe(x, &b, m, &res[off / 64]);
+    }
+    return nf;
+}
+
+
 // bits per entry
 double
 Xorfilter_bpe(Xorfilter *x)
@@ -250,7 +250,7 @@ Xorfilter_unmarshal(Xorfilter **p_x, const char *fname, uint32_t flags)
         zx.is_mmap = 1;
     } else {
         uint64_t sz = xorfilter_size(&zx);
-        zx.ptr = NEWZA(uint8_t, sz);
+        zx.ptr = NEWZA(uint8_t, sz + XORFILTER_PAD);
         assert(zx.ptr);
 
         memcpy(zx.ptr, p, sz);
@@ -0,0 +1,553 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * xorfilter_mt.c - Partitioned, multi-threaded Xorfilter construction
+ *
+ * Copyright (c) 2025 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Notes
+ * =====
+ * o  The filter built here is identical in layout to the one made
+ *    by Xorfilter_new8() (same hashes, same fingerprints); only the
+ *    construction differs. See xorfilter.c for the algorithm.
+ *
+ * o  The xorset array 'H' is split into partitions of 2^pshift
+ *    contiguous cells; worker 'w' owns every nthreads'th partition
+ *    starting at 'w' and is the only one that ever writes to them.
+ *    Every update to 'H' (3 per key) is first radix-partitioned by
+ *    its cell into per-worker buckets; after a barrier, each worker
+ *    applies all the updates destined to its partitions - one
+ *    partition at a time. Thus 'H' is written without atomics, and
+ *    a partition (which fits in L2) sees several updates to each of
+ *    its cache lines instead of one miss per update.
+ *
+ * o  The locality only comes from large batches: the per-worker
+ *    buffers together hold about as many updates as 'H' has cells.
+ *    So the memory needed beyond 'H' and the peel stack is bounded
+ *    by the size of 'H' (not 3n updates); the keys are hashed and
+ *    partitioned in steps of 'batch' keys per worker.
+ *
+ * o  Peeling is done in bulk-synchronous steps [1]: in step 's'
+ *    each worker takes the singleton cells of block (s mod 3) from
+ *    its frontier. A key has exactly one cell in each block; so no
+ *    key is peeled twice in a step - and the pivot cell of a key
+ *    isn't a cell of any other key peeled in the same step (it had
+ *    exactly one key). Removing the peeled keys from their 3 cells
+ *    is the same partitioned update as above; the owner of a cell
+ *    that drops to one key adds it to its frontier. Since that
+ *    happens in partition order, the next step reads the frontier
+ *    cells mostly in order too.
+ *
+ * o  The order of the keys within a step doesn't matter when
+ *    assigning the fingerprints in reverse order of peeling.
+ *
+ * o  The tail of the peeling has too little work to be worth the
+ *    barriers; once the frontier is smaller than XB_SEQMIN cells,
+ *    the rest is peeled by the caller in one thread.
+ *
+ * [1] Jiang, Mitzenmacher & Thaler, Parallel Peeling Algorithms.
+ *     https://arxiv.org/abs/1302.7014
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "utils/utils.h"
+#include "utils/cpu.h"
+#include "utils/xorfilter.h"
+#include "posix/job.h"
+#include "xorfilt_internal.h"
+
+
+// Fewest keys (or peeled cells) handled by a worker in one step
+#define XB_MINBATCH     4096
+
+// Smallest partition: 16k cells (256 KB of 'H')
+#define XB_MINSHIFT     14
+
+// Most partitions; more would need too many buckets per step
+#define XB_MAXPART      4096
+
+// Prefetch distance for the random reads of 'H'
+#define XB_PREFETCH     16
+
+// Peel the rest in one thread below these many frontier cells
+#define XB_SEQMIN       4096
+
+
+VECT_TYPEDEF(cellvect, uint32_t);
+
+struct xbuild;
+
+// Per worker state
+struct xworker
+{
+    struct xbuild *b;
+    int       id;
+
+    size_t    lo, hi;       // slice of keys
+
+    uint64_t *hv;           // hashed keys of this step
+    fpidx    *zv;           // and their cells
+    uint64_t *buf;          // updates (hashes) sorted by partition
+    size_t   *off;          // start of each partition in 'buf'
+
+    cellvect  fr[3];        // frontier: cells with one key (per block)
+    keyvect   peeled;       // keys peeled in this step
+};
+typedef struct xworker xworker;
+
+struct xbuild
+{
+    uint64_t *keys;
+    size_t    n;
+
+    uint64_t  seed;
+    uint32_t  size;
+    size_t    cap;
+    xorset   *H;
+
+    uint32_t  pshift;
+    size_t    npb;          // partitions per block
+    size_t    np;
+
+    int       nthreads;
+    xworker  *w;
+
+    pthread_barrier_t barrier;
+    keyvect  *stack;
+    size_t    batch;        // keys per worker per step
+    size_t    nbatch;       // steps to hash all the keys
+    int       done;
+};
+typedef struct xbuild xbuild;
+
+
+// Return 1 to exactly one of the waiters
+static inline int
+barrier(xbuild *b)
+{
+    return pthread_barrier_wait(&b->barrier) == PTHREAD_BARRIER_SERIAL_THREAD;
+}
+
+
+// Cell of hash 'h' in block 'bk'
+static inline uint64_t
+cell(xbuild *b, int bk, uint64_t h)
+{
+    switch (bk) {
+        case 0:  return __geth0(h, b->size);
+        case 1:  return __geth1(h, b->size) + b->size;
+        default: return __geth2(h, b->size) + (2 * (uint64_t)b->size);
+    }
+}
+
+
+/*
+ * Partition the 3 updates for each of 'm' keys in hv[], zv[] into
+ * w->buf.
+ */
+static void
+scatter(xworker *w, size_t m)
+{
+    xbuild  *b   = w->b;
+    size_t  *off = w->off;
+    uint32_t sh  = b->pshift;
+    size_t   p1  = b->npb,
+             p2  = 2 * b->npb;
+    uint64_t s1  = b->size,
+             s2  = 2 * (uint64_t)b->size;
+    size_t   i, s;
+
+    memset(off, 0, (b->np + 1) * sizeof off[0]);
+    for (i = 0; i < m; i++) {
+        fpidx z = w->zv[i];
+
+        off[(z.i >> sh) + 1]++;
+        off[p1 + ((z.j - s1) >> sh) + 1]++;
+        off[p2 + ((z.k - s2) >> sh) + 1]++;
+    }
+
+    for (s = 0, i = 0; i <= b->np; i++) {
+        s     += off[i];
+        off[i] = s;
+    }
+
+    // off[p] is the running insert point for partition 'p'; it ends
+    // up at the start of 'p+1' - which we fix up below.
+    for (i = 0; i < m; i++) {
+        fpidx    z = w->zv[i];
+        uint64_t h = w->hv[i];
+
+        w->buf[off[z.i >> sh]++]             = h;
+        w->buf[off[p1 + ((z.j - s1) >> sh)]++] = h;
+        w->buf[off[p2 + ((z.k - s2) >> sh)]++] = h;
+    }
+
+    memmove(&off[1], &off[0], b->np * sizeof off[0]);
+    off[0] = 0;
+}
+
+
+/*
+ * Apply the updates in u[0..n) to block 'bk'. The cells are
+ * computed XB_PREFETCH updates ahead (and prefetched).
+ */
+static void
+apply_one(xworker *w, int bk, const uint64_t *u, size_t n, int add)
+{
+    xbuild  *b = w->b;
+    xorset  *H = b->H;
+    uint64_t ring[XB_PREFETCH];
+    size_t   i;
+
+    for (i = 0; i < n && i < XB_PREFETCH; i++) {
+        ring[i] = cell(b, bk, u[i]);
+        __builtin_prefetch(&H[ring[i]], 1);
+    }
+
+    for (i = 0; i < n; i++) {
+        size_t   r = i & (XB_PREFETCH - 1);
+        uint64_t c = ring[r];
+        xorset  *x = &H[c];
+
+        if ((i + XB_PREFETCH) < n) {
+            ring[r] = cell(b, bk, u[i + XB_PREFETCH]);
+            __builtin_prefetch(&H[ring[r]], 1);
+        }
+
+        x->mask ^= u[i];
+        if (add) {
+            x->n++;
+        } else if (--x->n == 1) {
+            VECT_PUSH_BACK(&w->fr[bk], c);
+        }
+    }
+}
+
+
+/*
+ * Apply the updates of all the workers to the partitions owned by
+ * 'w'. A removal that leaves one key in a cell puts the cell on the
+ * frontier.
+ */
+static void
+apply(xworker *w, int add)
+{
+    xbuild *b = w->b;
+    size_t  p;
+    int     v;
+
+    for (p = w->id; p < b->np; p += b->nthreads) {
+        int bk = p / b->npb;
+
+        for (v = 0; v < b->nthreads; v++) {
+            xworker *y = &b->w[v];
+
+            apply_one(w, bk, &y->buf[y->off[p]], y->off[p+1] - y->off[p], add);
+        }
+    }
+}
+
+
+// Hash step 'i' of this worker's keys
+static size_t
+hash_keys(xworker *w, size_t i)
+{
+    xbuild *b  = w->b;
+    size_t  lo = w->lo + (i * b->batch);
+    size_t  m  = 0;
+
+    for (; lo < w->hi && m < b->batch; lo++, m++) {
+        uint64_t h = hashkey(b->keys[lo], b->seed);
+
+        w->hv[m] = h;
+        w->zv[m] = hash3(h, b->size);
+    }
+    return m;
+}
+
+
+// Peel the keys in the singleton cells of block 'bk'
+static size_t
+select_peel(xworker *w, int bk)
+{
+    xbuild   *b  = w->b;
+    xorset   *H  = b->H;
+    cellvect *fr = &w->fr[bk];
+    size_t    m  = 0;
+
+    VECT_RESET(&w->peeled);
+    while (VECT_LEN(fr) > 0 && m < b->batch) {
+        if (VECT_LEN(fr) > XB_PREFETCH) {
+            __builtin_prefetch(&H[VECT_ELEM(fr, VECT_LEN(fr) - XB_PREFETCH)]);
+        }
+
+        uint32_t c = VECT_POP_BACK(fr);
+
+        if (H[c].n != 1) continue;
+
+        keyidx ki = {
+            .hash = H[c].mask,
+            .idx  = c,
+        };
+
+        VECT_PUSH_BACK(&w->peeled, ki);
+        w->hv[m] = ki.hash;
+        w->zv[m] = hash3(ki.hash, b->size);
+        m++;
+    }
+    return m;
+}
+
+
+// Return the first and last+1 cells of partition 'p'
+static inline uint64_t
+pcells(xbuild *b, size_t p, uint64_t *c1)
+{
+    uint64_t bk = p / b->npb;
+    uint64_t c0 = ((p % b->npb) << b->pshift);
+    uint64_t c  = c0 + (_U64(1) << b->pshift);
+
+    if (c > b->size) c = b->size;
+
+    *c1 = c + (bk * b->size);
+    return c0 + (bk * b->size);
+}
+
+
+static int
+build_worker(void *ctx, void *job, int cpu)
+{
+    xbuild  *b = ctx;
+    xworker *w = job;
+    uint64_t c, c1;
+    size_t   i, p;
+    int      v, s;
+
+    USEARG(cpu);
+
+    // Clear the partitions we own - in parallel
+    for (p = w->id; p < b->np; p += b->nthreads) {
+        c = pcells(b, p, &c1);
+        memset(&b->H[c], 0, (c1 - c) * sizeof b->H[0]);
+    }
+
+    for (s = 0; s < 3; s++) VECT_RESET(&w->fr[s]);
+    barrier(b);
+
+    // Add all the keys to 'H'
+    for (i = 0; i < b->nbatch; i++) {
+        scatter(w, hash_keys(w, i));
+        barrier(b);
+        apply(w, 1);
+        barrier(b);
+    }
+
+    // Initial frontier
+    for (p = w->id; p < b->np; p += b->nthreads) {
+        cellvect *fr = &w->fr[p / b->npb];
+
+        for (c = pcells(b, p, &c1); c < c1; c++) {
+            if (b->H[c].n == 1) VECT_PUSH_BACK(fr, c);
+        }
+    }
+
+    for (s = 0; ; s = (s + 1) % 3) {
+        scatter(w, select_peel(w, s));
+        barrier(b);
+        apply(w, 0);
+        if (barrier(b)) {
+            size_t nf = 0;
+
+            for (v = 0; v < b->nthreads; v++) {
+                xworker *y = &b->w[v];
+
+                VECT_APPEND_VECT(b->stack, &y->peeled);
+                nf += VECT_LEN(&y->fr[0]) + VECT_LEN(&y->fr[1]) + VECT_LEN(&y->fr[2]);
+            }
+            b->done = nf < XB_SEQMIN;
+        }
+        barrier(b);
+        if (b->done) break;
+    }
+    return 0;
+}
+
+
+// Split the keys and partitions among the workers
+static void
+setup(xbuild *b)
+{
+    size_t slice = (b->n + b->nthreads - 1) / b->nthreads;
+    int v, s;
+
+    // partitions don't straddle blocks; an update only needs to
+    // carry the hash - its cell follows from the block.
+    b->pshift = XB_MINSHIFT;
+    while ((b->cap >> b->pshift) >= XB_MAXPART) b->pshift++;
+
+    // all the buffers together hold about 'cap' updates
+    b->npb    = (b->size >> b->pshift) + 1;
+    b->np     = 3 * b->npb;
+    b->batch  = b->cap / (3 * b->nthreads);
+    if (b->batch < XB_MINBATCH) b->batch = XB_MINBATCH;
+    if (b->batch > slice)       b->batch = slice ? slice : 1;
+    b->nbatch = (slice + b->batch - 1) / b->batch;
+
+    for (v = 0; v < b->nthreads; v++) {
+        xworker *w = &b->w[v];
+
+        w->b   = b;
+        w->id  = v;
+        w->lo  = (b->n * v) / b->nthreads;
+        w->hi  = (b->n * (v+1)) / b->nthreads;
+
+        w->hv  = NEWA(uint64_t, b->batch);
+        w->zv  = NEWA(fpidx, b->batch);
+        w->buf = NEWA(uint64_t, 3 * b->batch);
+        w->off = NEWA(size_t, b->np + 1);
+        for (s = 0; s < 3; s++) VECT_INIT(&w->fr[s], 1024);
+        VECT_INIT(&w->peeled, b->batch);
+    }
+}
+
+
+static void
+cleanup(xbuild *b)
+{
+    int v, s;
+
+    for (v = 0; v < b->nthreads; v++) {
+        xworker *w = &b->w[v];
+
+        DEL(w->hv);
+        DEL(w->zv);
+        DEL(w->buf);
+        DEL(w->off);
+        for (s = 0; s < 3; s++) VECT_FINI(&w->fr[s]);
+        VECT_FINI(&w->peeled);
+    }
+}
+
+
+// One attempt with the current seed; return true if all the keys
+// were peeled.
+static int
+build(xbuild *b, keyvect *q)
+{
+    int v, s;
+
+    VECT_RESET(b->stack);
+    if (b->nthreads == 1) {
+        build_worker(b, &b->w[0], 0);
+    } else {
+        job_manager jm;
+
+        if (job_manager_init(&jm, b->nthreads, build_worker, b) < 0) return 0;
+
+        for (v = 0; v < b->nthreads; v++) job_manager_submit_job(&jm, &b->w[v]);
+
+        job_manager_wait(&jm);
+        job_manager_destroy(&jm);
+    }
+
+    // Peel the rest here
+    VECT_RESET(q);
+    for (v = 0; v < b->nthreads; v++) {
+        for (s = 0; s < 3; s++) {
+            uint32_t *c;
+
+            VECT_FOR_EACH(&b->w[v].fr[s], c) {
+                keyidx ki = {
+                    .hash = b->H[*c].mask,
+                    .idx  = *c,
+                };
+
+                if (b->H[*c].n == 1) VECT_PUSH_BACK(q, ki);
+            }
+        }
+    }
+    xorfilter_peel(q, b->stack, b->H, b->size);
+
+    return VECT_LEN(b->stack) == b->n;
+}
+
+
+static Xorfilter *
+xorfilter_new_mt(uint64_t *keys, size_t n, int nthreads, int is16)
+{
+    Xorfilter *x = NEWZ(Xorfilter);
+    uint32_t tries = 0;
+    keyvect  stack,
+             q;
+    xbuild   b;
+
+    if (nthreads <= 0) nthreads = sys_cpu_getavail();
+
+    memset(&b, 0, sizeof b);
+    b.keys     = keys;
+    b.n        = n;
+    b.size     = xorfilter_calc_size(n);
+    b.cap      = 3 * (size_t)b.size;
+    b.H        = NEWA(xorset, b.cap);
+    b.nthreads = nthreads;
+    b.w        = NEWZA(xworker, nthreads);
+    b.stack    = &stack;
+
+    VECT_INIT(&stack, n);
+    VECT_INIT(&q, XB_SEQMIN);
+    pthread_barrier_init(&b.barrier, 0, nthreads);
+    setup(&b);
+
+    do {
+        if (++tries > XORFILTER_MAXTRIES) {
+            VECT_FINI(&stack);
+            DEL(x);
+            x = 0;
+            goto fini;
+        }
+
+        b.seed = rand64();
+    } while (!build(&b, &q));
+
+    x->seed = b.seed;
+    x->size = b.size;
+    x->n    = n;
+    x = __xorfilter_assign(x, &stack, is16);
+
+fini:
+    pthread_barrier_destroy(&b.barrier);
+    cleanup(&b);
+    VECT_FINI(&q);
+    DEL(b.w);
+    DEL(b.H);
+    return x;
+}
+
+
+Xorfilter *
+Xorfilter_new8_mt(uint64_t *keys, size_t n, int nthreads)
+{
+    return xorfilter_new_mt(keys, n, nthreads, 0);
+}
+
+
+Xorfilter *
+Xorfilter_new16_mt(uint64_t *keys, size_t n, int nthreads)
+{
+    return xorfilter_new_mt(keys, n, nthreads, 1);
+}
+
+/* EOF */
@@ -0,0 +1,399 @@
+/* vim: ts=4:sw=4:expandtab:tw=72:
+ *
+ * mempool-mt.c - Thread caching front-end for mempool.
+ *
+ * Copyright (c) 2005 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "utils/utils.h"
+#include "utils/mempool-mt.h"
+#include "fast/list.h"
+
+/*
+ * IMPLEMENTATION NOTES
+ * ====================
+ *
+ *  - A thread's magazine is a stack of pointers to free blocks. It
+ *    is found via a pthread key; the last one used is remembered in
+ *    a thread local so that the common case doesn't call
+ *    pthread_getspecific(). Each pool has a unique id so that a
+ *    stale entry (of a deleted pool) never matches.
+ *
+ *  - Blocks move between a magazine and the central pool in
+ *    batches of 'batch' (half the magazine). A batch is a chain of
+ *    blocks linked through their first word; the second word of
+ *    the first block links the batches.
+ *
+ *  - A full magazine pushes its oldest batch on 'ret' with a CAS.
+ *    'ret' is only ever emptied as a whole (atomic exchange) under
+ *    the lock; thus the push is ABA safe.
+ *
+ *  - An empty magazine is refilled under the lock: from 'ret', then
+ *    from the batches already moved from 'ret' to 'depot' and
+ *    lastly from the underlying mempool.
+ *
+ *  - Every magazine is on a list so that mempool_mt_delete() can
+ *    free them; a thread removes its magazine when it exits.
+ *
+ *  - mempool_mt_trim() frees the batches in 'ret' and 'depot' to
+ *    the mempool so that its empty chunks can be released.
+ */
+
+/* A free block in a batch */
+struct mtblk
+{
+    struct mtblk *next;     // next block of this batch
+    struct mtblk *batch;    // next batch (first block only)
+};
+typedef struct mtblk mtblk;
+
+
+/* Per-thread cache of free blocks */
+struct mtmag
+{
+    DL_ENTRY(mtmag) link;
+
+    struct mempool_mt *pool;
+
+    uint32_t n;         // number of blocks in blk[]
+    void    *blk[];
+};
+typedef struct mtmag mtmag;
+
+DL_HEAD_TYPEDEF(mtmag_head, mtmag);
+
+
+struct mempool_mt
+{
+    /* batches given back by full magazines */
+    _Atomic(mtblk *) ret;
+
+    uint64_t  id;
+    uint32_t  magsize;
+    uint32_t  batch;
+
+    pthread_key_t key;
+
+    /* Everything below is protected by 'lock' */
+    pthread_mutex_t lock;
+
+    mempool   pool;
+    mtblk    *depot;
+    mtmag_head mags;
+};
+
+
+/* Sizeof the smallest block that can be in a batch */
+#define MIN_BLKSIZE     (sizeof(mtblk))
+
+static atomic_uint_fast64_t Poolid;
+
+/* The magazine used last by this thread */
+static __thread uint64_t Lastid;
+static __thread mtmag   *Lastmag;
+
+
+/*
+ * Called when a thread exits: return its blocks to the pool and
+ * free the magazine.
+ */
+static void
+__mag_exit(void *v)
+{
+    mtmag      *g = v;
+    mempool_mt *m = g->pool;
+    uint32_t    i;
+
+    pthread_mutex_lock(&m->lock);
+    for (i = 0; i < g->n; i++) {
+        mempool_free(&m->pool, g->blk[i]);
+    }
+    DL_REMOVE(&m->mags, g, link);
+    pthread_mutex_unlock(&m->lock);
+
+    // Another TLS destructor on this thread may still use the pool;
+    // it must not find 'g' in the cache.
+    Lastid  = 0;
+    Lastmag = 0;
+    DEL(g);
+}
+
+
+static mtmag *
+__newmag(mempool_mt *m)
+{
+    mtmag *g = (mtmag *)malloc(sizeof *g + (m->magsize * sizeof(void *)));
+    if (!g) return 0;
+
+    g->pool = m;
+    g->n    = 0;
+
+    pthread_mutex_lock(&m->lock);
+    DL_INSERT_TAIL(&m->mags, g, link);
+    pthread_mutex_unlock(&m->lock);
+
+    pthread_setspecific(m->key, g);
+    return g;
+}
+
+
+/* Return the calling thread's magazine */
+static inline mtmag *
+__mymag(mempool_mt *m)
+{
+    mtmag *g;
+
+    if (likely(Lastid == m->id)) return Lastmag;
+
+    g = pthread_getspecific(m->key);
+    if (!g && !(g = __newmag(m))) return 0;
+
+    Lastid  = m->id;
+    Lastmag = g;
+    return g;
+}
+
+
+/*
+ * Refill the empty magazine 'g' with a batch of blocks. Return
+ * false if there are no more blocks.
+ */
+static int
+__refill(mempool_mt *m, mtmag *g)
+{
+    mtblk *b;
+    void  *p;
+
+    pthread_mutex_lock(&m->lock);
+    if ((b = atomic_exchange_explicit(&m->ret, 0, memory_order_acquire))) {
+        mtblk *t = b;
+
+        while (t->batch) t = t->batch;
+        t->batch = m->depot;
+        m->depot = b;
+    }
+
+    if ((b = m->depot)) {
+        m->depot = b->batch;
+        pthread_mutex_unlock(&m->lock);
+
+        for (; b; b = b->next) g->blk[g->n++] = b;
+        return 1;
+    }
+
+    while (g->n < m->batch && (p = mempool_alloc(&m->pool))) {
+        g->blk[g->n++] = p;
+    }
+    pthread_mutex_unlock(&m->lock);
+
+    return g->n > 0;
+}
+
+
+/*
+ * Give back the oldest batch of blocks of the full magazine 'g'.
+ */
+static void
+__giveback(mempool_mt *m, mtmag *g)
+{
+    mtblk   *h = 0;
+    uint32_t i;
+
+    for (i = 0; i < m->batch; i++) {
+        mtblk *b = g->blk[i];
+
+        b->next = h;
+        h       = b;
+    }
+
+    g->n -= m->batch;
+    memmove(&g->blk[0], &g->blk[m->batch], g->n * sizeof(void *));
+
+    h->batch = atomic_load_explicit(&m->ret, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&m->ret, &h->batch, h,
+                                memory_order_release, memory_order_relaxed))
+        ;
+}
+
+
+/*
+ * Free the blocks of the batch 'b' to the central pool; called with
+ * the lock held.
+ */
+static void
+__putbatch(mempool_mt *m, mtblk *b)
+{
+    mtblk *next;
+
+    for (; b; b = next) {
+        next = b->next;
+        mempool_free(&m->pool, b);
+    }
+}
+
+
+int
+mempool_mt_new(mempool_mt** p_m, const memmgr* tr, unsigned int blksize,
+               unsigned int max, unsigned int min_alloc_units,
+               unsigned int magsize)
+{
+    mempool_mt *m;
+    int r;
+
+    if (!p_m) return -EINVAL;
+
+    if (magsize == 0) magsize = MEMPOOL_MT_MAGSIZE;
+    if (magsize < 2)  magsize = 2;
+    if (blksize < MIN_BLKSIZE) blksize = MIN_BLKSIZE;
+
+    m = NEWZ(mempool_mt);
+    if (!m) return -ENOMEM;
+
+    if ((r = mempool_init(&m->pool, tr, blksize, max, min_alloc_units)) < 0) {
+        DEL(m);
+        return r;
+    }
+
+    if ((r = pthread_key_create(&m->key, __mag_exit)) != 0) {
+        mempool_fini(&m->pool);
+        DEL(m);
+        return -r;
+    }
+
+    atomic_init(&m->ret, 0);
+    pthread_mutex_init(&m->lock, 0);
+    DL_INIT(&m->mags);
+
+    m->id      = 1 + atomic_fetch_add(&Poolid, 1);
+    m->magsize = magsize;
+    m->batch   = magsize / 2;
+
+    *p_m = m;
+    return 0;
+}
+
+
+void
+mempool_mt_delete(mempool_mt* m)
+{
+    mtmag *g;
+
+    if (!m) return;
+
+    pthread_key_delete(m->key);
+    while ((g = DL_REMOVE_HEAD(&m->mags, link))) {
+        DEL(g);
+    }
+
+    // The blocks in the magazines and in the batches are in the
+    // chunks of the mempool.
+    mempool_fini(&m->pool);
+    pthread_mutex_destroy(&m->lock);
+    DEL(m);
+}
+
+
+void *
+mempool_mt_alloc(mempool_mt* m)
+{
+    mtmag *g = __mymag(m);
+
+    if (unlikely(!g)) {
+        void *p;
+
+        pthread_mutex_lock(&m->lock);
+        p = mempool_alloc(&m->pool);
+        pthread_mutex_unlock(&m->lock);
+        return p;
+    }
+
+    if (unlikely(g->n == 0) && !__refill(m, g)) return 0;
+
+    return g->blk[--g->n];
+}
+
+
+void
+mempool_mt_free(mempool_mt* m, void * ptr)
+{
+    mtmag *g = __mymag(m);
+
+    if (unlikely(!g)) {
+        pthread_mutex_lock(&m->lock);
+        mempool_free(&m->pool, ptr);
+        pthread_mutex_unlock(&m->lock);
+        return;
+    }
+
+    if (unlikely(g->n == m->magsize)) __giveback(m, g);
+
+    g->blk[g->n++] = ptr;
+}
+
+
+void
+mempool_mt_flush(mempool_mt* m)
+{
+    mtmag   *g = __mymag(m);
+    uint32_t i;
+
+    if (!g || g->n == 0) return;
+
+    pthread_mutex_lock(&m->lock);
+    for (i = 0; i < g->n; i++) {
+        mempool_free(&m->pool, g->blk[i]);
+    }
+    pthread_mutex_unlock(&m->lock);
+    g->n = 0;
+}
+
+
+uint64_t
+mempool_mt_trim(mempool_mt* m, unsigned int keep)
+{
+    mtblk   *b, *next;
+    uint64_t n;
+
+    pthread_mutex_lock(&m->lock);
+    b = atomic_exchange_explicit(&m->ret, 0, memory_order_acquire);
+    for (; b; b = next) {
+        next = b->batch;
+        __putbatch(m, b);
+    }
+
+    for (b = m->depot; b; b = next) {
+        next = b->batch;
+        __putbatch(m, b);
+    }
+    m->depot = 0;
+
+    n = mempool_trim(&m->pool, keep);
+    pthread_mutex_unlock(&m->lock);
+    return n;
+}
+
+
+unsigned int
+mempool_mt_block_size(mempool_mt* m)
+{
+    return mempool_block_size(&m->pool);
+}
+
+/* EOF */
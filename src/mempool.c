@@ -25,6 +25,11 @@
 #include <stdlib.h>
 #include <assert.h>
 
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif /* _WIN32 */
+
 #include "utils/mempool.h"
 #include "fast/list.h"
 
@@ -44,29 +49,40 @@
  *  - Make large allocations from the lower-layer. Each allocation can
  *    satifsy multiple BLKSIZE requests.
  *
- *  - Keep track of such large allocations in a singly linked list
- *    of "memchunks".  Each such memchunk holds a integral number
+ *  - Keep track of such large allocations ("memchunks") in an array
+ *    sorted by address. Each such memchunk holds a integral number
  *    of fixed-size objects.
  *
- *  - Newly created chunks are inserted into the head of the link list.
- *    The reasoning is that we only allocate a new chunk when our MRU
- *    list is empty i.e., even the last chunk we allocated is empty.
- *    Thus, it makes good sense to keep the "hot chunk" at the head
- *    of the list to facilitate fast allocations.
- *    head of the list.
- *  
- *  - Once fixed sized objects are returned back to the pool, we
- *    keep the returned objects in a second "MRU" linked list.
+ *  - Each chunk counts its free blocks and keeps the blocks returned
+ *    to it in its own free list. Blocks that were never allocated
+ *    are carved from the end of the chunk ("free area").
+ *
+ *  - A chunk with free blocks is on one of MEMPOOL_NCLASS lists by
+ *    the fraction of its blocks that are free; a chunk with every
+ *    block free is on the 'empty' list and a full chunk is on no
+ *    list. The lists are updated as blocks are allocated and freed.
  *
  *  - Requests for new fixed sized objects are satisfied in the following
  *    order:
- *      * MRU list
- *      * latest allocated chunk ("hot chunk")
+ *      * the current chunk
+ *      * the fullest chunk with free blocks
+ *      * an empty chunk
  *      * newly allocated chunk
  *
+ *    Thus, live blocks are packed into as few chunks as possible
+ *    and the other chunks have a chance to become empty.
+ *
+ *  - A free finds the chunk of the block with a binary search of
+ *    the chunk array; the chunk of the previous free is tried first.
+ *
+ *  - Empty chunks are released to the lower-layer by mempool_trim()
+ *    or - if a high-water mark is set - when a free leaves too many
+ *    of them.
+ *
  *  - if a pool instance is initialized with a fixed amount of
  *    memory, no new requests will be made to the underlying
- *    low-level allocator.
+ *    low-level allocator. Its chunk is never released; when it is
+ *    empty, trimming gives its pages back to the OS.
  *
  * Knobs to tune
  * -------------
@@ -107,14 +123,32 @@ typedef uint32_t ptrval_t;
 
 
 
+/*
+ * Each fixed sized object when it is returned to the pool is linked
+ * into the free list of its chunk. This struct provides the minimum
+ * infrastructure for such a list.
+ *
+ * Incidentally, the size of this struct is the minimum size of a
+ * fixed-size block.
+ */
+struct mru_node
+{
+    struct mru_node *next;
+};
+typedef struct mru_node mru_node;
+
+
 /*
  * Memory allocated from OS is held in one or more instances of this
  * struct.
  */
 struct memchunk
 {
-    /* links all allocated chunks */
-    struct memchunk * next;
+    /* links the chunks of the same class */
+    DL_ENTRY(memchunk) link;
+
+    /* blocks returned to this chunk */
+    mru_node *mru;
 
     /*
      * pointer to free area from whence we can carve out
@@ -124,23 +158,25 @@ struct memchunk
 
     /* points to the end of this hunk */
     uint8_t * end;
+
+    /* first block of this chunk */
+    uint8_t * start;
+
+    uint32_t nblocks;   // blocks in this chunk
+    uint32_t nfree;     // free blocks (in 'mru' and in 'free_area')
+    uint32_t cls;       // list this chunk is on
+    uint32_t fixed;     // set if the memory isn't ours to free
+    uint32_t purged;    // set if its pages were given back to the OS
+
+    /* (MEMPOOL_NCLASS << 32) / nblocks: to find the class of 'nfree' */
+    uint64_t clsmul;
 };
 typedef struct memchunk memchunk;
 
 
-/*
- * Each fixed sized object when it is returned to the pool is linked
- * into a MRU list. This struct provides the minimum infrastructure
- * for such an MRU list.
- *
- * Incidentally, the size of this struct is the minimum size of a
- * fixed-size block.
- */
-struct mru_node
-{
-    DL_ENTRY(mru_node)  link;
-};
-typedef struct mru_node mru_node;
+/* The class of a chunk with no free blocks; and of an empty chunk */
+#define CLS_FULL    (MEMPOOL_NCLASS)
+#define CLS_EMPTY   (MEMPOOL_NCLASS + 1)
 
 
 /*
@@ -220,14 +256,137 @@ __dummy_free(void* unused, void* a)
 }
 
 
+
 /*
- * Allocate a new chunk from the OS
+ * Chunk bookkeeping
+ */
+
+/* Return the class of chunk 'ch' */
+static inline uint32_t
+__cls(memchunk* ch)
+{
+    if (ch->nfree == 0)           return CLS_FULL;
+    if (ch->nfree == ch->nblocks) return CLS_EMPTY;
+
+    return (uint32_t)((ch->nfree * ch->clsmul) >> 32);
+}
+
+
+/* Take chunk 'ch' off its list */
+static inline void
+__unlist(mempool* a, memchunk* ch)
+{
+    switch (ch->cls) {
+    case CLS_FULL:
+        break;
+
+    case CLS_EMPTY:
+        DL_REMOVE(&a->empty, ch, link);
+        a->nempty--;
+        break;
+
+    default:
+        DL_REMOVE(&a->part[ch->cls], ch, link);
+        break;
+    }
+}
+
+
+/* Put chunk 'ch' on the list of class 'cls' */
+static inline void
+__list(mempool* a, memchunk* ch, uint32_t cls)
+{
+    ch->cls = cls;
+    switch (cls) {
+    case CLS_FULL:
+        break;
+
+    case CLS_EMPTY:
+        DL_INSERT_HEAD(&a->empty, ch, link);
+        a->nempty++;
+        break;
+
+    default:
+        DL_INSERT_HEAD(&a->part[cls], ch, link);
+        break;
+    }
+}
+
+
+/* Move 'ch' to the right list after its free count changed */
+static inline void
+__reclass(mempool* a, memchunk* ch)
+{
+    uint32_t cls = __cls(ch);
+
+    if (cls != ch->cls) {
+        __unlist(a, ch);
+        __list(a, ch, cls);
+    }
+}
+
+
+/*
+ * Setup the 'nblocks' blocks of chunk 'ch' starting at 'ptr' and
+ * add it to the pool. Return false if there's no memory to track
+ * the chunk.
  */
 static int
+__add_chunk(mempool* a, memchunk* ch, uint8_t* ptr, uint64_t nblocks)
+{
+    uint32_t i;
+
+    assert(nblocks > 0);
+    if (a->nchunks == a->capchunks) {
+        uint32_t   cap = 2 * a->capchunks;
+        memchunk **v   = (memchunk **) (*a->traits.alloc)(a->traits.context, cap * sizeof v[0]);
+        if (!v) return 0;
+
+        memcpy(v, a->chunkv, a->nchunks * sizeof v[0]);
+        if (a->chunkv != &a->chunk0) (*a->traits.free)(a->traits.context, a->chunkv);
+
+        a->chunkv    = v;
+        a->capchunks = cap;
+    }
+
+    ch->start     = ptr;
+    ch->free_area = ptr;
+    ch->end       = ptr + (nblocks * a->block_size);
+    ch->mru       = 0;
+    ch->nblocks   = nblocks;
+    ch->nfree     = nblocks;
+    ch->fixed     = 0;
+    ch->purged    = 0;
+    ch->clsmul    = (((uint64_t)MEMPOOL_NCLASS) << 32) / nblocks;
+
+    /* keep the array sorted */
+    for (i = a->nchunks; i > 0 && a->chunkv[i-1] > ch; i--) {
+        a->chunkv[i] = a->chunkv[i-1];
+    }
+    a->chunkv[i] = ch;
+    a->nchunks++;
+
+    __list(a, ch, CLS_EMPTY);
+    return 1;
+}
+
+
+/* Bytes to allocate for a chunk of 'n' blocks of 'block_size' */
+static inline uint64_t
+__chunk_bytes(uint_t block_size, uint_t n)
+{
+    return sizeof(memchunk) + ((uint64_t)block_size * n) + MINALIGNMENT;
+}
+
+
+/*
+ * Allocate a new chunk from the OS
+ */
+static memchunk*
 new_chunk(mempool* a)
 {
     uint64_t chunk_size = (uint64_t)a->block_size * (uint64_t)a->min_units;
-    uint64_t alloc_size = sizeof(memchunk) + chunk_size + MINALIGNMENT;
+    uint64_t alloc_size = __chunk_bytes(a->block_size, a->min_units);
 
     /* Guard against arithmetic overflow */
     assert(chunk_size > a->block_size && chunk_size > a->min_units);
@@ -236,44 +395,147 @@ new_chunk(mempool* a)
     memchunk *ch = (memchunk *) (*a->traits.alloc)(a->traits.context, alloc_size);
     if (!ch) return 0;
 
-    /* add this to list of chunks we already have */
-    ch->next  = a->chunks;
-    a->chunks = ch;
-
 
     /*
      * Setup the pointers within this chunk so that all alignment
      * constraints are met; thus making it easy for allocating
      * blocks when required.
      *
-     * When we are done, all memory between ch->free_area and
+     * When we are done, all memory between ch->start and
      * ch->end will be an exact multiple of a->block_size and
      * properly aligned.
      */
     uint8_t *ptr  = pUCHAR(ch) + sizeof *ch;    /* start of free area */
-    ch->free_area = _Align(uint8_t *, ptr);     /* aligned start of blocks */
-    ch->end       = ch->free_area + chunk_size; /* end of chunk memory */
 
-    return 1;
+    if (!__add_chunk(a, ch, _Align(uint8_t *, ptr), a->min_units)) {
+        (*a->traits.free)(a->traits.context, ch);
+        return 0;
+    }
+
+    return ch;
 }
 
 
+/* Release the empty chunk 'ch' to the OS */
+static void
+__release_chunk(mempool* a, memchunk* ch)
+{
+    uint32_t i;
+
+    assert(ch->cls == CLS_EMPTY && !ch->fixed);
+
+    __unlist(a, ch);
+    for (i = 0; a->chunkv[i] != ch; i++);
+    memmove(&a->chunkv[i], &a->chunkv[i+1], (a->nchunks - i - 1) * sizeof a->chunkv[0]);
+    a->nchunks--;
+
+    if (a->cur  == ch) a->cur  = 0;
+    if (a->last == ch) a->last = 0;
+
+    (*a->traits.free)(a->traits.context, ch);
+}
+
 
 /*
- * Try to allocate from the most recent allocated chunk and return a
- * pointer to a block.  Return 0 if not possible.
+ * Forget the blocks of the empty fixed chunk 'ch' and give its
+ * pages back to the OS. Return the number of bytes given back; a
+ * chunk that wasn't used since it was last purged gives nothing.
  */
-static void *
-alloc_from_chunk(mempool* a)
+static uint64_t
+__purge_chunk(memchunk* ch)
 {
-    memchunk *ch = a->chunks; /* latest chunk */
-    void  *p     = 0;
+    if (ch->purged) return 0;
+
+    ch->mru       = 0;
+    ch->free_area = ch->start;
+    ch->purged    = 1;
+
+#if !defined(_WIN32) && defined(MADV_DONTNEED)
+    uint64_t pg = sysconf(_SC_PAGESIZE);
+    uint8_t *s  = (uint8_t *)((_PTRVAL(ch->start) + pg - 1) & ~(pg - 1));
+    uint8_t *e  = (uint8_t *)(_PTRVAL(ch->end) & ~(pg - 1));
 
-    if (ch->free_area < ch->end) {
+    if (s < e && 0 == madvise(s, e - s, MADV_DONTNEED)) return e - s;
+#endif /* MADV_DONTNEED */
+
+    return 0;
+}
+
+
+/* Return the chunk holding 'ptr'; 0 if it isn't in this pool */
+static inline memchunk*
+__find_chunk(mempool* a, uint8_t* ptr)
+{
+    memchunk *ch = a->last;
+    uint32_t  lo = 0,
+              hi = a->nchunks;
+
+    if (ch && ch->start <= ptr && ptr < ch->end) return ch;
+
+    /* find the last chunk that starts at or below 'ptr' */
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (pUCHAR(a->chunkv[mid]) <= ptr) lo = mid + 1;
+        else                               hi = mid;
+    }
+    if (lo == 0) return 0;
+
+    ch = a->chunkv[lo-1];
+    if (ptr < ch->start || ptr >= ch->end) return 0;
+
+    a->last = ch;
+    return ch;
+}
+
+
+/* Pick the chunk to allocate from */
+static memchunk*
+__pick_chunk(mempool* a)
+{
+    memchunk *ch;
+    int i;
+
+    for (i = 0; i < MEMPOOL_NCLASS; i++) {
+        if ((ch = DL_FIRST(&a->part[i]))) goto _found;
+    }
+
+    if ((ch = DL_FIRST(&a->empty))) goto _found;
+
+    /*
+     * If this pool is clamped for max number of units, we won't
+     * try allocating more chunks - unless its chunk was trimmed.
+     */
+    if (a->max_blocks && a->nchunks > 0) return 0;
+
+    ch = new_chunk(a);
+
+_found:
+    a->cur = ch;
+    return ch;
+}
+
+
+/*
+ * Allocate a block from chunk 'ch'; it must have free blocks.
+ */
+static inline void *
+alloc_from_chunk(mempool* a, memchunk* ch)
+{
+    void *p;
+
+    if (ch->mru) {
+        p       = ch->mru;
+        ch->mru = ch->mru->next;
+    } else {
+        assert(ch->free_area < ch->end);
         p  = ch->free_area;
         ch->free_area += a->block_size;
     }
 
+    ch->nfree--;
+    ch->purged = 0;
+    __reclass(a, ch);
     return p;
 }
 
@@ -287,20 +549,10 @@ alloc_from_chunk(mempool* a)
 #if MEMPOOL_DEBUG > 0
 
 static int
-_valid_blk_p(mempool* a, uint8_t * ptr)
+_valid_blk_p(mempool* a, memchunk* ch, uint8_t * ptr)
 {
-    memchunk * ch = a->chunks;
-
-    while (ch) {
-        uint8_t *chunk_start = pUCHAR(ch) + sizeof *ch;
-
-        if (chunk_start <= ptr && ptr < ch->end)
-            return 1;
-
-        ch = ch->next;
-    }
-
-    return 0;
+    (void)a;
+    return ch && 0 == ((ptr - ch->start) % a->block_size) && ptr < ch->free_area;
 }
 
 /* Clear any memory that is returned back to the mempool */
@@ -309,7 +561,7 @@ _valid_blk_p(mempool* a, uint8_t * ptr)
 
 #else
 
-#define _valid_blk_p(a,b)   1
+#define _valid_blk_p(a,c,b) ((void)(a), (c) != 0)
 #define clear_memory(a,p)   do { } while (0)
 #define fill_memory(a,p)    p
 
@@ -317,10 +569,27 @@ _valid_blk_p(mempool* a, uint8_t * ptr)
 #endif /* MEMPOOL_DEBUG */
 
 
+static void
+__init_lists(mempool* a)
+{
+    int i;
+
+    for (i = 0; i < MEMPOOL_NCLASS; i++) {
+        DL_INIT(&a->part[i]);
+    }
+    DL_INIT(&a->empty);
+
+    a->chunkv    = &a->chunk0;
+    a->capchunks = 1;
+    a->hiwat     = MEMPOOL_NO_TRIM;
+}
+
+
 static int
 __real_init(mempool *a, const memmgr *tr, uint_t block_size, uint_t max, uint_t min_alloc_units)
 {
     memset(a, 0, sizeof *a);
+    __init_lists(a);
 
     /*
      * Make sure block_size has minimum qualifications.
@@ -343,7 +612,7 @@ __real_init(mempool *a, const memmgr *tr, uint_t block_size, uint_t max, uint_t
     a->traits     = *tr;
 
 
-    if (!new_chunk(a)) return -ENOMEM;
+    if (!(a->cur = new_chunk(a))) return -ENOMEM;
 
     return 0;
 }
@@ -418,6 +687,7 @@ mempool_init_from_mem(mempool* a, uint_t block_size,
     if (!(a && pool && poolsize)) return -EINVAL;
 
     memset(a, 0, sizeof *a);
+    __init_lists(a);
 
     if (block_size < MIN_OBJ_SIZE) block_size = MIN_OBJ_SIZE;
 
@@ -446,23 +716,24 @@ mempool_init_from_mem(mempool* a, uint_t block_size,
      * constraints are met; thus making it easy for allocating
      * blocks when required.
      *
-     * When we are done, all memory between ch->free_area and
+     * When we are done, all memory between ch->start and
      * ch->end will be an exact multiple of a->block_size;
      */
     end            = ptr + poolsize;          // end of allocation area
-    ch->free_area  = _Align(uint8_t *, ptr);  // aligned start of "n" blocks
-
-    nblocks        = (end - ch->free_area) / block_size;
-    ch->end        = ch->free_area + (nblocks * block_size);
-
-    assert(ch->end <= end);
+    ptr            = _Align(uint8_t *, ptr);  // aligned start of "n" blocks
+    nblocks        = (end - ptr) / block_size;
 
-    ch->next       = 0;
-    a->chunks      = ch;
     a->max_blocks  = a->min_units = nblocks;
     a->block_size  = block_size;
     a->traits.free = __dummy_free; // to make mempool_delete() easier
 
+    // The chunk array has room for one chunk; thus this can't fail
+    __add_chunk(a, ch, ptr, nblocks);
+    assert(ch->end <= end);
+
+    ch->fixed = 1;
+    a->cur    = ch;
+
     return 0;
 }
 
@@ -503,14 +774,13 @@ mempool_fini(mempool *a)
     if (!a) return;
 
     const memmgr* tr = &a->traits;
-    memchunk * ch    = a->chunks;
-
-    while (ch) {
-        memchunk * next = ch->next;
+    uint32_t i;
 
-        (*tr->free)(tr->context, ch);
-        ch = next;
+    for (i = 0; i < a->nchunks; i++) {
+        (*tr->free)(tr->context, a->chunkv[i]);
     }
+    if (a->chunkv != &a->chunk0) (*tr->free)(tr->context, a->chunkv);
+
     memset(a, 0, sizeof *a);
 }
 
@@ -537,37 +807,18 @@ mempool_delete(mempool* a)
 void *
 mempool_alloc(mempool* a)
 {
-    mru_node * blk = 0;
-    void * ptr     = 0;
+    memchunk * ch;
+    void * ptr;
 
     assert(a);
 
-    blk = DL_REMOVE_TAIL(&a->mru_head, link);
-    if (blk) {
-        ptr = blk;
-        goto _end;
-    }
-
-
-    /*
-     * MRU list is empty. We now try the most recent memchunk.
-     * If this state is clamped for max number of units, we
-     * won't try allocating more chunks.
-     */
-
-    ptr = alloc_from_chunk(a);
-    if (ptr || a->max_blocks) goto _end;
+    ch = a->cur;
+    if (!(ch && ch->nfree) && !(ch = __pick_chunk(a))) return 0;
 
+    ptr = alloc_from_chunk(a, ch);
 
-    /*
-     * Last try: allocate a new chunk and fetch a block from it.
-     */
-    if (new_chunk(a))
-        ptr = alloc_from_chunk(a);
-
-_end:
     //printf("state-%p: alloc() => %p\n", a, ptr);
-    return ptr ? fill_memory(a, ptr) : 0;
+    return fill_memory(a, ptr);
 }
 
 
@@ -579,15 +830,86 @@ void
 mempool_free(mempool* a, void * ptr)
 {
     mru_node * blk = (mru_node *)ptr;
+    memchunk * ch;
+    uint32_t   cls;
 
     assert(a);
-    assert(_valid_blk_p(a, pUCHAR(ptr)));
+
+    ch = __find_chunk(a, pUCHAR(ptr));
+    assert(_valid_blk_p(a, ch, pUCHAR(ptr)));
     clear_memory(a, ptr);
 
-    DL_INSERT_HEAD(&a->mru_head, blk, link);
+    blk->next = ch->mru;
+    ch->mru   = blk;
+    ch->nfree++;
+
+    cls = __cls(ch);
+    if (cls == ch->cls) return;
+
+    __unlist(a, ch);
+    __list(a, ch, cls);
+
+    /*
+     * A chunk that gets emptier than the one we allocate from isn't
+     * the best one any more.
+     */
+    if (ch == a->cur) a->cur = 0;
+
+    if (cls == CLS_EMPTY && a->nempty > a->hiwat && !ch->fixed) {
+        __release_chunk(a, ch);
+    }
 }
 
 
+/*
+ * Release empty chunks beyond 'keep'
+ */
+uint64_t
+mempool_trim(mempool* a, unsigned int keep)
+{
+    memchunk *ch, *next;
+    uint64_t  n = 0;
+    uint32_t  k = a->nempty;
+
+    for (ch = DL_FIRST(&a->empty); ch && k > keep; ch = next, k--) {
+        next = DL_NEXT(ch, link);
+
+        if (ch->fixed) {
+            n += __purge_chunk(ch);
+        } else {
+            n += sizeof *ch + (ch->end - ch->start);
+            __release_chunk(a, ch);
+        }
+    }
+    return n;
+}
+
+
+void
+mempool_set_trim(mempool* a, unsigned int hiwat)
+{
+    a->hiwat = hiwat;
+    if (hiwat != MEMPOOL_NO_TRIM) mempool_trim(a, hiwat);
+}
+
+
+
+/*
+ * Return the size of a chunk request; this must round the block
+ * size and pick the units like __real_init().
+ */
+uint64_t
+mempool_chunk_size(uint_t block_size, uint_t max, uint_t min_alloc_units)
+{
+    if (block_size < MIN_OBJ_SIZE) block_size = MIN_OBJ_SIZE;
+
+    block_size = _Align(uint_t, block_size);
+    if (max)                    min_alloc_units = max;
+    else if (!min_alloc_units)  min_alloc_units = MEMPOOL_MIN_ALLOC_UNITS;
+
+    return __chunk_bytes(block_size, min_alloc_units);
+}
+
 
 /*
  * Return the block size of this mempool.
@@ -14,11 +14,23 @@
  * suitability for any purpose.
  *
  * Creation date: Thu Oct 20 11:05:35 2005
+ *
+ * Notes
+ * =====
+ * o Mutex_locker has no shared ops; lockmgr_rdlock() falls back
+ *   to the exclusive lock.
+ *
+ * o Spin_locker is a single word: the high bit is held by a
+ *   writer and the rest counts the readers. A writer first claims
+ *   the high bit (new readers then back off) and waits for the
+ *   readers to drain; thus a steady stream of readers can't starve
+ *   a writer.
  */
 
 #include "utils/lockmgr.h"
 #include "utils/utils.h"
 #include <pthread.h>
+#include <stdatomic.h>
 
 
 static void
@@ -76,4 +88,171 @@ const lockmgr Mutex_locker =
     .dtor   = mutex_delete,
 };
 
+
+
+/* -- reader/writer lock -- */
+
+static void
+rwlock_wrlock(void* opaq)
+{
+    pthread_rwlock_wrlock((pthread_rwlock_t*)opaq);
+}
+
+
+static void
+rwlock_rdlock(void* opaq)
+{
+    pthread_rwlock_rdlock((pthread_rwlock_t*)opaq);
+}
+
+
+static void
+rwlock_unlock(void* opaq)
+{
+    pthread_rwlock_unlock((pthread_rwlock_t*)opaq);
+}
+
+
+static void
+rwlock_delete(void* opaq)
+{
+    pthread_rwlock_destroy((pthread_rwlock_t*)opaq);
+    DEL(opaq);
+}
+
+
+/* posix rwlock ctor */
+void
+lockmgr_new_rwlock(lockmgr* l)
+{
+    pthread_rwlock_t* m;
+
+    if (!l)
+        return;
+
+    m = NEWZ(pthread_rwlock_t);
+    if (!m)
+        return;
+
+    if (pthread_rwlock_init(m, 0) != 0)
+    {
+        DEL(m);
+        return;
+    }
+
+    *l = Rwlock_locker;
+    l->opaq   = m;
+}
+
+const lockmgr Rwlock_locker =
+{
+    .create   = lockmgr_new_rwlock,
+    .lock     = rwlock_wrlock,
+    .unlock   = rwlock_unlock,
+    .dtor     = rwlock_delete,
+    .rdlock   = rwlock_rdlock,
+    .rdunlock = rwlock_unlock,
+};
+
+
+
+/* -- reader/writer spin lock -- */
+
+#define SPIN_WRITER     0x80000000
+
+static void
+spin_wrlock(void* opaq)
+{
+    atomic_uint* s = (atomic_uint*)opaq;
+    unsigned int v = atomic_load_explicit(s, memory_order_relaxed);
+
+    // claim the writer bit
+    for (;;) {
+        if (v & SPIN_WRITER) {
+            sys_cpu_pause();
+            v = atomic_load_explicit(s, memory_order_relaxed);
+            continue;
+        }
+
+        if (atomic_compare_exchange_weak_explicit(s, &v, v | SPIN_WRITER,
+                    memory_order_acquire, memory_order_relaxed))
+            break;
+    }
+
+    // and wait for the readers to leave
+    while (atomic_load_explicit(s, memory_order_acquire) != SPIN_WRITER)
+        sys_cpu_pause();
+}
+
+
+static void
+spin_wrunlock(void* opaq)
+{
+    atomic_store_explicit((atomic_uint*)opaq, 0, memory_order_release);
+}
+
+
+static void
+spin_rdlock(void* opaq)
+{
+    atomic_uint* s = (atomic_uint*)opaq;
+    unsigned int v = atomic_load_explicit(s, memory_order_relaxed);
+
+    for (;;) {
+        if (v & SPIN_WRITER) {
+            sys_cpu_pause();
+            v = atomic_load_explicit(s, memory_order_relaxed);
+            continue;
+        }
+
+        if (atomic_compare_exchange_weak_explicit(s, &v, v + 1,
+                    memory_order_acquire, memory_order_relaxed))
+            break;
+    }
+}
+
+
+static void
+spin_rdunlock(void* opaq)
+{
+    atomic_fetch_sub_explicit((atomic_uint*)opaq, 1, memory_order_release);
+}
+
+
+static void
+spin_delete(void* opaq)
+{
+    DEL(opaq);
+}
+
+
+/* spin lock ctor */
+void
+lockmgr_new_spin(lockmgr* l)
+{
+    atomic_uint* s;
+
+    if (!l)
+        return;
+
+    s = NEWZ(atomic_uint);
+    if (!s)
+        return;
+
+    atomic_init(s, 0);
+
+    *l = Spin_locker;
+    l->opaq   = s;
+}
+
+const lockmgr Spin_locker =
+{
+    .create   = lockmgr_new_spin,
+    .lock     = spin_wrlock,
+    .unlock   = spin_wrunlock,
+    .dtor     = spin_delete,
+    .rdlock   = spin_rdlock,
+    .rdunlock = spin_rdunlock,
+};
+
 /* EOF */
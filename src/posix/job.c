@@ -137,7 +137,7 @@ job_manager_init(job_manager* jm, int nthreads, jobfunc_t func, void* ctx)
  * for all threads to exit.
  */
 void
-job_manager_cleanup(job_manager* jm)
+job_manager_destroy(job_manager* jm)
 {
     SYNCQ_FINI(&jm->q);
     sem_destroy(&jm->done);
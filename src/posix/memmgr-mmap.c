@@ -0,0 +1,315 @@
+/* :vi:ts=4:sw=4:
+ *
+ * memmgr-mmap.c - page, huge page and NUMA memory managers
+ *
+ * Copyright (c) 2005 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ *
+ * Implementation Notes:
+ *
+ *  - Every allocation is its own mapping; a small header at the
+ *    start of the mapping records its length for munmap(). The
+ *    header is a cacheline so that the caller's memory stays
+ *    aligned.
+ *
+ *  - Huge pages: MAP_HUGETLB needs pages reserved by the admin
+ *    (vm.nr_hugepages). When it fails we use transparent huge
+ *    pages: map an extra huge page, trim the mapping to a huge page
+ *    boundary and madvise(MADV_HUGEPAGE). The reserve may be grown
+ *    (or freed) later; so we don't give up on MAP_HUGETLB - we skip
+ *    it for the next HUGETLB_RETRY huge allocations.
+ *
+ *  - NUMA: the mapping is bound with mbind(2) before it is touched;
+ *    the pages are then faulted in on the right node no matter
+ *    which thread touches them first. We call the syscall directly
+ *    so that we don't need libnuma.
+ *
+ *  - The flags and the node are packed into the memmgr context;
+ *    thus the memory managers need no state of their own.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif /* __linux__ */
+
+#include "utils/utils.h"
+#include "utils/memmgr.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS   MAP_ANON
+#endif
+
+/* mbind(2) modes; from <numaif.h> */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED  1
+#define MPOL_BIND       2
+#endif
+
+/* Size of the header before each allocation */
+#define PGHDR_SIZE      MEMMGR_OVERHEAD
+
+/* Largest node number we can bind to */
+#define MAX_NODES       1024
+
+#define DEFAULT_HUGEPAGE    (2 * 1024 * 1024)
+
+/* Huge allocations that skip MAP_HUGETLB after it fails */
+#define HUGETLB_RETRY       64
+
+/* Node field of the context: 0 => no binding */
+#define CTX_FLAGS(c)    ((unsigned int)((uintptr_t)(c) & 0xff))
+#define CTX_NODE(c)     ((int)((uintptr_t)(c) >> 8) - 2)
+#define CTX_NUMA(c)     (((uintptr_t)(c) >> 8) != 0)
+#define MKCTX(f,n)      ((void *)(((uintptr_t)((n) + 2) << 8) | ((f) & 0xff)))
+
+
+struct pghdr
+{
+    size_t len;     // length of the mapping
+};
+
+
+static size_t Pagesize;
+static size_t Hugepagesize;
+static int    Numanodes;
+
+/* Huge allocations left before we try MAP_HUGETLB again; a lost
+ * update only changes when we retry. */
+static volatile int Hugetlb_skip;
+
+
+static size_t
+__pagesize(void)
+{
+    if (unlikely(!Pagesize)) {
+        long n = sysconf(_SC_PAGESIZE);
+        Pagesize = n > 0 ? (size_t)n : 4096;
+    }
+    return Pagesize;
+}
+
+
+size_t
+memmgr_hugepage_size(void)
+{
+    if (unlikely(!Hugepagesize)) {
+        size_t sz = DEFAULT_HUGEPAGE;
+#ifdef __linux__
+        FILE  *fp = fopen("/proc/meminfo", "r");
+        char   buf[256];
+        unsigned long kb;
+
+        if (fp) {
+            while (fgets(buf, sizeof buf, fp)) {
+                if (1 == sscanf(buf, "Hugepagesize: %lu kB", &kb) && kb > 0) {
+                    sz = kb * 1024;
+                    break;
+                }
+            }
+            fclose(fp);
+        }
+#endif /* __linux__ */
+        Hugepagesize = sz;
+    }
+    return Hugepagesize;
+}
+
+
+int
+memmgr_numa_nodes(void)
+{
+    if (unlikely(!Numanodes)) {
+        int n = 1;
+#ifdef __linux__
+        // The online nodes are a list of ranges, eg. "0-3" or "0,2";
+        // the highest node number is all we need.
+        FILE *fp = fopen("/sys/devices/system/node/online", "r");
+        char  buf[256];
+
+        if (fp) {
+            if (fgets(buf, sizeof buf, fp)) {
+                char *s = buf;
+
+                while (*s) {
+                    char *e;
+                    long  v = strtol(s, &e, 10);
+
+                    if (e == s) { s++; continue; }
+                    if (v + 1 > n) n = (int)(v + 1);
+                    s = e;
+                }
+            }
+            fclose(fp);
+        }
+#endif /* __linux__ */
+        Numanodes = n;
+    }
+    return Numanodes;
+}
+
+
+#ifdef __linux__
+/*
+ * Bind the mapping 'p' to the node in 'ctx'. Return 0 if the caller
+ * can use the memory.
+ */
+static int
+__bind(void *p, size_t len, void *ctx)
+{
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))];
+    unsigned int  f = CTX_FLAGS(ctx);
+    int node = CTX_NODE(ctx);
+    int mode = (f & MEMMGR_NUMA_STRICT) ? MPOL_BIND : MPOL_PREFERRED;
+    long r;
+
+    if (node < 0) {
+        unsigned int cpu, n;
+
+        if (syscall(SYS_getcpu, &cpu, &n, 0) < 0) return 0;
+        node = (int)n;
+    }
+
+    if (node >= MAX_NODES) return (f & MEMMGR_NUMA_STRICT) ? -EINVAL : 0;
+
+    memset(mask, 0, sizeof mask);
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+
+    r = syscall(SYS_mbind, p, len, mode, mask, MAX_NODES + 1, 0);
+    if (r < 0 && (f & MEMMGR_NUMA_STRICT)) return -errno;
+    return 0;
+}
+#else
+static inline int
+__bind(void *p, size_t len, void *ctx)
+{
+    USEARG(p);
+    USEARG(len);
+    USEARG(ctx);
+    return 0;
+}
+#endif /* __linux__ */
+
+
+/*
+ * Map 'len' bytes aligned to a huge page; 'len' is a multiple of
+ * the huge page size.
+ */
+static void *
+__maphuge(size_t len, size_t hp)
+{
+    unsigned char *p;
+    size_t head, tail;
+
+#ifdef MAP_HUGETLB
+    if (Hugetlb_skip > 0) {
+        Hugetlb_skip--;
+    } else {
+        p = mmap(0, len, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) return p;
+        Hugetlb_skip = HUGETLB_RETRY;
+    }
+#endif /* MAP_HUGETLB */
+
+    p = mmap(0, len + hp, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return 0;
+
+    head = _ALIGN_UP(_U64(p), hp) - _U64(p);
+    tail = hp - head;
+    if (head > 0) munmap(p, head);
+    if (tail > 0) munmap(p + head + len, tail);
+
+    p += head;
+#ifdef MADV_HUGEPAGE
+    madvise(p, len, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
+    return p;
+}
+
+
+static void *
+__mmap_alloc(void *ctx, size_t n)
+{
+    size_t need = n + PGHDR_SIZE;
+    size_t hp   = memmgr_hugepage_size();
+    size_t len;
+    struct pghdr *h;
+
+    if (need < n) return 0;
+
+    if ((CTX_FLAGS(ctx) & MEMMGR_HUGEPAGE) && need >= hp) {
+        len = _ALIGN_UP(need, hp);
+        h   = (struct pghdr *)__maphuge(len, hp);
+        if (!h) return 0;
+    } else {
+        len = _ALIGN_UP(need, __pagesize());
+        h   = (struct pghdr *)mmap(0, len, PROT_READ|PROT_WRITE,
+                                   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (h == MAP_FAILED) return 0;
+    }
+
+    if (CTX_NUMA(ctx) && __bind(h, len, ctx) < 0) {
+        munmap(h, len);
+        return 0;
+    }
+
+    h->len = len;
+    return pUCHAR(h) + PGHDR_SIZE;
+}
+
+
+static void
+__mmap_free(void *ctx, void *ptr)
+{
+    struct pghdr *h;
+
+    USEARG(ctx);
+    if (!ptr) return;
+
+    h = (struct pghdr *)(pUCHAR(ptr) - PGHDR_SIZE);
+    munmap(h, h->len);
+}
+
+
+memmgr *
+memmgr_init_mmap(memmgr *m, unsigned int flags)
+{
+    if (m) {
+        m->alloc   = __mmap_alloc;
+        m->free    = __mmap_free;
+        m->context = (void *)(uintptr_t)(flags & 0xff);
+    }
+    return m;
+}
+
+
+memmgr *
+memmgr_init_numa(memmgr *m, int node, unsigned int flags)
+{
+    if (!memmgr_init_mmap(m, flags)) return m;
+
+    // On a single node system there is nothing to bind to.
+    if (memmgr_numa_nodes() > 1 || (node >= 0 && (flags & MEMMGR_NUMA_STRICT))) {
+        if (node < MEMMGR_NUMA_LOCAL) node = MEMMGR_NUMA_LOCAL;
+        m->context = MKCTX(flags, node);
+    }
+    return m;
+}
+
+/* EOF */
@@ -0,0 +1,441 @@
+/* vim: ts=4:sw=4:expandtab:tw=72:
+ *
+ * slab.c - General purpose size-class allocator built on mempool.
+ *
+ * Copyright (c) 2005 Sudhi Herle <sw at herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include "utils/utils.h"
+#include "utils/mempool.h"
+#include "utils/slab.h"
+
+/*
+ * IMPLEMENTATION NOTES
+ * ====================
+ *
+ *  - Each size class is a mempool whose chunks are SLAB_REGION_SIZE
+ *    aligned regions mapped from the OS. The first HDR_SIZE bytes of
+ *    a region are a header with the size class; the mempool gets
+ *    the rest. A class's chunk is sized to fit in one region; thus
+ *    every block of a class lies in a region with its header.
+ *
+ *  - The mempool also asks its memory manager for its array of
+ *    chunk pointers. A request is a chunk iff its size is exactly
+ *    the chunk size of the class (mempool_chunk_size()); everything
+ *    else comes from malloc().
+ *
+ *  - The base address of every region is in a small open addressed
+ *    hash table. Given a pointer, masking the low bits gives a
+ *    candidate region; if it is in the table the pointer is a block
+ *    of that region's size class.
+ *
+ *  - Otherwise it is a large request: those come from malloc() with
+ *    their size in a header just before the pointer. We don't align
+ *    large requests to a region: posix_memalign() with a large
+ *    alignment is very slow and fragments the heap.
+ *
+ *  - The mempool of a class is made on its first allocation; a
+ *    slab that only sees a few sizes stays small.
+ */
+
+/* Header at the start of every region */
+struct slabhdr
+{
+    uint32_t cls;       // size class
+};
+typedef struct slabhdr slabhdr;
+
+/* Header size; keeps the memory after it cache line aligned */
+#define HDR_SIZE        64
+
+/* Header of a large allocation; keeps malloc()'s alignment */
+#define LARGE_HDR       16
+
+/* Room in a region for the mempool's own chunk header */
+#define CHUNK_SLACK     256
+
+#define _BASE(p)        (_U64(p) & ~_U64(SLAB_REGION_SIZE-1))
+#define _HDR(p)         ((slabhdr *)_BASE(p))
+#define _LSIZE(p)       (*(uint64_t *)(pUCHAR(p) - LARGE_HDR))
+
+/* Initial size of the region table */
+#define RMAP_LOGSIZE    8
+
+struct slab;
+
+struct slabclass
+{
+    mempool  pool;
+
+    struct slab *s;
+
+    uint32_t idx;
+    uint32_t size;
+    uint32_t units;
+    uint32_t chunk;     // size of a chunk request of the mempool
+    int      ready;
+};
+typedef struct slabclass slabclass;
+
+
+struct slab
+{
+    slabclass cls[SLAB_NCLASS];
+
+    /* base addresses of the regions; 0 is an empty slot */
+    uint64_t *rmap;
+    uint32_t  rlog;
+    uint32_t  rnum;
+};
+
+
+static inline uint32_t
+__rhash(slab *s, uint64_t base)
+{
+    return (uint32_t)(((base / SLAB_REGION_SIZE) * 0x9e3779b97f4a7c15ULL) >> (64 - s->rlog));
+}
+
+
+/* Return true if 'base' is a region of this slab */
+static inline int
+__risregion(slab *s, uint64_t base)
+{
+    uint32_t mask = (1U << s->rlog) - 1;
+    uint32_t i    = __rhash(s, base);
+    uint64_t v;
+
+    while ((v = s->rmap[i])) {
+        if (v == base) return 1;
+        i = (i + 1) & mask;
+    }
+    return 0;
+}
+
+
+static void
+__rput(uint64_t *map, uint32_t i, uint32_t mask, uint64_t base)
+{
+    while (map[i]) i = (i + 1) & mask;
+    map[i] = base;
+}
+
+
+static int
+__radd(slab *s, uint64_t base)
+{
+    uint32_t n = 1U << s->rlog;
+
+    if (2 * (s->rnum + 1) > n) {
+        uint64_t *old = s->rmap;
+        uint32_t  i;
+
+        if (!(s->rmap = NEWZA(uint64_t, 2 * n))) {
+            s->rmap = old;
+            return -ENOMEM;
+        }
+
+        s->rlog++;
+        for (i = 0; i < n; i++) {
+            if (old[i]) __rput(s->rmap, __rhash(s, old[i]), (2 * n) - 1, old[i]);
+        }
+        DEL(old);
+        n *= 2;
+    }
+
+    __rput(s->rmap, __rhash(s, base), n - 1, base);
+    s->rnum++;
+    return 0;
+}
+
+
+/* Remove 'base' and shift back the entries after it */
+static void
+__rdel(slab *s, uint64_t base)
+{
+    uint32_t mask = (1U << s->rlog) - 1;
+    uint32_t i    = __rhash(s, base);
+    uint32_t j;
+
+    while (s->rmap[i] != base) i = (i + 1) & mask;
+
+    s->rmap[i] = 0;
+    for (j = (i + 1) & mask; s->rmap[j]; j = (j + 1) & mask) {
+        uint32_t h = __rhash(s, s->rmap[j]);
+
+        // move j to the hole if its home isn't in (i, j]
+        if (((j - h) & mask) >= ((j - i) & mask)) {
+            s->rmap[i] = s->rmap[j];
+            s->rmap[j] = 0;
+            i = j;
+        }
+    }
+    s->rnum--;
+}
+
+
+/*
+ * Return the size class of 'n' (upto SLAB_MAX_SIZE): 16 bytes apart
+ * upto 128 bytes and four per power of 2 after that.
+ */
+static inline uint32_t
+__cls(size_t n)
+{
+    uint32_t k;
+
+    if (n <= 128) return n == 0 ? 0 : (uint32_t)((n + 15) / 16) - 1;
+
+    k = 63 - __builtin_clzll(n - 1);
+    return 8 + ((k - 7) * 4) + (uint32_t)((n - 1) >> (k - 2)) - 4;
+}
+
+
+/* Return the size of the class 'i' */
+static inline uint32_t
+__clsize(uint32_t i)
+{
+    uint32_t j, k;
+
+    if (i < 8) return (i + 1) * 16;
+
+    j = i - 8;
+    k = 7 + (j / 4);
+    return (4 + (j % 4) + 1) << (k - 2);
+}
+
+
+/* Map a new region for the size class 'c' */
+static void *
+__region(slabclass *c)
+{
+    unsigned char *p;
+    size_t head, tail;
+
+    p = mmap(0, 2 * SLAB_REGION_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+    if (p == MAP_FAILED) return 0;
+
+    head = _ALIGN_UP(_U64(p), SLAB_REGION_SIZE) - _U64(p);
+    tail = SLAB_REGION_SIZE - head;
+    if (head > 0) munmap(p, head);
+    if (tail > 0) munmap(p + head + SLAB_REGION_SIZE, tail);
+
+    p += head;
+    if (__radd(c->s, _U64(p)) < 0) {
+        munmap(p, SLAB_REGION_SIZE);
+        return 0;
+    }
+
+    ((slabhdr *)p)->cls = c->idx;
+    return p + HDR_SIZE;
+}
+
+
+/*
+ * Memory manager for the mempool of a size class: its chunks are
+ * regions; anything else (its chunk array) comes from malloc().
+ */
+static void *
+__cls_alloc(void *ctx, size_t n)
+{
+    slabclass *c = (slabclass *)ctx;
+
+    if (n != c->chunk) return malloc(n);
+
+    return __region(c);
+}
+
+
+static void
+__cls_free(void *ctx, void *ptr)
+{
+    slabclass *c = (slabclass *)ctx;
+    uint64_t   b = _U64(ptr) - HDR_SIZE;
+
+    if (!ptr) return;
+
+    if (_IS_ALIGNED(b, SLAB_REGION_SIZE) && __risregion(c->s, b)) {
+        __rdel(c->s, b);
+        munmap((void *)b, SLAB_REGION_SIZE);
+    } else {
+        free(ptr);
+    }
+}
+
+
+static int
+__cls_init(slabclass *c)
+{
+    memmgr mm;
+    int r;
+
+    memmgr_init(&mm, __cls_alloc, __cls_free, c);
+    if ((r = mempool_init(&c->pool, &mm, c->size, 0, c->units)) < 0) return r;
+
+    c->ready = 1;
+    return 0;
+}
+
+
+int
+slab_new(slab** p_s)
+{
+    slab    *s;
+    uint32_t i;
+
+    if (!p_s) return -EINVAL;
+
+    s = NEWZ(slab);
+    if (!s) return -ENOMEM;
+
+    s->rlog = RMAP_LOGSIZE;
+    s->rmap = NEWZA(uint64_t, 1U << s->rlog);
+    if (!s->rmap) {
+        DEL(s);
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < SLAB_NCLASS; i++) {
+        slabclass *c = &s->cls[i];
+
+        c->s     = s;
+        c->idx   = i;
+        c->size  = __clsize(i);
+        c->units = (SLAB_REGION_SIZE - HDR_SIZE - CHUNK_SLACK) / c->size;
+        c->chunk = (uint32_t)mempool_chunk_size(c->size, 0, c->units);
+        assert(c->chunk <= SLAB_REGION_SIZE - HDR_SIZE);
+    }
+
+    assert(__cls(SLAB_MAX_SIZE) == SLAB_NCLASS-1);
+    assert(__clsize(SLAB_NCLASS-1) == SLAB_MAX_SIZE);
+
+    *p_s = s;
+    return 0;
+}
+
+
+void
+slab_delete(slab* s)
+{
+    uint32_t i;
+
+    if (!s) return;
+
+    for (i = 0; i < SLAB_NCLASS; i++) {
+        slabclass *c = &s->cls[i];
+
+        if (c->ready) mempool_fini(&c->pool);
+    }
+
+    // Large allocations still live are the caller's to free.
+    DEL(s->rmap);
+    DEL(s);
+}
+
+
+void *
+slab_alloc(slab* s, size_t n)
+{
+    slabclass *c;
+    void *p;
+
+    if (unlikely(n > SLAB_MAX_SIZE)) {
+        uint64_t *h;
+
+        if (n > (SIZE_MAX - LARGE_HDR) || !(h = malloc(LARGE_HDR + n))) return 0;
+        *h = n;
+        return pUCHAR(h) + LARGE_HDR;
+    }
+
+    c = &s->cls[__cls(n)];
+    if (unlikely(!c->ready) && __cls_init(c) < 0) return 0;
+
+    p = mempool_alloc(&c->pool);
+    assert(!p || _HDR(p)->cls == c->idx);
+    return p;
+}
+
+
+void
+slab_free(slab* s, void * ptr)
+{
+    slabhdr *h;
+
+    if (unlikely(!ptr)) return;
+
+    if (unlikely(!__risregion(s, _BASE(ptr)))) {
+        free(pUCHAR(ptr) - LARGE_HDR);
+        return;
+    }
+
+    h = _HDR(ptr);
+    assert(h->cls < SLAB_NCLASS);
+    mempool_free(&s->cls[h->cls].pool, ptr);
+}
+
+
+size_t
+slab_size(slab* s, void * ptr)
+{
+    if (!__risregion(s, _BASE(ptr))) return _LSIZE(ptr);
+
+    return s->cls[_HDR(ptr)->cls].size;
+}
+
+
+void *
+slab_realloc(slab* s, void * ptr, size_t n)
+{
+    size_t have;
+    void  *p;
+
+    if (!ptr) return slab_alloc(s, n);
+    if (n == 0) {
+        slab_free(s, ptr);
+        return 0;
+    }
+
+    // Keep the memory unless it is too small or much too large.
+    have = slab_size(s, ptr);
+    if (n <= have) {
+        if (have <= SLAB_MAX_SIZE && __cls(n) == _HDR(ptr)->cls) return ptr;
+        if (have >  SLAB_MAX_SIZE && n > SLAB_MAX_SIZE && n >= (have / 2)) return ptr;
+    }
+
+    if (!(p = slab_alloc(s, n))) return 0;
+
+    memcpy(p, ptr, n < have ? n : have);
+    slab_free(s, ptr);
+    return p;
+}
+
+
+uint64_t
+slab_trim(slab* s)
+{
+    uint64_t n = 0;
+    uint32_t i;
+
+    for (i = 0; i < SLAB_NCLASS; i++) {
+        slabclass *c = &s->cls[i];
+
+        if (c->ready) n += mempool_trim(&c->pool, 0);
+    }
+    return n;
+}
+
+/* EOF */
@@ -19,6 +19,7 @@
 
 #include "utils/lockmgr.h"
 #include <windows.h>
+#include <stdlib.h>
 
 
 
@@ -56,12 +57,196 @@ lockmgr_new_mutex(lockmgr* l)
     if (!h)
         return 0;
 
-    l->lock   = mutex_lock;
-    l->unlock = mutex_unlock;
-    l->dtor   = mutex_delete;
-    l->opaq   = (void*)h;
+    *l = Mutex_locker;
+    l->opaq = (void*)h;
 
     return l;
 }
 
+
+static void
+mutex_create(lockmgr* l)
+{
+    lockmgr_new_mutex(l);
+}
+
+/* A mutex has no shared mode; rdlock/rdunlock are the exclusive ops */
+const lockmgr Mutex_locker =
+{
+    .create   = mutex_create,
+    .lock     = mutex_lock,
+    .unlock   = mutex_unlock,
+    .dtor     = mutex_delete,
+    .rdlock   = mutex_lock,
+    .rdunlock = mutex_unlock,
+};
+
+
+
+/* -- reader/writer lock (slim rwlock) -- */
+
+static void
+rwlock_wrlock(void* opaq)
+{
+    AcquireSRWLockExclusive((PSRWLOCK)opaq);
+}
+
+
+static void
+rwlock_wrunlock(void* opaq)
+{
+    ReleaseSRWLockExclusive((PSRWLOCK)opaq);
+}
+
+
+static void
+rwlock_rdlock(void* opaq)
+{
+    AcquireSRWLockShared((PSRWLOCK)opaq);
+}
+
+
+static void
+rwlock_rdunlock(void* opaq)
+{
+    ReleaseSRWLockShared((PSRWLOCK)opaq);
+}
+
+
+static void
+rwlock_delete(void* opaq)
+{
+    free(opaq);
+}
+
+
+/* create a win32 slim reader/writer lock abstraction */
+void
+lockmgr_new_rwlock(lockmgr* l)
+{
+    PSRWLOCK s;
+
+    if (!l)
+        return;
+
+    s = (PSRWLOCK)malloc(sizeof *s);
+    if (!s)
+        return;
+
+    InitializeSRWLock(s);
+
+    *l = Rwlock_locker;
+    l->opaq = (void*)s;
+}
+
+const lockmgr Rwlock_locker =
+{
+    .create   = lockmgr_new_rwlock,
+    .lock     = rwlock_wrlock,
+    .unlock   = rwlock_wrunlock,
+    .dtor     = rwlock_delete,
+    .rdlock   = rwlock_rdlock,
+    .rdunlock = rwlock_rdunlock,
+};
+
+
+
+/* -- reader/writer spin lock -- */
+
+#define SPIN_WRITER     ((LONG)0x80000000)
+
+static void
+spin_wrlock(void* opaq)
+{
+    volatile LONG* s = (volatile LONG*)opaq;
+
+    // claim the writer bit
+    for (;;) {
+        LONG v = *s;
+
+        if (v & SPIN_WRITER) {
+            YieldProcessor();
+            continue;
+        }
+
+        if (InterlockedCompareExchange(s, v | SPIN_WRITER, v) == v)
+            break;
+    }
+
+    // and wait for the readers to leave
+    while (*s != SPIN_WRITER)
+        YieldProcessor();
+}
+
+
+static void
+spin_wrunlock(void* opaq)
+{
+    InterlockedExchange((volatile LONG*)opaq, 0);
+}
+
+
+static void
+spin_rdlock(void* opaq)
+{
+    volatile LONG* s = (volatile LONG*)opaq;
+
+    for (;;) {
+        LONG v = *s;
+
+        if (v & SPIN_WRITER) {
+            YieldProcessor();
+            continue;
+        }
+
+        if (InterlockedCompareExchange(s, v + 1, v) == v)
+            break;
+    }
+}
+
+
+static void
+spin_rdunlock(void* opaq)
+{
+    InterlockedDecrement((volatile LONG*)opaq);
+}
+
+
+static void
+spin_delete(void* opaq)
+{
+    _aligned_free(opaq);
+}
+
+
+/* create a reader/writer spin lock abstraction */
+void
+lockmgr_new_spin(lockmgr* l)
+{
+    LONG* s;
+
+    if (!l)
+        return;
+
+    // Interlocked operations need a 32-bit aligned LONG
+    s = (LONG*)_aligned_malloc(sizeof *s, sizeof *s);
+    if (!s)
+        return;
+
+    *s = 0;
+
+    *l = Spin_locker;
+    l->opaq = (void*)s;
+}
+
+const lockmgr Spin_locker =
+{
+    .create   = lockmgr_new_spin,
+    .lock     = spin_wrlock,
+    .unlock   = spin_wrunlock,
+    .dtor     = spin_delete,
+    .rdlock   = spin_rdlock,
+    .rdunlock = spin_rdunlock,
+};
+
 /* EOF */
@@ -20,18 +20,23 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdint.h>
+#include <assert.h>
 
 #include "utils/utils.h"
 #include "utils/arena.h"
 #include "utils/xorshift-rand.h"
 #include "error.h"
 
+static void basic_test(void);
 static void perf_test(void);
+static void small_test(void);
 
 int
 main()
 {
+    basic_test();
     perf_test();
+    small_test();
 
     return 0;
 }
@@ -49,6 +54,78 @@ randsize(xs1024star* xs, size_t a, size_t b)
 }
 
 
+/*
+ * Alignment, mark/rewind and reuse of chunks after a reset.
+ */
+static void
+basic_test()
+{
+    arena_mark_t m;
+    arena_t a;
+    char *p, *q, *r;
+    int i;
+
+    i = arena_new(&a, 1024);
+    assert(i == 0);
+
+    // Nothing allocated yet
+    arena_mark(a, &m);
+    p = arena_alloc(a, 10);
+    assert(p);
+    arena_rewind(a, &m);
+    q = arena_alloc(a, 10);
+    assert(q == p);
+
+    for (i = 0; i < 100; i++) {
+        size_t al = 1 << (i % 13);
+
+        q = arena_alloc_aligned(a, i+1, al);
+        assert(q);
+        assert(_IS_ALIGNED(q, al));
+        memset(q, 'a', i+1);
+    }
+
+    // Rewind to a point in the middle of a chunk
+    arena_mark(a, &m);
+    q = arena_alloc(a, 100);
+    for (i = 0; i < 1000; i++) {
+        r = arena_alloc(a, 1 + (i % 200));
+        assert(r);
+    }
+    r = arena_alloc(a, 3 * 1024 * 1024);
+    assert(r);
+    arena_rewind(a, &m);
+    r = arena_alloc(a, 100);
+    assert(r == q);
+
+    // A reset arena reuses its chunks
+    arena_reset(a);
+    r = arena_alloc(a, 10);
+    assert(r == p);
+
+    arena_delete(a);
+
+    // An oversized allocation leaves the current chunk current
+    i = arena_new(&a, 4096);
+    assert(i == 0);
+    p = arena_alloc(a, 16);
+    r = arena_alloc(a, 64 * 1024);
+    assert(r);
+    q = arena_alloc(a, 16);
+    assert(q == p + 16);
+
+    // .. and a rewind gives its chunk back for reuse
+    arena_mark(a, &m);
+    p = arena_alloc(a, 64 * 1024);
+    assert(p);
+    arena_rewind(a, &m);
+    r = arena_alloc(a, 64 * 1024);
+    assert(r == p);
+
+    arena_delete(a);
+}
+
+
 static void
 perf_test()
 {
@@ -84,3 +161,44 @@ perf_test()
     printf("%d allocs; %6.5f cy/alloc\n", N, speed);
 }
 
+
+/*
+ * Small objects in a loop of requests: allocate a batch, then
+ * reset the arena.
+ */
+static void
+small_test()
+{
+    const int N     = 10000,
+              NREQ  = 100;
+    arena_t a;
+    int i, j;
+
+    int r = arena_new(&a, 0);
+    if (r < 0) error(1, -r, "Cannot allocate arena");
+
+    xs1024star xs;
+    size_t *sz = NEWA(size_t, N);
+
+    xs1024star_init(&xs, 0);
+    for (i = 0; i < N; i++) {
+        sz[i] = randsize(&xs, 8, 256);
+    }
+
+    uint64_t t0  = sys_cpu_timestamp();
+    for (j = 0; j < NREQ; j++) {
+        for (i = 0; i < N; i++) {
+            void * volatile p = arena_alloc(a, sz[i]);
+            (void)p;
+        }
+        arena_reset(a);
+    }
+    uint64_t sum = sys_cpu_timestamp() - t0;
+
+    arena_delete(a);
+    DEL(sz);
+
+    double speed = _d(sum) / _d(N * NREQ);   // cycles/alloc
+    printf("%d small allocs x %d resets; %6.5f cy/alloc\n", N, NREQ, speed);
+}
+
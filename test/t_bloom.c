@@ -12,6 +12,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "error.h"
 #include "utils/utils.h"
@@ -19,6 +20,7 @@
 #include "utils/arena.h"
 #include "fast/vect.h"
 #include "utils/hashfunc.h"
+#include "utils/xoroshiro.h"
 
 
 extern uint32_t arc4random(void);
@@ -54,6 +56,12 @@ typedef struct result result;
 
 #define NITER       32
 
+// number of random keys for the standard vs blocked comparison
+#define NCOMPARE    (4 * 1048576)
+
+// number of ingest threads for the concurrent test
+#define NTHREADS    4
+
 
 // Score a test result
 static void
@@ -196,6 +204,30 @@ perf_test(strvect* v, size_t Niters, int counting, int scalable)
 }
 
 
+static void
+blocked_perf_test(strvect* v, size_t Niters)
+{
+    Bloom _b;
+    uint64_t tins  = 0,
+             tsrch = 0;
+    size_t i;
+    size_t n = VECT_LEN(v);
+    Bloom *b;
+
+    for (i = 0; i < Niters; ++i) {
+        b      = Blocked_bloom_init(&_b, n, 0.005);
+        tins  += insert_words(v, b);
+        tsrch += find_all(v, b, 0);
+        Bloom_fini(b);
+    }
+
+    double  ins  = (_d(tins)  / _d(Niters)) / _d(n);
+    double  srch = (_d(tsrch) / _d(Niters)) / _d(n);
+
+    printf("    Performance:  blocked-bloom %8.4f cy/add %8.4f cy/search\n", ins, srch);
+}
+
+
 
 /*
  * Test false positive rate.
@@ -271,47 +303,162 @@ delete_test(strvect* v, Bloom* b)
 /*
  * Marshalling/Unmarshalling tests
  */
+
+struct mflags
+{
+    const char *name;
+    uint32_t    mflags;     // marshal flags
+};
+
+static const struct mflags Mflags[] = {
+      {"sha256", 0}
+    , {"xxh64",  BLOOM_CKSUM_FAST}
+    , {"ver0",   BLOOM_MARSHAL_VER0}
+};
+
+
+// Flip a byte in the middle of file 'fname'
+static void
+corrupt(const char *fname)
+{
+    FILE *fp = fopen(fname, "r+");
+    assert(fp);
+
+    fseek(fp, 0, SEEK_END);
+    long sz = ftell(fp);
+
+    fseek(fp, sz / 2, SEEK_SET);
+    int c = fgetc(fp);
+
+    fseek(fp, sz / 2, SEEK_SET);
+    fputc(c ^ 0x5a, fp);
+    fclose(fp);
+}
+
+
 static void
 marshal_tests(Bloom* b, strvect * v, const char *desc)
 {
     const char *fname = "/tmp/c.dat";
     Bloom *ub = 0;
+    size_t j;
 
     printf("    -- %s-bloom: Marshal/Unmarshal tests --\n", desc);
 
-    printf("    Marshal: ");
-    int r = Bloom_marshal(b, fname);
-    assert(r == 0);
+    for (j = 0; j < ARRAY_SIZE(Mflags); j++) {
+        const struct mflags *mf = &Mflags[j];
 
-    printf("ok\n    Unmarshal unmapped: ");
-    r = Bloom_unmarshal(&ub, fname, 0);
-    assert(r == 0);
-    assert(ub);
+        printf("    %-6s Marshal: ", mf->name);
+        int r = Bloom_marshal_flags(b, fname, mf->mflags);
+        assert(r == 0);
 
-    assert(Bloom_eq(b, ub));
+        printf("ok; Unmarshal unmapped: ");
+        r = Bloom_unmarshal(&ub, fname, 0);
+        assert(r == 0);
+        assert(ub);
 
-    // Verify that all the elements are present.
-    find_all(v, ub, 0);
-    Bloom_delete(ub); ub = 0;
+        assert(Bloom_eq(b, ub));
 
-    printf("ok\n    Unmarshal mem-mapped: ");
+        // Verify that all the elements are present.
+        find_all(v, ub, 0);
+        Bloom_delete(ub); ub = 0;
 
-    // Now with mmap'd data
-    r = Bloom_unmarshal(&ub, fname, BLOOM_BITMAP_MMAP);
-    assert(r == 0);
-    assert(ub);
+        printf("ok; mem-mapped: ");
 
-    assert(Bloom_eq(b, ub));
+        // Now with mmap'd data
+        r = Bloom_unmarshal(&ub, fname, BLOOM_BITMAP_MMAP);
+        assert(r == 0);
+        assert(ub);
 
-    // Verify that all the elements are present.
-    find_all(v, ub, 0);
-    Bloom_delete(ub);
-    unlink(fname);
+        assert(Bloom_eq(b, ub));
+
+        // Verify that all the elements are present.
+        find_all(v, ub, 0);
+        Bloom_delete(ub);
+
+        printf("ok; lazy: ");
+
+        // lazily verified
+        r = Bloom_unmarshal(&ub, fname, BLOOM_BITMAP_MMAP|BLOOM_VERIFY_LAZY);
+        assert(r == 0);
+        assert(ub);
 
-    printf("ok\n");
+        find_all(v, ub, 0);
+        assert(Bloom_eq(b, ub));
+        assert(Bloom_verify(ub, 0) == 0);
+        Bloom_delete(ub);
+
+        // A damaged file must not load; a lazily verified one loads
+        // but mustn't verify.
+        corrupt(fname);
+        r = Bloom_unmarshal(&ub, fname, 0);
+        assert(r == -EILSEQ);
+
+        if (!(mf->mflags & BLOOM_MARSHAL_VER0)) {
+            r = Bloom_unmarshal(&ub, fname, BLOOM_BITMAP_MMAP|BLOOM_VERIFY_LAZY);
+            if (r == 0) {
+                assert(Bloom_verify(ub, 0) == -EILSEQ);
+                Bloom_delete(ub);
+            }
+        }
+
+        unlink(fname);
+        printf("ok\n");
+    }
 }
 
 
+/*
+ * Time the unmarshal of a large filter with each checksum and
+ * verification mode.
+ */
+static void
+unmarshal_perf_test(size_t n)
+{
+    static const struct {
+        const char *name;
+        uint32_t    mflags;
+        uint32_t    uflags;
+    } T[] = {
+          {"ver0 sha256",          BLOOM_MARSHAL_VER0, BLOOM_BITMAP_MMAP}
+        , {"sha256",               0,                  BLOOM_BITMAP_MMAP}
+        , {"xxh64",                BLOOM_CKSUM_FAST,   BLOOM_BITMAP_MMAP}
+        , {"sha256 lazy",          0,                  BLOOM_BITMAP_MMAP|BLOOM_VERIFY_LAZY}
+    };
+    const char *fname = "/tmp/c.dat";
+    char buf[4096];
+    Bloom _b;
+    Bloom *b, *ub;
+    size_t i;
+
+    b = Standard_bloom_init(&_b, n, 0.001, 0);
+    for (i = 0; i < n; i++) Bloom_probe(b, arc4random() ^ ((uint64_t)arc4random() << 32));
+
+    printf("Unmarshal-perf:\n    %s\n", Bloom_desc(b, buf, sizeof buf));
+
+    for (i = 0; i < ARRAY_SIZE(T); i++) {
+        int r = Bloom_marshal_flags(b, fname, T[i].mflags);
+        assert(r == 0);
+
+        uint64_t t0 = timenow();
+        r = Bloom_unmarshal(&ub, fname, T[i].uflags);
+        uint64_t tt = timenow() - t0;
+        assert(r == 0);
+
+        printf("    %-14s %8.2f ms\n", T[i].name, _d(tt) / 1.0e6);
+        Bloom_delete(ub);
+    }
+
+    // The damaged block is only found when it's touched
+    corrupt(fname);
+    int r = Bloom_unmarshal(&ub, fname, BLOOM_BITMAP_MMAP|BLOOM_VERIFY_LAZY);
+    assert(r == 0);
+    assert(Bloom_verify(ub, 0) == -EILSEQ);
+    Bloom_delete(ub);
+
+    unlink(fname);
+    Bloom_fini(b);
+}
 
 
 static void
@@ -346,6 +493,293 @@ counting_tests(strvect* v)
 }
 
 
+// Add a key 'n' times to a filter with 4-bit counters; it must be
+// found until it is removed just as many times.
+static void
+counter4_overflow_test(uint64_t key, size_t n)
+{
+    char buf[4096];
+    Bloom _b;
+    Bloom* b = Counting_bloom_init_flags(&_b, 1024, 0.005, BLOOM_COUNTER4);
+    size_t i;
+    int r;
+
+    for (i = 0; i < n; i++) Bloom_probe(b, key);
+    printf("    %s\n", Bloom_desc(b, buf, sizeof buf));
+
+    for (i = 0; i < n; i++) {
+        assert(Bloom_find(b, key));
+        r = Bloom_remove(b, key);
+        assert(r);
+    }
+    assert(!Bloom_find(b, key));
+    Bloom_fini(b);
+}
+
+
+// Saturate every counter of a small filter with 4-bit counters so
+// that the overflow table grows several times; every key must be
+// found until it is removed. Counter 0 is among the saturated ones.
+static void
+counter4_saturate_test(size_t n)
+{
+    uint64_t* keys = NEWA(uint64_t, n);
+    xoro128plus xoro;
+    Bloom _b;
+    Bloom* b = Counting_bloom_init_flags(&_b, 64, 0.01, BLOOM_COUNTER4);
+    size_t i;
+    int r;
+
+    xoro128plus_init(&xoro, 0);
+    for (i = 0; i < n; i++) {
+        keys[i] = xoro128plus_u64(&xoro);
+        Bloom_probe(b, keys[i]);
+    }
+
+    for (i = 0; i < n; i++) {
+        r = Bloom_find(b, keys[i]);
+        assert(r);
+        r = Bloom_remove(b, keys[i]);
+        assert(r);
+    }
+
+    r = Bloom_find(b, keys[0]);
+    assert(!r);
+    Bloom_fini(b);
+    DEL(keys);
+}
+
+
+static void
+counting4_tests(strvect* v)
+{
+    char buf[4096];
+    Bloom _b;
+    size_t n = VECT_LEN(v);
+    Bloom* b;
+
+    printf("Counting4-Bloom-Tests:\n");
+
+    b = Counting_bloom_init_flags(&_b, n, 0.005, BLOOM_COUNTER4);
+    insert_words(v, b);
+    VECT_SHUFFLE(v, arc4random);
+    find_all(v, b, 1);
+
+    printf("    %s\n", Bloom_desc(b, buf, sizeof buf));
+    delete_test(v, b);
+    Bloom_fini(b);
+
+    b = Counting_bloom_init_flags(&_b, n, 0.005, BLOOM_COUNTER4);
+    false_positive_test(v, b);
+    Bloom_fini(b);
+
+    counter4_overflow_test(VECT_ELEM(v, 0).h, 100);
+    counter4_saturate_test(20000);
+
+    // the overflowed counters must survive a round trip
+    b = Counting_bloom_init_flags(&_b, n, 0.005, BLOOM_COUNTER4);
+    insert_words(v, b);
+    for (size_t i = 0; i < 40; i++) Bloom_probe(b, VECT_ELEM(v, 0).h);
+    marshal_tests(b, v, "Counting4");
+    Bloom_fini(b);
+}
+
+
+// Memory and add/find/remove rates of 8-bit vs 4-bit counters
+static void
+counter4_compare(size_t n)
+{
+    static const uint32_t F[] = { 0, BLOOM_COUNTER4 };
+    uint64_t* keys = NEWA(uint64_t, n);
+    xoro128plus xoro;
+    char buf[4096];
+    Bloom _b;
+    Bloom *b;
+    size_t i, j;
+
+    xoro128plus_init(&xoro, arc4random());
+    for (i = 0; i < n; i++) keys[i] = xoro128plus_u64(&xoro);
+
+    printf("Counting-8bit-vs-4bit: %zu random keys\n", n);
+    for (j = 0; j < ARRAY_SIZE(F); j++) {
+        uint64_t t0, tins, tsrch, tdel;
+        size_t fn = 0;
+
+        b = Counting_bloom_init_flags(&_b, n, 0.005, F[j]);
+
+        t0 = timenow();
+        for (i = 0; i < n; i++) Bloom_probe(b, keys[i]);
+        tins = timenow() - t0;
+
+        t0 = timenow();
+        for (i = 0; i < n; i++) fn += !Bloom_find(b, keys[i]);
+        tsrch = timenow() - t0;
+        assert(fn == 0);
+
+        printf("      %s\n", Bloom_desc(b, buf, sizeof buf));
+
+        t0 = timenow();
+        for (i = 0; i < n; i++) Bloom_remove(b, keys[i]);
+        tdel = timenow() - t0;
+
+        printf("    %-16s %7.2f M add/s %7.2f M find/s %7.2f M remove/s\n", b->name,
+                _d(n) * 1.0e3 / _d(tins), _d(n) * 1.0e3 / _d(tsrch), _d(n) * 1.0e3 / _d(tdel));
+        Bloom_fini(b);
+    }
+
+    DEL(keys);
+}
+
+
+// Fill a cuckoo filter until it refuses a key; every key that went
+// in must be found and removed.
+static void
+cuckoo_fill_test(size_t n)
+{
+    uint64_t* keys = NEWA(uint64_t, 2*n);
+    xoro128plus xoro;
+    char buf[4096];
+    Bloom _b;
+    Bloom* b = Cuckoo_bloom_init(&_b, n, 0.005);
+    size_t i, nk;
+    int r;
+
+    xoro128plus_init(&xoro, arc4random());
+    for (i = 0; i < 2*n; i++) keys[i] = xoro128plus_u64(&xoro);
+
+    for (nk = 0; nk < 2*n; nk++) {
+        if (Cuckoo_bloom_insert(b, keys[nk]) < 0) break;
+    }
+    assert(nk < 2*n);
+    printf("    fill: %s\n", Bloom_desc(b, buf, sizeof buf));
+
+    for (i = 0; i < nk; i++) assert(Bloom_find(b, keys[i]));
+
+    // room for one more after a remove
+    r = Bloom_remove(b, keys[0]);
+    assert(r);
+    r = Cuckoo_bloom_insert(b, keys[0]);
+    assert(r == 0);
+
+    // an empty filter only has false positives
+    size_t left = 0;
+    for (i = 0; i < nk; i++) {
+        r = Bloom_remove(b, keys[i]);
+        assert(r);
+    }
+    for (i = 0; i < nk; i++) left += Bloom_find(b, keys[i]);
+    assert(left == 0);
+
+    Bloom_fini(b);
+    DEL(keys);
+}
+
+
+static void
+cuckoo_tests(strvect* v)
+{
+    char buf[4096];
+    Bloom _b;
+    size_t n = VECT_LEN(v);
+    Bloom* b;
+
+    printf("Cuckoo-Filter-Tests:\n");
+
+    b = Cuckoo_bloom_init(&_b, n, 0.005);
+    insert_words(v, b);
+    VECT_SHUFFLE(v, arc4random);
+    find_all(v, b, 1);
+
+    printf("    %s\n", Bloom_desc(b, buf, sizeof buf));
+    delete_test(v, b);
+    Bloom_fini(b);
+
+    b = Cuckoo_bloom_init(&_b, n, 0.005);
+    false_positive_test(v, b);
+    Bloom_fini(b);
+
+    b = Cuckoo_bloom_init(&_b, n, 0.005);
+    insert_words(v, b);
+    marshal_tests(b, v, "Cuckoo");
+    Bloom_fini(b);
+
+    cuckoo_fill_test(65536);
+}
+
+
+// Add, find and remove 'n' keys and look up 'n' absent keys; print
+// the FP rate, bits per key and the rate of each op.
+static void
+deletable_one(Bloom* b, const uint64_t* keys, size_t n)
+{
+    char buf[4096];
+    uint64_t t0, tins, tsrch, tdel;
+    size_t i, fp = 0, fn = 0;
+
+    t0 = timenow();
+    for (i = 0; i < n; i++) Bloom_probe(b, keys[i]);
+    tins = timenow() - t0;
+
+    t0 = timenow();
+    for (i = 0; i < n; i++) fn += !Bloom_find(b, keys[i]);
+    tsrch = timenow() - t0;
+
+    for (i = n; i < 2*n; i++) fp += Bloom_find(b, keys[i]);
+
+    printf("      %s\n", Bloom_desc(b, buf, sizeof buf));
+
+    t0 = timenow();
+    for (i = 0; i < n; i++) Bloom_remove(b, keys[i]);
+    tdel = timenow() - t0;
+
+    double fprate = _d(fp) / _d(n);
+
+    printf("    %-16s FP %6.4f (want %6.4f)%s; %7.2f M add/s %7.2f M find/s %7.2f M remove/s%s\n",
+            b->name, fprate, b->e, fprate > b->e ? " **TOO HIGH**" : "",
+            _d(n) * 1.0e3 / _d(tins), _d(n) * 1.0e3 / _d(tsrch), _d(n) * 1.0e3 / _d(tdel),
+            fn ? " ** ERR FALSE NEG **" : "");
+}
+
+
+// Cuckoo filter vs the counting filters at 3 FP rates: 8, 12 and
+// 16 bit fingerprints.
+static void
+cuckoo_compare(size_t n)
+{
+    static const double E[] = { 0.05, 0.005, 0.0002 };
+    uint64_t* keys = NEWA(uint64_t, 2*n);
+    xoro128plus xoro;
+    Bloom _b;
+    Bloom *b;
+    size_t i;
+
+    xoro128plus_init(&xoro, arc4random());
+    for (i = 0; i < 2*n; i++) keys[i] = xoro128plus_u64(&xoro);
+
+    printf("Cuckoo-vs-Counting: %zu random keys\n", n);
+
+    // 16-bit fingerprints can't do better than 8/65536
+    b = Cuckoo_bloom_init(&_b, n, 0.0001);
+    assert(!b);
+
+    for (i = 0; i < ARRAY_SIZE(E); i++) {
+        b = Cuckoo_bloom_init(&_b, n, E[i]);
+        deletable_one(b, keys, n);
+        Bloom_fini(b);
+
+        b = Counting_bloom_init_flags(&_b, n, E[i], BLOOM_COUNTER4);
+        deletable_one(b, keys, n);
+        Bloom_fini(b);
+
+        b = Counting_bloom_init(&_b, n, E[i]);
+        deletable_one(b, keys, n);
+        Bloom_fini(b);
+    }
+
+    DEL(keys);
+}
+
+
 static void
 quick_tests(strvect* v, int scalable)
 {
@@ -387,6 +821,376 @@ quick_tests(strvect* v, int scalable)
 
 
 
+static void
+blocked_tests(strvect* v)
+{
+    char buf[4096];
+    Bloom _b;
+    size_t n = VECT_LEN(v);
+    Bloom *b;
+
+    printf("Blocked-Bloom-Tests:\n");
+
+    b = Blocked_bloom_init(&_b, n, 0.005);
+    insert_words(v, b);
+    VECT_SHUFFLE(v, arc4random);
+    find_all(v, b, 1);
+
+    printf("    %s\n", Bloom_desc(b, buf, sizeof buf));
+    Bloom_fini(b);
+
+    b = Blocked_bloom_init(&_b, n, 0.005);
+    false_positive_test(v, b);
+    Bloom_fini(b);
+
+    b = Blocked_bloom_init(&_b, n, 0.005);
+    insert_words(v, b);
+    marshal_tests(b, v, "Blocked");
+    Bloom_fini(b);
+
+    blocked_perf_test(v, NITER);
+}
+
+
+// Add the first 'n' keys, look them up and then look up the next
+// 'n' (absent) keys; time each loop as a whole.
+static void
+compare_one(Bloom* b, const uint64_t* keys, size_t n)
+{
+    size_t i;
+    uint64_t t0, tins, tsrch, tmiss,
+             fp = 0,
+             fn = 0;
+
+    t0 = now();
+    for (i = 0; i < n; i++) Bloom_probe(b, keys[i]);
+    tins = now() - t0;
+
+    t0 = now();
+    for (i = 0; i < n; i++) fn += !Bloom_find(b, keys[i]);
+    tsrch = now() - t0;
+
+    t0 = now();
+    for (i = n; i < 2*n; i++) fp += Bloom_find(b, keys[i]);
+    tmiss = now() - t0;
+
+    double fprate = _d(fp) / _d(n);
+
+    printf("    %-16s FP %6.4f (want %6.4f)%s; %7.2f cy/add %7.2f cy/hit %7.2f cy/miss%s\n",
+            b->name, fprate, b->e, fprate > b->e ? " **TOO HIGH**" : "",
+            _d(tins) / _d(n), _d(tsrch) / _d(n), _d(tmiss) / _d(n),
+            fn ? " ** ERR FALSE NEG **" : "");
+}
+
+
+static void
+compare_test(size_t n)
+{
+    char buf[4096];
+    uint64_t* keys = NEWA(uint64_t, 2*n);
+    xoro128plus xoro;
+    Bloom _b;
+    Bloom *b;
+    size_t i;
+
+    xoro128plus_init(&xoro, arc4random());
+    for (i = 0; i < 2*n; i++) keys[i] = xoro128plus_u64(&xoro);
+
+    printf("Standard-vs-Blocked: %zu random keys\n", n);
+
+    b = Standard_bloom_init(&_b, n, 0.005, 0);
+    compare_one(b, keys, n);
+    printf("      %s\n", Bloom_desc(b, buf, sizeof buf));
+    Bloom_fini(b);
+
+    b = Blocked_bloom_init(&_b, n, 0.005);
+    compare_one(b, keys, n);
+    printf("      %s\n", Bloom_desc(b, buf, sizeof buf));
+    Bloom_fini(b);
+
+    DEL(keys);
+}
+
+
+/*
+ * Concurrent mode: NTHREADS threads add interleaved slices of the
+ * keys to one filter.
+ */
+struct ingest
+{
+    Bloom          *b;
+    const uint64_t *keys;
+    size_t          n;
+    size_t          id;
+    size_t          nthr;
+};
+typedef struct ingest ingest;
+
+
+static void *
+ingest_thread(void *v)
+{
+    ingest *x = v;
+    size_t i;
+
+    for (i = x->id; i < x->n; i += x->nthr) Bloom_probe(x->b, x->keys[i]);
+    return 0;
+}
+
+
+// Add 'n' keys to 'b' with 'nthr' threads; return elapsed ns
+static uint64_t
+ingest_all(Bloom* b, const uint64_t* keys, size_t n, size_t nthr)
+{
+    pthread_t th[NTHREADS];
+    ingest    in[NTHREADS];
+    size_t i;
+
+    uint64_t t0 = timenow();
+    for (i = 0; i < nthr; i++) {
+        ingest *x = &in[i];
+
+        x->b    = b;
+        x->keys = keys;
+        x->n    = n;
+        x->id   = i;
+        x->nthr = nthr;
+        if (pthread_create(&th[i], 0, ingest_thread, x) != 0) error(1, errno, "can't create thread");
+    }
+
+    for (i = 0; i < nthr; i++) pthread_join(th[i], 0);
+    return timenow() - t0;
+}
+
+
+static Bloom *
+concurrent_mk(Bloom* b, size_t n, int blocked)
+{
+    return blocked ? Blocked_bloom_init(b, n, 0.005) : Standard_bloom_init(b, n, 0.005, 0);
+}
+
+
+// Fill a filter with one thread and then another one (in concurrent
+// mode) with NTHREADS threads; verify the latter.
+static void
+concurrent_one(const uint64_t* keys, size_t n, int blocked)
+{
+    char buf[4096];
+    Bloom _b;
+    Bloom *b;
+    size_t i;
+    uint64_t fp = 0,
+             fn = 0;
+
+    b = concurrent_mk(&_b, n, blocked);
+    uint64_t t1 = ingest_all(b, keys, n, 1);
+    Bloom_fini(b);
+
+    b = concurrent_mk(&_b, n, blocked);
+    if (Bloom_concurrent(b, 1) != 0) error(1, 0, "%s: can't enable concurrent mode", b->name);
+
+    uint64_t tn = ingest_all(b, keys, n, NTHREADS);
+
+    // lookups work in concurrent mode too
+    for (i = 0; i < n; i++)   fn += !Bloom_find(b, keys[i]);
+    for (i = n; i < 2*n; i++) fp += Bloom_find(b, keys[i]);
+
+    Bloom_concurrent(b, 0);
+
+    double fprate = _d(fp) / _d(n);
+
+    printf("    %-16s 1 thr %7.2f M adds/s; %d thr %7.2f M adds/s; FP %6.4f%s%s\n",
+            b->name, _d(n) * 1000.0 / _d(t1), NTHREADS, _d(n) * 1000.0 / _d(tn),
+            fprate, fprate > b->e ? " ** ERR TOO HIGH **" : "",
+            fn ? " ** ERR FALSE NEG **" : "");
+    printf("      %s\n", Bloom_desc(b, buf, sizeof buf));
+    Bloom_fini(b);
+}
+
+
+static void
+concurrent_test(size_t n)
+{
+    uint64_t* keys = NEWA(uint64_t, 2*n);
+    xoro128plus xoro;
+    size_t i;
+
+    xoro128plus_init(&xoro, arc4random());
+    for (i = 0; i < 2*n; i++) keys[i] = xoro128plus_u64(&xoro);
+
+    printf("Concurrent-Bloom-Tests: %zu random keys\n", n);
+    concurrent_one(keys, n, 0);
+    concurrent_one(keys, n, 1);
+
+    DEL(keys);
+}
+
+
+/*
+ * Union/Intersection: fill NTHREADS shards (made like a reference
+ * filter) with interleaved slices of the keys; their union must be
+ * identical to the reference.
+ */
+static void
+merge_one(const uint64_t* keys, size_t n, int blocked)
+{
+    char buf[4096];
+    Bloom *shard[NTHREADS];
+    Bloom _r, _u;
+    Bloom *r, *u;
+    size_t i, j;
+    int nthr;
+
+    r = concurrent_mk(&_r, n, blocked);
+    for (j = 0; j < NTHREADS; j++) {
+        shard[j] = Bloom_new_like(r);
+        assert(shard[j]);
+    }
+
+    for (i = 0; i < n; i++) {
+        Bloom_probe(r, keys[i]);
+        Bloom_probe(shard[i % NTHREADS], keys[i]);
+    }
+
+    for (nthr = 1; nthr <= NTHREADS; nthr *= NTHREADS) {
+        u = Bloom_init_like(&_u, r);
+        assert(u);
+
+        uint64_t t0 = timenow();
+        for (j = 0; j < NTHREADS; j++) {
+            int e = Bloom_union(u, shard[j], nthr);
+            if (e < 0) error(1, -e, "%s: union failed", r->name);
+        }
+        uint64_t tt = timenow() - t0;
+
+        printf("    %-16s union of %d shards, %d thr: %s; %6.2f ms\n", r->name, NTHREADS, nthr,
+                Bloom_eq(u, r) ? "ok" : "** ERR NOT EQUAL **", _d(tt) / 1.0e6);
+        Bloom_fini(u);
+    }
+
+    // intersection of (shard 0 | shard 1) and (shard 1 | shard 2)
+    // has all of shard 1.
+    Bloom *a = Bloom_new_like(r),
+          *b = Bloom_new_like(r);
+
+    Bloom_union(a, shard[0], 1);
+    Bloom_union(a, shard[1], 1);
+    Bloom_union(b, shard[1], 1);
+    Bloom_union(b, shard[2], 1);
+    Bloom_intersect(a, b, NTHREADS);
+
+    uint64_t fn = 0;
+    for (i = 1; i < n; i += NTHREADS) fn += !Bloom_find(a, keys[i]);
+
+    printf("    %-16s intersection: %s\n      %s\n", r->name,
+            fn ? "** ERR FALSE NEG **" : "ok", Bloom_desc(a, buf, sizeof buf));
+
+    Bloom_delete(a);
+    Bloom_delete(b);
+    for (j = 0; j < NTHREADS; j++) Bloom_delete(shard[j]);
+    Bloom_fini(r);
+}
+
+
+static void
+merge_test(size_t n)
+{
+    uint64_t* keys = NEWA(uint64_t, n);
+    xoro128plus xoro;
+    size_t i;
+
+    xoro128plus_init(&xoro, arc4random());
+    for (i = 0; i < n; i++) keys[i] = xoro128plus_u64(&xoro);
+
+    printf("Merge-Bloom-Tests: %zu random keys\n", n);
+    merge_one(keys, n, 0);
+    merge_one(keys, n, 1);
+
+    DEL(keys);
+}
+
+
+/*
+ * Batched lookups: look up 'n' present and 'n' absent keys - one
+ * at a time and in batches of NBATCH keys; the results must match.
+ */
+#define NBATCH      1024
+
+static void
+batch_one(Bloom* b, const uint64_t* keys, size_t n)
+{
+    uint64_t res[NBATCH / 64];
+    uint64_t t0, t1, t2;
+    size_t i, j, nf0 = 0, nf1 = 0;
+
+    for (i = 0; i < n; i++) Bloom_probe(b, keys[i]);
+
+    // best of a few runs
+    uint64_t c0 = ~0,
+             c1 = ~0;
+
+    for (int r = 0; r < 5; r++) {
+        nf0 = nf1 = 0;
+
+        t0 = now();
+        for (i = 0; i < 2*n; i++) nf0 += Bloom_find(b, keys[i]);
+        t1 = now();
+        for (i = 0; i < 2*n; i += NBATCH) {
+            size_t m = (2*n - i) > NBATCH ? NBATCH : (2*n - i);
+
+            nf1 += Bloom_find_batch(b, &keys[i], m, res);
+        }
+        t2 = now();
+
+        if ((t1 - t0) < c0) c0 = t1 - t0;
+        if ((t2 - t1) < c1) c1 = t2 - t1;
+    }
+
+    // verify the bitmap of the last batch
+    for (i = 2*n - (2*n % NBATCH ? 2*n % NBATCH : NBATCH), j = 0; i < 2*n; i++, j++) {
+        int bit = !!(res[j / 64] & (_U64(1) << (j % 64)));
+        assert(bit == Bloom_find(b, keys[i]));
+    }
+    assert(nf0 == nf1);
+    assert(nf0 >= n);
+
+    printf("    %-16s %9zu keys: %7.2f cy/find %7.2f cy/key batched (%4.2fx)\n",
+            b->name, n, _d(c0) / _d(2*n), _d(c1) / _d(2*n), _d(c0) / _d(c1));
+}
+
+
+static void
+batch_test(size_t nsmall, size_t nbig)
+{
+    uint64_t* keys = NEWA(uint64_t, 2*nbig);
+    xoro128plus xoro;
+    size_t sz[] = { nsmall, nbig };
+    Bloom _b;
+    Bloom *b;
+    size_t i;
+
+    xoro128plus_init(&xoro, arc4random());
+    for (i = 0; i < 2*nbig; i++) keys[i] = xoro128plus_u64(&xoro);
+
+    printf("Batched-Find: %d keys per batch\n", NBATCH);
+    for (i = 0; i < ARRAY_SIZE(sz); i++) {
+        b = Standard_bloom_init(&_b, sz[i], 0.005, 0);
+        batch_one(b, keys, sz[i]);
+        Bloom_fini(b);
+
+        b = Blocked_bloom_init(&_b, sz[i], 0.005);
+        batch_one(b, keys, sz[i]);
+        Bloom_fini(b);
+
+        b = Counting_bloom_init(&_b, sz[i], 0.005);
+        batch_one(b, keys, sz[i]);
+        Bloom_fini(b);
+    }
+
+    DEL(keys);
+}
+
+
 int
 main(int argc, char* argv[])
 {
@@ -401,10 +1205,21 @@ main(int argc, char* argv[])
     read_words(&v, a, filename);
 
     counting_tests(&v);
+    counting4_tests(&v);
+    cuckoo_tests(&v);
 
     quick_tests(&v, 0);
     quick_tests(&v, 1);
 
+    blocked_tests(&v);
+    compare_test(NCOMPARE);
+    counter4_compare(NCOMPARE);
+    cuckoo_compare(NCOMPARE);
+    concurrent_test(NCOMPARE);
+    merge_test(NCOMPARE);
+    batch_test(16384, 4 * NCOMPARE);
+    unmarshal_perf_test(4 * NCOMPARE);
+
     VECT_FINI(&v);
     arena_delete(a);
     return 0;
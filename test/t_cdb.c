@@ -0,0 +1,390 @@
+/*
+ * Test harness for the CDB writer, bulk builder and reader.
+ *
+ * With an argument 'N', benchmark lookups in a cdb64 of N GB.
+ */
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "utils/utils.h"
+#include "cdb_reader.h"
+#include "cdb_writer.h"
+
+#define NELEM   10000
+
+// Records for the build throughput test
+#define NBUILD  (1024 * 1024)
+
+// A value larger than the write buffers
+#define BIGVAL  (5 * 1024 * 1024)
+
+// Value size and number of lookups of the cdb64 benchmark
+#define BENCHVAL    1000
+#define NLOOKUP     (1024 * 1024)
+
+#define _d(x)   ((double)(x))
+
+extern void arc4random_buf(void *, size_t);
+
+static uint64_t
+rand64()
+{
+    uint64_t z;
+    arc4random_buf(&z, sizeof z);
+    return z;
+}
+
+struct recs {
+    cdb_rec *r;
+    char    *buf;
+    size_t   n;
+};
+typedef struct recs recs;
+
+
+// Make 'n' records; the last one is a duplicate of the first with
+// a different value. One of them has a large value.
+static void
+mkrecs(recs *rs, size_t n)
+{
+    size_t i;
+    char  *p;
+
+    rs->n   = n + 1;
+    rs->r   = NEWZA(cdb_rec, n + 1);
+    rs->buf = NEWA(char, (n * 48) + BIGVAL);
+
+    p = rs->buf;
+    for (i = 0; i < n; i++) {
+        cdb_rec *r = &rs->r[i];
+        int k = sprintf(p, "key-%zu", i);
+
+        r->key  = p;
+        r->klen = k;
+        p += k;
+
+        k = sprintf(p, "value-%zx-%*s", i, (int)(i % 13), "");
+        r->val  = p;
+        r->vlen = k;
+        p += k;
+    }
+
+    memset(p, 'v', BIGVAL);
+    rs->r[n/2].val  = p;
+    rs->r[n/2].vlen = BIGVAL;
+
+    rs->r[n]     = rs->r[0];
+    rs->r[n].val = "duplicate";
+    rs->r[n].vlen = 9;
+}
+
+
+static void
+delrecs(recs *rs)
+{
+    DEL(rs->r);
+    DEL(rs->buf);
+}
+
+
+static void
+writerdb(const char *fname, recs *rs, int nthr, uint32_t flags)
+{
+    cdb_writer w;
+    size_t i;
+    int r;
+
+    r = cdb_writer_init(&w, fname, nthr, flags);
+    assert(r == 0);
+
+    for (i = 0; i < rs->n; i++) {
+        cdb_rec *c = &rs->r[i];
+
+        r = cdb_writer_add(&w, c->key, c->klen, c->val, c->vlen);
+        assert(r == 0);
+    }
+
+    r = cdb_writer_finish(&w);
+    assert(r == 0);
+}
+
+
+// Every record must be found; of the duplicates, the first.
+static void
+verify(const char *fname, recs *rs)
+{
+    CDB db;
+    size_t i;
+    void *v;
+    int r;
+
+    r = cdb_read_init(&db, fname);
+    assert(r == 0);
+
+    for (i = 0; i < (rs->n - 1); i++) {
+        cdb_rec *c = &rs->r[i];
+        ssize_t  m = cdb_find(&db, &v, c->key, c->klen);
+
+        assert(m == c->vlen);
+        assert(0 == memcmp(v, c->val, m));
+    }
+
+    for (i = 0; i < NELEM; i++) {
+        char k[32];
+        int  n = snprintf(k, sizeof k, "absent-%zu", i);
+
+        assert(cdb_find(&db, &v, k, n) == -ENOENT);
+    }
+
+    cdb_close(&db);
+}
+
+
+// Return true if files 'a' and 'b' are identical
+static int
+samefile(const char *a, const char *b)
+{
+    FILE *fa = fopen(a, "r"),
+         *fb = fopen(b, "r");
+    int   same = 1,
+          ca, cb;
+
+    assert(fa && fb);
+    do {
+        ca = fgetc(fa);
+        cb = fgetc(fb);
+        if (ca != cb) {
+            same = 0;
+            break;
+        }
+    } while (ca != EOF);
+
+    fclose(fa);
+    fclose(fb);
+    return same;
+}
+
+
+/*
+ * The writer and the bulk builder must make the same DB -
+ * regardless of the number of threads. The reader must tell a CDB
+ * from a cdb64.
+ */
+static void
+basictest(size_t n, uint32_t flags)
+{
+    const char *f0 = "/tmp/cdb-test0.db",
+               *f1 = "/tmp/cdb-test1.db";
+    recs rs;
+    int  r;
+
+    mkrecs(&rs, n);
+
+    writerdb(f0, &rs, 1, flags);
+    verify(f0, &rs);
+
+    writerdb(f1, &rs, 4, flags);
+    assert(samefile(f0, f1));
+
+    r = cdb_build(f1, rs.r, rs.n, 1, flags);
+    assert(r == 0);
+    assert(samefile(f0, f1));
+
+    r = cdb_build(f1, rs.r, rs.n, 3, flags);
+    assert(r == 0);
+    assert(samefile(f0, f1));
+
+    // The other format
+    r = cdb_build(f1, rs.r, rs.n, 2, flags ^ CDB_64BIT);
+    assert(r == 0);
+    assert(!samefile(f0, f1));
+    verify(f1, &rs);
+
+    // An empty DB
+    r = cdb_build(f1, rs.r, 0, 2, flags);
+    assert(r == 0);
+    {
+        CDB  db;
+        void *v;
+
+        r = cdb_read_init(&db, f1);
+        assert(r == 0);
+        assert(db.is64 == !!(flags & CDB_64BIT));
+        assert(cdb_find(&db, &v, "key-0", 5) == -ENOENT);
+        cdb_close(&db);
+    }
+
+    // A DB gets the mode of a new file - not that of mkostemp(3)
+    {
+        mode_t um = umask(022);
+        struct stat st;
+
+        r = cdb_build(f1, rs.r, 0, 1, flags);
+        assert(r == 0);
+        r = stat(f1, &st);
+        assert(r == 0);
+        assert((st.st_mode & 0777) == 0644);
+        umask(um);
+    }
+
+    // An aborted DB leaves nothing behind
+    {
+        cdb_writer w;
+
+        r = cdb_writer_init(&w, f1, 1, flags);
+        assert(r == 0);
+        r = cdb_writer_add(&w, "a", 1, "b", 1);
+        assert(r == 0);
+        cdb_writer_abort(&w);
+        assert(access(w.tmp, F_OK) < 0);
+    }
+
+    unlink(f0);
+    unlink(f1);
+    delrecs(&rs);
+}
+
+
+/*
+ * Build throughput of the writer and of the bulk builder with 1, 2
+ * and 4 threads.
+ */
+static void
+buildtest(size_t n)
+{
+    static const int Thr[] = { 1, 2, 4 };
+    const char *fname = "/tmp/cdb-build.db";
+    recs   rs;
+    size_t t;
+    int    r;
+
+    mkrecs(&rs, n);
+
+    duration_t d0 = timenow();
+    writerdb(fname, &rs, 1, 0);
+    duration_t tt = timenow() - d0;
+
+    double base = (_Second(_d(rs.n)) / _d(tt)) / 1000000.0;
+
+    printf("  %zu records: writer     %6.2f M recs/sec\n", rs.n, base);
+    verify(fname, &rs);
+
+    for (t = 0; t < ARRAY_SIZE(Thr); t++) {
+        d0 = timenow();
+        r  = cdb_build(fname, rs.r, rs.n, Thr[t], 0);
+        tt = timenow() - d0;
+        assert(r == 0);
+
+        double spd = (_Second(_d(rs.n)) / _d(tt)) / 1000000.0;
+
+        printf("  %zu records: bulk-%d     %6.2f M recs/sec (%4.2fx)\n",
+                rs.n, Thr[t], spd, spd / base);
+    }
+    verify(fname, &rs);
+
+    unlink(fname);
+    delrecs(&rs);
+}
+
+
+/*
+ * Build a cdb64 of 'gb' GB with the writer and time random lookups
+ * of keys in it - and of keys not in it.
+ */
+static void
+bigtest(uint64_t gb)
+{
+    const char *fname = "/tmp/cdb-big.db";
+    uint64_t    want  = gb * 1024 * 1024 * 1024,
+                n     = want / (BENCHVAL + 24),
+                i;
+    char       *val   = NEWA(char, BENCHVAL);
+    char       *keys  = NEWA(char, NLOOKUP * 32);
+    int        *klen  = NEWA(int, NLOOKUP);
+    cdb_writer  w;
+    char        k[32];
+    CDB         db;
+    void       *v;
+    int         r;
+
+    memset(val, 'x', BENCHVAL);
+    r = cdb_writer_init(&w, fname, 0, CDB_64BIT);
+    assert(r == 0);
+
+    duration_t d0 = timenow();
+    for (i = 0; i < n; i++) {
+        int kl = snprintf(k, sizeof k, "key-%" PRIu64, i);
+
+        r = cdb_writer_add(&w, k, kl, val, BENCHVAL);
+        assert(r == 0);
+    }
+    r = cdb_writer_finish(&w);
+    assert(r == 0);
+    duration_t tt = timenow() - d0;
+
+    r = cdb_read_init(&db, fname);
+    assert(r == 0);
+    assert(db.is64);
+    printf("  %" PRIu64 " records, %.2f GB: build %.2f s, %.2f M recs/sec\n",
+            n, _d(db.size) / _d(1024 * 1024 * 1024), _d(tt) / _d(_Second(1)),
+            (_Second(_d(n)) / _d(tt)) / 1000000.0);
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (i = 0; i < NLOOKUP; i++) {
+            klen[i] = snprintf(&keys[i * 32], 32, "%s-%" PRIu64,
+                               pass ? "absent" : "key", rand64() % n);
+        }
+
+        d0 = timenow();
+        for (i = 0; i < NLOOKUP; i++) {
+            ssize_t m = cdb_find(&db, &v, &keys[i * 32], klen[i]);
+
+            assert(pass ? m == -ENOENT : m == BENCHVAL);
+        }
+        tt = timenow() - d0;
+
+        printf("  %s: %.1f ns/lookup\n", pass ? "misses" : "hits  ",
+                _d(tt) / _d(NLOOKUP));
+    }
+
+    cdb_close(&db);
+    unlink(fname);
+    DEL(val);
+    DEL(keys);
+    DEL(klen);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    if (argc > 1) {
+        int gb = atoi(argv[1]);
+
+        if (gb <= 0) {
+            fprintf(stderr, "Usage: %s [GB]\n", argv[0]);
+            exit(1);
+        }
+
+        printf("CDB: cdb64 of %d GB ..\n", gb);
+        bigtest(gb);
+        return 0;
+    }
+
+    printf("CDB: Basic tests ..\n");
+    basictest(NELEM, 0);
+
+    printf("CDB: Basic tests (cdb64) ..\n");
+    basictest(NELEM, CDB_64BIT);
+
+    printf("CDB: Build throughput ..\n");
+    buildtest(NBUILD);
+    return 0;
+}
+
+/* EOF */
@@ -8,6 +8,9 @@
 #include <stdint.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "error.h"
 #include "utils/typeutils.h"
@@ -25,18 +28,40 @@ typedef struct kv kv;
 
 VECT_TYPEDEF(kvv, kv);
 
-static void basic_tests(void);
-static void rand_tests(uint64_t);
+static void basic_tests(uint32_t);
+static void rand_tests(uint64_t, uint32_t);
+static void churn_tests(uint64_t, uint32_t);
+static void marshal_tests(uint64_t, uint32_t);
 
 
 int
 main()
 {
-    basic_tests();
+    basic_tests(0);
+    basic_tests(FASTHT_INCREMENTAL);
+    basic_tests(FASTHT_FLAT);
 
     for (uint64_t i = 1; i < 4; i++) {
-        rand_tests(i);
+        rand_tests(i, 0);
+        rand_tests(i, FASTHT_INCREMENTAL);
+        rand_tests(i, FASTHT_FLAT);
     }
+
+    churn_tests(1, 0);
+    churn_tests(2, FASTHT_INCREMENTAL);
+    churn_tests(3, FASTHT_FLAT);
+
+    marshal_tests(1, 0);
+    marshal_tests(2, FASTHT_FLAT);
+}
+
+
+static const char *
+mode(uint32_t flags)
+{
+    if (flags & FASTHT_FLAT)        return " [flat]";
+    if (flags & FASTHT_INCREMENTAL) return " [incremental]";
+    return "";
 }
 
 
@@ -54,7 +79,7 @@ __dump_stdout(const char *str, size_t n)
 }
 
 static void
-rand_tests(uint64_t seed)
+rand_tests(uint64_t seed, uint32_t flags)
 {
     ht  _h;
     ht *h = &_h;
@@ -66,7 +91,7 @@ rand_tests(uint64_t seed)
 
     xoro128plus_init(&xoro, seed);
 
-    printf("rand tests: %d elements; seed %#" PRIx64 "\n", NELEM, seed);
+    printf("rand tests: %d elements; seed %#" PRIx64 "%s\n", NELEM, seed, mode(flags));
 
     // generate N random numbers
     VECT_INIT(&v, NELEM);
@@ -79,7 +104,12 @@ rand_tests(uint64_t seed)
         VECT_PUSH_BACK(&v, w);
     }
 
-    ht_init(h, VECT_LEN(&v), 85);
+    // Start small when resizing incrementally so that we exercise
+    // lookups and deletes in the middle of a migration.
+    if (flags & FASTHT_INCREMENTAL)
+        ht_init_flags(h, 1024, 85, flags);
+    else
+        ht_init_flags(h, VECT_LEN(&v), 85, flags);
 
     uint64_t cyi = 0,
              cyf = 0,
@@ -124,6 +154,51 @@ rand_tests(uint64_t seed)
         assert(ret == (void *)p->val);
     }
 
+    // batched lookups must agree with the scalar lookups
+    {
+        size_t n = VECT_LEN(&v);
+        uint64_t *keys = NEWZA(uint64_t, n);
+        void **vals    = NEWZA(void *, n);
+        uint8_t *found = NEWZA(uint8_t, n);
+
+        for (size_t i = 0; i < n; i++) {
+            // perturb every 3rd key so that we also look for misses
+            keys[i] = VECT_ELEM(&v, i).key ^ (i % 3 == 0 ? 0 : _U64(1) << 63);
+        }
+
+        size_t nf = ht_find_batch(h, keys, n, vals, found);
+        size_t ne = 0;
+        for (size_t i = 0; i < n; i++) {
+            void *ret = 0;
+            int r = ht_find(h, keys[i], &ret);
+
+            assert(r == found[i]);
+            assert(!r || ret == vals[i]);
+            ne += r;
+        }
+        assert(nf == ne);
+
+        // re-inserting everything must find every key. NB: a key
+        // with a nil value is indistinguishable from a new insert.
+        size_t nz = 0;
+        for (size_t i = 0; i < n; i++) {
+            keys[i] = VECT_ELEM(&v, i).key;
+            vals[i] = 0;
+            nz     += !VECT_ELEM(&v, i).val;
+        }
+        size_t np = ht_probe_batch(h, keys, n, vals, found);
+        assert(nz == np);
+        for (size_t i = 0; i < n; i++) {
+            if (VECT_ELEM(&v, i).val) {
+                assert(found[i] && vals[i] == (void *)VECT_ELEM(&v, i).val);
+            }
+        }
+
+        DEL(keys);
+        DEL(vals);
+        DEL(found);
+    }
+
 #define _d(x) ((double)(x))
 
     printf("Perf: %" PRIu64 " elems; %" PRIu64 " buckets, %" PRIu64 " filled (%5.2f %%)\n"
@@ -231,6 +306,246 @@ rand_tests(uint64_t seed)
 }
 
 
+// Walk the table and verify that we see every node exactly once.
+static void
+iter_check(ht *h, kvv *v)
+{
+    ht_iter it;
+    uint64_t k, n = 0, ksum = 0, vsum = 0;
+    void *val;
+
+    ht_iter_init(&it, h);
+    while (ht_iter_next(&it, &k, &val)) {
+        n++;
+        ksum += k;
+        vsum += (uint64_t)val;
+    }
+    assert(n == h->nodes);
+
+    // the walk must match the keys we can find
+    kv *p;
+    uint64_t xk = 0, xv = 0;
+    VECT_FOR_EACH(v, p) {
+        void *ret = 0;
+        if (ht_find(h, p->key, &ret)) {
+            xk += p->key;
+            xv += p->val;
+        }
+    }
+    assert(xk == ksum);
+    assert(xv == vsum);
+}
+
+
+// Insert, iterate, remove most of the table via the iterator,
+// compact and shrink.
+static void
+churn_tests(uint64_t seed, uint32_t flags)
+{
+    ht  _h;
+    ht *h = &_h;
+    kvv  v;
+    kv *p;
+    xoro128plus xoro;
+
+    xoro128plus_init(&xoro, seed);
+    VECT_INIT(&v, NELEM);
+    for (int i = 0; i < NELEM; i++) {
+        kv w = {
+            .key = xoro128plus_u64(&xoro) | 1,
+            .val = (uint64_t)i+1,
+        };
+        VECT_PUSH_BACK(&v, w);
+    }
+
+    printf("churn tests: %d elements; seed %#" PRIx64 "%s\n", NELEM, seed, mode(flags));
+
+    ht_init_flags(h, 1024, 85, flags);
+    ht_set_minfill(h, 20);
+
+    VECT_FOR_EACH(&v, p) {
+        void *r = ht_probe(h, p->key, (void *)p->val);
+        assert(!r);
+    }
+    iter_check(h, &v);
+
+    uint64_t n0 = h->n;
+
+    // expire 7 of every 8 nodes via the iterator
+    ht_iter it;
+    uint64_t k;
+    uint64_t nrm = 0;
+    ht_iter_init(&it, h);
+    while (ht_iter_next(&it, &k, 0)) {
+        if (k & 0xe) {
+            int r = ht_iter_remove(&it);
+            assert(r);
+            nrm++;
+        }
+    }
+    assert(h->nodes == (uint64_t)NELEM - nrm);
+
+    uint64_t nfree = ht_compact(h);
+    assert(!h->ob);
+    assert(h->bagmax <= (h->maxn + FASTHT_BAGSZ - 1) / FASTHT_BAGSZ);
+    iter_check(h, &v);
+
+    printf("   removed %" PRIu64 " nodes; compact freed %" PRIu64 " bags; max-bags %u, max-items %u\n",
+            nrm, nfree, h->bagmax, h->maxn);
+
+    // now remove the rest; the table must shrink
+    VECT_FOR_EACH(&v, p) {
+        if (!(p->key & 0xe)) {
+            void *ret = 0;
+            int r = ht_remove(h, p->key, &ret);
+            xassert(r);
+            xassert(ret == (void *)p->val);
+        }
+    }
+    assert(h->nodes == 0);
+    assert(h->n < n0);
+
+    printf("   empty table: %" PRIu64 " buckets (was %" PRIu64 "), %u shrinks\n",
+            h->n, n0, h->shrinks);
+
+    // and it must still work
+    VECT_FOR_EACH(&v, p) {
+        void *r = ht_probe(h, p->key, (void *)p->val);
+        assert(!r);
+    }
+    iter_check(h, &v);
+    ht_fini(h);
+
+    // A tiny table must not shrink below its minimum size
+    ht_init_flags(h, 4, 85, flags);
+    ht_set_minfill(h, 20);
+    for (int i = 0; i < 1000; i++) {
+        void *r = ht_probe(h, v.arr[i].key, (void *)v.arr[i].val);
+        assert(!r);
+    }
+    for (int i = 0; i < 1000; i++) {
+        int r = ht_remove(h, v.arr[i].key, 0);
+        assert(r);
+    }
+    assert(h->nodes == 0);
+    assert(h->n >= h->minn);
+    if (flags & FASTHT_FLAT) assert(h->n >= FASTHT_GROUP);
+
+    ht_fini(h);
+    VECT_FINI(&v);
+}
+
+
+// Every key in 'v' must be in 'h' with the right value
+static void
+find_all(ht *h, kvv *v, uint64_t seed)
+{
+    kv *p;
+
+    VECT_FOR_EACH(v, p) {
+        void *ret = 0;
+        int r = ht_find(h, p->key, &ret);
+
+        xassert(r);
+        xassert(ret == (void *)p->val);
+    }
+}
+
+
+// Marshal a table, read it back (copied and mmap'd) and verify its
+// contents. Also make sure a corrupted image is rejected.
+static void
+marshal_tests(uint64_t seed, uint32_t flags)
+{
+    const char *fname = "/tmp/fast-ht-test.dat";
+    ht  _h, _u;
+    ht *h = &_h,
+       *u = &_u;
+    kvv  v;
+    kv *p;
+    xoro128plus xoro;
+    int r;
+
+    xoro128plus_init(&xoro, seed);
+    VECT_INIT(&v, NELEM);
+    for (int i = 0; i < NELEM; i++) {
+        kv w = {
+            .key = xoro128plus_u64(&xoro) | 1,
+            .val = (uint64_t)i+1,
+        };
+        VECT_PUSH_BACK(&v, w);
+    }
+
+    printf("marshal tests: %d elements; seed %#" PRIx64 "%s\n", NELEM, seed, mode(flags));
+
+    ht_init_flags(h, 1024, 85, flags);
+    VECT_FOR_EACH(&v, p) {
+        void *x = ht_probe(h, p->key, (void *)p->val);
+        assert(!x);
+    }
+
+    r = ht_marshal(h, fname);
+    assert(r == 0);
+
+    // copied
+    r = ht_unmarshal(u, fname, 0);
+    assert(r == 0);
+    assert(u->nodes == h->nodes);
+    assert(u->flags & FASTHT_FLAT);
+    find_all(u, &v, seed);
+    ht_fini(u);
+
+    // mmap'd; the table must be usable and modifiable without
+    // changing the file.
+    r = ht_unmarshal(u, fname, FASTHT_MMAP|FASTHT_NOVERIFY);
+    assert(r == 0);
+    assert(u->map);
+    find_all(u, &v, seed);
+
+    VECT_FOR_EACH(&v, p) {
+        void *ret = 0;
+        r = ht_remove(u, p->key, &ret);
+        xassert(r);
+    }
+    assert(u->nodes == 0);
+
+    // force a resize away from the mapping
+    uint64_t n0 = u->n;
+    for (uint64_t i = 0; i < n0; i++) {
+        ht_probe(u, (i << 1) | 1, (void *)i);
+    }
+    assert(!u->map);
+    ht_fini(u);
+
+    r = ht_unmarshal(u, fname, FASTHT_MMAP);
+    assert(r == 0);
+    find_all(u, &v, seed);
+    ht_fini(u);
+
+    printf("   %" PRIu64 " nodes in %" PRIu64 " buckets marshaled\n", h->nodes, h->n);
+
+    // flip a byte in the slots; the checksum must catch it.
+    int fd = open(fname, O_RDWR);
+    assert(fd >= 0);
+
+    uint8_t b;
+    off_t off = lseek(fd, 0, SEEK_END) / 2;
+    r = pread(fd, &b, 1, off);
+    assert(r == 1);
+    b ^= 0x5a;
+    r = pwrite(fd, &b, 1, off);
+    assert(r == 1);
+    close(fd);
+
+    r = ht_unmarshal(u, fname, FASTHT_MMAP);
+    assert(r == -EILSEQ);
+
+    unlink(fname);
+    ht_fini(h);
+    VECT_FINI(&v);
+}
+
+
 const kv Kvpairs[] = {
       {0x3154943e5c03bd00, 64}
     , {0xa896836ae76aa1e2, 63}
@@ -307,12 +622,12 @@ dump(const char *str, size_t n)
 
 
 static void
-basic_tests()
+basic_tests(uint32_t flags)
 {
     ht  _h;
     ht *h = &_h;
 
-    ht_init(h, 3, 85);
+    ht_init_flags(h, 3, 85, flags);
 
     const kv *p = &Kvpairs[0],
              *e = p + ARRAY_SIZE(Kvpairs);
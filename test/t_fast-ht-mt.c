@@ -0,0 +1,269 @@
+/*
+ * Test and benchmark for the concurrent fast hash table.
+ *
+ * (c) 2015 Sudhi Herle <sudhi-at-herle.net>
+ *
+ * - Correctness: one writer grows a small table (forcing several
+ *   resizes) while reader threads look up keys that are already in
+ *   the table; every such lookup must succeed.
+ *
+ * - Performance: compare lookup throughput of the concurrent table
+ *   against fast-ht wrapped in a mutex for 1..N threads.
+ *
+ * Optional argument: max number of threads (default: number of
+ * CPUs).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "error.h"
+#include "utils/cpu.h"
+#include "utils/utils.h"
+#include "utils/fast-ht.h"
+#include "utils/fast-ht-mt.h"
+#include "utils/xoroshiro.h"
+
+
+#define NKEYS       (256 * 1024)
+#define NLOOKUPS    (512 * 1024)
+
+#define _d(x)       ((double)(x))
+
+// Keys 0..NKEYS/2 are inserted up front; the rest by the writer.
+static uint64_t *Keys;
+
+// the mutex wrapped table
+static ht              Mt;
+static pthread_mutex_t Mt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static cht *Ct;
+
+static atomic_uint_fast32_t Done;
+
+struct ctx
+{
+    pthread_t id;
+    int       cpu;
+    int       ncpu;
+    uint64_t  seed;
+    uint64_t  nlookups;
+    uint64_t  found;
+};
+typedef struct ctx ctx;
+
+
+static void
+mkkeys(uint64_t seed)
+{
+    xoro128plus xoro;
+
+    xoro128plus_init(&xoro, seed);
+    Keys = NEWZA(uint64_t, NKEYS);
+    for (int i = 0; i < NKEYS; i++) {
+        uint64_t k;
+
+        // keys must be non-zero
+        while (!(k = xoro128plus_u64(&xoro)))
+            ;
+        Keys[i] = k;
+    }
+}
+
+
+// Reader for the correctness test: loop until the writer is done.
+static void *
+check_reader(void *v)
+{
+    ctx *c = v;
+    xoro128plus xoro;
+
+    sys_cpu_set_my_thread_affinity(c->cpu % c->ncpu);
+    xoro128plus_init(&xoro, c->seed);
+    while (!atomic_load(&Done)) {
+        uint64_t i = xoro128plus_u64(&xoro) % (NKEYS/2);
+        void *r = 0;
+
+        if (!cht_find(Ct, Keys[i], &r)) {
+            printf("** reader %d: can't find key %#" PRIx64 "\n", c->cpu, Keys[i]);
+            abort();
+        }
+        assert(r == (void *)(i+1));
+        c->nlookups++;
+    }
+    return 0;
+}
+
+
+static void
+check_test(int nthr)
+{
+    ctx *cx = NEWZA(ctx, nthr);
+
+    Ct = cht_new(16, 0);
+    for (uint64_t i = 0; i < NKEYS/2; i++) {
+        void *r = cht_probe(Ct, Keys[i], (void *)(i+1));
+        assert(!r);
+    }
+
+    atomic_store(&Done, 0);
+    for (int i = 0; i < nthr; i++) {
+        ctx *c = &cx[i];
+
+        c->cpu  = i;
+        c->ncpu = nthr;
+        c->seed = i+1;
+        pthread_create(&c->id, 0, check_reader, c);
+    }
+
+    // writer: add the rest and remove them again
+    for (uint64_t i = NKEYS/2; i < NKEYS; i++) {
+        void *r = cht_probe(Ct, Keys[i], (void *)(i+1));
+        assert(!r);
+    }
+    for (uint64_t i = NKEYS/2; i < NKEYS; i++) {
+        void *r = 0;
+        int   ok = cht_remove(Ct, Keys[i], &r);
+
+        assert(ok);
+        assert(r == (void *)(i+1));
+    }
+    atomic_store(&Done, 1);
+
+    uint64_t tot = 0;
+    for (int i = 0; i < nthr; i++) {
+        pthread_join(cx[i].id, 0);
+        tot += cx[i].nlookups;
+    }
+
+    cht_stats st;
+    cht_stat(Ct, &st);
+    assert(st.nodes == NKEYS/2);
+
+    printf("check: %d readers, %" PRIu64 " lookups during %u splits; %" PRIu64 " nodes in %" PRIu64 " buckets\n",
+            nthr, tot, st.splits, st.nodes, st.n);
+
+    cht_del(Ct);
+    DEL(cx);
+}
+
+
+static void *
+mutex_reader(void *v)
+{
+    ctx *c = v;
+    xoro128plus xoro;
+
+    sys_cpu_set_my_thread_affinity(c->cpu % c->ncpu);
+    xoro128plus_init(&xoro, c->seed);
+    for (uint64_t n = 0; n < NLOOKUPS; n++) {
+        uint64_t i = xoro128plus_u64(&xoro) % NKEYS;
+        void *r = 0;
+
+        pthread_mutex_lock(&Mt_lock);
+        c->found += ht_find(&Mt, Keys[i], &r);
+        pthread_mutex_unlock(&Mt_lock);
+    }
+    return 0;
+}
+
+static void *
+cht_reader(void *v)
+{
+    ctx *c = v;
+    xoro128plus xoro;
+
+    sys_cpu_set_my_thread_affinity(c->cpu % c->ncpu);
+    xoro128plus_init(&xoro, c->seed);
+    for (uint64_t n = 0; n < NLOOKUPS; n++) {
+        uint64_t i = xoro128plus_u64(&xoro) % NKEYS;
+        void *r = 0;
+
+        c->found += cht_find(Ct, Keys[i], &r);
+    }
+    return 0;
+}
+
+
+// Run 'nthr' readers and return the aggregate rate in M lookups/s
+static double
+run_readers(void *(*fp)(void *), int nthr, int ncpu)
+{
+    ctx *cx = NEWZA(ctx, nthr);
+    uint64_t t0 = timenow();
+
+    for (int i = 0; i < nthr; i++) {
+        ctx *c = &cx[i];
+
+        c->cpu  = i;
+        c->ncpu = ncpu;
+        c->seed = i+1;
+        pthread_create(&c->id, 0, fp, c);
+    }
+
+    for (int i = 0; i < nthr; i++) {
+        pthread_join(cx[i].id, 0);
+        assert(cx[i].found == NLOOKUPS);
+    }
+
+    uint64_t tt = timenow() - t0;
+    DEL(cx);
+
+    // timenow() is in ns; thus 1000 * (n/t) is M/s
+    return 1000.0 * (_d(nthr) * _d(NLOOKUPS)) / _d(tt);
+}
+
+
+static void
+perf_test(int maxthr, int ncpu)
+{
+    ht_init(&Mt, NKEYS, 0);
+    Ct = cht_new(NKEYS, 0);
+
+    for (uint64_t i = 0; i < NKEYS; i++) {
+        ht_probe(&Mt, Keys[i], (void *)(i+1));
+        cht_probe(Ct, Keys[i], (void *)(i+1));
+    }
+
+    printf("perf: %d keys, %d lookups/thread\n"
+           "  thr  mutex-ht M/s    cht M/s\n", NKEYS, NLOOKUPS);
+    for (int n = 1; n <= maxthr; n++) {
+        double m = run_readers(mutex_reader, n, ncpu);
+        double c = run_readers(cht_reader, n, ncpu);
+
+        printf("  %3d  %10.2f %10.2f\n", n, m, c);
+    }
+
+    cht_del(Ct);
+    ht_fini(&Mt);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int ncpu   = sys_cpu_getavail();
+    int maxthr = ncpu;
+
+    program_name = argv[0];
+    if (argc > 1) {
+        maxthr = atoi(argv[1]);
+        if (maxthr <= 0) die("invalid number of threads %s", argv[1]);
+    }
+
+    mkkeys(0x5eed);
+
+    // we need at least two readers to race against the writer
+    check_test(maxthr < 2 ? 2 : maxthr);
+    perf_test(maxthr, ncpu);
+
+    DEL(Keys);
+    return 0;
+}
+
+/* EOF */
@@ -26,14 +26,19 @@ static const struct option Long_options[] =
 {
       {"help",                            no_argument,       0, 300}
     , {"machine-output",                  no_argument,       0, 302}
+    , {"keys",                            required_argument, 0, 'k'}
 
     , {0, 0, 0, 0}
 };
 
-static const char Short_options[] = "hm";
+static const char Short_options[] = "hmk:";
 
 static int Machine_output = 0;
 
+// largest table for engine_perf(); 1M, 10M, 100M .. upto this many
+// keys are timed.
+static size_t Maxkeys = 1024 * 1024;
+
 extern uint32_t arc4random(void);
 extern void     arc4random_buf(void *, size_t);
 
@@ -95,6 +100,177 @@ insert_words(strvect* v, ht* h)
 
 
 
+static int
+u64_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a,
+             y = *(const uint64_t *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Insert every word into a table that starts small (so that it is
+// resized many times) and report the latency distribution of the
+// inserts.
+static void
+insert_latency(strvect* v, uint32_t flags)
+{
+    size_t n = VECT_LEN(v);
+    uint64_t *lat = NEWZA(uint64_t, n);
+    word *w;
+    size_t i;
+    ht _h;
+    ht *h = &_h;
+
+    if (!n) {
+        DEL(lat);
+        return;
+    }
+
+    ht_init_flags(h, 128, 85, flags);
+    VECT_FOR_EACHi(v, i, w) {
+        uint64_t t0 = now();
+        ht_probe(h, w->h, w->w);
+        lat[i] = now() - t0;
+    }
+
+    qsort(lat, n, sizeof lat[0], u64_cmp);
+
+#define pctile(p)   lat[(size_t)(_d(n-1) * (p))]
+
+    const char *mode = (flags & FASTHT_INCREMENTAL) ? "incremental" : "stop-the-world";
+    if (Machine_output) {
+        printf("%s p50 %" PRIu64 " p99 %" PRIu64 " p999 %" PRIu64 " max %" PRIu64 " cy\n",
+                mode, pctile(0.5), pctile(0.99), pctile(0.999), lat[n-1]);
+    } else {
+        printf("Insert latency [%s; %u splits]:\n"
+               "  p50 %" PRIu64 " cy, p99 %" PRIu64 " cy, p999 %" PRIu64 " cy, max %" PRIu64 " cy\n",
+               mode, h->splits,
+               pctile(0.5), pctile(0.99), pctile(0.999), lat[n-1]);
+    }
+
+    ht_fini(h);
+    DEL(lat);
+}
+
+
+// Compare scalar lookups against ht_find_batch() for different
+// batch sizes. We use a large table of random keys so that the
+// lookups miss the cache.
+static void
+batch_perf(size_t nkeys)
+{
+    uint64_t *keys = NEWZA(uint64_t, nkeys);
+    void **vals    = NEWZA(void *, nkeys);
+    uint8_t *found = NEWZA(uint8_t, nkeys);
+    ht _h;
+    ht *h = &_h;
+
+    arc4random_buf(keys, nkeys * sizeof keys[0]);
+    ht_init(h, nkeys, 85);
+    for (size_t i = 0; i < nkeys; i++) {
+        keys[i] |= 1;   // keys must be non-zero
+        ht_probe(h, keys[i], &keys[i]);
+    }
+
+    uint64_t t0 = timenow();
+    size_t nf   = 0;
+    for (size_t i = 0; i < nkeys; i++) {
+        nf += ht_find(h, keys[i], &vals[i]);
+    }
+    double scalar = _d(timenow() - t0) / _d(nkeys);
+    assert(nf == nkeys);
+
+    if (!Machine_output)
+        printf("Batch lookups [%zu keys]: scalar %6.2f ns/key\n", nkeys, scalar);
+
+    for (size_t bs = 1; bs <= 256; bs *= 2) {
+        nf = 0;
+        t0 = timenow();
+        for (size_t i = 0; i < nkeys; i += bs) {
+            size_t n = (i + bs) > nkeys ? nkeys - i : bs;
+            nf += ht_find_batch(h, &keys[i], n, &vals[i], &found[i]);
+        }
+        double batch = _d(timenow() - t0) / _d(nkeys);
+        assert(nf == nkeys);
+
+        if (Machine_output)
+            printf("batch %zu %4.2f ns/key scalar %4.2f ns/key\n", bs, batch, scalar);
+        else
+            printf("  batch %3zu: %6.2f ns/key (%4.2fx)\n", bs, batch, scalar / batch);
+    }
+
+    ht_fini(h);
+    DEL(keys);
+    DEL(vals);
+    DEL(found);
+}
+
+
+// Time 'n' calls of 'op' (an expression of 'i'); return ns/op
+#define timeit(n, i, op) ({                         \
+            uint64_t _t0 = timenow();               \
+            for (i = 0; i < (n); i++) op;           \
+            _d(timenow() - _t0) / _d(n);            \
+        })
+
+// Compare the bag engine with the flat engine (FASTHT_FLAT) for
+// 'nkeys' random keys: insert into a growing table, find every key,
+// find keys that aren't in the table and delete every key.
+static void
+engine_perf(size_t nkeys)
+{
+    static const uint32_t engines[] = { 0, FASTHT_FLAT };
+    static const char *names[]      = { "bags", "flat" };
+    uint64_t *keys = NEWZA(uint64_t, nkeys);
+    uint64_t *miss = NEWZA(uint64_t, nkeys);
+    size_t i, nf;
+    ht _h;
+    ht *h = &_h;
+
+    // keys are odd and misses are even: they never collide
+    arc4random_buf(keys, nkeys * sizeof keys[0]);
+    arc4random_buf(miss, nkeys * sizeof miss[0]);
+    for (i = 0; i < nkeys; i++) {
+        keys[i] |= 1;
+        miss[i]  = (miss[i] & ~_U64(1)) | 2;
+    }
+
+    if (!Machine_output)
+        printf("Engines [%zu keys]:  insert   find-hit  find-miss   delete (ns/op)\n", nkeys);
+
+    for (size_t e = 0; e < ARRAY_SIZE(engines); e++) {
+        ht_init_flags(h, 0, 85, engines[e]);
+
+        double ins = timeit(nkeys, i, ht_probe(h, keys[i], &keys[i]));
+        assert(h->nodes == nkeys);
+
+        nf = 0;
+        double hit  = timeit(nkeys, i, nf += ht_find(h, keys[i], 0));
+        assert(nf == nkeys);
+
+        nf = 0;
+        double xhit = timeit(nkeys, i, nf += ht_find(h, miss[i], 0));
+        assert(nf == 0);
+
+        nf = 0;
+        double del  = timeit(nkeys, i, nf += ht_remove(h, keys[i], 0));
+        assert(nf == nkeys);
+
+        if (Machine_output)
+            printf("%s %zu insert %4.2f hit %4.2f miss %4.2f del %4.2f ns/op\n",
+                    names[e], nkeys, ins, hit, xhit, del);
+        else
+            printf("  %-16s %8.2f %10.2f %10.2f %8.2f\n", names[e], ins, hit, xhit, del);
+
+        ht_fini(h);
+    }
+
+    DEL(keys);
+    DEL(miss);
+}
+
+
 // % of buckets occupied
 #define fill(h) ((100.0 * _d(h->fill)) / _d(h->n))
 
@@ -270,10 +446,15 @@ main(int argc, char** argv)
         switch (c) {
         case 300:  /* help */
         case 'h':  /* help */
-            printf("Usage: %s [--machine-output|-m] [inputfile ...]\n", program_name);
+            printf("Usage: %s [--machine-output|-m] [--keys|-k N] [inputfile ...]\n", program_name);
             exit(0);
             break;
 
+        case 'k':
+            Maxkeys = strtoul(optarg, 0, 0);
+            if (!Maxkeys) die("invalid number of keys %s", optarg);
+            break;
+
         case 302:  /* machine-output */
         case 'm':
             Machine_output = 1;
@@ -317,6 +498,15 @@ main(int argc, char** argv)
     print_ht(h);
     ht_fini(h);
 
+    insert_latency(&v, 0);
+    insert_latency(&v, FASTHT_INCREMENTAL);
+
+    batch_perf(1024 * 1024);
+
+    for (size_t n = 1000000; n <= Maxkeys; n *= 10) {
+        engine_perf(n);
+    }
+
 
 #ifdef __MAKE_OPTIMIZE__
 
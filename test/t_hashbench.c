@@ -7,12 +7,16 @@
  *
  * Input file is a list of tokens/keys that must be hashed.
  * Each token is on a separate line.
+ *
+ * Also benchmarks lookups of the same tokens in the policy based
+ * hash table (utils/hashtab.h) - with and without inline keys.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
+#include <inttypes.h>
 #include "error.h"
 #include "utils/hashfunc.h"
 #include "utils/siphash.h"
@@ -20,6 +24,7 @@
 #include <sys/time.h>
 #include "utils/arena.h"
 #include "utils/utils.h"
+#include "utils/hashtab.h"
 #include "fast/vect.h"
 
 #include <assert.h>
@@ -38,6 +43,22 @@ typedef struct token token;
 // Dynamically growing array of tokens
 VECT_TYPEDEF(token_array, token);
 
+/*
+ * Hash table lookups are done with a copy of the token (like a
+ * key that comes from the outside world); 'orig' is the token in
+ * the table.
+ */
+struct probe
+{
+    token  key;
+    token* orig;
+};
+typedef struct probe probe;
+
+VECT_TYPEDEF(probe_array, probe);
+
+extern uint32_t arc4random(void);
+
 
 // fold a 64 bit value into a 32 bit one. Use all 64 bits to do the
 // folding.
@@ -124,6 +145,114 @@ benchmark(const token_array* tok, const hashfunc* hf)
 }
 
 
+/*
+ * Hash table callbacks: the elements are tokens.
+ */
+static uint32_t
+tok_hash(const void* x)
+{
+    const token* t = (const token*)x;
+    return fasthash32(t->str, t->len, 0);
+}
+
+static int
+tok_cmp(const void* a, const void* b)
+{
+    const token* x = (const token*)a;
+    const token* y = (const token*)b;
+    return strcmp(x->str, y->str);
+}
+
+static const void*
+tok_key(const void* x, size_t* len)
+{
+    const token* t = (const token*)x;
+
+    *len = t->len;
+    return t->str;
+}
+
+
+/*
+ * Insert the tokens in a hash table (inline keys upto 'keymax'
+ * bytes) and time looking up copies of them in random order.
+ */
+static void
+table_benchmark(const token_array* tok, size_t keymax)
+{
+    hash_table_policy pol;
+    hash_table_t tb;
+    probe_array  order;
+    probe*       pp;
+    size_t i, n = VECT_LEN(tok);
+    uint64_t found = 0;
+    int e;
+
+    memset(&pol, 0, sizeof pol);
+    malloc_memmgr(&pol.mem);
+    lockmgr_new_empty(&pol.lock);
+    pol.hash    = tok_hash;
+    pol.cmp     = tok_cmp;
+    pol.key     = tok_key;
+    pol.keymax  = keymax;
+
+    if ((e = hash_table_new(&tb, &pol)) < 0)
+        error(1, -e, "Can't create hash table");
+
+    VECT_INIT(&order, n);
+    for (i = 0; i < n; i++) {
+        token* t = &VECT_ELEM(tok, i);
+
+        // the input may have duplicates; we only look up the
+        // first of them.
+        e = hash_table_insert(tb, t);
+        if (e == 0) {
+            probe x = { { strdup(t->str), t->len }, t };
+
+            VECT_PUSH_BACK(&order, x);
+        } else if (e != -EEXIST)
+            error(1, -e, "Can't insert token %zu", i);
+    }
+
+    VECT_SHUFFLE(&order, arc4random);
+
+    n = VECT_LEN(&order);
+
+    // Best of a few rounds - to weed out noise.
+    uint64_t tn = ~0, tm = ~0;
+    for (int round = 0; round < 5; round++) {
+        found = 0;
+
+        uint64_t t1 = timenow();
+        uint64_t t0 = sys_cpu_timestamp();
+        for (i = 0; i < n; i++) {
+            probe* x = &VECT_ELEM(&order, i);
+            void*  r = 0;
+
+            found += hash_table_lookup(tb, &x->key, &r) && r == x->orig;
+        }
+        t0 = sys_cpu_timestamp() - t0;
+        t1 = timenow() - t1;
+
+        if (t0 < tn) tn = t0;
+        if (t1 < tm) tm = t1;
+    }
+
+    if (found != n)
+        error(1, 0, "hashtab inline-%zu: found %" PRIu64 " of %zu tokens",
+                keymax, found, n);
+
+    printf("hashtab inline-%-3zu: %8.2f cyc/lookup %6.2f M lookups/sec\n",
+            keymax, (double)tn / (double)n, 1000.0 * (double)n / (double)tm);
+
+    VECT_FOR_EACH(&order, pp) {
+        free(pp->key.str);
+    }
+    VECT_FINI(&order);
+    hash_table_delete(tb);
+}
+
+
 static int
 read_tokens(token_array* tok, FILE* fp, arena_t a)
 {
@@ -208,6 +337,11 @@ main(int argc, char* argv[])
         benchmark(&tok, hf);
     }
 
+    // inline-0 is the plain node layout
+    table_benchmark(&tok, 0);
+    table_benchmark(&tok, 24);
+    table_benchmark(&tok, HASH_TABLE_KEYMAX);
+
     VECT_FINI(&tok);
     arena_delete(a);
 
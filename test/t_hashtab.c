@@ -4,6 +4,11 @@
  * Reads from stdin or a file and builds a hash table. Does
  * self-test of hash table functions and prints out some timining
  * numbers.
+ *
+ * Lastly, benchmarks concurrent lookups on the same input with
+ * 1..N threads for each of the mutex, rwlock and spin lockers; and
+ * checks that lookups find every key while the table grows under
+ * them.
  */
 #include <stdio.h>
 #include <string.h>
@@ -12,12 +17,15 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "getopt_long.h"
 #include "error.h"
 #include "utils/hashtab.h"
 #include "utils/arena.h"
 #include "utils/utils.h"
+#include "utils/cpu.h"
 #include "fast/vect.h"
 #include "utils/hashfunc.h"
 #include "utils/siphash.h"
@@ -41,11 +49,14 @@ static struct option lopt[] =
     {"logsize", required_argument, 0, 's'},
     {"fill", required_argument, 0, 'f'},
     {"hash",  required_argument, 0, 'H'},
+    {"lock",  required_argument, 0, 'l'},
+    {"threads",  required_argument, 0, 't'},
+    {"inline",  required_argument, 0, 'k'},
     {"help",  no_argument, 0, 'h'},
     {0, 0,0, 0}
 } ;
 
-static char sopt[] = "s:f:H:h" ;
+static char sopt[] = "s:f:H:l:t:k:h" ;
 
 static void Usage(int) ;
 static void test_hash_table(input_vect*, hash_table_policy*);
@@ -54,11 +65,15 @@ static void store_data(input_vect *, hash_table_t) ;
 static void query_data(input_vect *, hash_table_t) ;
 static void remove_data(input_vect *, hash_table_t) ;
 static void iterator_test(input_vect *, hash_table_t, int sorted);
+static void contention_test(input_vect *, hash_table_policy*, int maxthr);
+static void resize_test(input_vect *, hash_table_policy*, int nthr);
+static void many_tables_test(input_vect *, hash_table_policy*);
 
 
 static hash_func_f* str2hash(const char* name);
 
 static int str_keyval_cmp(const void*, const void*);
+static const void* str_keyval_key(const void*, size_t*);
 
 
 // fold a 64 bit value into a 32 bit one. Use all 64 bits to do the
@@ -112,6 +127,47 @@ str_keyval_cmp(const void* lhs, const void* rhs)
     return strcmp(a->key, b->key);
 }
 
+/*
+ * List of lockers
+ */
+struct locker_pair
+{
+    const char* name;
+    const lockmgr* lock;
+};
+typedef struct locker_pair locker_pair;
+
+static const locker_pair Lockers [] =
+{
+    {"none",    0},
+    {"mutex",   &Mutex_locker},
+    {"rwlock",  &Rwlock_locker},
+    {"spin",    &Spin_locker},
+    {0, 0}
+};
+
+static const locker_pair*
+str2lock(const char* name)
+{
+    const locker_pair* p = &Lockers[0];
+
+    for (; p->name; ++p) {
+        if (0 == strcasecmp(name, p->name))
+            return p;
+    }
+
+    return 0;
+}
+
+static const void*
+str_keyval_key(const void* x, size_t* len)
+{
+    const datum* a = (const datum*)x;
+
+    *len = strlen(a->key);
+    return a->key;
+}
+
 static hash_func_f*
 str2hash(const char* name)
 {
@@ -164,18 +220,21 @@ perfaccum(perf* dest, perf p0)
 int
 main(int argc, char *argv[])
 {
-    int logsize=0, htmaxfill=0 ;
+    int logsize=0, htmaxfill=0, keymax=0 ;
     int c;
     FILE *fp = 0;
     char *filename ;
     hash_table_policy pol;
     hash_func_f* hashfunc;
+    const locker_pair* locker;
+    int maxthr = sys_cpu_getavail();
     arena_t arena;
     input_vect vv;
 
     program_name = argv[0] ;
 
     hashfunc = str2hash("default");
+    locker   = str2lock("none");
 
     while ( (c=getopt_long(argc, argv, sopt, lopt, 0)) != EOF ) {
         switch(c)
@@ -194,6 +253,19 @@ main(int argc, char *argv[])
             case 'f' :
                 htmaxfill = atoi(optarg) ;
                 break ;
+            case 'l':
+                locker = str2lock(optarg);
+                if (!locker)
+                    error(1, 0, "Can't find locker '%s'", optarg);
+                break;
+            case 'k':
+                keymax = atoi(optarg);
+                break;
+            case 't':
+                maxthr = atoi(optarg);
+                if (maxthr <= 0)
+                    error(1, 0, "Invalid number of threads '%s'", optarg);
+                break;
             case 'h':
             default :
                 Usage(1) ;
@@ -227,9 +299,18 @@ main(int argc, char *argv[])
     pol.dtor    = 0;
     pol.fillmax = htmaxfill;
     pol.logsize = logsize;
+    pol.key     = str_keyval_key;
+    pol.keymax  = keymax;
+
+    if (locker->lock)
+        pol.lock = *locker->lock;
+    else
+        lockmgr_new_empty(&pol.lock);
 
-    lockmgr_new_empty(&pol.lock);
     test_hash_table(&vv, &pol);
+    contention_test(&vv, &pol, maxthr);
+    resize_test(&vv, &pol, maxthr);
+    many_tables_test(&vv, &pol);
 
 
     /* since we are using the arena memory manager, we don't have to
@@ -522,6 +603,214 @@ iterator_test(input_vect* inp, hash_table_t tb, int sorted)
 }
 
 
+/*
+ * Concurrent lookups: every thread looks up all the keys - each
+ * starting at a different offset in the input.
+ */
+struct lookup_ctx
+{
+    pthread_t id;
+    int       cpu;
+    int       ncpu;
+    size_t    start;
+
+    input_vect*  inp;
+    hash_table_t tb;
+};
+typedef struct lookup_ctx lookup_ctx;
+
+static void*
+lookup_thread(void* v)
+{
+    lookup_ctx* c  = (lookup_ctx*)v;
+    size_t n = VECT_LEN(c->inp);
+    size_t i;
+
+    sys_cpu_set_my_thread_affinity(c->cpu % c->ncpu);
+    for (i = 0; i < n; ++i) {
+        datum* d  = VECT_ELEM(c->inp, (c->start + i) % n);
+        void * ret = 0;
+
+        if (!hash_table_lookup(c->tb, d, &ret) || ret != d)
+            error(1, 0, "** thread %d: can't find key %s\n", c->cpu, d->key);
+    }
+    return 0;
+}
+
+
+// Run 'nthr' lookup threads and return the aggregate rate in M ops/s
+static double
+run_lookups(input_vect* inp, hash_table_t tb, int nthr)
+{
+    lookup_ctx* cx = NEWZA(lookup_ctx, nthr);
+    int ncpu = sys_cpu_getavail();
+    int i;
+    uint64_t t0 = timenow();
+
+    for (i = 0; i < nthr; ++i) {
+        lookup_ctx* c = &cx[i];
+
+        c->cpu   = i;
+        c->ncpu  = ncpu;
+        c->start = (VECT_LEN(inp) * i) / nthr;
+        c->inp   = inp;
+        c->tb    = tb;
+        pthread_create(&c->id, 0, lookup_thread, c);
+    }
+
+    for (i = 0; i < nthr; ++i)
+        pthread_join(cx[i].id, 0);
+
+    uint64_t tt = timenow() - t0;
+    DEL(cx);
+
+    // timenow() is in ns; thus 1000 * (n/t) is M/s
+    return 1000.0 * (_d(nthr) * _d(VECT_LEN(inp))) / _d(tt);
+}
+
+
+static void
+contention_test(input_vect* inp, hash_table_policy* pol, int maxthr)
+{
+    static const char* names[] = { "mutex", "rwlock", "spin" };
+    hash_table_t tb[ARRAY_SIZE(names)];
+    hash_table_policy p = *pol;
+    size_t j;
+    int n;
+
+    for (j = 0; j < ARRAY_SIZE(names); ++j) {
+        size_t i;
+        datum** pd;
+        int err;
+
+        p.lock = *str2lock(names[j])->lock;
+        err    = hash_table_new(&tb[j], &p);
+        if (err < 0)
+            error(1, -err, "Can't create hash table");
+
+        VECT_FOR_EACHi(inp, i, pd) {
+            err = hash_table_insert(tb[j], *pd);
+            if (err != 0)
+                error(1, -err, "** Fatal error while inserting rec %zu\n", i);
+        }
+    }
+
+    printf("Concurrent lookups: %zu keys/thread\n"
+           "  thr   mutex M/s  rwlock M/s    spin M/s\n", VECT_LEN(inp));
+    for (n = 1; n <= maxthr; ++n) {
+        printf("  %3d", n);
+        for (j = 0; j < ARRAY_SIZE(names); ++j)
+            printf("  %10.2f", run_lookups(inp, tb[j], n));
+        printf("\n");
+    }
+
+    for (j = 0; j < ARRAY_SIZE(names); ++j)
+        hash_table_delete(tb[j]);
+}
+
+
+/*
+ * Lookups during a resize: readers look up the first half of the
+ * keys while the main thread inserts the second half into a small
+ * table. Every lookup must find its key across the resizes.
+ */
+struct grow_ctx
+{
+    pthread_t id;
+    size_t    lookups;
+
+    input_vect*  inp;
+    hash_table_t tb;
+    atomic_int*  done;
+};
+typedef struct grow_ctx grow_ctx;
+
+static void*
+grow_reader(void* v)
+{
+    grow_ctx* c = (grow_ctx*)v;
+    size_t n = VECT_LEN(c->inp) / 2;
+    size_t i;
+
+    while (!atomic_load(c->done)) {
+        for (i = 0; i < n; ++i) {
+            datum* d  = VECT_ELEM(c->inp, i);
+            void * ret = 0;
+
+            if (!hash_table_lookup(c->tb, d, &ret) || ret != d)
+                error(1, 0, "** resize: can't find key %s\n", d->key);
+        }
+        c->lookups += n;
+    }
+    return 0;
+}
+
+
+static void
+resize_test(input_vect* inp, hash_table_policy* pol, int nthr)
+{
+    hash_table_policy p = *pol;
+    grow_ctx* cx = NEWZA(grow_ctx, nthr);
+    atomic_int done = 0;
+    hash_table_t tb;
+    hash_table_stat st;
+    size_t i, n = VECT_LEN(inp), lookups = 0;
+    int j, err;
+
+    p.lock    = Rwlock_locker;
+    p.logsize = 4;
+    p.thread_cache = 1;
+    err = hash_table_new(&tb, &p);
+    if (err < 0)
+        error(1, -err, "Can't create hash table");
+
+    for (i = 0; i < n/2; ++i) {
+        err = hash_table_insert(tb, VECT_ELEM(inp, i));
+        if (err != 0)
+            error(1, -err, "** Fatal error while inserting rec %zu\n", i);
+    }
+
+    hash_table_stats(tb, &st);
+    int splits = st.splits;
+
+    for (j = 0; j < nthr; ++j) {
+        grow_ctx* c = &cx[j];
+
+        c->inp  = inp;
+        c->tb   = tb;
+        c->done = &done;
+        pthread_create(&c->id, 0, grow_reader, c);
+    }
+
+    for (; i < n; ++i) {
+        err = hash_table_insert(tb, VECT_ELEM(inp, i));
+        if (err != 0)
+            error(1, -err, "** Fatal error while inserting rec %zu\n", i);
+    }
+
+    atomic_store(&done, 1);
+    for (j = 0; j < nthr; ++j) {
+        pthread_join(cx[j].id, 0);
+        lookups += cx[j].lookups;
+    }
+
+    hash_table_stats(tb, &st);
+    assert(st.nodes == n);
+    for (i = 0; i < n; ++i) {
+        void * ret = 0;
+        int r = hash_table_lookup(tb, VECT_ELEM(inp, i), &ret);
+
+        assert(r && ret == VECT_ELEM(inp, i));
+    }
+
+    printf("Lookups during resize: %d readers, %d splits, %zu lookups\n",
+            nthr, st.splits - splits, lookups);
+
+    hash_table_delete(tb);
+    DEL(cx);
+}
+
+
 static void
 Usage(int s)
 {
@@ -535,6 +824,11 @@ Usage: %s [OPTIONS] file [file ..]\n\
           --hash=NAME, -H NAME  Use hash function 'NAME' instead of default\n\
                                 NAME must be one of 'default', 'hsieh', 'murmur', \n\
                                 'fnv', 'city', 'siphash[*]', 'fast', 'yorrike'\n\
+          --lock=NAME, -l NAME  Use locker 'NAME' for the main test\n\
+                                NAME must be one of 'none[*]', 'mutex', 'rwlock', 'spin'\n\
+          --threads=N, -t N     Run the concurrent lookups with upto N threads\n\
+                                [number of CPUs]\n\
+          --inline=N, -k N      Store keys upto N bytes inline in the hash nodes [0]\n\
 ", program_name) ;
 
     exit(s) ;
@@ -591,4 +885,35 @@ hash_yorrike(const void* x)
     return yorrike_hash32(p->key, strlen(p->key), 0);
 }
 
+/*
+ * Tables with a locker, more than there are pthread keys: the
+ * default node pool mustn't use one up.
+ */
+static void
+many_tables_test(input_vect* inp, hash_table_policy* pol)
+{
+    const size_t N = 2048;
+    hash_table_t* tb = NEWA(hash_table_t, N);
+    hash_table_policy p = *pol;
+    size_t i;
+    int err;
+
+    p.lock    = Mutex_locker;
+    p.logsize = 1;
+    for (i = 0; i < N; ++i) {
+        err = hash_table_new(&tb[i], &p);
+        if (err < 0)
+            error(1, -err, "Can't create hash table %zu", i);
+
+        err = hash_table_insert(tb[i], VECT_ELEM(inp, i % VECT_LEN(inp)));
+        assert(err == 0);
+    }
+
+    for (i = 0; i < N; ++i)
+        hash_table_delete(tb[i]);
+
+    DEL(tb);
+    printf("%zu locked tables: ok\n", N);
+}
+
 /* EOF */
@@ -0,0 +1,206 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * t_memmgr.c - test harness for the page, huge page and NUMA
+ *              memory managers
+ *
+ * Copyright (c) 2005 Sudhi Herle <sw@herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "utils/utils.h"
+#include "utils/memmgr.h"
+#include "utils/mempool.h"
+#include "utils/arena.h"
+#include "utils/xorshift-rand.h"
+#include "error.h"
+
+static void basic_test(void);
+static void plug_test(void);
+static void tlb_test(size_t mb);
+
+int
+main(int argc, char **argv)
+{
+    size_t mb = 256;
+
+    program_name = argv[0];
+    if (argc > 1) mb = strtoul(argv[1], 0, 0);
+
+    printf("%d NUMA nodes; huge page %zu kB\n",
+            memmgr_numa_nodes(), memmgr_hugepage_size() / 1024);
+
+    basic_test();
+    plug_test();
+    if (mb > 0) tlb_test(mb);
+
+    return 0;
+}
+
+
+/*
+ * Allocate, verify and free a range of sizes from 'm'.
+ */
+static void
+exercise(memmgr *m)
+{
+    static const size_t sizes[] = {
+        1, 100, 4000, 4096, 65536, 1024 * 1024,
+        2 * 1024 * 1024, 5 * 1024 * 1024 + 7,
+    };
+    void  *v[ARRAY_SIZE(sizes)];
+    size_t i, j;
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        unsigned char *p = memmgr_alloc(m, sizes[i]);
+
+        assert(p);
+        assert(_IS_ALIGNED(p, 64));
+        for (j = 0; j < sizes[i]; j += 512) {
+            assert(p[j] == 0);
+        }
+        assert(p[sizes[i]-1] == 0);
+        memset(p, 0xa5, sizes[i]);
+        v[i] = p;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        memmgr_free(m, v[i]);
+    }
+    memmgr_free(m, 0);
+}
+
+
+static void
+basic_test()
+{
+    memmgr m;
+    void  *p;
+
+    exercise(memmgr_init_mmap(&m, 0));
+    exercise(memmgr_init_mmap(&m, MEMMGR_HUGEPAGE));
+    exercise(memmgr_init_numa(&m, MEMMGR_NUMA_LOCAL, 0));
+    exercise(memmgr_init_numa(&m, 0, MEMMGR_HUGEPAGE|MEMMGR_NUMA_STRICT));
+
+    // a node that doesn't exist: strict fails, else it is a hint
+    memmgr_init_numa(&m, memmgr_numa_nodes() + 1, MEMMGR_NUMA_STRICT);
+    p = memmgr_alloc(&m, 100);
+    assert(!p);
+    exercise(memmgr_init_numa(&m, memmgr_numa_nodes() + 1, 0));
+}
+
+
+/*
+ * The page allocators behind a mempool and an arena.
+ */
+static void
+plug_test()
+{
+    const int N = 100000;
+    void **v    = NEWA(void *, N);
+    mempool *mp;
+    arena_t  a;
+    memmgr   m;
+    size_t   hp = memmgr_hugepage_size();
+    unsigned units;
+    int i, r;
+
+    memmgr_init_mmap(&m, MEMMGR_HUGEPAGE);
+
+    // Chunks that fill a huge page and don't spill into the next
+    units = (unsigned)((hp - MEMMGR_OVERHEAD) / 48);
+    while (mempool_chunk_size(48, 0, units) > hp - MEMMGR_OVERHEAD) units--;
+
+    r = mempool_new(&mp, &m, 48, 0, units);
+    if (r < 0) error(1, -r, "can't make mempool");
+
+    for (i = 0; i < N; i++) {
+        v[i] = mempool_alloc(mp);
+        assert(v[i]);
+        memset(v[i], i & 0xff, 48);
+    }
+    for (i = 0; i < N; i++) {
+        mempool_free(mp, v[i]);
+    }
+    mempool_delete(mp);
+
+    r = arena_new_memmgr(&a, 0, &m);
+    if (r < 0) error(1, -r, "can't make arena");
+
+    for (i = 0; i < N; i++) {
+        char *p = arena_alloc(a, 1 + (i % 300));
+
+        assert(p);
+        memset(p, 'x', 1 + (i % 300));
+    }
+    arena_reset(a);
+    v[0] = arena_alloc(a, 10);
+    assert(v[0]);
+    arena_delete(a);
+
+    DEL(v);
+}
+
+
+/*
+ * Random 8 byte reads over 'mb' MB of memory: 4k pages vs. huge
+ * pages.
+ */
+static double
+random_reads(memmgr *m, size_t mb)
+{
+    const size_t N = 4 * 1024 * 1024;
+    size_t    n = (mb * 1024 * 1024) / sizeof(uint64_t);
+    uint64_t *p = memmgr_alloc(m, n * sizeof(uint64_t));
+    uint64_t  t0, sum = 0, x = 0;
+    xs1024star xs;
+    size_t i;
+
+    if (!p) error(1, ENOMEM, "can't allocate %zu MB", mb);
+
+    for (i = 0; i < n; i++) {
+        p[i] = i;
+    }
+
+    xs1024star_init(&xs, 0);
+    t0 = sys_cpu_timestamp();
+    for (i = 0; i < N; i++) {
+        x += p[(xs1024star_u64(&xs) ^ x) % n];
+    }
+    sum = sys_cpu_timestamp() - t0;
+
+    memmgr_free(m, p);
+
+    if (x == 42) printf("..");
+    return ((double)sum) / ((double)N);
+}
+
+
+static void
+tlb_test(size_t mb)
+{
+    memmgr m;
+    double small, huge;
+
+    small = random_reads(memmgr_init_mmap(&m, 0), mb);
+    huge  = random_reads(memmgr_init_mmap(&m, MEMMGR_HUGEPAGE), mb);
+
+    printf("%zu MB random reads: 4k pages %6.2f cy/read, huge pages %6.2f cy/read\n",
+            mb, small, huge);
+}
+
+/* EOF */
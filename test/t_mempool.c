@@ -22,11 +22,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <assert.h>
 #include <errno.h>
 #include <time.h>
 #include <sys/time.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif /* __GLIBC__ */
 
 #include "utils/mempool.h"
+#include "utils/mempool-mt.h"
+#include "utils/cpu.h"
 #include "fast/vect.h"
 #include "utils/utils.h"
 #include "error.h"
@@ -50,6 +59,12 @@ VECT_TYPEDEF(ptr_vect, void*);
 
 #define N       (65535 * 16)
 
+// Blocks held by a thread and rounds of the multi-threaded tests
+#define MT_NBLK     32
+#define MT_ROUNDS   20000
+
+#define _d(x)       ((double)(x))
+
 
 #define now()   sys_cpu_timestamp()
 
@@ -189,18 +204,452 @@ prealloc_test()
 
 
 
+/* Return the resident set size in MB; 0 if unknown */
+static double
+rss_mb()
+{
+    FILE *fp = fopen("/proc/self/statm", "r");
+    unsigned long sz, res = 0;
+
+    if (!fp) return 0.0;
+    if (fscanf(fp, "%lu %lu", &sz, &res) != 2) res = 0;
+    fclose(fp);
+
+    return _d(res) * _d(sysconf(_SC_PAGESIZE)) / (1024.0 * 1024.0);
+}
+
+
+/*
+ * A burst of allocations followed by a steady state with a tenth of
+ * the blocks live: live blocks are freed at random and new ones
+ * allocated. Print the RSS as the pool is trimmed over time.
+ */
+static void
+burst_test()
+{
+    const int NB    = 1024 * 1024,
+              LIVE  = NB / 10;
+    mempool m;
+    void  **p = NEWZA(void *, NB);
+    int i, t, r;
+
+#ifdef __GLIBC__
+    // Chunks must come from mmap(2) for free(3) to give them back;
+    // earlier tests freed large chunks and made glibc raise its
+    // threshold.
+    mallopt(M_MMAP_THRESHOLD, 128 * 1024);
+#endif /* __GLIBC__ */
+
+    printf("Burst of %d blocks of %zu bytes; then %d live:\n", NB, sizeof(obj2), LIVE);
+    printf("  start     %8.2f MB\n", rss_mb());
+
+    r = mempool_init(&m, 0, sizeof(obj2), 0, 4096);
+    assert(r == 0);
+    for (i = 0; i < NB; i++) {
+        p[i] = mempool_alloc(&m);
+        assert(p[i]);
+        memset(p[i], 0x55, sizeof(obj2));
+    }
+    printf("  burst     %8.2f MB\n", rss_mb());
+
+    // Keep a random tenth of the blocks
+    ptr_vect v;
+    VECT_INIT(&v, NB);
+    for (i = 0; i < NB; i++) VECT_PUSH_BACK(&v, p[i]);
+    VECT_SHUFFLE(&v, arc4random);
+    for (i = LIVE; i < NB; i++) mempool_free(&m, VECT_ELEM(&v, i));
+
+    uint64_t n = mempool_trim(&m, 0);
+    printf("  free 90%%  %8.2f MB (trimmed %.2f MB)\n", rss_mb(), _d(n) / (1024.0 * 1024.0));
+
+    // Churn: replace live blocks; new blocks go to the fullest chunks
+    for (t = 1; t <= 8; t++) {
+        for (i = 0; i < LIVE; i++) {
+            int j = arc4random() % LIVE;
+
+            mempool_free(&m, VECT_ELEM(&v, j));
+            VECT_ELEM(&v, j) = mempool_alloc(&m);
+            assert(VECT_ELEM(&v, j));
+        }
+
+        n = mempool_trim(&m, 0);
+        printf("  churn %d   %8.2f MB (trimmed %.2f MB)\n", t, rss_mb(), _d(n) / (1024.0 * 1024.0));
+    }
+
+    for (i = 0; i < LIVE; i++) mempool_free(&m, VECT_ELEM(&v, i));
+    n = mempool_trim(&m, 0);
+    printf("  free all  %8.2f MB (trimmed %.2f MB)\n", rss_mb(), _d(n) / (1024.0 * 1024.0));
+
+    mempool_fini(&m);
+    VECT_FINI(&v);
+    DEL(p);
+}
+
+
+/*
+ * A pool with a high-water mark releases chunks as they become
+ * empty; a pool in a fixed zone is purged.
+ */
+static void
+trim_test()
+{
+    mempool m;
+    void **p = NEWZA(void *, N);
+    void  *q;
+    uint64_t z;
+    int i, r;
+
+    r = mempool_init(&m, 0, sizeof(obj), 0, 1024);
+    assert(r == 0);
+    for (i = 0; i < N; i++) {
+        p[i] = mempool_alloc(&m);
+        assert(p[i]);
+    }
+
+    // Nothing to trim in full chunks
+    z = mempool_trim(&m, 0);
+    assert(z == 0);
+
+    mempool_set_trim(&m, 2);
+    for (i = 0; i < N; i++) {
+        mempool_free(&m, p[i]);
+    }
+
+    // Atmost 2 empty chunks were kept
+    z = mempool_trim(&m, 0);
+    assert(z > 0);
+    z = mempool_trim(&m, 0);
+    assert(z == 0);
+
+    // Allocating after a trim makes new chunks
+    for (i = 0; i < N; i++) {
+        p[i] = mempool_alloc(&m);
+        assert(p[i]);
+    }
+    for (i = 0; i < N; i++) {
+        mempool_free(&m, p[i]);
+    }
+    mempool_fini(&m);
+
+    // A bounded pool whose chunk was trimmed gets a new one
+    r = mempool_init(&m, 0, sizeof(obj), 16, 0);
+    assert(r == 0);
+    for (i = 0; i < 16; i++) p[i] = mempool_alloc(&m);
+    q = mempool_alloc(&m);
+    assert(!q);
+    for (i = 0; i < 16; i++) mempool_free(&m, p[i]);
+    z = mempool_trim(&m, 0);
+    assert(z > 0);
+    for (i = 0; i < 16; i++) {
+        p[i] = mempool_alloc(&m);
+        assert(p[i]);
+    }
+    q = mempool_alloc(&m);
+    assert(!q);
+    mempool_fini(&m);
+
+    // The chunk of a fixed zone is reset
+    {
+        const unsigned int poolsz = (1024 * 1024);
+        void *zone = NEWZA(uint8_t, poolsz);
+        int n;
+
+        r = mempool_init_from_mem(&m, sizeof(obj), zone, poolsz);
+        assert(r == 0);
+        n = mempool_total_blocks(&m);
+        for (i = 0; i < n && i < N; i++) {
+            p[i] = mempool_alloc(&m);
+            assert(p[i]);
+        }
+        for (i = 0; i < n && i < N; i++) mempool_free(&m, p[i]);
+        z = mempool_trim(&m, 0);
+        assert(z > 0);
+
+        // An unused purged chunk isn't purged - or counted - again
+        z = mempool_trim(&m, 0);
+        assert(z == 0);
+        for (i = 0; i < n && i < N; i++) {
+            p[i] = mempool_alloc(&m);
+            assert(p[i]);
+        }
+        q = mempool_alloc(&m);
+        assert(!q);
+
+        mempool_fini(&m);
+        DEL(zone);
+    }
+
+    DEL(p);
+}
+
+
+/*
+ * Multi-threaded tests: each thread allocates MT_NBLK blocks, stamps
+ * them, checks the stamps and frees them. The last batch of each
+ * thread is freed by the main thread.
+ */
+
+struct mtctx
+{
+    pthread_t   id;
+    int         cpu;
+    int         ncpu;
+
+    mempool_mt *mt;     // thread cached pool or ..
+    mempool    *mp;     // .. a mempool behind a mutex
+    pthread_mutex_t *lock;
+
+    // blocks left for another thread to free
+    obj2      **give;
+
+    uint64_t    cyc;
+};
+typedef struct mtctx mtctx;
+
+
+static inline void *
+mt_alloc(mtctx *c)
+{
+    void *p;
+
+    if (c->mt) return mempool_mt_alloc(c->mt);
+
+    pthread_mutex_lock(c->lock);
+    p = mempool_alloc(c->mp);
+    pthread_mutex_unlock(c->lock);
+    return p;
+}
+
+
+static inline void
+mt_free(mtctx *c, void *p)
+{
+    if (c->mt) {
+        mempool_mt_free(c->mt, p);
+        return;
+    }
+
+    pthread_mutex_lock(c->lock);
+    mempool_free(c->mp, p);
+    pthread_mutex_unlock(c->lock);
+}
+
+
+static void *
+mt_checker(void *v)
+{
+    mtctx *c = v;
+    obj2  *p[MT_NBLK];
+    int    r, i;
+
+    for (r = 0; r < MT_ROUNDS / 10; r++) {
+        for (i = 0; i < MT_NBLK; i++) {
+            p[i] = mt_alloc(c);
+            assert(p[i]);
+            memset(p[i]->b, c->cpu, sizeof p[i]->b);
+        }
+        for (i = 0; i < MT_NBLK; i++) {
+            assert(p[i]->b[0]  == (char)c->cpu);
+            assert(p[i]->b[63] == (char)c->cpu);
+            mt_free(c, p[i]);
+        }
+    }
+
+    // Blocks for another thread to free
+    for (i = 0; i < MT_NBLK; i++) {
+        c->give[i] = mt_alloc(c);
+        assert(c->give[i]);
+    }
+    return 0;
+}
+
+
+static void *
+mt_bench(void *v)
+{
+    mtctx *c = v;
+    void  *p[MT_NBLK];
+    int    r, i;
+
+    sys_cpu_set_my_thread_affinity(c->cpu % c->ncpu);
+
+    uint64_t c0 = sys_cpu_timestamp();
+    for (r = 0; r < MT_ROUNDS; r++) {
+        for (i = 0; i < MT_NBLK; i++) p[i] = mt_alloc(c);
+        for (i = 0; i < MT_NBLK; i++) mt_free(c, p[i]);
+    }
+    c->cyc = sys_cpu_timestamp() - c0;
+    return 0;
+}
+
+
+// Run 'nthr' threads of 'fp'; return the average cycles/op
+static double
+mt_run(void *(*fp)(void *), int nthr, int ncpu, mempool_mt *mt, mempool *mp)
+{
+    pthread_mutex_t lock;
+    mtctx *cx = NEWZA(mtctx, nthr);
+    uint64_t cyc = 0;
+    int i;
+
+    pthread_mutex_init(&lock, 0);
+    for (i = 0; i < nthr; i++) {
+        mtctx *c = &cx[i];
+
+        c->cpu  = i;
+        c->ncpu = ncpu;
+        c->mt   = mt;
+        c->mp   = mp;
+        c->lock = &lock;
+        c->give = NEWZA(obj2 *, MT_NBLK);
+        pthread_create(&c->id, 0, fp, c);
+    }
+
+    for (i = 0; i < nthr; i++) {
+        pthread_join(cx[i].id, 0);
+        cyc += cx[i].cyc;
+    }
+
+    // Free the blocks allocated by the other threads
+    for (i = 0; i < nthr; i++) {
+        mtctx *c = &cx[i];
+        int j;
+
+        for (j = 0; j < MT_NBLK; j++) {
+            if (c->give[j]) mt_free(c, c->give[j]);
+        }
+    }
+
+    for (i = 0; i < nthr; i++) DEL(cx[i].give);
+    DEL(cx);
+    pthread_mutex_destroy(&lock);
+
+    return _d(cyc) / (_d(nthr) * 2.0 * MT_ROUNDS * MT_NBLK);
+}
+
+
+/*
+ * A TLS destructor that runs after the pool's own (glibc runs them
+ * in key order) mustn't use the magazine the pool just freed.
+ */
+static pthread_key_t Latekey;
+
+static void
+late_dtor(void *v)
+{
+    mempool_mt *mt = (mempool_mt *)v;
+    void *p = mempool_mt_alloc(mt);
+
+    assert(p);
+    mempool_mt_free(mt, p);
+}
+
+
+static void *
+late_thread(void *v)
+{
+    mempool_mt *mt = (mempool_mt *)v;
+    void *p = mempool_mt_alloc(mt);
+
+    assert(p);
+    mempool_mt_free(mt, p);
+    pthread_setspecific(Latekey, mt);
+    return 0;
+}
+
+
+static void
+mt_test(int maxthr, int ncpu)
+{
+    mempool_mt *mt;
+    mempool     mp;
+    int n, r;
+
+    r = mempool_mt_new(&mt, 0, sizeof(obj2), 0, 0, 0);
+    assert(r == 0);
+    assert(mempool_mt_block_size(mt) >= sizeof(obj2));
+    for (n = 1; n <= maxthr; n *= 2) {
+        mt_run(mt_checker, n, ncpu, mt, 0);
+    }
+    mempool_mt_delete(mt);
+
+    // A bounded pool runs out
+    {
+        void *p[64], *q;
+        int i;
+
+        r = mempool_mt_new(&mt, 0, sizeof(obj2), 64, 0, 8);
+        assert(r == 0);
+        for (i = 0; i < 64; i++) {
+            p[i] = mempool_mt_alloc(mt);
+            assert(p[i]);
+        }
+        q = mempool_mt_alloc(mt);
+        assert(!q);
+        for (i = 0; i < 64; i++) mempool_mt_free(mt, p[i]);
+        mempool_mt_flush(mt);
+        mempool_mt_delete(mt);
+    }
+
+    // A late TLS destructor
+    {
+        pthread_t t;
+
+        r = mempool_mt_new(&mt, 0, sizeof(obj2), 0, 0, 0);
+        assert(r == 0);
+        r = pthread_key_create(&Latekey, late_dtor);
+        assert(r == 0);
+
+        pthread_create(&t, 0, late_thread, mt);
+        pthread_join(t, 0);
+
+        pthread_key_delete(Latekey);
+        mempool_mt_delete(mt);
+    }
+
+    printf("MT alloc+free, %d blocks/thread:\n"
+           "  thr  mutex cyc/op  cached cyc/op\n", MT_NBLK);
+    for (n = 1; n <= maxthr; n++) {
+        r = mempool_init(&mp, 0, sizeof(obj2), 0, 0);
+        assert(r == 0);
+        r = mempool_mt_new(&mt, 0, sizeof(obj2), 0, 0, 0);
+        assert(r == 0);
+
+        double m = mt_run(mt_bench, n, ncpu, 0, &mp);
+        double c = mt_run(mt_bench, n, ncpu, mt, 0);
+
+        printf("  %3d  %12.2f  %13.2f\n", n, m, c);
+
+        mempool_mt_delete(mt);
+        mempool_fini(&mp);
+    }
+}
+
+
 int
-main()
+main(int argc, char **argv)
 {
+    int ncpu   = sys_cpu_getavail();
+    int maxthr = ncpu;
     int i = 0;
 
+    program_name = argv[0];
+    if (argc > 1) {
+        maxthr = atoi(argv[1]);
+        if (maxthr <= 0) die("invalid number of threads %s", argv[1]);
+    }
+
     basic_test();
     prealloc_test();
+    trim_test();
 
     for (i = 0; i < 10; i++) {
         perf_test(i);
     }
 
+    burst_test();
+    mt_test(maxthr, ncpu);
+
     return 0;
 }
 
@@ -0,0 +1,214 @@
+/*
+ * Test and benchmark for the byte match scans in fast/simd.h
+ *
+ * (c) 2025 Sudhi Herle <sudhi-at-herle.net>
+ *
+ * - Correctness: every ISA specific version of simd_match32() and
+ *   simd_match64() that the CPU supports must agree with a scalar
+ *   scan at every byte offset (aligned and unaligned).
+ *
+ * - Performance: scan a buffer of control bytes with each version
+ *   and print the throughput in GB/s.
+ *
+ * Optional argument: size of the buffer in KB (default 64).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include "error.h"
+#include "fast/simd.h"
+#include "utils/utils.h"
+#include "utils/xoroshiro.h"
+
+#define _d(x)       ((double)(x))
+
+typedef uint64_t (*matchfp)(const void *p, uint8_t b);
+
+struct target
+{
+    const char *name;
+    int         isa;    // min ISA needed
+    int         width;  // bytes per call
+    matchfp     fp;
+};
+typedef struct target target;
+
+
+static uint64_t
+scalar_match32(const void *p, uint8_t b)
+{
+    const uint8_t *s = p;
+    uint64_t m = 0;
+
+    for (int i = 0; i < 32; i++) {
+        if (s[i] == b) m |= _U64(1) << i;
+    }
+    return m;
+}
+
+static uint64_t
+scalar_match64(const void *p, uint8_t b)
+{
+    const uint8_t *s = p;
+
+    return scalar_match32(s, b) | (scalar_match32(s + 32, b) << 32);
+}
+
+
+#ifndef __NO_SIMD__
+
+// Wrap the inline versions so that we can call them via a pointer
+static uint64_t m128_32(const void *p, uint8_t b) { return simd128_match32(p, b); }
+static uint64_t m128_64(const void *p, uint8_t b) { return simd128_match64(p, b); }
+static uint64_t m256_32(const void *p, uint8_t b) { return simd256_match32(p, b); }
+static uint64_t m256_64(const void *p, uint8_t b) { return simd256_match64(p, b); }
+static uint64_t m512_64(const void *p, uint8_t b) { return simd512_match64(p, b); }
+
+#endif // __NO_SIMD__
+
+static uint64_t auto_32(const void *p, uint8_t b) { return simd_match32(p, b); }
+static uint64_t auto_64(const void *p, uint8_t b) { return simd_match64(p, b); }
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define ISA_256     SIMD_ISA_128    // emulated with NEON
+#define ISA_512     SIMD_ISA_128
+#else
+#define ISA_256     SIMD_ISA_256
+#define ISA_512     SIMD_ISA_512
+#endif
+
+static const target Targets[] = {
+      {"scalar-32",  SIMD_ISA_NONE, 32, scalar_match32}
+    , {"scalar-64",  SIMD_ISA_NONE, 64, scalar_match64}
+#ifndef __NO_SIMD__
+    , {"simd128-32", SIMD_ISA_128,  32, m128_32}
+    , {"simd128-64", SIMD_ISA_128,  64, m128_64}
+    , {"simd256-32", ISA_256,       32, m256_32}
+    , {"simd256-64", ISA_256,       64, m256_64}
+    , {"simd512-64", ISA_512,       64, m512_64}
+#endif
+    , {"auto-32",    SIMD_ISA_NONE, 32, auto_32}
+    , {"auto-64",    SIMD_ISA_NONE, 64, auto_64}
+};
+
+
+static const char *
+isa_name(int isa)
+{
+    switch (isa) {
+    case SIMD_ISA_128: return "128-bit";
+    case SIMD_ISA_256: return "AVX2";
+    case SIMD_ISA_512: return "AVX-512BW";
+    default:           return "none";
+    }
+}
+
+
+// Fill 'buf' with bytes from a small alphabet - so that every scan
+// has a mix of matches and non-matches. Include bytes with the MSB
+// set (free slots in a Swiss table).
+static void
+fill(uint8_t *buf, size_t n, uint64_t seed)
+{
+    xoro128plus xoro;
+
+    xoro128plus_init(&xoro, seed);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t r = xoro128plus_u64(&xoro);
+
+        buf[i] = (r & 0x100) ? 0x80 : (r & 0x7);
+    }
+}
+
+
+static void
+check_test(const uint8_t *buf, size_t n, int isa)
+{
+    static const uint8_t probes[] = { 0, 1, 5, 0x80, 0xff };
+    size_t ncheck = 0;
+
+    for (size_t t = 0; t < ARRAY_SIZE(Targets); t++) {
+        const target *x = &Targets[t];
+        matchfp ref = x->width == 32 ? scalar_match32 : scalar_match64;
+
+        if (x->isa > isa) continue;
+
+        for (size_t i = 0; i + x->width <= n; i++) {
+            for (size_t j = 0; j < ARRAY_SIZE(probes); j++) {
+                uint64_t want = ref(&buf[i], probes[j]);
+                uint64_t got  = x->fp(&buf[i], probes[j]);
+
+                if (want != got) {
+                    printf("** %s: offset %zu, byte %#x: exp %#" PRIx64 ", saw %#" PRIx64 "\n",
+                            x->name, i, probes[j], want, got);
+                    abort();
+                }
+                ncheck++;
+            }
+        }
+    }
+    printf("check: %zu scans agree with the scalar scan\n", ncheck);
+}
+
+
+static void
+perf_test(const uint8_t *buf, size_t n, int isa)
+{
+    size_t rounds = (64 * 1024 * 1024) / n;
+
+    if (!rounds) rounds = 1;
+
+    printf("perf: %zu KB buffer, %zu rounds\n", n / 1024, rounds);
+    for (size_t t = 0; t < ARRAY_SIZE(Targets); t++) {
+        const target *x = &Targets[t];
+        uint64_t nm = 0;
+
+        if (x->isa > isa) {
+            printf("  %-12s  unsupported\n", x->name);
+            continue;
+        }
+
+        uint64_t t0 = timenow();
+        for (size_t r = 0; r < rounds; r++) {
+            for (size_t i = 0; i + x->width <= n; i += x->width) {
+                nm += __builtin_popcountll(x->fp(&buf[i], (uint8_t)r & 0x7));
+            }
+        }
+        uint64_t tt = timenow() - t0;
+
+        // bytes per ns is GB/s
+        printf("  %-12s  %6.2f GB/s  (%" PRIu64 " matches)\n", x->name,
+                _d(rounds) * _d(n) / _d(tt), nm);
+    }
+}
+
+
+int
+main(int argc, char **argv)
+{
+    size_t n = 64 * 1024;
+    int isa  = simd_isa();
+
+    program_name = argv[0];
+    if (argc > 1) {
+        n = strtoul(argv[1], 0, 0) * 1024;
+        if (!n) die("invalid buffer size %s", argv[1]);
+    }
+
+    uint8_t *buf = NEWZA(uint8_t, n);
+
+    printf("simd: best ISA %s\n", isa_name(isa));
+
+    fill(buf, n, 0x5eed);
+    check_test(buf, n < 4096 ? n : 4096, isa);
+    perf_test(buf, n, isa);
+
+    DEL(buf);
+    return 0;
+}
+
+/* EOF */
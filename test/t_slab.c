@@ -0,0 +1,272 @@
+/* vim: expandtab:tw=68:ts=4:sw=4:
+ *
+ * t_slab.c - test harness for the size-class allocator
+ *
+ * Copyright (c) 2005 Sudhi Herle <sw@herle.net>
+ *
+ * Licensing Terms: GPLv2
+ *
+ * If you need a commercial license for this work, please contact
+ * the author.
+ *
+ * This software does not come with any express or implied
+ * warranty; it is provided "as is". No claim  is made to its
+ * suitability for any purpose.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "utils/utils.h"
+#include "utils/slab.h"
+#include "utils/xorshift-rand.h"
+#include "error.h"
+
+static void basic_test(void);
+static void realloc_test(void);
+static void mixed_test(size_t nlive, size_t nops);
+
+#define _d(x)   ((double)(x))
+
+int
+main(int argc, char **argv)
+{
+    size_t nops = 4 * 1024 * 1024;
+
+    program_name = argv[0];
+    if (argc > 1) nops = strtoul(argv[1], 0, 0);
+
+    basic_test();
+    realloc_test();
+    mixed_test(10000, nops);
+    mixed_test(1000000, nops);
+
+    return 0;
+}
+
+
+/*
+ * Return a size from a mix of mostly small objects, some medium
+ * and a few large ones.
+ */
+static size_t
+mixsize(xs1024star *xs)
+{
+    uint64_t r = xs1024star_u64(xs);
+    uint64_t v = r >> 8;
+
+    switch (r % 100) {
+    default:
+        return 8 + (v % 121);           // 70%: 8..128
+    case 70 ... 94:
+        return 129 + (v % 896);         // 25%: 129..1024
+    case 95 ... 98:
+        return 1025 + (v % 15360);      //  4%: 1K..16K
+    case 99:
+        return 16385 + (v % 49152);     //  1%: 16K..64K
+    }
+}
+
+
+static void
+fill(unsigned char *p, size_t n, size_t i)
+{
+    memset(p, (int)(i & 0xff), n);
+}
+
+
+static void
+check(unsigned char *p, size_t n, size_t i)
+{
+    size_t j;
+
+    for (j = 0; j < n; j++) {
+        if (p[j] != (unsigned char)(i & 0xff))
+            error(1, 0, "ptr %p [%zu]: corrupt at %zu", p, n, j);
+    }
+}
+
+
+static void
+basic_test()
+{
+    const size_t N = 100000;
+    void   **v  = NEWA(void *, N);
+    size_t  *sz = NEWA(size_t, N);
+    slab *s;
+    memmgr m;
+    xs1024star xs;
+    uint64_t z;
+    size_t i, n;
+    int r;
+
+    r = slab_new(&s);
+    if (r < 0) error(1, -r, "can't make slab");
+
+    // every size upto a little past the largest size class
+    for (n = 0; n < SLAB_MAX_SIZE + 64; n++) {
+        unsigned char *p = slab_alloc(s, n);
+
+        assert(p);
+        assert(_IS_ALIGNED(p, 8));
+        assert(slab_size(s, p) >= n);
+        if (n > 128 && n <= SLAB_MAX_SIZE)
+            assert(slab_size(s, p) <= n + (n / 4));
+        fill(p, n, n);
+        check(p, n, n);
+        slab_free(s, p);
+    }
+    slab_free(s, 0);
+
+    xs1024star_init(&xs, 0);
+    for (i = 0; i < N; i++) {
+        sz[i] = mixsize(&xs);
+        v[i]  = slab_alloc(s, sz[i]);
+        assert(v[i]);
+        fill(v[i], sz[i], i);
+    }
+
+    // free every other one and re-allocate
+    for (i = 0; i < N; i += 2) {
+        check(v[i], sz[i], i);
+        slab_free(s, v[i]);
+    }
+    for (i = 0; i < N; i += 2) {
+        v[i] = slab_alloc(s, sz[i]);
+        assert(v[i]);
+        fill(v[i], sz[i], i);
+    }
+
+    for (i = 0; i < N; i++) {
+        check(v[i], sz[i], i);
+        slab_free(s, v[i]);
+    }
+    z = slab_trim(s);
+    assert(z > 0);
+
+    // as a memory manager
+    slab_memmgr(&m, s);
+    for (i = 0; i < N; i++) {
+        v[i] = memmgr_alloc(&m, sz[i]);
+        assert(v[i]);
+    }
+    for (i = 0; i < N; i++) {
+        memmgr_free(&m, v[i]);
+    }
+
+    slab_delete(s);
+    DEL(v);
+    DEL(sz);
+}
+
+
+static void
+realloc_test()
+{
+    unsigned char *p, *q;
+    slab *s;
+    size_t n;
+    int r;
+
+    r = slab_new(&s);
+    if (r < 0) error(1, -r, "can't make slab");
+
+    // grow one byte at a time, like a string buffer
+    p = slab_realloc(s, 0, 1);
+    fill(p, 1, 7);
+    for (n = 2; n < 100000; n++) {
+        q = slab_realloc(s, p, n);
+        assert(q);
+        check(q, n-1, 7);
+        q[n-1] = 7;
+        p = q;
+    }
+
+    // shrink within a class keeps the pointer
+    q = slab_realloc(s, p, n - 10);
+    assert(q == p);
+    check(q, n - 10, 7);
+
+    // shrink to a small class moves it
+    p = slab_realloc(s, q, 100);
+    assert(p && p != q);
+    check(p, 100, 7);
+    assert(slab_size(s, p) == 112);
+
+    q = slab_realloc(s, p, 0);
+    assert(!q);
+    slab_delete(s);
+}
+
+
+/*
+ * Mixed size workload: 'nlive' live objects; each op frees a random
+ * one and allocates a new one of a random size. Compares the slab
+ * allocator with malloc.
+ */
+static void
+mixed_test(size_t nlive, size_t nops)
+{
+    void   **v  = NEWZA(void *, nlive);
+    size_t  *sz = NEWA(size_t, nops);
+    size_t  *ix = NEWA(size_t, nops);
+    uint64_t t0, ts, tm;
+    xs1024star xs;
+    slab *s;
+    size_t i, n;
+    int r;
+
+    r = slab_new(&s);
+    if (r < 0) error(1, -r, "can't make slab");
+
+    xs1024star_init(&xs, 0);
+    for (i = 0; i < nops; i++) {
+        sz[i] = mixsize(&xs);
+        ix[i] = xs1024star_u64(&xs) % nlive;
+    }
+
+    t0 = sys_cpu_timestamp();
+    for (i = 0; i < nlive; i++) {
+        v[i] = slab_alloc(s, sz[i % nops]);
+    }
+    for (i = 0; i < nops; i++) {
+        size_t j = ix[i];
+
+        slab_free(s, v[j]);
+        v[j] = slab_alloc(s, sz[i]);
+    }
+    for (i = 0; i < nlive; i++) {
+        slab_free(s, v[i]);
+    }
+    ts = sys_cpu_timestamp() - t0;
+    slab_delete(s);
+
+    t0 = sys_cpu_timestamp();
+    for (i = 0; i < nlive; i++) {
+        v[i] = malloc(sz[i % nops]);
+    }
+    for (i = 0; i < nops; i++) {
+        size_t j = ix[i];
+
+        free(v[j]);
+        v[j] = malloc(sz[i]);
+    }
+    for (i = 0; i < nlive; i++) {
+        free(v[i]);
+    }
+    tm = sys_cpu_timestamp() - t0;
+
+    n = nops + nlive;
+    printf("mixed sizes, %zu live, %zu ops: slab %6.2f cy/op, malloc %6.2f cy/op\n",
+            nlive, nops, _d(ts) / _d(n), _d(tm) / _d(n));
+
+    DEL(v);
+    DEL(sz);
+    DEL(ix);
+}
+
+/* EOF */
@@ -5,26 +5,45 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <errno.h>
 #include <assert.h>
 #include <unistd.h>
 #include "error.h"
 #include "utils/utils.h"
 #include "utils/xorfilter.h"
+#include "utils/fusefilter.h"
 
 extern void arc4random_buf(void *, size_t);
 
-static void basictest(int is16,   size_t n);
+static void basictest(int is16,   size_t n, int nthr);
 static void perftest(int is16,    size_t n);
 static void marshaltest(int is16, size_t n);
+static void buildtest(int is16,   size_t n);
+static void fusetest(int is16,    size_t n);
+static void comparetest(size_t n);
+static void batchtest(int is16,   size_t n);
 
 #define NELEM   10000
 
+// Keys for the construction throughput test
+#define NBUILD  (4 * 1024 * 1024)
+
+// Keys for the Xor vs. Fuse comparison
+#define NCMP    (1024 * 1024)
+
+// Keys per call of Xorfilter_contains_batch()
+#define NBATCH  1024
+
 int
 main()
 {
     printf("Xorfilter: Basic tests ..\n");
-    basictest(0, NELEM);
-    basictest(1, NELEM);
+    basictest(0, NELEM, 0);
+    basictest(1, NELEM, 0);
+
+    printf("Xorfilter: Basic tests (partitioned build) ..\n");
+    basictest(0, NELEM, 1);
+    basictest(1, NELEM, 4);
 
     printf("Xorfilter: Perf tests ..\n");
     perftest(0, NELEM);
@@ -33,6 +52,23 @@ main()
     printf("Xorfilter: Marshal/Unmarshal tests ..\n");
     marshaltest(0, NELEM);
     marshaltest(1, NELEM);
+
+    printf("Xorfilter: Construction throughput ..\n");
+    buildtest(0, NBUILD);
+
+    printf("Fusefilter: Basic & Marshal/Unmarshal tests ..\n");
+    fusetest(0, NELEM);
+    fusetest(1, NELEM);
+    fusetest(0, 10);
+
+    printf("Xorfilter vs. Fusefilter: %d keys ..\n", NCMP);
+    comparetest(NCMP);
+
+    printf("Xorfilter: Batched lookups (%d keys per batch) ..\n", NBATCH);
+    batchtest(0, NELEM);
+    batchtest(1, NELEM);
+    batchtest(0, NBUILD);
+    batchtest(1, NBUILD);
 }
 
 
@@ -45,14 +81,24 @@ rand64()
     return z;
 }
 
+// Make a filter; 'nthr' > 0 uses the partitioned build
+static Xorfilter *
+mkfilter(int is16, uint64_t *keys, size_t n, int nthr)
+{
+    if (nthr > 0) {
+        return is16 ? Xorfilter_new16_mt(keys, n, nthr) : Xorfilter_new8_mt(keys, n, nthr);
+    }
+    return is16 ? Xorfilter_new16(keys, n) : Xorfilter_new8(keys, n);
+}
+
 static void
-basictest(int is16, size_t n)
+basictest(int is16, size_t n, int nthr)
 {
     uint64_t *keys = NEWA(uint64_t, n);
 
     for (size_t i = 0; i < n; i++) keys[i] = i;
 
-    Xorfilter* x = is16 ? Xorfilter_new16(keys, n) : Xorfilter_new8(keys, n);
+    Xorfilter* x = mkfilter(is16, keys, n, nthr);
     assert(x);
 
     for (size_t i = 0; i < n; i++) {
@@ -202,3 +248,223 @@ marshaltest(int is16, size_t n)
     DEL(keys);
     unlink(fname);
 }
+
+
+/*
+ * Construction throughput of the classic build and the partitioned
+ * build with 1, 2, 4 and 8 threads.
+ */
+static void
+buildtest(int is16, size_t n)
+{
+    static const int Thr[] = { 0, 1, 2, 4, 8 };
+    uint64_t *keys = NEWA(uint64_t, n);
+    double base    = 0.0;
+
+    for (size_t i = 0; i < n; i++) keys[i] = rand64();
+
+    for (size_t t = 0; t < ARRAY_SIZE(Thr); t++) {
+        duration_t d0 = timenow();
+        Xorfilter *x  = mkfilter(is16, keys, n, Thr[t]);
+        duration_t tt = timenow() - d0;
+
+        assert(x);
+        for (size_t i = 0; i < n; i++) {
+            assert(Xorfilter_contains(x, keys[i]));
+        }
+        Xorfilter_delete(x);
+
+        double spd = (_Second(_d(n)) / _d(tt)) / 1000000.0;
+
+        if (t == 0) {
+            base = spd;
+            printf("  %zu keys: classic       %6.2f M keys/sec\n", n, spd);
+        } else {
+            printf("  %zu keys: partitioned-%d %6.2f M keys/sec (%4.2fx)\n",
+                    n, Thr[t], spd, spd / base);
+        }
+    }
+
+    DEL(keys);
+}
+
+
+
+// Return true if all of keys[] are in 'f'
+static int
+fuse_all(Fusefilter *f, uint64_t *keys, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (!Fusefilter_contains(f, keys[i])) return 0;
+    }
+    return 1;
+}
+
+static void
+fusetest(int is16, size_t n)
+{
+    uint64_t *keys = NEWA(uint64_t, n + 4);
+
+    for (size_t i = 0; i < n; i++) keys[i] = rand64();
+
+    // duplicate keys are allowed
+    for (size_t i = 0; i < 4; i++) keys[n+i] = keys[i];
+
+    Fusefilter *f = is16 ? Fusefilter_new16(keys, n + 4) : Fusefilter_new8(keys, n + 4);
+    assert(f);
+    assert(fuse_all(f, keys, n));
+
+    const char *fname = "/tmp/fuse-test.dat";
+    int r = Fusefilter_marshal(f, fname);
+
+    assert(r == 0);
+    Fusefilter_delete(f); f = 0;
+
+    r = Fusefilter_unmarshal(&f, fname, 0);
+    assert(r == 0);
+    assert(f);
+    assert(fuse_all(f, keys, n));
+    Fusefilter_delete(f);
+
+    r = Fusefilter_unmarshal(&f, fname, FUSEFILTER_MMAP);
+    assert(r == 0);
+    assert(f);
+    assert(fuse_all(f, keys, n));
+    Fusefilter_delete(f);
+
+    // A corrupted file must be rejected
+    FILE *fp = fopen(fname, "r+");
+    assert(fp);
+    fseek(fp, -40, SEEK_END);
+    fputc(0x5a ^ fgetc(fp), fp);
+    fclose(fp);
+
+    f = 0;
+    r = Fusefilter_unmarshal(&f, fname, 0);
+    assert(r == -EILSEQ);
+    assert(!f);
+
+    DEL(keys);
+    unlink(fname);
+}
+
+
+/*
+ * Size, build time, query time and false positive rate of the Xor
+ * and Fuse filters for the same keys.
+ */
+static void
+comparetest(size_t n)
+{
+    const size_t nq = 4 * 1024 * 1024;
+    uint64_t *keys = NEWA(uint64_t, n);
+    uint64_t *q    = NEWA(uint64_t, nq);
+
+    for (size_t i = 0; i < n; i++)  keys[i] = rand64();
+    for (size_t i = 0; i < nq; i++) q[i]    = rand64();
+
+    for (int is16 = 0; is16 < 2; is16++) {
+        duration_t d0 = timenow();
+        Xorfilter *x  = is16 ? Xorfilter_new16(keys, n) : Xorfilter_new8(keys, n);
+        duration_t tx = timenow() - d0;
+
+        d0 = timenow();
+        Fusefilter *f = is16 ? Fusefilter_new16(keys, n) : Fusefilter_new8(keys, n);
+        duration_t tf = timenow() - d0;
+
+        assert(x);
+        assert(f);
+        assert(fuse_all(f, keys, n));
+
+        size_t fx = 0,
+               ff = 0;
+
+        d0 = timenow();
+        for (size_t i = 0; i < nq; i++) fx += Xorfilter_contains(x, q[i]);
+        duration_t qx = timenow() - d0;
+
+        d0 = timenow();
+        for (size_t i = 0; i < nq; i++) ff += Fusefilter_contains(f, q[i]);
+        duration_t qf = timenow() - d0;
+
+        const char *w = is16 ? "16" : "8 ";
+
+        printf("  Xor%s  %5.2f bits/entry, build %7.2f ms, query %5.2f ns, FP %8.7f\n",
+                w, Xorfilter_bpe(x), _d(tx) / _d(_Millisecond(1)), _d(qx) / _d(nq),
+                _d(fx) / _d(nq));
+        printf("  Fuse%s %5.2f bits/entry, build %7.2f ms, query %5.2f ns, FP %8.7f\n",
+                w, Fusefilter_bpe(f), _d(tf) / _d(_Millisecond(1)), _d(qf) / _d(nq),
+                _d(ff) / _d(nq));
+
+        Xorfilter_delete(x);
+        Fusefilter_delete(f);
+    }
+
+    DEL(q);
+    DEL(keys);
+}
+
+
+/*
+ * Look up 'n' present and 'n' absent keys one at a time and in
+ * batches; the results must match.
+ */
+static void
+batchtest(int is16, size_t n)
+{
+    uint64_t *keys = NEWA(uint64_t, 2*n);
+    uint64_t  res[NBATCH / 64];
+    size_t    nf0 = 0,
+              nf1 = 0;
+
+    for (size_t i = 0; i < 2*n; i++) keys[i] = rand64();
+
+    Xorfilter *x = mkfilter(is16, keys, n, 0);
+    assert(x);
+
+    // best of a few runs; this box is noisy
+    duration_t t0 = ~0,
+               t1 = ~0;
+
+    for (int r = 0; r < 5; r++) {
+        duration_t d0 = timenow();
+
+        nf0 = 0;
+        for (size_t i = 0; i < 2*n; i++) nf0 += Xorfilter_contains(x, keys[i]);
+
+        duration_t d1 = timenow();
+
+        nf1 = 0;
+        for (size_t i = 0; i < 2*n; i += NBATCH) {
+            size_t m = (2*n - i) > NBATCH ? NBATCH : (2*n - i);
+
+            nf1 += Xorfilter_contains_batch(x, &keys[i], m, res);
+        }
+
+        duration_t d2 = timenow();
+
+        if ((d1 - d0) < t0) t0 = d1 - d0;
+        if ((d2 - d1) < t1) t1 = d2 - d1;
+    }
+
+    assert(nf0 == nf1);
+    assert(nf0 >= n);
+
+    // odd sized batches at odd offsets
+    for (size_t i = 0; i < 2*n; i += 999) {
+        size_t m = (2*n - i) > 777 ? 777 : (2*n - i);
+
+        Xorfilter_contains_batch(x, &keys[i], m, res);
+        for (size_t j = 0; j < m; j++) {
+            int bit = !!(res[j / 64] & (_U64(1) << (j % 64)));
+            assert(bit == Xorfilter_contains(x, keys[i+j]));
+        }
+    }
+
+    printf("  %s %8zu keys: %6.2f ns/contains %6.2f ns/key batched (%4.2fx)\n",
+            is16 ? "Xor16" : "Xor8 ", n, _d(t0) / _d(2*n), _d(t1) / _d(2*n),
+            _d(t0) / _d(t1));
+
+    Xorfilter_delete(x);
+    DEL(keys);
+}